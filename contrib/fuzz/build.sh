@@ -0,0 +1,53 @@
+#!/bin/sh
+#
+# Build the fuzzing harnesses in contrib/fuzz.  Run from the top of the
+# source tree; see contrib/fuzz/README.
+#
+
+set -e
+
+: "${CC:=clang}"
+: "${OUT:=contrib/fuzz/out}"
+
+if [ -n "$STANDALONE" ]; then
+	SANITIZE="${SANITIZE--fsanitize=address}"
+	ENGINE="contrib/fuzz/standalone.c"
+else
+	SANITIZE="${SANITIZE--fsanitize=address,fuzzer-no-link}"
+	ENGINE="${LIB_FUZZING_ENGINE:--fsanitize=fuzzer}"
+fi
+
+FUZZ_CFLAGS="-g -O1 $SANITIZE -DFUZZING_BUILD_MODE_UNSAFE_FOR_PRODUCTION $CFLAGS"
+
+[ -x configure ] || ./autogen.sh
+./configure CC="$CC" CFLAGS="$FUZZ_CFLAGS" $CONFIGURE_FLAGS
+make -C src clean
+make -C src
+
+mkdir -p "$OUT"
+
+# the harnesses provide their own main()
+objcopy --redefine-sym main=oidentd_main src/oidentd.o "$OUT/oidentd.o"
+
+objs="$OUT/oidentd.o"
+for obj in src/*.o; do
+	case "$obj" in
+		src/oidentd.o|src/audit_read.o) ;;
+		*) objs="$objs $obj" ;;
+	esac
+done
+
+libs="src/missing/libmissing.a $(sed -n 's/^ADD_LIB = //p' src/Makefile) \
+	$(sed -n 's/^LIBS = //p' src/Makefile)"
+
+for target in config query proc_tcp conntrack masq_map; do
+	$CC $FUZZ_CFLAGS -I. -Isrc -Isrc/missing -o "$OUT/fuzz_$target" \
+		"contrib/fuzz/fuzz_$target.c" contrib/fuzz/harness.c \
+		$ENGINE $objs $libs
+done
+
+# the checks have their own main() and don't need a fuzzing engine
+for check in addr_cache audit close_wait flight lazy_config offload shed user_prefs; do
+	$CC $FUZZ_CFLAGS -I. -Isrc -Isrc/missing -o "$OUT/check_$check" \
+		"contrib/fuzz/check_$check.c" contrib/fuzz/harness.c $objs $libs
+done
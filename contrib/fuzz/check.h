@@ -0,0 +1,40 @@
+/*
+** check.h - oidentd behaviour checks.
+** Copyright (c) 2019      Janik Rabe  <oidentd@janikrabe.com>
+**
+** This program is free software; you can redistribute it and/or modify
+** it under the terms of the GNU General Public License, version 2,
+** as published by the Free Software Foundation.
+**
+** This program is distributed in the hope that it will be useful,
+** but WITHOUT ANY WARRANTY; without even the implied warranty of
+** MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+** GNU General Public License for more details.
+**
+** You should have received a copy of the GNU General Public License
+** along with this program; if not, write to the Free Software
+** Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA
+*/
+
+#ifndef __OIDENTD_FUZZ_CHECK_H
+#define __OIDENTD_FUZZ_CHECK_H
+
+#include <stdio.h>
+#include <stdlib.h>
+
+/*
+** The checks cover behaviour that fuzzing can't observe, such as what is
+** cached and for how long.  Each check is a program that stops at the
+** first condition that doesn't hold, naming it, and exits with a failure
+** status.
+*/
+
+#define CHECK(cond) do {												\
+	if (!(cond)) {														\
+		fprintf(stderr, "%s:%d: check failed: %s\n",					\
+			__FILE__, __LINE__, #cond);									\
+		exit(EXIT_FAILURE);												\
+	}																	\
+} while (0)
+
+#endif
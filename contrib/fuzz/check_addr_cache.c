@@ -0,0 +1,308 @@
+/*
+** check_addr_cache.c - check when the address cache resolves names.
+** Copyright (c) 2019      Janik Rabe  <oidentd@janikrabe.com>
+**
+** This program is free software; you can redistribute it and/or modify
+** it under the terms of the GNU General Public License, version 2,
+** as published by the Free Software Foundation.
+**
+** This program is distributed in the hope that it will be useful,
+** but WITHOUT ANY WARRANTY; without even the implied warranty of
+** MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+** GNU General Public License for more details.
+**
+** You should have received a copy of the GNU General Public License
+** along with this program; if not, write to the Free Software
+** Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA
+*/
+
+#include <config.h>
+
+#include <unistd.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <pwd.h>
+#include <netdb.h>
+#include <sys/types.h>
+#include <sys/wait.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
+
+#include "oidentd.h"
+#include "util.h"
+#include "addr_cache.h"
+#include "shm_cache.h"
+#include "harness.h"
+#include "check.h"
+
+/*
+** The daemon's clock and resolver are replaced, so that entries can be
+** made to expire and lookups can be counted.  Each name resolves to the
+** address given for it, or fails if there is none.
+*/
+
+struct fake_host {
+	const char *name;
+	const char *addr;
+	unsigned int lookups;
+};
+
+struct fake_addrinfo {
+	struct addrinfo ai;
+	struct sockaddr_in sin;
+};
+
+static char long_name[256];
+
+static struct fake_host hosts[] = {
+	{ "a.example",		"192.0.2.1",	0 },
+	{ "gone.example",	NULL,			0 },
+	{ "lazy.example",	"192.0.2.4",	0 },
+	{ long_name,		"192.0.2.5",	0 },
+};
+
+static time_t now = 1000000000;
+
+static struct fake_host *fake_host(const char *name);
+static void make_addr(struct sockaddr_storage *ss, const char *str);
+static void child_wait(void);
+static void check_expiry(struct addr_cache *cache);
+static void check_adoption(void);
+static void check_lazy(void);
+
+time_t time(time_t *t) {
+	if (t)
+		*t = now;
+
+	return now;
+}
+
+int getaddrinfo(const char *node,
+				const char *service __notused,
+				const struct addrinfo *hints,
+				struct addrinfo **res)
+{
+	struct fake_addrinfo *fake;
+	struct in_addr in;
+
+	if (hints->ai_flags & AI_NUMERICHOST) {
+		if (inet_pton(AF_INET, node, &in) != 1)
+			return EAI_NONAME;
+	} else {
+		struct fake_host *host = fake_host(node);
+
+		if (!host)
+			return EAI_NONAME;
+
+		++host->lookups;
+
+		if (!host->addr || inet_pton(AF_INET, host->addr, &in) != 1)
+			return EAI_NONAME;
+	}
+
+	fake = calloc(1, sizeof(*fake));
+	if (!fake)
+		return EAI_MEMORY;
+
+	fake->sin.sin_family = AF_INET;
+	fake->sin.sin_addr = in;
+	fake->ai.ai_family = AF_INET;
+	fake->ai.ai_socktype = SOCK_STREAM;
+	fake->ai.ai_addrlen = sizeof(fake->sin);
+	fake->ai.ai_addr = (struct sockaddr *) &fake->sin;
+
+	*res = &fake->ai;
+	return 0;
+}
+
+void freeaddrinfo(struct addrinfo *res) {
+	free(res);
+}
+
+static struct fake_host *fake_host(const char *name) {
+	size_t i;
+
+	for (i = 0; i < sizeof(hosts) / sizeof(hosts[0]); ++i) {
+		if (!strcmp(hosts[i].name, name))
+			return &hosts[i];
+	}
+
+	return NULL;
+}
+
+static void make_addr(struct sockaddr_storage *ss, const char *str) {
+	struct sockaddr_in *sin = (struct sockaddr_in *) ss;
+
+	memset(ss, 0, sizeof(*ss));
+	sin->sin_family = AF_INET;
+
+	if (inet_pton(AF_INET, str, &sin->sin_addr) != 1)
+		abort();
+}
+
+/*
+** Wait for a child process and require it to have succeeded.
+*/
+
+static void child_wait(void) {
+	int status;
+
+	CHECK(wait(&status) != -1);
+	CHECK(WIFEXITED(status) && WEXITSTATUS(status) == EXIT_SUCCESS);
+}
+
+/*
+** A name is resolved once per TTL, and after a failed lookup once per
+** negative TTL.  Expired entries keep matching their previous addresses
+** until the cache is refreshed.
+*/
+
+static void check_expiry(struct addr_cache *cache) {
+	struct fake_host *a = fake_host("a.example");
+	struct fake_host *gone = fake_host("gone.example");
+	struct sockaddr_storage old, new;
+	struct addr_set *set;
+
+	make_addr(&old, "192.0.2.1");
+	make_addr(&new, "192.0.2.3");
+
+	set = addr_cache_get(cache, "192.0.2.1");
+	CHECK(set->numeric);
+	CHECK(addr_cache_match(set, &old));
+
+	set = addr_cache_get(cache, "a.example");
+	CHECK(!set->numeric);
+	CHECK(addr_cache_get(cache, "a.example") == set);
+	CHECK(addr_cache_match(set, &old));
+	CHECK(addr_cache_match(set, &old));
+	CHECK(a->lookups == 1);
+
+	a->addr = "192.0.2.3";
+	now += ADDR_CACHE_TTL - 1;
+	CHECK(addr_cache_refresh(cache) == 1);
+	CHECK(a->lookups == 1);
+
+	now += 1;
+	CHECK(addr_cache_match(set, &old));
+	CHECK(!addr_cache_match(set, &new));
+	CHECK(a->lookups == 1);
+
+	CHECK(addr_cache_refresh(cache) == ADDR_CACHE_TTL);
+	CHECK(a->lookups == 2);
+	CHECK(!addr_cache_match(set, &old));
+	CHECK(addr_cache_match(set, &new));
+
+	set = addr_cache_get(cache, "gone.example");
+	CHECK(!addr_cache_match(set, &old));
+	CHECK(gone->lookups == 1);
+
+	now += ADDR_CACHE_NEG_TTL - 1;
+	addr_cache_refresh(cache);
+	CHECK(gone->lookups == 1);
+
+	now += 1;
+	addr_cache_refresh(cache);
+	CHECK(gone->lookups == 2);
+
+	/* the previous addresses are kept if resolution fails */
+	a->addr = NULL;
+	now += ADDR_CACHE_TTL;
+	addr_cache_refresh(cache);
+	CHECK(a->lookups == 3);
+	CHECK(addr_cache_match(addr_cache_get(cache, "a.example"), &new));
+
+	a->addr = "192.0.2.3";
+	now += ADDR_CACHE_NEG_TTL - 1;
+	addr_cache_refresh(cache);
+	CHECK(a->lookups == 3);
+
+	now += 1;
+	addr_cache_refresh(cache);
+	CHECK(a->lookups == 4);
+}
+
+/*
+** Another process adopts the addresses this one has resolved, and
+** resolves names too long to be shared itself.
+*/
+
+static void check_adoption(void) {
+	struct addr_cache *cache = addr_cache_create(false);
+	struct fake_host *a = fake_host("a.example");
+	struct fake_host *lng = fake_host(long_name);
+	struct sockaddr_storage addr, long_addr;
+
+	make_addr(&addr, "192.0.2.3");
+	make_addr(&long_addr, "192.0.2.5");
+
+	CHECK(addr_cache_match(addr_cache_get(cache, "a.example"), &addr));
+	CHECK(addr_cache_match(addr_cache_get(cache, long_name), &long_addr));
+	CHECK(lng->lookups == 1);
+
+	if (fork() == 0) {
+		struct addr_cache *child = addr_cache_create(false);
+		unsigned int lookups = a->lookups;
+
+		CHECK(addr_cache_match(addr_cache_get(child, "a.example"), &addr));
+		CHECK(a->lookups == lookups);
+
+		CHECK(addr_cache_match(addr_cache_get(child, long_name), &long_addr));
+		CHECK(lng->lookups == 2);
+
+		_exit(EXIT_SUCCESS);
+	}
+
+	child_wait();
+	addr_cache_destroy(cache);
+}
+
+/*
+** Lazy entries never make the caller wait: they match nothing until the
+** name has been resolved in the background, by a child process when
+** there are no worker threads.
+*/
+
+static void check_lazy(void) {
+	struct addr_cache *cache = addr_cache_create(true);
+	struct fake_host *lazy = fake_host("lazy.example");
+	struct sockaddr_storage addr;
+	struct addr_set *set;
+
+	make_addr(&addr, "192.0.2.4");
+	set = addr_cache_get(cache, "lazy.example");
+
+	CHECK(!addr_cache_match(set, &addr));
+	CHECK(!addr_cache_match(set, &addr));
+	CHECK(lazy->lookups == 0);
+
+	addr_cache_resolve_wanted();
+	child_wait();
+
+	CHECK(addr_cache_match(set, &addr));
+	CHECK(lazy->lookups == 0);
+
+	addr_cache_destroy(cache);
+}
+
+int main(void) {
+	struct addr_cache *cache;
+
+	fuzz_setup(NULL);
+
+	memset(long_name, 'x', sizeof(long_name) - 1);
+	shm_cache_init();
+
+	cache = addr_cache_create(false);
+	check_expiry(cache);
+
+	if (shm_cache_enabled()) {
+		check_adoption();
+		check_lazy();
+	}
+
+	addr_cache_destroy(cache);
+	return EXIT_SUCCESS;
+}
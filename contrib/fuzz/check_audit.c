@@ -0,0 +1,191 @@
+/*
+** check_audit.c - check the records written to the audit log.
+** Copyright (c) 2019      Janik Rabe  <oidentd@janikrabe.com>
+**
+** This program is free software; you can redistribute it and/or modify
+** it under the terms of the GNU General Public License, version 2,
+** as published by the Free Software Foundation.
+**
+** This program is distributed in the hope that it will be useful,
+** but WITHOUT ANY WARRANTY; without even the implied warranty of
+** MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+** GNU General Public License for more details.
+**
+** You should have received a copy of the GNU General Public License
+** along with this program; if not, write to the Free Software
+** Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA
+*/
+
+#include <config.h>
+
+#include <unistd.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <fcntl.h>
+#include <pwd.h>
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
+
+#include "oidentd.h"
+#include "util.h"
+#include "audit.h"
+#include "harness.h"
+#include "check.h"
+
+/*
+** A log with room for CHECK_CAPACITY records is written past its end, so
+** that the oldest records are overwritten, and is then read back the way
+** oidentd-audit reads it.
+*/
+
+#define CHECK_CAPACITY	4
+#define CHECK_RECORDS	6
+
+static char path[] = "/tmp/oidentd-check-audit.XXXXXX";
+
+static void remove_log(void);
+
+#ifdef HAVE_SYNC_FETCH_AND_ADD
+static void make_addr(struct sockaddr_storage *ss, const char *str, in_port_t port);
+static void audit_query(u_int64_t n, const char *laddr, const char *faddr, const char *reply);
+static void read_record(int fd, u_int64_t n, struct audit_record *rec);
+static void check_log(int fd);
+#endif
+
+static void remove_log(void) {
+	unlink(path);
+}
+
+#ifdef HAVE_SYNC_FETCH_AND_ADD
+
+static void make_addr(struct sockaddr_storage *ss, const char *str, in_port_t port) {
+	memset(ss, 0, sizeof(*ss));
+
+	if (strchr(str, ':')) {
+		struct sockaddr_in6 *sin6 = (struct sockaddr_in6 *) ss;
+
+		sin6->sin6_family = AF_INET6;
+		sin6->sin6_port = htons(port);
+		CHECK(inet_pton(AF_INET6, str, &sin6->sin6_addr) == 1);
+	} else {
+		struct sockaddr_in *sin = (struct sockaddr_in *) ss;
+
+		sin->sin_family = AF_INET;
+		sin->sin_port = htons(port);
+		CHECK(inet_pton(AF_INET, str, &sin->sin_addr) == 1);
+	}
+}
+
+/*
+** Answer query number "n" for the connection between "laddr" and
+** "faddr" with "reply."  The querying host asks from port 40000 + n.
+*/
+
+static void audit_query(u_int64_t n, const char *laddr, const char *faddr, const char *reply) {
+	struct sockaddr_storage local, remote;
+	struct audit_ctx ctx;
+
+	make_addr(&local, laddr, 113);
+	make_addr(&remote, faddr, 40000 + n);
+
+	audit_begin(&ctx, &local, &remote, 1024 + n, 6667);
+	audit_reply(AUDIT_UDB, AUDIT_USERID, 1000 + n, reply);
+	audit_end();
+}
+
+/*
+** Read the record with sequence number "n."
+*/
+
+static void read_record(int fd, u_int64_t n, struct audit_record *rec) {
+	off_t off = sizeof(struct audit_header) +
+		(n % CHECK_CAPACITY) * sizeof(struct audit_record);
+
+	CHECK(pread(fd, rec, sizeof(*rec), off) == sizeof(*rec));
+	CHECK(rec->seq == n + 1);
+}
+
+static void check_log(int fd) {
+	struct audit_header hdr;
+	struct audit_record rec;
+	char reply[AUDIT_REPLY_LEN * 2];
+	unsigned char addr[16];
+	u_int64_t n;
+
+	/* files that aren't audit logs are left alone */
+	CHECK(write(fd, "not an audit log\n", 17) == 17);
+	CHECK(audit_open(path, CHECK_CAPACITY) == -1);
+	CHECK(pread(fd, reply, 17, 0) == 17 && !memcmp(reply, "not an audit log\n", 17));
+	CHECK(ftruncate(fd, 0) == 0);
+
+	CHECK(audit_open(path, CHECK_CAPACITY) == 0);
+
+	/* replies outside of a query are not recorded */
+	audit_reply(AUDIT_UDB, AUDIT_USERID, 0, "none");
+
+	for (n = 0; n + 1 < CHECK_RECORDS; ++n) {
+		snprintf(reply, sizeof(reply), "user%u", (unsigned int) n);
+		audit_query(n, "192.0.2.1", "192.0.2.2", reply);
+	}
+
+	/* long replies are truncated */
+	memset(reply, 'x', sizeof(reply) - 1);
+	reply[sizeof(reply) - 1] = '\0';
+	audit_query(n, "2001:db8::1", "2001:db8::2", reply);
+
+	CHECK(pread(fd, &hdr, sizeof(hdr), 0) == sizeof(hdr));
+	CHECK(!memcmp(hdr.magic, AUDIT_MAGIC, sizeof(hdr.magic)));
+	CHECK(hdr.version == AUDIT_VERSION);
+	CHECK(hdr.byte_order == AUDIT_BYTE_ORDER);
+	CHECK(hdr.header_size == sizeof(struct audit_header));
+	CHECK(hdr.record_size == sizeof(struct audit_record));
+	CHECK(hdr.capacity == CHECK_CAPACITY);
+	CHECK(hdr.next == CHECK_RECORDS);
+
+	/* the oldest records have been overwritten */
+	for (n = CHECK_RECORDS - CHECK_CAPACITY; n + 1 < CHECK_RECORDS; ++n) {
+		read_record(fd, n, &rec);
+		snprintf(reply, sizeof(reply), "user%u", (unsigned int) n);
+
+		CHECK(rec.uid == 1000 + n);
+		CHECK(rec.lport == 1024 + n && rec.fport == 6667);
+		CHECK(rec.peer_port == 40000 + n);
+		CHECK(rec.family == AUDIT_INET);
+		CHECK(rec.path == AUDIT_UDB && rec.result == AUDIT_USERID);
+		CHECK(!strcmp(rec.reply, reply));
+
+		CHECK(inet_pton(AF_INET, "192.0.2.2", addr) == 1);
+		CHECK(!memcmp(rec.faddr, addr, 4));
+	}
+
+	read_record(fd, n, &rec);
+	CHECK(rec.family == AUDIT_INET6);
+	CHECK(strlen(rec.reply) == AUDIT_REPLY_LEN - 1);
+
+	CHECK(inet_pton(AF_INET6, "2001:db8::1", addr) == 1);
+	CHECK(!memcmp(rec.laddr, addr, 16));
+}
+
+#endif
+
+int main(void) {
+	int fd;
+
+	fuzz_setup(NULL);
+
+	fd = mkstemp(path);
+	CHECK(fd != -1);
+	atexit(remove_log);
+
+#ifdef HAVE_SYNC_FETCH_AND_ADD
+	check_log(fd);
+#else
+	CHECK(audit_open(path, CHECK_CAPACITY) == -1);
+#endif
+
+	close(fd);
+	return EXIT_SUCCESS;
+}
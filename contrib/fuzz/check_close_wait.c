@@ -0,0 +1,127 @@
+/*
+** check_close_wait.c - check how connections to clients are closed.
+** Copyright (c) 2019      Janik Rabe  <oidentd@janikrabe.com>
+**
+** This program is free software; you can redistribute it and/or modify
+** it under the terms of the GNU General Public License, version 2,
+** as published by the Free Software Foundation.
+**
+** This program is distributed in the hope that it will be useful,
+** but WITHOUT ANY WARRANTY; without even the implied warranty of
+** MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+** GNU General Public License for more details.
+**
+** You should have received a copy of the GNU General Public License
+** along with this program; if not, write to the Free Software
+** Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA
+*/
+
+#include <config.h>
+
+#include <unistd.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <pwd.h>
+#include <sys/time.h>
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
+
+#include "oidentd.h"
+#include "util.h"
+#include "inet_util.h"
+#include "harness.h"
+#include "check.h"
+
+/*
+** The daemon waits for clients to close the connection first, so that
+** the TIME_WAIT state ends up on their side, but only for so long.
+*/
+
+#define CHECK_WAIT	300
+
+static void connect_pair(int *server, int *client);
+static long close_wait_msecs(int server, bool reset);
+
+/*
+** Connect "client" to "server" over the loopback interface.
+*/
+
+static void connect_pair(int *server, int *client) {
+	struct sockaddr_in sin;
+	socklen_t len = sizeof(sin);
+	int listener;
+
+	memset(&sin, 0, sizeof(sin));
+	sin.sin_family = AF_INET;
+	sin.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+
+	listener = socket(AF_INET, SOCK_STREAM, 0);
+	CHECK(listener != -1);
+	CHECK(bind(listener, (struct sockaddr *) &sin, sizeof(sin)) == 0);
+	CHECK(listen(listener, 1) == 0);
+	CHECK(getsockname(listener, (struct sockaddr *) &sin, &len) == 0);
+
+	*client = socket(AF_INET, SOCK_STREAM, 0);
+	CHECK(*client != -1);
+	CHECK(connect(*client, (struct sockaddr *) &sin, sizeof(sin)) == 0);
+
+	*server = accept(listener, NULL, NULL);
+	CHECK(*server != -1);
+
+	close(listener);
+}
+
+/*
+** Close "server" with sock_close_wait(), and require it to be closed.
+** Returns how long that took, in milliseconds.
+*/
+
+static long close_wait_msecs(int server, bool reset) {
+	struct timeval start, end;
+
+	gettimeofday(&start, NULL);
+	sock_close_wait(server, CHECK_WAIT, reset);
+	gettimeofday(&end, NULL);
+
+	CHECK(fcntl(server, F_GETFD) == -1 && errno == EBADF);
+
+	return (end.tv_sec - start.tv_sec) * 1000 +
+		(end.tv_usec - start.tv_usec) / 1000;
+}
+
+int main(void) {
+	int server, client;
+	char buf[16];
+
+	fuzz_setup(NULL);
+
+	/* clients that close first are not waited for */
+	connect_pair(&server, &client);
+	CHECK(close(client) == 0);
+	CHECK(close_wait_msecs(server, false) < CHECK_WAIT / 2);
+
+	/* anything they send after their query is discarded */
+	connect_pair(&server, &client);
+	CHECK(write(client, "more\r\n", 6) == 6);
+	CHECK(close(client) == 0);
+	CHECK(close_wait_msecs(server, false) < CHECK_WAIT / 2);
+
+	/* others are waited for, and then see the connection closed */
+	connect_pair(&server, &client);
+	CHECK(close_wait_msecs(server, false) >= CHECK_WAIT - 10);
+	CHECK(read(client, buf, sizeof(buf)) == 0);
+	close(client);
+
+	/* or reset, which leaves no TIME_WAIT state behind */
+	connect_pair(&server, &client);
+	CHECK(close_wait_msecs(server, true) >= CHECK_WAIT - 10);
+	CHECK(read(client, buf, sizeof(buf)) == -1 && errno == ECONNRESET);
+	close(client);
+
+	return EXIT_SUCCESS;
+}
@@ -0,0 +1,286 @@
+/*
+** check_flight.c - check that concurrent lookups are coalesced.
+** Copyright (c) 2019      Janik Rabe  <oidentd@janikrabe.com>
+**
+** This program is free software; you can redistribute it and/or modify
+** it under the terms of the GNU General Public License, version 2,
+** as published by the Free Software Foundation.
+**
+** This program is distributed in the hope that it will be useful,
+** but WITHOUT ANY WARRANTY; without even the implied warranty of
+** MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+** GNU General Public License for more details.
+**
+** You should have received a copy of the GNU General Public License
+** along with this program; if not, write to the Free Software
+** Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA
+*/
+
+#include <config.h>
+
+#include <unistd.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <pwd.h>
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
+
+#include "oidentd.h"
+#include "util.h"
+#include "flight.h"
+#include "harness.h"
+#include "check.h"
+
+#if THREAD_SUPPORT
+#	include <pthread.h>
+#endif
+
+/*
+** The owner of the connection from local port "lport" is CHECK_UID plus
+** "lport."  Lookups and scans block until they are released, so that
+** other threads can ask for connections while they are in progress.
+*/
+
+#define CHECK_UID		1000
+#define CHECK_THREADS	8
+
+struct lookup {
+	in_port_t lport;
+	struct sockaddr_storage laddr;
+	struct sockaddr_storage faddr;
+	struct flight_query query;
+	uid_t uid;
+};
+
+static unsigned int num_lookups;
+static unsigned int num_scans;
+static size_t batch_size;
+
+static void make_addr(struct sockaddr_storage *ss, const char *str);
+static void lookup_init(struct lookup *lookup, in_port_t lport);
+static uid_t lookup_user(void *data);
+static void scan_table(struct flight_query **queries, size_t num);
+
+#if THREAD_SUPPORT
+static pthread_mutex_t check_mutex = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t check_cond = PTHREAD_COND_INITIALIZER;
+static bool released = true;
+
+static void check_block(void);
+static void check_release(void);
+static void *get_user_thread(void *data);
+static void *scan_thread(void *data);
+static void check_get_user(void);
+static void check_scan(void);
+#endif
+
+static void make_addr(struct sockaddr_storage *ss, const char *str) {
+	struct sockaddr_in *sin = (struct sockaddr_in *) ss;
+
+	memset(ss, 0, sizeof(*ss));
+	sin->sin_family = AF_INET;
+
+	if (inet_pton(AF_INET, str, &sin->sin_addr) != 1)
+		abort();
+}
+
+static void lookup_init(struct lookup *lookup, in_port_t lport) {
+	memset(lookup, 0, sizeof(*lookup));
+	lookup->lport = lport;
+	make_addr(&lookup->laddr, "192.0.2.1");
+	make_addr(&lookup->faddr, "192.0.2.2");
+
+	lookup->query.lport = lport;
+	lookup->query.fport = 6667;
+	lookup->query.laddr = &lookup->laddr;
+	lookup->query.faddr = &lookup->faddr;
+}
+
+#if THREAD_SUPPORT
+
+/*
+** Make lookups and scans block until check_release() is called.
+*/
+
+static void check_block(void) {
+	pthread_mutex_lock(&check_mutex);
+	released = false;
+	pthread_mutex_unlock(&check_mutex);
+}
+
+static void check_release(void) {
+	struct timespec delay = { 0, 100 * 1000 * 1000 };
+
+	/* let the other threads catch up with the lookup in progress */
+	nanosleep(&delay, NULL);
+
+	pthread_mutex_lock(&check_mutex);
+	released = true;
+	pthread_cond_broadcast(&check_cond);
+	pthread_mutex_unlock(&check_mutex);
+}
+
+#endif
+
+static uid_t lookup_user(void *data) {
+	struct lookup *lookup = data;
+
+#if THREAD_SUPPORT
+	pthread_mutex_lock(&check_mutex);
+	++num_lookups;
+
+	while (!released)
+		pthread_cond_wait(&check_cond, &check_mutex);
+
+	pthread_mutex_unlock(&check_mutex);
+#else
+	++num_lookups;
+#endif
+
+	return CHECK_UID + lookup->lport;
+}
+
+static void scan_table(struct flight_query **queries, size_t num) {
+	size_t i;
+
+#if THREAD_SUPPORT
+	pthread_mutex_lock(&check_mutex);
+	++num_scans;
+	batch_size = num;
+
+	while (!released)
+		pthread_cond_wait(&check_cond, &check_mutex);
+
+	pthread_mutex_unlock(&check_mutex);
+#else
+	++num_scans;
+	batch_size = num;
+#endif
+
+	for (i = 0; i < num; ++i) {
+		queries[i]->found = true;
+		queries[i]->uid = CHECK_UID + queries[i]->lport;
+	}
+}
+
+#if THREAD_SUPPORT
+
+static void *get_user_thread(void *data) {
+	struct lookup *lookup = data;
+
+	lookup->uid = flight_get_user(lookup->lport, 6667,
+					&lookup->laddr, &lookup->faddr, lookup_user, lookup);
+
+	return NULL;
+}
+
+static void *scan_thread(void *data) {
+	struct lookup *lookup = data;
+
+	flight_scan(FLIGHT_TCP4, &lookup->query, scan_table);
+	return NULL;
+}
+
+/*
+** Threads asking for a connection while it is being looked up get the
+** result of that lookup.
+*/
+
+static void check_get_user(void) {
+	struct lookup lookups[CHECK_THREADS];
+	pthread_t threads[CHECK_THREADS];
+	size_t i;
+
+	num_lookups = 0;
+	check_block();
+
+	for (i = 0; i < CHECK_THREADS; ++i) {
+		lookup_init(&lookups[i], 113);
+		CHECK(pthread_create(&threads[i], NULL, get_user_thread, &lookups[i]) == 0);
+	}
+
+	check_release();
+
+	for (i = 0; i < CHECK_THREADS; ++i) {
+		CHECK(pthread_join(threads[i], NULL) == 0);
+		CHECK(lookups[i].uid == CHECK_UID + 113);
+	}
+
+	CHECK(num_lookups == 1);
+}
+
+/*
+** Threads asking for different connections while the table is being
+** scanned are all answered by one more scan.
+*/
+
+static void check_scan(void) {
+	struct lookup lookups[CHECK_THREADS];
+	pthread_t threads[CHECK_THREADS];
+	size_t i;
+
+	num_scans = 0;
+	check_block();
+
+	lookup_init(&lookups[0], 1024);
+	CHECK(pthread_create(&threads[0], NULL, scan_thread, &lookups[0]) == 0);
+
+	/* wait for the first scan to start */
+	for (;;) {
+		struct timespec delay = { 0, 1000 * 1000 };
+		unsigned int scans;
+
+		pthread_mutex_lock(&check_mutex);
+		scans = num_scans;
+		pthread_mutex_unlock(&check_mutex);
+
+		if (scans > 0)
+			break;
+
+		nanosleep(&delay, NULL);
+	}
+
+	for (i = 1; i < CHECK_THREADS; ++i) {
+		lookup_init(&lookups[i], 1024 + i);
+		CHECK(pthread_create(&threads[i], NULL, scan_thread, &lookups[i]) == 0);
+	}
+
+	check_release();
+
+	for (i = 0; i < CHECK_THREADS; ++i) {
+		CHECK(pthread_join(threads[i], NULL) == 0);
+		CHECK(lookups[i].query.found);
+		CHECK(lookups[i].query.uid == CHECK_UID + 1024 + i);
+	}
+
+	CHECK(num_scans == 2);
+	CHECK(batch_size == CHECK_THREADS - 1);
+}
+
+#endif
+
+int main(void) {
+	struct lookup lookup;
+
+	fuzz_setup(NULL);
+
+	lookup_init(&lookup, 113);
+	CHECK(flight_get_user(113, 6667, &lookup.laddr, &lookup.faddr,
+		lookup_user, &lookup) == CHECK_UID + 113);
+	CHECK(num_lookups == 1);
+
+	flight_scan(FLIGHT_TCP4, &lookup.query, scan_table);
+	CHECK(lookup.query.found && lookup.query.uid == CHECK_UID + 113);
+	CHECK(num_scans == 1 && batch_size == 1);
+
+#if THREAD_SUPPORT
+	check_get_user();
+	check_scan();
+#endif
+
+	return EXIT_SUCCESS;
+}
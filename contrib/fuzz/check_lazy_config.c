@@ -0,0 +1,212 @@
+/*
+** check_lazy_config.c - check that lazy parsing gives the same answers.
+** Copyright (c) 2019      Janik Rabe  <oidentd@janikrabe.com>
+**
+** This program is free software; you can redistribute it and/or modify
+** it under the terms of the GNU General Public License, version 2,
+** as published by the Free Software Foundation.
+**
+** This program is distributed in the hope that it will be useful,
+** but WITHOUT ANY WARRANTY; without even the implied warranty of
+** MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+** GNU General Public License for more details.
+**
+** You should have received a copy of the GNU General Public License
+** along with this program; if not, write to the Free Software
+** Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA
+*/
+
+#include <config.h>
+
+#include <unistd.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <pwd.h>
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
+
+#include "oidentd.h"
+#include "util.h"
+#include "user_db.h"
+#include "harness.h"
+#include "check.h"
+
+/*
+** The users are made up, and the name service is replaced so that its
+** lookups can be counted.  Their home directories don't exist, so only
+** the system-wide configuration file decides the answers.
+*/
+
+static struct passwd users[] = {
+	{ .pw_name = "alice",	.pw_uid = 1001,	.pw_dir = "/nonexistent" },
+	{ .pw_name = "bob",		.pw_uid = 1002,	.pw_dir = "/nonexistent" },
+	{ .pw_name = "carol",	.pw_uid = 1003,	.pw_dir = "/nonexistent" },
+	{ .pw_name = "dave",	.pw_uid = 1004,	.pw_dir = "/nonexistent" },
+};
+
+#define NUM_USERS	(sizeof(users) / sizeof(users[0]))
+
+/*
+** The user "bob" is named by UID, which the name service is asked about,
+** as it might be a user name made of digits.
+*/
+
+static const char config[] =
+	"default {\n"
+	"	default {\n"
+	"		force reply \"default\"\n"
+	"	}\n"
+	"\n"
+	"	to 192.0.2.9 {\n"
+	"		force reply \"default-to\"\n"
+	"	}\n"
+	"}\n"
+	"\n"
+	"user alice {\n"
+	"	default {\n"
+	"		force reply \"alice\"\n"
+	"	}\n"
+	"\n"
+	"	fport 6667 {\n"
+	"		force reply \"alice-irc\"\n"
+	"	}\n"
+	"}\n"
+	"\n"
+	"# user dave { is not a block\n"
+	"user 1002 {\n"
+	"	default {\n"
+	"		force reply \"bob\"\n"
+	"	}\n"
+	"}\n"
+	"\n"
+	"user carol {\n"
+	"	lport 2000:3000 {\n"
+	"		force hide\n"
+	"	}\n"
+	"}\n";
+
+struct query {
+	in_port_t lport;
+	in_port_t fport;
+	const char *faddr;
+};
+
+static const struct query queries[] = {
+	{ 113,	6667,	"192.0.2.2" },
+	{ 2500,	80,		"192.0.2.2" },
+	{ 2500,	80,		"192.0.2.9" },
+	{ 113,	6667,	"192.0.2.9" },
+};
+
+#define NUM_QUERIES	(sizeof(queries) / sizeof(queries[0]))
+
+struct answer {
+	int ret;
+	char reply[64];
+};
+
+static char path[] = "/tmp/oidentd-check-config.XXXXXX";
+static unsigned int num_getpwnam;
+
+static void remove_input(void);
+static void make_addr(struct sockaddr_storage *ss, const char *str);
+static void answer(const struct passwd *pw, const struct query *query, struct answer *ans);
+
+struct passwd *getpwnam(const char *name) {
+	size_t i;
+
+	++num_getpwnam;
+
+	for (i = 0; i < NUM_USERS; ++i) {
+		if (!strcmp(users[i].pw_name, name))
+			return &users[i];
+	}
+
+	return NULL;
+}
+
+static void remove_input(void) {
+	unlink(path);
+}
+
+static void make_addr(struct sockaddr_storage *ss, const char *str) {
+	struct sockaddr_in *sin = (struct sockaddr_in *) ss;
+
+	memset(ss, 0, sizeof(*ss));
+	sin->sin_family = AF_INET;
+
+	if (inet_pton(AF_INET, str, &sin->sin_addr) != 1)
+		abort();
+}
+
+static void answer(const struct passwd *pw, const struct query *query, struct answer *ans) {
+	struct sockaddr_storage laddr, faddr;
+
+	make_addr(&laddr, "192.0.2.1");
+	make_addr(&faddr, query->faddr);
+
+	memset(ans, 0, sizeof(*ans));
+	ans->ret = get_ident(pw, query->lport, query->fport, &laddr, &faddr,
+				ans->reply, sizeof(ans->reply));
+}
+
+int main(void) {
+	struct answer full[NUM_USERS][NUM_QUERIES];
+	size_t i, j;
+	FILE *fp;
+	int fd;
+
+	fuzz_setup(NULL);
+
+	fd = mkstemp(path);
+	CHECK(fd != -1);
+	atexit(remove_input);
+
+	fp = fdopen(fd, "w");
+	CHECK(fp && fputs(config, fp) != EOF && fclose(fp) == 0);
+
+	num_getpwnam = 0;
+	CHECK(read_config(path) == 0);
+	CHECK(num_getpwnam == 3);
+
+	for (i = 0; i < NUM_USERS; ++i) {
+		for (j = 0; j < NUM_QUERIES; ++j)
+			answer(&users[i], &queries[j], &full[i][j]);
+	}
+
+	CHECK(!strcmp(full[0][0].reply, "alice-irc"));
+	CHECK(!strcmp(full[1][2].reply, "bob"));
+	CHECK(full[2][1].ret == -1);
+	CHECK(!strcmp(full[3][2].reply, "default-to"));
+
+	/*
+	** A lazily parsed file is good for the user of a single query.  The
+	** name service is only asked about the block named by UID, and about
+	** the user's own block when it is parsed.
+	*/
+
+	for (i = 0; i < NUM_USERS; ++i) {
+		for (j = 0; j < NUM_QUERIES; ++j) {
+			struct answer lazy;
+			struct user_db *db;
+
+			CHECK(read_config_lazy(path) == 0);
+
+			db = user_db_acquire();
+			CHECK(db->lazy != NULL);
+			user_db_release(db);
+
+			num_getpwnam = 0;
+			answer(&users[i], &queries[j], &lazy);
+			CHECK(num_getpwnam == (users[i].pw_uid == 1004 ? 1 : 2));
+
+			CHECK(lazy.ret == full[i][j].ret);
+			CHECK(!strcmp(lazy.reply, full[i][j].reply));
+		}
+	}
+
+	return EXIT_SUCCESS;
+}
@@ -0,0 +1,152 @@
+/*
+** check_offload.c - check that stuck services don't hold up the others.
+** Copyright (c) 2019      Janik Rabe  <oidentd@janikrabe.com>
+**
+** This program is free software; you can redistribute it and/or modify
+** it under the terms of the GNU General Public License, version 2,
+** as published by the Free Software Foundation.
+**
+** This program is distributed in the hope that it will be useful,
+** but WITHOUT ANY WARRANTY; without even the implied warranty of
+** MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+** GNU General Public License for more details.
+**
+** You should have received a copy of the GNU General Public License
+** along with this program; if not, write to the Free Software
+** Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA
+*/
+
+#include <config.h>
+
+#include <unistd.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <time.h>
+#include <pwd.h>
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+
+#include "oidentd.h"
+#include "util.h"
+#include "offload.h"
+#include "harness.h"
+#include "check.h"
+
+#if THREAD_SUPPORT
+#	include <pthread.h>
+
+/*
+** Jobs for the service "/home/stuck" block until they are released, as
+** if the home directory were on an NFS server that stopped responding.
+*/
+
+static pthread_mutex_t stuck_mutex = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t stuck_cond = PTHREAD_COND_INITIALIZER;
+static unsigned int started;
+static unsigned int finished;
+static bool released;
+
+static void stuck_job(void *data __notused);
+static bool stuck_wait(unsigned int *count, unsigned int num);
+static void check_pool(void);
+#endif
+
+static void quick_job(void *data);
+
+/*
+** Other jobs finish right away.
+*/
+
+static void quick_job(void *data) {
+	*(bool *) data = true;
+}
+
+#if THREAD_SUPPORT
+
+static void stuck_job(void *data __notused) {
+	pthread_mutex_lock(&stuck_mutex);
+
+	++started;
+	pthread_cond_broadcast(&stuck_cond);
+
+	while (!released)
+		pthread_cond_wait(&stuck_cond, &stuck_mutex);
+
+	++finished;
+	pthread_cond_broadcast(&stuck_cond);
+
+	pthread_mutex_unlock(&stuck_mutex);
+}
+
+/*
+** Wait up to a second for "count" to reach "num."
+** Returns true if it did.
+*/
+
+static bool stuck_wait(unsigned int *count, unsigned int num) {
+	struct timespec deadline;
+	int ret = 0;
+
+	clock_gettime(CLOCK_REALTIME, &deadline);
+	++deadline.tv_sec;
+
+	pthread_mutex_lock(&stuck_mutex);
+
+	while (*count < num && ret == 0)
+		ret = pthread_cond_timedwait(&stuck_cond, &stuck_mutex, &deadline);
+
+	ret = *count >= num;
+	pthread_mutex_unlock(&stuck_mutex);
+
+	return ret;
+}
+
+/*
+** At most OFFLOAD_KEY_THREADS jobs for a stuck service run at once.  The
+** other pool threads keep running jobs for other services, and the
+** service's queued jobs run once it recovers.
+*/
+
+static void check_pool(void) {
+	bool ran = false;
+	unsigned int i;
+
+	CHECK(offload_init(OFFLOAD_THREADS) == 0);
+
+	for (i = 0; i < OFFLOAD_KEY_THREADS + 1; ++i)
+		CHECK(offload_queue("/home/stuck", stuck_job, NULL, NULL) == 0);
+
+	CHECK(stuck_wait(&started, OFFLOAD_KEY_THREADS));
+
+	CHECK(offload_call("hosts", quick_job, &ran, NULL) == 0);
+	CHECK(ran);
+
+	/* the last job waits although there are idle threads */
+	CHECK(!stuck_wait(&started, OFFLOAD_KEY_THREADS + 1));
+
+	pthread_mutex_lock(&stuck_mutex);
+	released = true;
+	pthread_cond_broadcast(&stuck_cond);
+	pthread_mutex_unlock(&stuck_mutex);
+
+	CHECK(stuck_wait(&finished, OFFLOAD_KEY_THREADS + 1));
+}
+
+#endif
+
+int main(void) {
+	bool ran = false;
+
+	fuzz_setup(NULL);
+
+	/* before the pool is started, operations run in the calling thread */
+	CHECK(offload_call("hosts", quick_job, &ran, NULL) == 0);
+	CHECK(ran);
+
+#if THREAD_SUPPORT
+	check_pool();
+#endif
+
+	return EXIT_SUCCESS;
+}
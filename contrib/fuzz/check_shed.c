@@ -0,0 +1,139 @@
+/*
+** check_shed.c - check when load is shed.
+** Copyright (c) 2019      Janik Rabe  <oidentd@janikrabe.com>
+**
+** This program is free software; you can redistribute it and/or modify
+** it under the terms of the GNU General Public License, version 2,
+** as published by the Free Software Foundation.
+**
+** This program is distributed in the hope that it will be useful,
+** but WITHOUT ANY WARRANTY; without even the implied warranty of
+** MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+** GNU General Public License for more details.
+**
+** You should have received a copy of the GNU General Public License
+** along with this program; if not, write to the Free Software
+** Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA
+*/
+
+#include <config.h>
+
+#include <unistd.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <pwd.h>
+#include <sys/time.h>
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+
+#include "oidentd.h"
+#include "util.h"
+#include "shed.h"
+#include "harness.h"
+#include "check.h"
+
+/*
+** Lookups are recorded as having taken a second, against a target of
+** 100 ms.  The clock used for decaying the latency while the daemon is
+** idle is replaced, so that idle seconds can be skipped.
+*/
+
+#define CHECK_TARGET	100
+
+static time_t idle;
+static struct sockaddr_storage peer;
+
+static void record_second(void);
+static int admit_level(void);
+
+time_t time(time_t *t) {
+	struct timeval now;
+
+	gettimeofday(&now, NULL);
+	now.tv_sec += idle;
+
+	if (t)
+		*t = now.tv_sec;
+
+	return now.tv_sec;
+}
+
+static void record_second(void) {
+	struct timeval start;
+
+	gettimeofday(&start, NULL);
+	--start.tv_sec;
+	shed_record(&start);
+}
+
+/*
+** Admit SHED_PROBE_INTERVAL requests.  While requests are answered with
+** errors, exactly one of them is a probe that is looked up cheaply.
+** Returns the level they were admitted at.
+*/
+
+static int admit_level(void) {
+	int num[SHED_ERROR + 1] = { 0 };
+	int i;
+
+	for (i = 0; i < SHED_PROBE_INTERVAL; ++i) {
+		int level = shed_admit(&peer);
+
+		CHECK(level >= SHED_NONE && level <= SHED_ERROR);
+		++num[level];
+	}
+
+	if (num[SHED_NONE] == SHED_PROBE_INTERVAL)
+		return SHED_NONE;
+
+	if (num[SHED_CHEAP] == SHED_PROBE_INTERVAL)
+		return SHED_CHEAP;
+
+	CHECK(num[SHED_CHEAP] == 1 && num[SHED_ERROR] == SHED_PROBE_INTERVAL - 1);
+	return SHED_ERROR;
+}
+
+int main(void) {
+	fuzz_setup(NULL);
+
+	peer.ss_family = AF_INET;
+
+	/* without a target, nothing is shed */
+	record_second();
+	record_second();
+	CHECK(admit_level() == SHED_NONE);
+	CHECK(!shed_active());
+
+	shed_init(CHECK_TARGET);
+	CHECK(admit_level() == SHED_NONE);
+
+	/* a smoothed latency of 125 ms exceeds the target */
+	record_second();
+	CHECK(admit_level() == SHED_CHEAP);
+	CHECK(shed_active());
+
+	/* one of 234 ms exceeds twice the target */
+	record_second();
+	CHECK(admit_level() == SHED_ERROR);
+	CHECK(shed_active());
+
+	/*
+	** Every idle second halves the latency, but the level is only
+	** lowered once the latency is below half of the threshold.
+	*/
+
+	idle += 2;
+	CHECK(admit_level() == SHED_ERROR);
+
+	idle += 2;
+	CHECK(admit_level() == SHED_CHEAP);
+
+	idle += 2;
+	CHECK(admit_level() == SHED_NONE);
+	CHECK(!shed_active());
+
+	return EXIT_SUCCESS;
+}
@@ -0,0 +1,167 @@
+/*
+** check_user_prefs.c - check that children share parsed user files.
+** Copyright (c) 2019      Janik Rabe  <oidentd@janikrabe.com>
+**
+** This program is free software; you can redistribute it and/or modify
+** it under the terms of the GNU General Public License, version 2,
+** as published by the Free Software Foundation.
+**
+** This program is distributed in the hope that it will be useful,
+** but WITHOUT ANY WARRANTY; without even the implied warranty of
+** MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+** GNU General Public License for more details.
+**
+** You should have received a copy of the GNU General Public License
+** along with this program; if not, write to the Free Software
+** Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA
+*/
+
+#include <config.h>
+
+#include <unistd.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <pwd.h>
+#include <sys/types.h>
+#include <sys/wait.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
+
+#include "oidentd.h"
+#include "util.h"
+#include "user_db.h"
+#include "harness.h"
+#include "check.h"
+
+/*
+** In fork mode, each connection is served by a child process, which
+** parses the user's configuration file and sends it to the parent.  The
+** children forked later inherit the parent's cache, and only look at the
+** file again once USER_CONF_RECHECK seconds have passed.  The clock is
+** replaced so that this can be checked without waiting.
+*/
+
+static char home[] = "/tmp/oidentd-check-home.XXXXXX";
+static char user_conf[sizeof(home) + sizeof(USER_CONF) + 1];
+static char system_conf[] = "/tmp/oidentd-check-config.XXXXXX";
+static time_t now = 1000000000;
+
+static void remove_files(void);
+static void write_file(const char *path, const char *data);
+static void child_answer(const struct passwd *pw, const char *expected);
+
+time_t time(time_t *t) {
+	if (t)
+		*t = now;
+
+	return now;
+}
+
+static void remove_files(void) {
+	unlink(user_conf);
+	unlink(system_conf);
+	rmdir(home);
+}
+
+static void write_file(const char *path, const char *data) {
+	FILE *fp = fopen(path, "w");
+
+	CHECK(fp && fputs(data, fp) != EOF && fclose(fp) == 0);
+}
+
+/*
+** Answer a query for a connection of "pw" in a child process, as the
+** daemon does in fork mode, and require the reply to be "expected."
+*/
+
+static void child_answer(const struct passwd *pw, const char *expected) {
+	int status;
+
+	if (fork() == 0) {
+		struct sockaddr_storage laddr, faddr;
+		char reply[64];
+
+		memset(&laddr, 0, sizeof(laddr));
+		memset(&faddr, 0, sizeof(faddr));
+		laddr.ss_family = AF_INET;
+		faddr.ss_family = AF_INET;
+
+		CHECK(get_ident(pw, 1024, 6667, &laddr, &faddr, reply, sizeof(reply)) == 0);
+		CHECK(!strcmp(reply, expected));
+
+		_exit(EXIT_SUCCESS);
+	}
+
+	CHECK(wait(&status) != -1);
+	CHECK(WIFEXITED(status) && WEXITSTATUS(status) == EXIT_SUCCESS);
+}
+
+int main(void) {
+	struct passwd pw;
+	int fd;
+
+	fuzz_setup(NULL);
+
+	CHECK(mkdtemp(home) != NULL);
+	CHECK(close(mkstemp(system_conf)) == 0);
+	snprintf(user_conf, sizeof(user_conf), "%s/%s", home, USER_CONF);
+	atexit(remove_files);
+
+	memset(&pw, 0, sizeof(pw));
+	pw.pw_name = "checkuser";
+	pw.pw_uid = getuid();
+	pw.pw_dir = home;
+
+	write_file(system_conf,
+		"default {\n"
+		"	default {\n"
+		"		allow spoof\n"
+		"		allow spoof_all\n"
+		"	}\n"
+		"}\n");
+
+	write_file(user_conf,
+		"global {\n"
+		"	reply \"shared\"\n"
+		"}\n");
+
+	CHECK(read_config(system_conf) == 0);
+
+	fd = user_db_share_init();
+
+#ifdef HAVE_FMEMOPEN
+	CHECK(fd != -1);
+
+	child_answer(&pw, "shared");
+	user_db_receive_prefs(fd);
+
+	/* the next child answers from the cache, even though the file is gone */
+	CHECK(unlink(user_conf) == 0);
+	child_answer(&pw, "shared");
+
+	/* which it checks once USER_CONF_RECHECK seconds have passed */
+	now += USER_CONF_RECHECK;
+	child_answer(&pw, "checkuser");
+
+	/* changed files are parsed by the child and sent again */
+	write_file(user_conf,
+		"global {\n"
+		"	reply \"changed\"\n"
+		"}\n");
+
+	now += USER_CONF_RECHECK;
+	child_answer(&pw, "changed");
+	user_db_receive_prefs(fd);
+
+	CHECK(unlink(user_conf) == 0);
+	child_answer(&pw, "changed");
+#else
+	CHECK(fd == -1);
+	child_answer(&pw, "shared");
+#endif
+
+	return EXIT_SUCCESS;
+}
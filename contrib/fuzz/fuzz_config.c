@@ -0,0 +1,98 @@
+/*
+** fuzz_config.c - fuzz the configuration file parsers.
+** Copyright (c) 2019      Janik Rabe  <oidentd@janikrabe.com>
+**
+** This program is free software; you can redistribute it and/or modify
+** it under the terms of the GNU General Public License, version 2,
+** as published by the Free Software Foundation.
+**
+** This program is distributed in the hope that it will be useful,
+** but WITHOUT ANY WARRANTY; without even the implied warranty of
+** MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+** GNU General Public License for more details.
+**
+** You should have received a copy of the GNU General Public License
+** along with this program; if not, write to the Free Software
+** Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA
+*/
+
+#include <config.h>
+
+#include <unistd.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <pwd.h>
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+
+#include "oidentd.h"
+#include "util.h"
+#include "user_db.h"
+#include "harness.h"
+
+/*
+** The parsers read files, so each input is written to a temporary file.
+** It is parsed completely, and lazily as with --stdio, where only the
+** blocks for the user "fuzz_pw" are parsed.
+*/
+
+static char path[] = "/tmp/oidentd-fuzz-config.XXXXXX";
+static int fd = -1;
+static struct passwd fuzz_pw = { .pw_name = "root", .pw_uid = 0 };
+
+static void remove_input(void);
+static void run(const uint8_t *data, size_t size);
+
+static void remove_input(void) {
+	unlink(path);
+}
+
+static void run(const uint8_t *data, size_t size) {
+	struct user_db *db;
+
+	if (ftruncate(fd, 0) != 0 || pwrite(fd, data, size, 0) != (ssize_t) size)
+		abort();
+
+	read_config(path);
+
+	if (read_config_lazy(path) != 0)
+		return;
+
+	db = user_db_acquire();
+	if (db->lazy)
+		user_db_load_lazy(db, &fuzz_pw);
+	user_db_release(db);
+}
+
+const char *__asan_default_options(void);
+int LLVMFuzzerInitialize(int *argc, char ***argv);
+int LLVMFuzzerTestOneInput(const uint8_t *data, size_t size);
+
+/*
+** Strings that the parser discards when it gives up on a file are not
+** freed, so leaks are not reported.
+*/
+
+const char *__asan_default_options(void) {
+	return "detect_leaks=0";
+}
+
+int LLVMFuzzerInitialize(int *argc __notused, char ***argv __notused) {
+	fuzz_setup(NULL);
+
+	fd = mkstemp(path);
+	if (fd == -1) {
+		perror(path);
+		exit(EXIT_FAILURE);
+	}
+
+	atexit(remove_input);
+	return 0;
+}
+
+int LLVMFuzzerTestOneInput(const uint8_t *data, size_t size) {
+	return fuzz_cost_run("config", run, data, size);
+}
@@ -0,0 +1,58 @@
+/*
+** fuzz_conntrack.c - fuzz the parser of connection tracking files.
+** Copyright (c) 2019      Janik Rabe  <oidentd@janikrabe.com>
+**
+** This program is free software; you can redistribute it and/or modify
+** it under the terms of the GNU General Public License, version 2,
+** as published by the Free Software Foundation.
+**
+** This program is distributed in the hope that it will be useful,
+** but WITHOUT ANY WARRANTY; without even the implied warranty of
+** MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+** GNU General Public License for more details.
+**
+** You should have received a copy of the GNU General Public License
+** along with this program; if not, write to the Free Software
+** Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA
+*/
+
+#include <config.h>
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <pwd.h>
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+
+#include "oidentd.h"
+#include "util.h"
+#include "fuzz.h"
+#include "harness.h"
+
+static void run(const uint8_t *data, size_t size);
+
+static void run(const uint8_t *data __notused, size_t size __notused) {
+#if MASQ_SUPPORT
+	FILE *fp = fuzz_fmemopen(data, size);
+
+	if (!fp)
+		return;
+
+	fuzz_conntrack(fp);
+	fclose(fp);
+#endif
+}
+
+int LLVMFuzzerInitialize(int *argc, char ***argv);
+int LLVMFuzzerTestOneInput(const uint8_t *data, size_t size);
+
+int LLVMFuzzerInitialize(int *argc __notused, char ***argv __notused) {
+	fuzz_setup("--masquerade", NULL);
+	return 0;
+}
+
+int LLVMFuzzerTestOneInput(const uint8_t *data, size_t size) {
+	return fuzz_cost_run("conntrack", run, data, size);
+}
@@ -0,0 +1,80 @@
+/*
+** fuzz_query.c - fuzz the parser of ident queries.
+** Copyright (c) 2019      Janik Rabe  <oidentd@janikrabe.com>
+**
+** This program is free software; you can redistribute it and/or modify
+** it under the terms of the GNU General Public License, version 2,
+** as published by the Free Software Foundation.
+**
+** This program is distributed in the hope that it will be useful,
+** but WITHOUT ANY WARRANTY; without even the implied warranty of
+** MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+** GNU General Public License for more details.
+**
+** You should have received a copy of the GNU General Public License
+** along with this program; if not, write to the Free Software
+** Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA
+*/
+
+#include <config.h>
+
+#include <unistd.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <fcntl.h>
+#include <pwd.h>
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+
+#include "oidentd.h"
+#include "util.h"
+#include "harness.h"
+
+/*
+** Only the first line of a query is read, so larger inputs are cut short
+** to fit into the pipe they are read from.
+*/
+
+#define QUERY_MAX_LEN	16384
+
+static int null_fd = -1;
+
+static void run(const uint8_t *data, size_t size);
+
+static void run(const uint8_t *data, size_t size) {
+	int fds[2];
+
+	if (pipe(fds) != 0)
+		abort();
+
+	if (size > QUERY_MAX_LEN)
+		size = QUERY_MAX_LEN;
+
+	if (write(fds[1], data, size) != (ssize_t) size)
+		abort();
+
+	close(fds[1]);
+	service_request(fds[0], null_fd);
+	close(fds[0]);
+}
+
+int LLVMFuzzerInitialize(int *argc, char ***argv);
+int LLVMFuzzerTestOneInput(const uint8_t *data, size_t size);
+
+int LLVMFuzzerInitialize(int *argc __notused, char ***argv __notused) {
+	fuzz_setup(NULL);
+
+	null_fd = open("/dev/null", O_WRONLY);
+	if (null_fd == -1) {
+		perror("/dev/null");
+		exit(EXIT_FAILURE);
+	}
+
+	return 0;
+}
+
+int LLVMFuzzerTestOneInput(const uint8_t *data, size_t size) {
+	return fuzz_cost_run("query", run, data, size);
+}
@@ -0,0 +1,289 @@
+/*
+** harness.c - oidentd fuzzing harness support.
+** Copyright (c) 2019      Janik Rabe  <oidentd@janikrabe.com>
+**
+** This program is free software; you can redistribute it and/or modify
+** it under the terms of the GNU General Public License, version 2,
+** as published by the Free Software Foundation.
+**
+** This program is distributed in the hope that it will be useful,
+** but WITHOUT ANY WARRANTY; without even the implied warranty of
+** MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+** GNU General Public License for more details.
+**
+** You should have received a copy of the GNU General Public License
+** along with this program; if not, write to the Free Software
+** Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA
+*/
+
+#define _GNU_SOURCE
+#include <config.h>
+
+#include <unistd.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdarg.h>
+#include <stdint.h>
+#include <string.h>
+#include <time.h>
+#include <errno.h>
+#include <pwd.h>
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+
+#include "oidentd.h"
+#include "util.h"
+#include "options.h"
+#include "harness.h"
+
+struct fuzz_cost {
+	unsigned long long nsecs;
+	size_t bytes;
+};
+
+/*
+** Heap usage is tracked through the allocator hooks of the sanitizers,
+** where they are available.  Without them, only CPU time is measured.
+*/
+
+extern int __sanitizer_install_malloc_and_free_hooks(
+	void (*malloc_hook)(const volatile void *, size_t),
+	void (*free_hook)(const volatile void *)) __attribute__((weak));
+extern size_t __sanitizer_get_allocated_size(const volatile void *)
+	__attribute__((weak));
+
+static size_t heap_live;
+static size_t heap_peak;
+
+#ifdef __linux__
+/*
+** libFuzzer treats these as coverage: an input that reaches a new power
+** of two of CPU time or heap usage is kept and mutated further, which
+** steers fuzzing towards expensive inputs.
+*/
+
+__attribute__((section("__libfuzzer_extra_counters"), used))
+static uint8_t cost_counters[2][32];
+#endif
+
+static void heap_malloc_hook(const volatile void *ptr __notused, size_t size);
+static void heap_free_hook(const volatile void *ptr);
+static unsigned long long cpu_nsecs(void);
+static void measure(fuzz_run_t run,
+					const uint8_t *data,
+					size_t size,
+					struct fuzz_cost *cost);
+static uint8_t *repeat_input(const uint8_t *data, size_t size, size_t *len);
+static unsigned int log2_bucket(unsigned long long value);
+static void log_cost(	const char *name,
+						size_t size,
+						const struct fuzz_cost *cost,
+						size_t scaled_size,
+						const struct fuzz_cost *scaled);
+
+static void heap_malloc_hook(const volatile void *ptr __notused, size_t size) {
+	heap_live += size;
+
+	if (heap_live > heap_peak)
+		heap_peak = heap_live;
+}
+
+static void heap_free_hook(const volatile void *ptr) {
+	size_t size;
+
+	if (!ptr || !__sanitizer_get_allocated_size)
+		return;
+
+	size = __sanitizer_get_allocated_size(ptr);
+	heap_live -= size < heap_live ? size : heap_live;
+}
+
+void fuzz_setup(const char *arg, ...) {
+	char *argv[16];
+	int argc = 0;
+	va_list ap;
+
+	argv[argc++] = "oidentd";
+	argv[argc++] = "--quiet";
+
+	va_start(ap, arg);
+	for (; arg && argc < 15; arg = va_arg(ap, const char *))
+		argv[argc++] = (char *) arg;
+	va_end(ap);
+
+	argv[argc] = NULL;
+
+	if (get_options(argc, argv) != 0 || k_open() != 0 ||
+		seed_prng() != 0 || read_config("/dev/null") != 0)
+	{
+		fprintf(stderr, "Unable to set up oidentd for fuzzing\n");
+		exit(EXIT_FAILURE);
+	}
+
+	if (__sanitizer_install_malloc_and_free_hooks && __sanitizer_get_allocated_size)
+		__sanitizer_install_malloc_and_free_hooks(heap_malloc_hook, heap_free_hook);
+}
+
+FILE *fuzz_fmemopen(const uint8_t *data, size_t size) {
+	if (size == 0)
+		return NULL;
+
+	return fmemopen((void *) data, size, "r");
+}
+
+static unsigned long long cpu_nsecs(void) {
+	struct timespec ts;
+
+	clock_gettime(CLOCK_PROCESS_CPUTIME_ID, &ts);
+	return (unsigned long long) ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+/*
+** Run "run" on the input and store its CPU time and the growth of the
+** heap while it ran in "cost."
+*/
+
+static void measure(fuzz_run_t run,
+					const uint8_t *data,
+					size_t size,
+					struct fuzz_cost *cost)
+{
+	size_t base = heap_live;
+	unsigned long long start;
+
+	heap_peak = heap_live;
+	start = cpu_nsecs();
+
+	run(data, size);
+
+	cost->nsecs = cpu_nsecs() - start;
+	cost->bytes = heap_peak - base;
+}
+
+/*
+** Return a newly allocated buffer holding FUZZ_SCALE copies of the input,
+** each ending in a newline, so that line-based formats get FUZZ_SCALE
+** times as many lines.
+*/
+
+static uint8_t *repeat_input(const uint8_t *data, size_t size, size_t *len) {
+	bool newline = data[size - 1] != '\n';
+	size_t copy = size + newline;
+	uint8_t *buf;
+	size_t i;
+
+	if (copy > FUZZ_MAX_SCALED / FUZZ_SCALE)
+		return NULL;
+
+	buf = malloc(copy * FUZZ_SCALE);
+	if (!buf)
+		return NULL;
+
+	for (i = 0; i < FUZZ_SCALE; ++i) {
+		memcpy(buf + i * copy, data, size);
+
+		if (newline)
+			buf[i * copy + size] = '\n';
+	}
+
+	*len = copy * FUZZ_SCALE;
+	return buf;
+}
+
+static unsigned int log2_bucket(unsigned long long value) {
+	unsigned int bucket = 0;
+
+	while (value > 1 && bucket < 31) {
+		value >>= 1;
+		++bucket;
+	}
+
+	return bucket;
+}
+
+static void log_cost(	const char *name,
+						size_t size,
+						const struct fuzz_cost *cost,
+						size_t scaled_size,
+						const struct fuzz_cost *scaled)
+{
+	static FILE *fp;
+	const char *path;
+
+	if (!fp) {
+		path = getenv("OIDENTD_FUZZ_COST_LOG");
+		if (!path || !(fp = fopen(path, "a")))
+			return;
+
+		setvbuf(fp, NULL, _IOLBF, 0);
+	}
+
+	fprintf(fp, "%s %zu %llu %zu %zu %llu %zu\n", name,
+		size, cost->nsecs, cost->bytes,
+		scaled_size, scaled->nsecs, scaled->bytes);
+}
+
+int fuzz_cost_run(const char *name, fuzz_run_t run, const uint8_t *data, size_t size) {
+	struct fuzz_cost cost;
+	struct fuzz_cost scaled = { 0, 0 };
+	size_t scaled_size = 0;
+	uint8_t *buf = NULL;
+	bool slow;
+	bool large;
+	int i;
+
+	measure(run, data, size, &cost);
+
+#ifdef __linux__
+	cost_counters[0][log2_bucket(cost.nsecs / 1000)] = 1;
+	cost_counters[1][log2_bucket(cost.bytes)] = 1;
+#endif
+
+	if (size > 0)
+		buf = repeat_input(data, size, &scaled_size);
+
+	if (buf)
+		measure(run, buf, scaled_size, &scaled);
+
+	log_cost(name, size, &cost, scaled_size, &scaled);
+
+	if (!buf)
+		return 0;
+
+	/* timing is noisy, so only the cheapest of several runs counts */
+	for (i = 1; i < FUZZ_REMEASURE; ++i) {
+		struct fuzz_cost again;
+
+		slow = scaled.nsecs > FUZZ_MIN_NSECS &&
+			scaled.nsecs > cost.nsecs * FUZZ_SCALE_LIMIT;
+		if (!slow)
+			break;
+
+		measure(run, data, size, &again);
+		if (again.nsecs < cost.nsecs)
+			cost.nsecs = again.nsecs;
+
+		measure(run, buf, scaled_size, &again);
+		if (again.nsecs < scaled.nsecs)
+			scaled.nsecs = again.nsecs;
+	}
+
+	free(buf);
+
+	slow = scaled.nsecs > FUZZ_MIN_NSECS &&
+		scaled.nsecs > cost.nsecs * FUZZ_SCALE_LIMIT;
+	large = scaled.bytes > FUZZ_MIN_BYTES &&
+		scaled.bytes > cost.bytes * FUZZ_SCALE_LIMIT;
+
+	if (slow || large) {
+		fprintf(stderr, "%s: super-linear %s: %zu bytes of input took %llu us "
+			"and %zu bytes of heap; %zu bytes took %llu us and %zu bytes\n",
+			name, slow ? "time" : "memory",
+			size, cost.nsecs / 1000, cost.bytes,
+			scaled_size, scaled.nsecs / 1000, scaled.bytes);
+		abort();
+	}
+
+	return 0;
+}
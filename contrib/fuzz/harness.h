@@ -0,0 +1,71 @@
+/*
+** harness.h - oidentd fuzzing harness support.
+** Copyright (c) 2019      Janik Rabe  <oidentd@janikrabe.com>
+**
+** This program is free software; you can redistribute it and/or modify
+** it under the terms of the GNU General Public License, version 2,
+** as published by the Free Software Foundation.
+**
+** This program is distributed in the hope that it will be useful,
+** but WITHOUT ANY WARRANTY; without even the implied warranty of
+** MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+** GNU General Public License for more details.
+**
+** You should have received a copy of the GNU General Public License
+** along with this program; if not, write to the Free Software
+** Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA
+*/
+
+#ifndef __OIDENTD_FUZZ_HARNESS_H
+#define __OIDENTD_FUZZ_HARNESS_H
+
+#include <stdio.h>
+#include <stdint.h>
+
+/*
+** Each input is also run repeated FUZZ_SCALE times.  An input is reported
+** as super-linear if the repeated input costs more than FUZZ_SCALE_LIMIT
+** times as much, which is half of what quadratic growth would give, and
+** its cost exceeds FUZZ_MIN_NSECS nanoseconds of CPU time or
+** FUZZ_MIN_BYTES bytes of peak heap usage.  Repeated inputs larger than
+** FUZZ_MAX_SCALED bytes are not run.
+*/
+
+#define FUZZ_SCALE			8
+#define FUZZ_SCALE_LIMIT	(FUZZ_SCALE * FUZZ_SCALE / 2)
+#define FUZZ_MIN_NSECS		2000000ULL
+#define FUZZ_MIN_BYTES		(1024 * 1024)
+#define FUZZ_MAX_SCALED		(4 * 1024 * 1024)
+
+/*
+** Suspected super-linear inputs are measured this many times, keeping the
+** lowest cost, before they are reported.
+*/
+
+#define FUZZ_REMEASURE		3
+
+typedef void (*fuzz_run_t)(const uint8_t *data, size_t size);
+
+/*
+** Set up the options, configuration and kernel interface of the daemon,
+** as if it had been started with the given arguments.
+*/
+
+void fuzz_setup(const char *arg, ...);
+
+/*
+** Open "data" as a read-only stream, or return NULL if it is empty.
+*/
+
+FILE *fuzz_fmemopen(const uint8_t *data, size_t size);
+
+/*
+** Run "run" on the input, measuring its CPU time and peak heap usage, and
+** on the input repeated FUZZ_SCALE times.  Costs are appended to the file
+** named by OIDENTD_FUZZ_COST_LOG, if set.  Inputs whose cost grows
+** super-linearly abort the process, so that the fuzzer keeps them.
+*/
+
+int fuzz_cost_run(const char *name, fuzz_run_t run, const uint8_t *data, size_t size);
+
+#endif
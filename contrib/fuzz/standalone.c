@@ -0,0 +1,165 @@
+/*
+** standalone.c - run fuzzing harnesses over files, without a fuzzing engine.
+** Copyright (c) 2019      Janik Rabe  <oidentd@janikrabe.com>
+**
+** This program is free software; you can redistribute it and/or modify
+** it under the terms of the GNU General Public License, version 2,
+** as published by the Free Software Foundation.
+**
+** This program is distributed in the hope that it will be useful,
+** but WITHOUT ANY WARRANTY; without even the implied warranty of
+** MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+** GNU General Public License for more details.
+**
+** You should have received a copy of the GNU General Public License
+** along with this program; if not, write to the Free Software
+** Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA
+*/
+
+#define _GNU_SOURCE
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <errno.h>
+#include <signal.h>
+#include <unistd.h>
+#include <dirent.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+
+/*
+** Like libFuzzer, an input that runs for more than RUN_TIMEOUT seconds is
+** reported as a hang.
+*/
+
+#define RUN_TIMEOUT		10
+
+int LLVMFuzzerInitialize(int *argc, char ***argv);
+int LLVMFuzzerTestOneInput(const uint8_t *data, size_t size);
+
+static const char *cur_path;
+
+static void timeout_handler(int sig);
+static int run_file(const char *path);
+static int run_path(const char *path);
+
+static void timeout_handler(int sig) {
+	static const char msg[] = "Input timed out: ";
+
+	(void) sig;
+
+	if (write(STDERR_FILENO, msg, sizeof(msg) - 1) < 0 ||
+		write(STDERR_FILENO, cur_path, strlen(cur_path)) < 0 ||
+		write(STDERR_FILENO, "\n", 1) < 0)
+	{
+		_exit(EXIT_FAILURE);
+	}
+
+	abort();
+}
+
+/*
+** Run the harness on the contents of the file "path."
+** Returns 0 on success, -1 on failure.
+*/
+
+static int run_file(const char *path) {
+	uint8_t *data = NULL;
+	size_t size = 0;
+	size_t len;
+	FILE *fp;
+
+	fp = fopen(path, "rb");
+	if (!fp) {
+		fprintf(stderr, "%s: %s\n", path, strerror(errno));
+		return -1;
+	}
+
+	for (;;) {
+		data = realloc(data, size + 65536);
+		if (!data)
+			abort();
+
+		len = fread(data + size, 1, 65536, fp);
+		size += len;
+
+		if (len < 65536)
+			break;
+	}
+
+	fclose(fp);
+
+	cur_path = path;
+	alarm(RUN_TIMEOUT);
+	LLVMFuzzerTestOneInput(data, size);
+	alarm(0);
+	free(data);
+
+	return 0;
+}
+
+/*
+** Run the harness on "path," or on every file in it if it is a directory.
+** Returns 0 on success, -1 on failure.
+*/
+
+static int run_path(const char *path) {
+	struct dirent *ent;
+	struct stat st;
+	DIR *dir;
+	int ret = 0;
+
+	if (stat(path, &st) != 0) {
+		fprintf(stderr, "%s: %s\n", path, strerror(errno));
+		return -1;
+	}
+
+	if (!S_ISDIR(st.st_mode))
+		return run_file(path);
+
+	dir = opendir(path);
+	if (!dir) {
+		fprintf(stderr, "%s: %s\n", path, strerror(errno));
+		return -1;
+	}
+
+	while ((ent = readdir(dir))) {
+		char *child;
+
+		if (ent->d_name[0] == '.')
+			continue;
+
+		if (asprintf(&child, "%s/%s", path, ent->d_name) == -1)
+			abort();
+
+		if (run_path(child) != 0)
+			ret = -1;
+
+		free(child);
+	}
+
+	closedir(dir);
+	return ret;
+}
+
+int main(int argc, char **argv) {
+	int ret = EXIT_SUCCESS;
+	int i;
+
+	if (argc < 2) {
+		fprintf(stderr, "Usage: %s <file or directory>...\n", argv[0]);
+		return EXIT_FAILURE;
+	}
+
+	signal(SIGALRM, timeout_handler);
+	LLVMFuzzerInitialize(&argc, &argv);
+
+	for (i = 1; i < argc; ++i) {
+		if (run_path(argv[i]) != 0)
+			ret = EXIT_FAILURE;
+	}
+
+	return ret;
+}
@@ -0,0 +1,76 @@
+/*
+** acl.c - oidentd access control for querying hosts.
+** Copyright (c) 2019      Janik Rabe  <oidentd@janikrabe.com>
+**
+** This program is free software; you can redistribute it and/or modify
+** it under the terms of the GNU General Public License, version 2,
+** as published by the Free Software Foundation.
+**
+** This program is distributed in the hope that it will be useful,
+** but WITHOUT ANY WARRANTY; without even the implied warranty of
+** MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+** GNU General Public License for more details.
+**
+** You should have received a copy of the GNU General Public License
+** along with this program; if not, write to the Free Software
+** Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA
+*/
+
+#include <config.h>
+
+#include <unistd.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <syslog.h>
+#include <pwd.h>
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+
+#include "oidentd.h"
+#include "util.h"
+#include "missing.h"
+#include "inet_util.h"
+#include "lpm.h"
+#include "acl.h"
+
+/*
+** The networks given with --allow and --deny.  The most specific network
+** containing a host decides whether it may connect.  Hosts in none of
+** them may connect unless --allow was given.  Connections are checked
+** as soon as they are accepted, before anything is logged or looked up.
+*/
+
+static struct lpm acl;
+static bool default_allow = true;
+
+/*
+** Allow or deny connections from the network "net," of the form
+** "address[/bits]."
+** Returns 0 on success, -1 if "net" is invalid.
+*/
+
+int acl_add(const char *net, bool allow) {
+	struct cidr cidr;
+
+	if (cidr_parse(net, &cidr) != 0)
+		return -1;
+
+	lpm_insert(&acl, &cidr, allow);
+
+	if (allow)
+		default_allow = false;
+
+	return 0;
+}
+
+/*
+** Returns true if "addr" may connect.
+*/
+
+bool acl_permit(const struct sockaddr_storage *addr) {
+	int value = lpm_lookup(&acl, addr);
+
+	return value == -1 ? default_allow : value != 0;
+}
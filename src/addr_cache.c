@@ -0,0 +1,887 @@
+/*
+** addr_cache.c - oidentd address cache for configuration statements.
+** Copyright (c) 2019      Janik Rabe  <oidentd@janikrabe.com>
+**
+** This program is free software; you can redistribute it and/or modify
+** it under the terms of the GNU General Public License, version 2,
+** as published by the Free Software Foundation.
+**
+** This program is distributed in the hope that it will be useful,
+** but WITHOUT ANY WARRANTY; without even the implied warranty of
+** MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+** GNU General Public License for more details.
+**
+** You should have received a copy of the GNU General Public License
+** along with this program; if not, write to the Free Software
+** Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA
+*/
+
+#include <config.h>
+
+#include <unistd.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <syslog.h>
+#include <time.h>
+#include <pwd.h>
+#include <signal.h>
+#include <netdb.h>
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
+
+#include "oidentd.h"
+#include "util.h"
+#include "missing.h"
+#include "inet_util.h"
+#include "addr_cache.h"
+#include "offload.h"
+#include "shm_cache.h"
+
+#if THREAD_SUPPORT
+#	include <pthread.h>
+#endif
+
+/*
+** A single lock protects the entries of all caches.  It is never held
+** while a name is being resolved.
+*/
+
+DEFINE_LOCK(cache_mutex);
+
+/*
+** A name resolution run by the offload pool.
+*/
+
+struct lookup_job {
+	char *name;
+	int ret;
+	size_t num;
+	struct sockaddr_storage *addrs;
+};
+
+/*
+** Resolved names are shared with other processes through the lookup
+** cache, so that a name is resolved at most once per TTL no matter which
+** process needs it.  Names are keyed by two hashes and a prefix of the
+** name.  The whole name is stored with the addresses and compared before
+** they are adopted, so that a name made to collide with another, say in a
+** user's configuration file, can't replace its addresses.  Names of
+** ADDR_SHARED_NAME_LEN bytes or more are not shared, and at most
+** ADDR_SHARED_MAX addresses are shared per name.  While a process resolves
+** a name in the background, the entry has no addresses, and "resolving"
+** is set until the process is expected to be done.
+*/
+
+#define ADDR_SHARED_MAX			8
+#define ADDR_SHARED_NAME_LEN	128
+
+struct shared_key {
+	u_int32_t hash[2];
+	char prefix[SHM_CACHE_KEY_LEN - 2 * sizeof(u_int32_t)];
+};
+
+struct shared_addrs {
+	time_t expires;
+	u_int32_t num;
+	u_int32_t resolving;
+	char name[ADDR_SHARED_NAME_LEN];
+	struct {
+		u_int16_t family;
+		unsigned char addr[16];
+	} addrs[ADDR_SHARED_MAX];
+};
+
+/*
+** The process resolving expired names in the background, if any, and
+** the names a child process serving a connection is to resolve once it
+** is done.
+*/
+
+static volatile pid_t resolver_pid;
+static list_t *wanted;
+
+extern u_int32_t num_threads;
+
+static unsigned int addr_cache_hash(const char *name);
+static int addr_cache_lookup(	const char *name,
+								int flags,
+								struct sockaddr_storage **addrs_ret,
+								size_t *num_ret);
+static void lookup_job_run(void *data);
+static void lookup_job_free(void *data);
+static int shared_key_init(const char *name, struct shared_key *key);
+static bool addr_cache_adopt(struct addr_set *set, time_t now, time_t *busy);
+static void addr_cache_publish(	const char *name,
+								struct sockaddr_storage *addrs,
+								size_t num,
+								time_t expires);
+static void addr_cache_claim(const char *name, time_t until);
+static void addr_cache_share(const char *name);
+static void share_job_run(void *data);
+static void addr_cache_background(struct addr_set *set, time_t now);
+static void addr_cache_resolver(struct addr_cache *cache, time_t now);
+static void addr_cache_destroy_cb(void *data);
+
+/*
+** Hash a name for the address cache.
+*/
+
+static unsigned int addr_cache_hash(const char *name) {
+	unsigned int hash = 5381;
+
+	while (*name)
+		hash = hash * 33 + (unsigned char) *name++;
+
+	return hash % ADDR_CACHE_HASH_SIZE;
+}
+
+/*
+** Resolve "name" and store the addresses it resolves to in a newly
+** allocated array.
+** Returns 0 on success, -1 on failure.
+*/
+
+static int addr_cache_lookup(	const char *name,
+								int flags,
+								struct sockaddr_storage **addrs_ret,
+								size_t *num_ret)
+{
+	struct addrinfo hints, *res, *cur;
+	struct sockaddr_storage *addrs = NULL;
+	size_t num = 0;
+
+	memset(&hints, 0, sizeof(hints));
+	hints.ai_flags = flags;
+	hints.ai_socktype = SOCK_STREAM;
+
+	if (getaddrinfo(name, NULL, &hints, &res) != 0)
+		return -1;
+
+	for (cur = res; cur; cur = cur->ai_next) {
+		switch (cur->ai_addr->sa_family) {
+			case AF_INET:
+#if WANT_IPV6
+			case AF_INET6:
+#endif
+				break;
+			default:
+				continue;
+		}
+
+		if ((size_t) cur->ai_addrlen > sizeof(struct sockaddr_storage))
+			continue;
+
+		addrs = xrealloc(addrs, (num + 1) * sizeof(struct sockaddr_storage));
+		memset(&addrs[num], 0, sizeof(struct sockaddr_storage));
+		memcpy(&addrs[num], cur->ai_addr, cur->ai_addrlen);
+		++num;
+	}
+
+	freeaddrinfo(res);
+
+	if (num == 0)
+		return -1;
+
+	*addrs_ret = addrs;
+	*num_ret = num;
+
+	return 0;
+}
+
+/*
+** Build the key under which the addresses of "name" are shared.
+** Returns 0 on success, -1 if the name is too long to be shared.
+*/
+
+static int shared_key_init(const char *name, struct shared_key *key) {
+	u_int32_t fnv = 2166136261U;
+	u_int32_t djb = 5381;
+	size_t len = strlen(name);
+	size_t i;
+
+	if (len >= ADDR_SHARED_NAME_LEN)
+		return -1;
+
+	memset(key, 0, sizeof(*key));
+
+	for (i = 0; i < len; ++i) {
+		fnv = (fnv ^ (unsigned char) name[i]) * 16777619U;
+		djb = djb * 33 + (unsigned char) name[i];
+	}
+
+	key->hash[0] = fnv;
+	key->hash[1] = djb;
+	memcpy(key->prefix, name, MIN(len, sizeof(key->prefix)));
+
+	return 0;
+}
+
+/*
+** Adopt the addresses another process has resolved the name of "set" to.
+** As with a failed lookup, the previous addresses are kept if resolution
+** failed there.  If a process is still resolving the name, "busy," unless
+** NULL, is set to the time it is expected to be done, and to 0 otherwise.
+** The cache lock must be held.
+** Returns true if a current entry was found.
+*/
+
+static bool addr_cache_adopt(struct addr_set *set, time_t now, time_t *busy) {
+	struct shared_key key;
+	struct shared_addrs val;
+	size_t num = 0;
+	size_t i;
+
+	if (busy)
+		*busy = 0;
+
+	if (shared_key_init(set->name, &key) != 0)
+		return false;
+
+	if (shm_cache_get(SHM_ADDR, &key, sizeof(key), &val, sizeof(val)) !=
+		(ssize_t) sizeof(val) || val.expires <= now || val.num > ADDR_SHARED_MAX ||
+		strncmp(val.name, set->name, sizeof(val.name)) != 0)
+	{
+		return false;
+	}
+
+	if (val.resolving) {
+		if (busy)
+			*busy = val.expires;
+
+		return false;
+	}
+
+	if (val.num > 0) {
+		enum mem_tag prev = mem_enter(MEM_CONFIG);
+
+		set->addrs = xrealloc(set->addrs,
+						val.num * sizeof(struct sockaddr_storage));
+
+		for (i = 0; i < val.num; ++i) {
+			struct sockaddr_storage *ss = &set->addrs[num];
+
+			switch (val.addrs[i].family) {
+				case AF_INET:
+#if WANT_IPV6
+				case AF_INET6:
+#endif
+					break;
+				default:
+					continue;
+			}
+
+			memset(ss, 0, sizeof(struct sockaddr_storage));
+			ss->ss_family = val.addrs[i].family;
+			memcpy(sin_addr(ss), val.addrs[i].addr, sin_addr_len(ss));
+			++num;
+		}
+
+		set->num = num;
+		mem_leave(prev);
+	}
+
+	set->expires = val.expires;
+	set->resolved = true;
+
+	return true;
+}
+
+/*
+** Share the addresses "name" resolves to until "expires."  An empty set
+** records a failed lookup.
+*/
+
+static void addr_cache_publish(	const char *name,
+								struct sockaddr_storage *addrs,
+								size_t num,
+								time_t expires)
+{
+	struct shared_key key;
+	struct shared_addrs val;
+	time_t now = time(NULL);
+	size_t i;
+
+	if (expires <= now || shared_key_init(name, &key) != 0)
+		return;
+
+	memset(&val, 0, sizeof(val));
+	val.expires = expires;
+	val.num = (u_int32_t) MIN(num, ADDR_SHARED_MAX);
+	memcpy(val.name, name, strlen(name) + 1);
+
+	for (i = 0; i < val.num; ++i) {
+		val.addrs[i].family = addrs[i].ss_family;
+		memcpy(val.addrs[i].addr, sin_addr(&addrs[i]), sin_addr_len(&addrs[i]));
+	}
+
+	shm_cache_put(SHM_ADDR, &key, sizeof(key), &val, sizeof(val), expires - now);
+}
+
+/*
+** Record that this process is resolving "name" in the background, and
+** expects to be done by "until."
+*/
+
+static void addr_cache_claim(const char *name, time_t until) {
+	struct shared_key key;
+	struct shared_addrs val;
+	time_t now = time(NULL);
+
+	if (until <= now || shared_key_init(name, &key) != 0)
+		return;
+
+	memset(&val, 0, sizeof(val));
+	val.expires = until;
+	val.resolving = 1;
+	memcpy(val.name, name, strlen(name) + 1);
+
+	shm_cache_put(SHM_ADDR, &key, sizeof(key), &val, sizeof(val), until - now);
+}
+
+/*
+** Resolve "name" and share the result.
+*/
+
+static void addr_cache_share(const char *name) {
+	struct sockaddr_storage *addrs = NULL;
+	size_t num = 0;
+
+	if (addr_cache_lookup(name, 0, &addrs, &num) == 0) {
+		addr_cache_publish(name, addrs, num, time(NULL) + ADDR_CACHE_TTL);
+		xfree(addrs);
+	} else {
+		debug("Failed to resolve \"%s\"", name);
+		addr_cache_publish(name, NULL, 0, time(NULL) + ADDR_CACHE_NEG_TTL);
+	}
+}
+
+static void share_job_run(void *data) {
+	addr_cache_share(data);
+}
+
+static void lookup_job_run(void *data) {
+	struct lookup_job *job = data;
+	enum mem_tag prev = mem_enter(MEM_CONFIG);
+
+	/* the addresses replace those of an entry of the cache */
+	job->ret = addr_cache_lookup(job->name, 0, &job->addrs, &job->num);
+	mem_leave(prev);
+}
+
+static void lookup_job_free(void *data) {
+	struct lookup_job *job = data;
+
+	xfree(job->name);
+	xfree(job->addrs);
+	xfree(job);
+}
+
+/*
+** Create an empty address cache.  The entries of a lazy cache are
+** resolved again when they are used after they have expired.
+*/
+
+struct addr_cache *addr_cache_create(bool lazy) {
+	struct addr_cache *cache = xcalloc(1, sizeof(struct addr_cache));
+
+	cache->lazy = lazy;
+	return cache;
+}
+
+/*
+** Find the cache entry for "name," creating it if necessary.  Numeric
+** addresses are converted immediately; host names are resolved only when
+** first needed.
+*/
+
+struct addr_set *addr_cache_get(struct addr_cache *cache, const char *name) {
+	list_t **bucket = &cache->hash[addr_cache_hash(name)];
+	struct addr_set *set;
+	list_t *cur;
+
+	o_lock(cache_mutex);
+
+	for (cur = *bucket; cur; cur = cur->next) {
+		set = cur->data;
+
+		if (!strcmp(set->name, name)) {
+			o_unlock(cache_mutex);
+			return set;
+		}
+	}
+
+	set = xcalloc(1, sizeof(struct addr_set));
+	set->name = xstrdup(name);
+	set->lazy = cache->lazy;
+
+	if (addr_cache_lookup(name, AI_NUMERICHOST, &set->addrs, &set->num) == 0) {
+		set->numeric = true;
+		set->resolved = true;
+	}
+
+	list_prepend(bucket, set);
+	o_unlock(cache_mutex);
+
+	return set;
+}
+
+/*
+** Resolve the name of "set" if it has not been resolved or has expired,
+** unless another process has already done so.  The previous addresses are
+** kept if resolution fails.
+** Returns 0 if the set contains at least one address, -1 otherwise.
+*/
+
+int addr_cache_resolve(struct addr_set *set) {
+	struct lookup_job *job;
+	bool found;
+	time_t now;
+	int ret;
+
+	o_lock(cache_mutex);
+
+	if (set->numeric) {
+		o_unlock(cache_mutex);
+		return 0;
+	}
+
+	now = time(NULL);
+
+	if ((set->resolved && now < set->expires) || addr_cache_adopt(set, now, NULL)) {
+		ret = set->num > 0 ? 0 : -1;
+		o_unlock(cache_mutex);
+		return ret;
+	}
+
+	o_unlock(cache_mutex);
+
+	job = xcalloc(1, sizeof(struct lookup_job));
+	job->name = xstrdup(set->name);
+
+	if (offload_call("hosts", lookup_job_run, job, lookup_job_free) != 0)
+		job = NULL;
+
+	found = job && job->ret == 0;
+	if (!found)
+		debug("Failed to resolve \"%s\"", set->name);
+
+	o_lock(cache_mutex);
+
+	if (found) {
+		xfree(set->addrs);
+		set->addrs = job->addrs;
+		set->num = job->num;
+		set->expires = now + ADDR_CACHE_TTL;
+		job->addrs = NULL;
+	} else
+		set->expires = now + ADDR_CACHE_NEG_TTL;
+
+	if (job)
+		lookup_job_free(job);
+
+	set->resolved = true;
+	addr_cache_publish(set->name, set->addrs,
+		found ? set->num : 0, set->expires);
+
+	ret = set->num > 0 ? 0 : -1;
+
+	o_unlock(cache_mutex);
+	return ret;
+}
+
+/*
+** Make sure the name of the lazy entry "set" is resolved in the background,
+** unless another process has already done so.  Worker threads leave this
+** to the offload pool.  A child process serving a connection leaves it to
+** addr_cache_resolve_wanted(), which it calls once it has closed the
+** connection.  The result is shared through the lookup cache and adopted
+** by later calls, so without the lookup cache, the name is resolved right
+** away instead.  The cache lock must be held; it is dropped while the name
+** is resolved.
+*/
+
+static void addr_cache_background(struct addr_set *set, time_t now) {
+	enum mem_tag prev;
+	time_t busy;
+	list_t *cur;
+
+	if (addr_cache_adopt(set, now, &busy))
+		return;
+
+	if (busy != 0) {
+		set->expires = busy;
+		return;
+	}
+
+	/* this process has already asked for it */
+	if (now < set->expires)
+		return;
+
+	if (!shm_cache_enabled() || strlen(set->name) >= ADDR_SHARED_NAME_LEN) {
+		o_unlock(cache_mutex);
+		addr_cache_resolve(set);
+		o_lock(cache_mutex);
+		return;
+	}
+
+	set->expires = now + ADDR_CACHE_TIMEOUT;
+	addr_cache_claim(set->name, set->expires);
+
+	prev = mem_enter(MEM_CONFIG);
+
+	if (num_threads > 0) {
+		char *name = xstrdup(set->name);
+
+		o_unlock(cache_mutex);
+		offload_queue("hosts", share_job_run, name, xfree);
+		o_lock(cache_mutex);
+	} else {
+		for (cur = wanted; cur; cur = cur->next) {
+			if (!strcmp(cur->data, set->name))
+				break;
+		}
+
+		if (!cur)
+			list_prepend(&wanted, xstrdup(set->name));
+	}
+
+	mem_leave(prev);
+}
+
+/*
+** Returns true if "addr" is one of the addresses in "set."  NULL is treated
+** as a wildcard.  Expired entries that are not lazy are matched against
+** their previous addresses; they are refreshed by addr_cache_refresh().
+** Lazy entries are refreshed in the background.  They keep matching their
+** previous addresses until then, and match nothing if they have none yet,
+** so that requests never wait for names to be resolved.
+*/
+
+bool addr_cache_match(struct addr_set *set, struct sockaddr_storage *addr) {
+	bool ret = false;
+	time_t now;
+	size_t i;
+
+	if (!set)
+		return true;
+
+	o_lock(cache_mutex);
+
+	now = time(NULL);
+
+	if (set->lazy && !set->numeric && (!set->resolved || now >= set->expires))
+		addr_cache_background(set, now);
+	else if (!set->resolved) {
+		o_unlock(cache_mutex);
+		addr_cache_resolve(set);
+		o_lock(cache_mutex);
+	}
+
+	for (i = 0; i < set->num; ++i) {
+		if (set->addrs[i].ss_family != addr->ss_family)
+			continue;
+
+		if (sin_equal(addr, &set->addrs[i])) {
+			ret = true;
+			break;
+		}
+	}
+
+	o_unlock(cache_mutex);
+	return ret;
+}
+
+/*
+** Copy the first address of "set" to "addr."
+** Returns 0 on success, -1 if the set has no addresses.
+*/
+
+int addr_cache_first(struct addr_set *set, struct sockaddr_storage *addr) {
+	time_t now;
+	int ret = -1;
+
+	o_lock(cache_mutex);
+
+	now = time(NULL);
+
+	if (set->lazy && !set->numeric && (!set->resolved || now >= set->expires))
+		addr_cache_background(set, now);
+	else if (!set->resolved) {
+		o_unlock(cache_mutex);
+		addr_cache_resolve(set);
+		o_lock(cache_mutex);
+	}
+
+	if (set->num > 0) {
+		memcpy(addr, &set->addrs[0], sizeof(struct sockaddr_storage));
+		ret = 0;
+	}
+
+	o_unlock(cache_mutex);
+	return ret;
+}
+
+/*
+** Resolve all entries that have expired.
+** Returns the number of seconds until the next entry expires,
+** or -1 if no entry needs to be refreshed.
+*/
+
+long addr_cache_refresh(struct addr_cache *cache) {
+	long next = -1;
+	size_t i;
+
+	o_lock(cache_mutex);
+
+	for (i = 0; i < ADDR_CACHE_HASH_SIZE; ++i) {
+		list_t *cur;
+
+		/*
+		** Entries are only ever prepended, and are not freed before the
+		** cache is destroyed, so the lock may be dropped while walking
+		** the list.
+		*/
+
+		for (cur = cache->hash[i]; cur; cur = cur->next) {
+			struct addr_set *set = cur->data;
+			long left;
+
+			if (set->numeric || !set->resolved)
+				continue;
+
+			if (time(NULL) >= set->expires) {
+				o_unlock(cache_mutex);
+				addr_cache_resolve(set);
+				o_lock(cache_mutex);
+			}
+
+			left = (long) (set->expires - time(NULL));
+			if (left < 0)
+				left = 0;
+
+			if (next == -1 || left < next)
+				next = left;
+		}
+	}
+
+	o_unlock(cache_mutex);
+	return next;
+}
+
+/*
+** Resolve the names of the entries of "cache" that have expired and share
+** the results.  This runs in a child process, so entries may be read
+** without the lock and are not modified.
+*/
+
+static void addr_cache_resolver(struct addr_cache *cache, time_t now) {
+	size_t i;
+
+	for (i = 0; i < ADDR_CACHE_HASH_SIZE; ++i) {
+		list_t *cur;
+
+		for (cur = cache->hash[i]; cur; cur = cur->next) {
+			struct addr_set *set = cur->data;
+
+			if (set->numeric || !set->resolved || now < set->expires)
+				continue;
+
+			addr_cache_share(set->name);
+		}
+	}
+}
+
+/*
+** Like addr_cache_refresh(), but for a process that accepts connections
+** itself: expired entries are resolved by a child process, which shares
+** the results through the lookup cache, and are adopted by later calls.
+** Until then, rules match the previous addresses.  Falls back to
+** addr_cache_refresh() if the lookup cache is not available.
+** Returns the number of seconds until this should be called again,
+** or -1 if no entry needs to be refreshed.
+*/
+
+long addr_cache_refresh_async(struct addr_cache *cache) {
+	bool running = resolver_pid != 0;
+	size_t waiting = 0;
+	long next = -1;
+	sigset_t set, old;
+	time_t now;
+	pid_t pid;
+	size_t i;
+
+	if (!shm_cache_enabled())
+		return addr_cache_refresh(cache);
+
+	now = time(NULL);
+	o_lock(cache_mutex);
+
+	for (i = 0; i < ADDR_CACHE_HASH_SIZE; ++i) {
+		list_t *cur;
+
+		for (cur = cache->hash[i]; cur; cur = cur->next) {
+			struct addr_set *entry = cur->data;
+			long left;
+
+			if (entry->numeric || !entry->resolved)
+				continue;
+
+			if (entry->pending || now >= entry->expires) {
+				if (addr_cache_adopt(entry, now, NULL))
+					entry->pending = false;
+				else if (!entry->pending || running) {
+					++waiting;
+					continue;
+				} else {
+					/* the resolver has exited without a result */
+					entry->pending = false;
+					entry->expires = now + ADDR_CACHE_NEG_TTL;
+				}
+			}
+
+			left = (long) (entry->expires - now);
+			if (next == -1 || left < next)
+				next = left;
+		}
+	}
+
+	o_unlock(cache_mutex);
+
+	if (waiting == 0)
+		return next;
+
+	/* check for results every second */
+	if (running)
+		return 1;
+
+	/*
+	** SIGCHLD is blocked until the resolver has been recorded, so that it
+	** is not mistaken for a connection if it exits right away.
+	*/
+
+	sigemptyset(&set);
+	sigaddset(&set, SIGCHLD);
+	sigprocmask(SIG_BLOCK, &set, &old);
+
+	pid = fork();
+
+	if (pid == 0) {
+		signal(SIGALRM, SIG_DFL);
+		sigprocmask(SIG_SETMASK, &old, NULL);
+		alarm(ADDR_CACHE_TIMEOUT);
+		addr_cache_resolver(cache, now);
+		_exit(EXIT_SUCCESS);
+	}
+
+	if (pid != -1)
+		resolver_pid = pid;
+	else
+		o_log(LOG_CRIT, "Failed to fork: %s", strerror(errno));
+
+	sigprocmask(SIG_SETMASK, &old, NULL);
+
+	o_lock(cache_mutex);
+
+	for (i = 0; i < ADDR_CACHE_HASH_SIZE; ++i) {
+		list_t *cur;
+
+		for (cur = cache->hash[i]; cur; cur = cur->next) {
+			struct addr_set *entry = cur->data;
+
+			if (entry->numeric || !entry->resolved || entry->pending ||
+				now < entry->expires)
+			{
+				continue;
+			}
+
+			if (pid != -1)
+				entry->pending = true;
+			else
+				entry->expires = now + ADDR_CACHE_NEG_TTL;
+		}
+	}
+
+	o_unlock(cache_mutex);
+
+	if (pid == -1)
+		return next == -1 ? ADDR_CACHE_NEG_TTL : MIN(next, ADDR_CACHE_NEG_TTL);
+
+	return 1;
+}
+
+/*
+** Resolve the names that requests served by this process were missing,
+** in a child process so that the caller can exit right away.  Called by
+** a child process serving a connection once it has closed it.
+*/
+
+void addr_cache_resolve_wanted(void) {
+	list_t *cur;
+	pid_t pid;
+
+	if (!wanted)
+		return;
+
+	pid = fork();
+
+	if (pid == 0) {
+		signal(SIGALRM, SIG_DFL);
+		alarm(ADDR_CACHE_TIMEOUT);
+
+		for (cur = wanted; cur; cur = cur->next)
+			addr_cache_share(cur->data);
+
+		_exit(EXIT_SUCCESS);
+	}
+
+	if (pid == -1)
+		debug("fork: %s", strerror(errno));
+
+	list_destroy(wanted, xfree);
+	wanted = NULL;
+}
+
+/*
+** Called for each child process that has exited.
+** Returns true if "pid" was the process resolving names in the background.
+*/
+
+bool addr_cache_reap(pid_t pid) {
+	if (resolver_pid == 0 || pid != resolver_pid)
+		return false;
+
+	resolver_pid = 0;
+	return true;
+}
+
+/*
+** Callback for destroying a cache entry with list_destroy.
+*/
+
+static void addr_cache_destroy_cb(void *data) {
+	struct addr_set *set = data;
+
+	xfree(set->name);
+	xfree(set->addrs);
+	xfree(set);
+}
+
+/*
+** Destroy an address cache.  The cache must no longer be in use.
+*/
+
+void addr_cache_destroy(struct addr_cache *cache) {
+	size_t i;
+
+	if (!cache)
+		return;
+
+	for (i = 0; i < ADDR_CACHE_HASH_SIZE; ++i)
+		list_destroy(cache->hash[i], addr_cache_destroy_cb);
+
+	xfree(cache);
+}
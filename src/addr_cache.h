@@ -0,0 +1,67 @@
+/*
+** addr_cache.h - oidentd address cache for configuration statements.
+** Copyright (c) 2019      Janik Rabe  <oidentd@janikrabe.com>
+**
+** This program is free software; you can redistribute it and/or modify
+** it under the terms of the GNU General Public License, version 2,
+** as published by the Free Software Foundation.
+**
+** This program is distributed in the hope that it will be useful,
+** but WITHOUT ANY WARRANTY; without even the implied warranty of
+** MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+** GNU General Public License for more details.
+**
+** You should have received a copy of the GNU General Public License
+** along with this program; if not, write to the Free Software
+** Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA
+*/
+
+#ifndef __OIDENTD_ADDR_CACHE_H
+#define __OIDENTD_ADDR_CACHE_H
+
+#define ADDR_CACHE_HASH_SIZE	64
+
+/*
+** The set of addresses a name given in a configuration file resolves to.
+** Entries are owned by the cache; capabilities only keep references.
+** "pending" is set while the name is being resolved in the background,
+** and "lazy" if it is refreshed when used rather than by
+** addr_cache_refresh().
+*/
+
+struct addr_set {
+	char *name;
+	bool numeric;
+	bool resolved;
+	bool pending;
+	bool lazy;
+	time_t expires;
+	size_t num;
+	struct sockaddr_storage *addrs;
+};
+
+/*
+** Each configuration snapshot and each parsed user configuration file has
+** its own cache, so entries live exactly as long as the capabilities that
+** refer to them.  Only the caches of configuration snapshots are refreshed
+** by addr_cache_refresh(); the others are "lazy," and are resolved in the
+** background when requests use them.
+*/
+
+struct addr_cache {
+	bool lazy;
+	list_t *hash[ADDR_CACHE_HASH_SIZE];
+};
+
+struct addr_cache *addr_cache_create(bool lazy);
+struct addr_set *addr_cache_get(struct addr_cache *cache, const char *name);
+int addr_cache_resolve(struct addr_set *set);
+bool addr_cache_match(struct addr_set *set, struct sockaddr_storage *addr);
+int addr_cache_first(struct addr_set *set, struct sockaddr_storage *addr);
+long addr_cache_refresh(struct addr_cache *cache);
+long addr_cache_refresh_async(struct addr_cache *cache);
+void addr_cache_resolve_wanted(void);
+bool addr_cache_reap(pid_t pid);
+void addr_cache_destroy(struct addr_cache *cache);
+
+#endif
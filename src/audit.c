@@ -0,0 +1,271 @@
+/*
+** audit.c - oidentd binary audit log.
+** Copyright (c) 2019      Janik Rabe  <oidentd@janikrabe.com>
+**
+** This program is free software; you can redistribute it and/or modify
+** it under the terms of the GNU General Public License, version 2,
+** as published by the Free Software Foundation.
+**
+** This program is distributed in the hope that it will be useful,
+** but WITHOUT ANY WARRANTY; without even the implied warranty of
+** MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+** GNU General Public License for more details.
+**
+** You should have received a copy of the GNU General Public License
+** along with this program; if not, write to the Free Software
+** Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA
+*/
+
+#include <config.h>
+
+#include <unistd.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <fcntl.h>
+#include <errno.h>
+#include <syslog.h>
+#include <pwd.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <sys/time.h>
+#include <sys/mman.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+
+#include "oidentd.h"
+#include "util.h"
+#include "missing.h"
+#include "inet_util.h"
+#include "audit.h"
+
+#if THREAD_SUPPORT
+#	include <pthread.h>
+#endif
+
+/*
+** The log is mapped before any processes or threads are started, so all
+** of them append to the same mapping.  Writers claim sequence numbers
+** atomically, so none of them ever waits for another.
+*/
+
+static struct audit_header *header;
+static struct audit_record *records;
+
+#if THREAD_SUPPORT
+static pthread_key_t current_key;
+static pthread_once_t current_once = PTHREAD_ONCE_INIT;
+
+static void audit_key_create(void);
+#else
+static struct audit_ctx *current;
+#endif
+
+static void audit_set_current(struct audit_ctx *ctx);
+static struct audit_ctx *audit_current(void);
+static void audit_addr(	const struct sockaddr_storage *ss,
+						int family,
+						unsigned char *addr);
+
+#if THREAD_SUPPORT
+
+static void audit_key_create(void) {
+	if (pthread_key_create(&current_key, NULL) != 0)
+		o_log(LOG_CRIT, "Failed to create thread-specific key");
+}
+
+static void audit_set_current(struct audit_ctx *ctx) {
+	pthread_once(&current_once, audit_key_create);
+	pthread_setspecific(current_key, ctx);
+}
+
+static struct audit_ctx *audit_current(void) {
+	pthread_once(&current_once, audit_key_create);
+	return pthread_getspecific(current_key);
+}
+
+#else
+
+static void audit_set_current(struct audit_ctx *ctx) {
+	current = ctx;
+}
+
+static struct audit_ctx *audit_current(void) {
+	return current;
+}
+
+#endif
+
+/*
+** Open the audit log at "path," creating it with room for "capacity"
+** records if it is empty, and map it.  An existing log is appended to.
+** Returns 0 on success, -1 on failure.
+*/
+
+int audit_open(const char *path, u_int64_t capacity) {
+#ifdef HAVE_SYNC_FETCH_AND_ADD
+	struct audit_header hdr;
+	struct stat st;
+	size_t size;
+	void *map;
+	int fd;
+
+	fd = open(path, O_RDWR | O_CREAT, 0600);
+	if (fd == -1) {
+		o_log(LOG_CRIT, "Unable to open audit log %s: %s", path, strerror(errno));
+		return -1;
+	}
+
+	if (fstat(fd, &st) != 0) {
+		o_log(LOG_CRIT, "Unable to open audit log %s: %s", path, strerror(errno));
+		goto failure;
+	}
+
+	if (st.st_size == 0) {
+		memset(&hdr, 0, sizeof(hdr));
+		memcpy(hdr.magic, AUDIT_MAGIC, sizeof(hdr.magic));
+		hdr.version = AUDIT_VERSION;
+		hdr.byte_order = AUDIT_BYTE_ORDER;
+		hdr.header_size = sizeof(struct audit_header);
+		hdr.record_size = sizeof(struct audit_record);
+		hdr.capacity = capacity;
+
+		if (ftruncate(fd, sizeof(hdr) + capacity * sizeof(struct audit_record)) != 0 ||
+			write(fd, &hdr, sizeof(hdr)) != sizeof(hdr))
+		{
+			o_log(LOG_CRIT, "Unable to create audit log %s: %s", path, strerror(errno));
+			goto failure;
+		}
+	} else if (read(fd, &hdr, sizeof(hdr)) != sizeof(hdr) ||
+		memcmp(hdr.magic, AUDIT_MAGIC, sizeof(hdr.magic)) != 0 ||
+		hdr.version != AUDIT_VERSION ||
+		hdr.byte_order != AUDIT_BYTE_ORDER ||
+		hdr.header_size != sizeof(struct audit_header) ||
+		hdr.record_size != sizeof(struct audit_record) ||
+		hdr.capacity == 0 ||
+		(u_int64_t) st.st_size != sizeof(hdr) + hdr.capacity * sizeof(struct audit_record))
+	{
+		/* never overwrite a file that may be something else */
+		o_log(LOG_CRIT, "%s is not an audit log written by this version of "
+			PACKAGE_NAME, path);
+		goto failure;
+	}
+
+	size = sizeof(hdr) + hdr.capacity * sizeof(struct audit_record);
+
+	map = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+	if (map == MAP_FAILED) {
+		o_log(LOG_CRIT, "Unable to map audit log %s: %s", path, strerror(errno));
+		goto failure;
+	}
+
+	close(fd);
+
+	header = map;
+	records = (struct audit_record *) (header + 1);
+	return 0;
+
+failure:
+	close(fd);
+	return -1;
+#else
+	(void) path;
+	(void) capacity;
+
+	o_log(LOG_CRIT, "Audit logs are not supported in this build");
+	return -1;
+#endif
+}
+
+/*
+** Make "ctx" describe the query being answered by the calling thread
+** until audit_end() is called.
+*/
+
+void audit_begin(	struct audit_ctx *ctx,
+					const struct sockaddr_storage *laddr,
+					const struct sockaddr_storage *faddr,
+					in_port_t lport,
+					in_port_t fport)
+{
+	if (!header)
+		return;
+
+	ctx->laddr = laddr;
+	ctx->faddr = faddr;
+	ctx->lport = lport;
+	ctx->fport = fport;
+
+	audit_set_current(ctx);
+}
+
+void audit_end(void) {
+	if (header)
+		audit_set_current(NULL);
+}
+
+static void audit_addr(	const struct sockaddr_storage *ss,
+						int family,
+						unsigned char *addr)
+{
+	const unsigned char *bytes = cidr_bytes(ss, family);
+
+	if (bytes)
+		memcpy(addr, bytes, family == AF_INET ? 4 : 16);
+}
+
+/*
+** Append a record of the answer to the query being answered by the
+** calling thread.  Replies longer than the record's field are truncated.
+*/
+
+void audit_reply(int path, int result, uid_t uid, const char *reply) {
+#ifdef HAVE_SYNC_FETCH_AND_ADD
+	struct audit_ctx *ctx;
+	struct audit_record *rec;
+	struct timeval now;
+	u_int64_t seq;
+	int family;
+
+	if (!header)
+		return;
+
+	ctx = audit_current();
+	if (!ctx)
+		return;
+
+	gettimeofday(&now, NULL);
+
+	seq = __sync_fetch_and_add(&header->next, 1);
+	rec = &records[seq % header->capacity];
+
+	rec->seq = 0;
+	audit_barrier();
+
+	family = ctx->laddr->ss_family;
+
+	rec->sec = now.tv_sec;
+	rec->usec = now.tv_usec;
+	rec->uid = uid;
+	rec->lport = ctx->lport;
+	rec->fport = ctx->fport;
+	rec->peer_port = ntohs(sin_port(ctx->faddr));
+	rec->family = family == AF_INET ? AUDIT_INET : AUDIT_INET6;
+	rec->path = path;
+	rec->result = result;
+	memset(rec->reserved, 0, sizeof(rec->reserved));
+	memset(rec->laddr, 0, sizeof(rec->laddr));
+	memset(rec->faddr, 0, sizeof(rec->faddr));
+	audit_addr(ctx->laddr, family, rec->laddr);
+	audit_addr(ctx->faddr, family, rec->faddr);
+	xstrncpy(rec->reply, reply, sizeof(rec->reply));
+
+	audit_barrier();
+	rec->seq = seq + 1;
+#else
+	(void) path;
+	(void) result;
+	(void) uid;
+	(void) reply;
+#endif
+}
@@ -0,0 +1,133 @@
+/*
+** audit.h - oidentd binary audit log.
+** Copyright (c) 2019      Janik Rabe  <oidentd@janikrabe.com>
+**
+** This program is free software; you can redistribute it and/or modify
+** it under the terms of the GNU General Public License, version 2,
+** as published by the Free Software Foundation.
+**
+** This program is distributed in the hope that it will be useful,
+** but WITHOUT ANY WARRANTY; without even the implied warranty of
+** MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+** GNU General Public License for more details.
+**
+** You should have received a copy of the GNU General Public License
+** along with this program; if not, write to the Free Software
+** Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA
+*/
+
+#ifndef __OIDENTD_AUDIT_H
+#define __OIDENTD_AUDIT_H
+
+/*
+** The audit log is a file holding a header followed by a ring of
+** fixed-size records in the byte order of the host that wrote it.  The
+** writer appends records without formatting them; oidentd-audit decodes
+** them.  Any change to the layout must increase AUDIT_VERSION.
+*/
+
+#define AUDIT_MAGIC			"OIDAUDIT"
+#define AUDIT_VERSION		1
+#define AUDIT_BYTE_ORDER	0x01020304
+#define AUDIT_REPLY_LEN		184
+
+#ifdef HAVE_SYNC_FETCH_AND_ADD
+#	define audit_barrier() __sync_synchronize()
+#else
+#	define audit_barrier() do { } while (0)
+#endif
+
+/*
+** "next" is the sequence number of the next record to be written.  The
+** record with sequence number "n" is stored at index "n % capacity."
+*/
+
+struct audit_header {
+	char magic[8];
+	u_int32_t version;
+	u_int32_t byte_order;
+	u_int32_t header_size;
+	u_int32_t record_size;
+	u_int64_t capacity;
+	u_int64_t next;
+	char reserved[24];
+};
+
+/*
+** The answer to a query for the connection (laddr:lport, faddr:fport),
+** which the host at faddr asked about from port "peer_port."  Addresses
+** are stored in network byte order; IPv4 addresses take the first four
+** bytes.  "seq" is zero while the record is being written and one more
+** than the record's sequence number once it is complete, so a reader
+** that finds it changed after copying the record must copy it again.
+*/
+
+struct audit_record {
+	u_int64_t seq;
+	u_int64_t sec;
+	u_int32_t usec;
+	u_int32_t uid;
+	u_int16_t lport;
+	u_int16_t fport;
+	u_int16_t peer_port;
+	u_int8_t family;
+	u_int8_t path;
+	u_int8_t result;
+	u_int8_t reserved[7];
+	unsigned char laddr[16];
+	unsigned char faddr[16];
+	char reply[AUDIT_REPLY_LEN];
+};
+
+/*
+** Address families, independent of the values the system uses.
+*/
+
+enum {
+	AUDIT_INET = 4,
+	AUDIT_INET6 = 6
+};
+
+/*
+** Where the answer came from.
+*/
+
+enum {
+	AUDIT_LOCAL = 1,
+	AUDIT_UDB,
+	AUDIT_MASQ,
+	AUDIT_FORWARD,
+	AUDIT_SHED
+};
+
+/*
+** The kind of answer.  "reply" holds the user name for AUDIT_USERID and
+** the error for AUDIT_ERROR.
+*/
+
+enum {
+	AUDIT_USERID = 1,
+	AUDIT_ERROR
+};
+
+/*
+** The query being answered by the calling thread.
+*/
+
+struct audit_ctx {
+	const struct sockaddr_storage *laddr;
+	const struct sockaddr_storage *faddr;
+	in_port_t lport;
+	in_port_t fport;
+};
+
+int audit_open(const char *path, u_int64_t capacity);
+void audit_begin(	struct audit_ctx *ctx,
+					const struct sockaddr_storage *laddr,
+					const struct sockaddr_storage *faddr,
+					in_port_t lport,
+					in_port_t fport);
+void audit_end(void);
+void audit_reply(int path, int result, uid_t uid, const char *reply);
+
+#endif
@@ -0,0 +1,350 @@
+/*
+** audit_read.c - decode and follow oidentd audit logs.
+** Copyright (c) 2019      Janik Rabe  <oidentd@janikrabe.com>
+**
+** This program is free software; you can redistribute it and/or modify
+** it under the terms of the GNU General Public License, version 2,
+** as published by the Free Software Foundation.
+**
+** This program is distributed in the hope that it will be useful,
+** but WITHOUT ANY WARRANTY; without even the implied warranty of
+** MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+** GNU General Public License for more details.
+**
+** You should have received a copy of the GNU General Public License
+** along with this program; if not, write to the Free Software
+** Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA
+*/
+
+#include <config.h>
+
+#include <unistd.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <fcntl.h>
+#include <errno.h>
+#include <time.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <sys/mman.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
+
+#include "oidentd.h"
+#include "audit.h"
+
+#define AUDIT_POLL_USECS	100000
+#define AUDIT_STALL_POLLS	10
+
+/*
+** Records are only shown if they match all given filters.
+*/
+
+struct audit_filter {
+	bool by_uid;
+	u_int32_t uid;
+	int family;
+	unsigned char addr[16];
+	u_int16_t port;
+};
+
+static const struct audit_header *header;
+static const struct audit_record *records;
+
+static void usage(void);
+static int audit_map(const char *path);
+static int audit_copy(u_int64_t seq, struct audit_record *rec);
+static bool audit_match(const struct audit_record *rec, const struct audit_filter *filter);
+static void audit_print(const struct audit_record *rec);
+
+static void usage(void) {
+	fprintf(stderr,
+"Usage: oidentd-audit [options] <file>\n"
+"-f           Keep printing records as they are written\n"
+"-n <number>  Start with the last <number> records\n"
+"-u <uid>     Only print answers for user <uid>\n"
+"-a <address> Only print queries involving <address>\n"
+"-p <port>    Only print queries for connections on <port>\n");
+}
+
+/*
+** Map the audit log at "path" and check that it can be decoded.
+** Returns 0 on success, -1 on failure.
+*/
+
+static int audit_map(const char *path) {
+	struct stat st;
+	void *map;
+	int fd;
+
+	fd = open(path, O_RDONLY);
+	if (fd == -1 || fstat(fd, &st) != 0) {
+		fprintf(stderr, "%s: %s\n", path, strerror(errno));
+		return -1;
+	}
+
+	if ((size_t) st.st_size < sizeof(struct audit_header)) {
+		fprintf(stderr, "%s: Not an audit log\n", path);
+		close(fd);
+		return -1;
+	}
+
+	map = mmap(NULL, st.st_size, PROT_READ, MAP_SHARED, fd, 0);
+	close(fd);
+
+	if (map == MAP_FAILED) {
+		fprintf(stderr, "%s: %s\n", path, strerror(errno));
+		return -1;
+	}
+
+	header = map;
+	records = (const struct audit_record *) (header + 1);
+
+	if (memcmp(header->magic, AUDIT_MAGIC, sizeof(header->magic)) != 0) {
+		fprintf(stderr, "%s: Not an audit log\n", path);
+		return -1;
+	}
+
+	if (header->byte_order != AUDIT_BYTE_ORDER) {
+		fprintf(stderr, "%s: Written by a host with a different byte order\n", path);
+		return -1;
+	}
+
+	if (header->version != AUDIT_VERSION ||
+		header->header_size != sizeof(struct audit_header) ||
+		header->record_size != sizeof(struct audit_record))
+	{
+		fprintf(stderr, "%s: Unsupported version %u\n", path, header->version);
+		return -1;
+	}
+
+	if (header->capacity == 0 || (u_int64_t) st.st_size !=
+		sizeof(struct audit_header) + header->capacity * sizeof(struct audit_record))
+	{
+		fprintf(stderr, "%s: Truncated audit log\n", path);
+		return -1;
+	}
+
+	return 0;
+}
+
+/*
+** Copy the record with sequence number "seq" to "rec," retrying while
+** it is being overwritten.
+** Returns 0 on success, -1 if the record is incomplete, or 1 if it has
+** been overwritten by a newer one.
+*/
+
+static int audit_copy(u_int64_t seq, struct audit_record *rec) {
+	const volatile struct audit_record *src = &records[seq % header->capacity];
+
+	for (;;) {
+		u_int64_t before = src->seq;
+
+		if (before == 0)
+			return -1;
+
+		if (before != seq + 1)
+			return before > seq + 1 ? 1 : -1;
+
+		audit_barrier();
+		memcpy(rec, (const void *) src, sizeof(*rec));
+		audit_barrier();
+
+		if (src->seq == before)
+			return 0;
+	}
+}
+
+static bool audit_match(const struct audit_record *rec, const struct audit_filter *filter) {
+	size_t len;
+
+	if (filter->by_uid && rec->uid != filter->uid)
+		return false;
+
+	if (filter->port != 0 && rec->lport != filter->port &&
+		rec->fport != filter->port)
+	{
+		return false;
+	}
+
+	if (filter->family != 0) {
+		if (rec->family != filter->family)
+			return false;
+
+		len = filter->family == AUDIT_INET ? 4 : 16;
+
+		if (memcmp(rec->laddr, filter->addr, len) != 0 &&
+			memcmp(rec->faddr, filter->addr, len) != 0)
+		{
+			return false;
+		}
+	}
+
+	return true;
+}
+
+/*
+** Print a record as one line of space-separated fields: the time, the
+** querying host and port, the queried connection, the UID, where the
+** answer came from, and the answer.
+*/
+
+static void audit_print(const struct audit_record *rec) {
+	static const char *const paths[] = {
+		"?", "local", "udb", "masq", "forward", "shed"
+	};
+	char laddr[INET6_ADDRSTRLEN];
+	char faddr[INET6_ADDRSTRLEN];
+	char when[32];
+	char uid[16];
+	time_t sec = rec->sec;
+	int af = rec->family == AUDIT_INET ? AF_INET : AF_INET6;
+
+	strftime(when, sizeof(when), "%Y-%m-%dT%H:%M:%S", localtime(&sec));
+
+	if (!inet_ntop(af, rec->laddr, laddr, sizeof(laddr)))
+		strcpy(laddr, "?");
+
+	if (!inet_ntop(af, rec->faddr, faddr, sizeof(faddr)))
+		strcpy(faddr, "?");
+
+	if (rec->uid == (u_int32_t) -1)
+		strcpy(uid, "-");
+	else
+		snprintf(uid, sizeof(uid), "%u", rec->uid);
+
+	printf("%s.%06u %s %u %u,%u %s %s %s %s %.*s\n",
+		when, rec->usec, faddr, rec->peer_port, rec->lport, rec->fport,
+		laddr, uid, rec->path < sizeof(paths) / sizeof(paths[0]) ?
+			paths[rec->path] : "?",
+		rec->result == AUDIT_USERID ? "USERID" : "ERROR",
+		(int) sizeof(rec->reply), rec->reply);
+}
+
+int main(int argc, char *argv[]) {
+	struct audit_filter filter;
+	u_int64_t last = 0;
+	bool follow = false;
+	bool by_last = false;
+	u_int64_t seq;
+	u_int64_t next;
+	int stalled = 0;
+	int opt;
+
+	memset(&filter, 0, sizeof(filter));
+
+	while ((opt = getopt(argc, argv, "a:fhn:p:u:")) != -1) {
+		char *end;
+
+		switch (opt) {
+			case 'a':
+				if (inet_pton(AF_INET, optarg, filter.addr) == 1)
+					filter.family = AUDIT_INET;
+				else if (inet_pton(AF_INET6, optarg, filter.addr) == 1)
+					filter.family = AUDIT_INET6;
+				else {
+					fprintf(stderr, "Bad address: \"%s\"\n", optarg);
+					return EXIT_FAILURE;
+				}
+				break;
+
+			case 'f':
+				follow = true;
+				break;
+
+			case 'n':
+				last = strtoull(optarg, &end, 10);
+				if (*end != '\0') {
+					fprintf(stderr, "Bad number of records: \"%s\"\n", optarg);
+					return EXIT_FAILURE;
+				}
+				by_last = true;
+				break;
+
+			case 'p':
+				filter.port = strtoul(optarg, &end, 10);
+				if (*end != '\0' || filter.port == 0) {
+					fprintf(stderr, "Bad port: \"%s\"\n", optarg);
+					return EXIT_FAILURE;
+				}
+				break;
+
+			case 'u':
+				filter.uid = strtoul(optarg, &end, 10);
+				if (*end != '\0') {
+					fprintf(stderr, "Bad UID: \"%s\"\n", optarg);
+					return EXIT_FAILURE;
+				}
+				filter.by_uid = true;
+				break;
+
+			case 'h':
+				usage();
+				return EXIT_SUCCESS;
+
+			default:
+				usage();
+				return EXIT_FAILURE;
+		}
+	}
+
+	if (optind != argc - 1) {
+		usage();
+		return EXIT_FAILURE;
+	}
+
+	if (audit_map(argv[optind]) != 0)
+		return EXIT_FAILURE;
+
+	next = header->next;
+	seq = next > header->capacity ? next - header->capacity : 0;
+
+	if (by_last && next - seq > last)
+		seq = next - last;
+
+	for (;;) {
+		struct audit_record rec;
+		int ret;
+
+		next = header->next;
+
+		if (seq >= next) {
+			if (!follow)
+				break;
+
+			fflush(stdout);
+			usleep(AUDIT_POLL_USECS);
+			continue;
+		}
+
+		/* a writer that is overtaken while reading may have been lapped */
+		if (next - seq > header->capacity) {
+			fprintf(stderr, "Skipped %llu overwritten records\n",
+				(unsigned long long) (next - header->capacity - seq));
+			seq = next - header->capacity;
+		}
+
+		ret = audit_copy(seq, &rec);
+
+		/*
+		** A record may still be being written, or its writer may have
+		** died.  Records that stay incomplete are skipped.
+		*/
+
+		if (ret == -1 && follow && ++stalled < AUDIT_STALL_POLLS) {
+			usleep(AUDIT_POLL_USECS);
+			continue;
+		}
+
+		if (ret == 0 && audit_match(&rec, &filter))
+			audit_print(&rec);
+
+		stalled = 0;
+		++seq;
+	}
+
+	return EXIT_SUCCESS;
+}
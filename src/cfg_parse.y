@@ -28,9 +28,13 @@
 #include <ctype.h>
 #include <errno.h>
 #include <syslog.h>
+#include <fcntl.h>
 #include <pwd.h>
 #include <netdb.h>
 #include <sys/types.h>
+#include <sys/stat.h>
+#include <sys/time.h>
+#include <sys/mman.h>
 #include <sys/socket.h>
 #include <netinet/in.h>
 #include <arpa/inet.h>
@@ -41,26 +45,89 @@
 #include "inet_util.h"
 #include "user_db.h"
 #include "options.h"
+#include "addr_cache.h"
 
-extern struct user_info *default_user;
-extern u_int32_t current_line;
-extern int parser_mode;
+%}
 
-static FILE *open_user_config(const struct passwd *pw);
-static int extract_port_range(const char *token, struct port_range *range);
-static void free_cap_entries(struct user_cap *free_cap);
-static void yyerror(const char *err);
+%code requires {
+#ifndef YY_TYPEDEF_YY_SCANNER_T
+#	define YY_TYPEDEF_YY_SCANNER_T
+typedef void *yyscan_t;
+#endif
+
+/*
+** Parser state.  Each configuration file is parsed with its own context,
+** so user configuration files can be parsed concurrently.
+*/
 
-void yyrestart(FILE *fp);
-int yylex();
+struct parse_ctx {
+	int parser_mode;
+	u_int32_t current_line;
+	struct user_db *db;
+	struct addr_cache *addr_cache;
+	struct user_info *cur_user;
+	struct user_cap *cur_cap;
+	list_t *pref_list;
+
+	/* Scanner state for quoted strings */
+	char *string_buf;
+	size_t str_idx;
+	size_t max_slen;
+
+	/* Limits on user configuration files; see parse_ctx_over_budget() */
+	bool budget;
+	struct timeval deadline;
+	u_int32_t num_rules;
+	u_int32_t num_tokens;
+	size_t str_bytes;
+	const char *over_budget;
+};
+
+bool parse_ctx_over_budget(struct parse_ctx *ctx);
+}
 
-static struct user_info *cur_user;
-static struct user_cap *cur_cap;
-list_t *pref_list;
+%code {
+/*
+** The top-level "default" and "user" blocks of a configuration file that
+** is parsed lazily.  "name" is NULL for default blocks.
+*/
 
-u_int16_t default_caps;
+struct lazy_block {
+	char *name;
+	size_t start;
+	size_t end;
+	u_int32_t line;
+};
+
+struct lazy_config {
+	char *map;
+	size_t len;
+	struct lazy_block *blocks;
+	size_t num_blocks;
+};
+
+static void parse_ctx_init(	struct parse_ctx *ctx,
+							int mode,
+							struct user_db *db);
+static int parse_config(FILE *fp, struct parse_ctx *ctx);
+static int parse_config_buf(const char *buf, size_t len, struct parse_ctx *ctx);
+static int lazy_index(struct lazy_config *lazy);
+static bool lazy_match(const char *name, const struct passwd *pw);
+static int extract_port_range(const char *token, struct port_range *range);
+static void free_cap_entries(struct parse_ctx *ctx, struct user_cap *free_cap);
+static int add_forward_target(struct parse_ctx *ctx, const char *host, const char *port);
+static void yyerror(yyscan_t scanner, struct parse_ctx *ctx, const char *err);
+
+int yylex(YYSTYPE *yylval_param, yyscan_t scanner);
+int yylex_init_extra(struct parse_ctx *ctx, yyscan_t *scanner);
+int yylex_destroy(yyscan_t scanner);
+void yyset_in(FILE *fp, yyscan_t scanner);
+struct yy_buffer_state *yy_scan_bytes(const char *bytes, int len, yyscan_t scanner);
+}
 
-%}
+%define api.pure full
+%parse-param {yyscan_t scanner} {struct parse_ctx *ctx}
+%lex-param {yyscan_t scanner}
 
 %union {
 	int value;
@@ -93,16 +160,22 @@ parse_global:
 	user_rule
 |
 	{
-		if (parser_mode != PARSE_USER) {
+		if (ctx->parser_mode != PARSE_USER) {
 			o_log(LOG_CRIT,
-				"[line %d] This construct is valid only for user configuration files", current_line);
+				"[line %d] This construct is valid only for user configuration files", ctx->current_line);
 			YYABORT;
 		}
 
-		cur_cap = xcalloc(1, sizeof(struct user_cap));
-		cur_cap->caps = default_caps;
+		ctx->cur_cap = xcalloc(1, sizeof(struct user_cap));
+		ctx->cur_cap->caps = ctx->db->default_caps;
 	} user_range_rule {
-		list_prepend(&pref_list, cur_cap);
+		list_prepend(&ctx->pref_list, ctx->cur_cap);
+		ctx->cur_cap = NULL;
+
+		if (ctx->budget && ++ctx->num_rules > USER_CONF_MAX_RULES) {
+			ctx->over_budget = "too many rules";
+			YYABORT;
+		}
 	}
 ;
 
@@ -114,46 +187,46 @@ user_rule:
 
 default_statement:
 	TOK_DEFAULT {
-		if (parser_mode != PARSE_SYSTEM)
+		if (ctx->parser_mode != PARSE_SYSTEM)
 			YYABORT;
 
-		cur_user = xmalloc(sizeof(struct user_info));
-		cur_user->cap_list = NULL;
+		ctx->cur_user = xmalloc(sizeof(struct user_info));
+		ctx->cur_user->cap_list = NULL;
 
-		user_db_set_default(cur_user);
+		user_db_set_default(ctx->db, ctx->cur_user);
 	} '{' target_rule '}'
 ;
 
 user_statement:
 	TOK_USER TOK_STRING {
-		if (parser_mode != PARSE_SYSTEM) {
-			free($2);
+		if (ctx->parser_mode != PARSE_SYSTEM) {
+			xfree($2);
 			YYABORT;
 		}
 
-		cur_user = xmalloc(sizeof(struct user_info));
-		cur_user->cap_list = NULL;
+		ctx->cur_user = xmalloc(sizeof(struct user_info));
+		ctx->cur_user->cap_list = NULL;
 
-		if (find_user($2, &cur_user->user) != 0) {
-			o_log(LOG_CRIT, "[line %u] Invalid user: \"%s\"", current_line, $2);
-			free($2);
-			free_cap_entries(cur_cap);
+		if (find_user($2, &ctx->cur_user->user) != 0) {
+			o_log(LOG_CRIT, "[line %u] Invalid user: \"%s\"", ctx->current_line, $2);
+			xfree($2);
+			free_cap_entries(ctx, ctx->cur_cap);
 			YYABORT;
 		}
 
-		if (user_db_lookup(cur_user->user)) {
+		if (user_db_lookup(ctx->db, ctx->cur_user->user)) {
 			o_log(LOG_CRIT,
 				"[line %u] User \"%s\" already has a capability entry",
-				current_line, $2);
-			free($2);
-			free_cap_entries(cur_cap);
+				ctx->current_line, $2);
+			xfree($2);
+			free_cap_entries(ctx, ctx->cur_cap);
 			YYABORT;
 		}
 
-		free($2);
+		xfree($2);
 	} '{' target_rule '}'
 	{
-		user_db_add(cur_user);
+		user_db_add(ctx->db, ctx->cur_user);
 	}
 ;
 
@@ -165,17 +238,18 @@ target_rule:
 
 target_statement:
 	{
-		cur_cap = xcalloc(1, sizeof(struct user_cap));
-		cur_cap->caps = default_caps;
+		ctx->cur_cap = xcalloc(1, sizeof(struct user_cap));
+		ctx->cur_cap->caps = ctx->db->default_caps;
 	} range_rule {
-		list_prepend(&cur_user->cap_list, cur_cap);
+		list_prepend(&ctx->cur_user->cap_list, ctx->cur_cap);
+		ctx->cur_cap = NULL;
 	}
 ;
 
 range_rule:
 	TOK_DEFAULT '{' cap_rule '}' {
-		if (cur_user == default_user)
-			default_caps = cur_cap->caps;
+		if (ctx->cur_user == ctx->db->default_user)
+			ctx->db->default_caps = ctx->cur_cap->caps;
 	}
 |
 	rule_specification_list_req '{' cap_rule '}'
@@ -203,117 +277,122 @@ rule_specification:
 
 to_statement:
 	TOK_TO TOK_STRING {
-		if (cur_cap->dest) {
-			if (parser_mode == PARSE_SYSTEM) {
+		if (ctx->cur_cap->dest) {
+			if (ctx->parser_mode == PARSE_SYSTEM) {
 				o_log(LOG_CRIT, "[line %u] 'to' can only be specified once",
-					current_line);
+					ctx->current_line);
 			}
 
-			free($2);
-			free_cap_entries(cur_cap);
+			xfree($2);
+			free_cap_entries(ctx, ctx->cur_cap);
 			YYABORT;
 		}
 
-		cur_cap->dest = xmalloc(sizeof(struct sockaddr_storage));
+		ctx->cur_cap->dest = addr_cache_get(ctx->addr_cache, $2);
 
-		if (get_addr($2, cur_cap->dest) == -1) {
-			if (parser_mode == PARSE_SYSTEM) {
-				o_log(LOG_CRIT, "[line %u] Bad address: \"%s\"",
-					current_line, $2);
-			}
+		/*
+		** Host names in user configuration files are resolved in
+		** the background when a rule first needs them.
+		*/
+
+		if (ctx->parser_mode == PARSE_SYSTEM &&
+			addr_cache_resolve(ctx->cur_cap->dest) == -1)
+		{
+			o_log(LOG_CRIT, "[line %u] Bad address: \"%s\"",
+				ctx->current_line, $2);
 
-			free($2);
-			free_cap_entries(cur_cap);
+			xfree($2);
+			free_cap_entries(ctx, ctx->cur_cap);
 			YYABORT;
 		}
 
-		free($2);
+		xfree($2);
 	}
 ;
 
 fport_statement:
 	TOK_FPORT TOK_STRING {
-		if (cur_cap->fport) {
-			if (parser_mode == PARSE_SYSTEM) {
+		if (ctx->cur_cap->fport) {
+			if (ctx->parser_mode == PARSE_SYSTEM) {
 				o_log(LOG_CRIT, "[line %u] 'fport' can only be specified once",
-					current_line);
+					ctx->current_line);
 			}
 
-			free($2);
-			free_cap_entries(cur_cap);
+			xfree($2);
+			free_cap_entries(ctx, ctx->cur_cap);
 			YYABORT;
 		}
 
-		cur_cap->fport = xmalloc(sizeof(struct port_range));
+		ctx->cur_cap->fport = xmalloc(sizeof(struct port_range));
 
-		if (extract_port_range($2, cur_cap->fport) == -1) {
-			if (parser_mode == PARSE_SYSTEM)
-				o_log(LOG_CRIT, "[line %u] Bad port or port range: \"%s\"", current_line, $2);
+		if (extract_port_range($2, ctx->cur_cap->fport) == -1) {
+			if (ctx->parser_mode == PARSE_SYSTEM)
+				o_log(LOG_CRIT, "[line %u] Bad port or port range: \"%s\"", ctx->current_line, $2);
 
-			free($2);
-			free_cap_entries(cur_cap);
+			xfree($2);
+			free_cap_entries(ctx, ctx->cur_cap);
 			YYABORT;
 		}
 
-		free($2);
+		xfree($2);
 	}
 ;
 
 from_statement:
 	TOK_FROM TOK_STRING {
-		if (cur_cap->src) {
-			if (parser_mode == PARSE_SYSTEM) {
+		if (ctx->cur_cap->src) {
+			if (ctx->parser_mode == PARSE_SYSTEM) {
 				o_log(LOG_CRIT, "[line %u] 'from' can only be specified once",
-					current_line);
+					ctx->current_line);
 			}
 
-			free($2);
-			free_cap_entries(cur_cap);
+			xfree($2);
+			free_cap_entries(ctx, ctx->cur_cap);
 			YYABORT;
 		}
 
-		cur_cap->src = xmalloc(sizeof(struct sockaddr_storage));
+		ctx->cur_cap->src = addr_cache_get(ctx->addr_cache, $2);
 
-		if (get_addr($2, cur_cap->src) == -1) {
-			if (parser_mode == PARSE_SYSTEM) {
-				o_log(LOG_CRIT, "[line %u] Bad address: \"%s\"",
-					current_line, $2);
-			}
+		if (ctx->parser_mode == PARSE_SYSTEM &&
+			addr_cache_resolve(ctx->cur_cap->src) == -1)
+		{
+			o_log(LOG_CRIT, "[line %u] Bad address: \"%s\"",
+				ctx->current_line, $2);
 
-			free($2);
-			free_cap_entries(cur_cap);
+			xfree($2);
+			free_cap_entries(ctx, ctx->cur_cap);
 			YYABORT;
 		}
 
-		free($2);
+		xfree($2);
 	}
 ;
 
 lport_statement:
 	TOK_LPORT TOK_STRING {
-		if (cur_cap->lport) {
-			if (parser_mode == PARSE_SYSTEM) {
+		if (ctx->cur_cap->lport) {
+			if (ctx->parser_mode == PARSE_SYSTEM) {
 				o_log(LOG_CRIT, "[line %u] 'lport' can only be specified once",
-					current_line);
+					ctx->current_line);
 			}
 
-			free($2);
-			free_cap_entries(cur_cap);
+			xfree($2);
+			free_cap_entries(ctx, ctx->cur_cap);
 			YYABORT;
 		}
 
-		cur_cap->lport = xmalloc(sizeof(struct port_range));
+		ctx->cur_cap->lport = xmalloc(sizeof(struct port_range));
 
-		if (extract_port_range($2, cur_cap->lport) == -1) {
-			if (parser_mode == PARSE_SYSTEM)
-				o_log(LOG_CRIT, "[line %u] Bad port or port range: \"%s\"", current_line, $2);
+		if (extract_port_range($2, ctx->cur_cap->lport) == -1) {
+			if (ctx->parser_mode == PARSE_SYSTEM)
+				o_log(LOG_CRIT, "[line %u] Bad port or port range: \"%s\"", ctx->current_line, $2);
 
-			free($2);
-			free_cap_entries(cur_cap);
+			xfree($2);
+			free_cap_entries(ctx, ctx->cur_cap);
 			YYABORT;
 		}
 
-		free($2);
+		xfree($2);
 	}
 ;
 
@@ -325,62 +404,58 @@ cap_rule:
 
 force_reply:
 	TOK_FORCE TOK_REPLY TOK_STRING {
-		cur_cap->caps = CAP_REPLY;
-		cur_cap->action = ACTION_FORCE;
-		cur_cap->data.replies.num = 1;
-		cur_cap->data.replies.data = xrealloc(cur_cap->data.replies.data,
+		ctx->cur_cap->caps = CAP_REPLY;
+		ctx->cur_cap->action = ACTION_FORCE;
+		ctx->cur_cap->data.replies.num = 1;
+		ctx->cur_cap->data.replies.data = xrealloc(ctx->cur_cap->data.replies.data,
 			sizeof(u_char *));
-		cur_cap->data.replies.data[0] = $3;
+		ctx->cur_cap->data.replies.data[0] = $3;
 	}
 |
 	force_reply TOK_STRING {
-		if (cur_cap->data.replies.num < 0xFF) {
-			cur_cap->data.replies.data = xrealloc(cur_cap->data.replies.data,
-				++cur_cap->data.replies.num * sizeof(u_char *));
-			cur_cap->data.replies.data[cur_cap->data.replies.num - 1] = $2;
+		if (ctx->cur_cap->data.replies.num < 0xFF) {
+			ctx->cur_cap->data.replies.data = xrealloc(ctx->cur_cap->data.replies.data,
+				++ctx->cur_cap->data.replies.num * sizeof(u_char *));
+			ctx->cur_cap->data.replies.data[ctx->cur_cap->data.replies.num - 1] = $2;
 		} else {
 			o_log(LOG_CRIT, "[line %u] No more than 255 replies may be specified",
-				current_line);
-			free_cap_entries(cur_cap);
+				ctx->current_line);
+			free_cap_entries(ctx, ctx->cur_cap);
 			YYABORT;
 		}
 	}
 ;
 
 force_forward:
-	TOK_FORCE TOK_FORWARD TOK_STRING TOK_STRING {
-		cur_cap->caps = CAP_FORWARD;
-		cur_cap->action = ACTION_FORCE;
-		cur_cap->data.forward.host = xmalloc(sizeof(struct sockaddr_storage));
-
-		if (get_addr($3, cur_cap->data.forward.host) == -1) {
-			if (parser_mode == PARSE_SYSTEM) {
-				o_log(LOG_CRIT, "[line %u] Bad address: \"%s\"",
-					current_line, $3);
-			}
-
-			free($3); free($4);
-			free_cap_entries(cur_cap);
-			YYABORT;
-		}
+	TOK_FORCE TOK_FORWARD {
+		ctx->cur_cap->caps = CAP_FORWARD;
+		ctx->cur_cap->action = ACTION_FORCE;
+		ctx->cur_cap->data.forward.num = 0;
+	} forward_targets
+;
 
-		if (get_port($4, &cur_cap->data.forward.port) == -1) {
-			if (parser_mode == PARSE_SYSTEM)
-				o_log(LOG_CRIT, "[line %u] Bad port: \"%s\"", current_line, $4);
+forward_targets:
+	forward_target
+|
+	forward_targets forward_target
+;
 
-			free($3); free($4);
-			free_cap_entries(cur_cap);
+forward_target:
+	TOK_STRING TOK_STRING {
+		if (add_forward_target(ctx, $1, $2) != 0) {
+			xfree($1); xfree($2);
+			free_cap_entries(ctx, ctx->cur_cap);
 			YYABORT;
 		}
 
-		free($3); free($4);
+		xfree($1); xfree($2);
 	}
 ;
 
 cap_statement:
 	TOK_FORCE TOK_CAP {
-		cur_cap->caps = $2;
-		cur_cap->action = ACTION_FORCE;
+		ctx->cur_cap->caps = $2;
+		ctx->cur_cap->action = ACTION_FORCE;
 	}
 |
 	force_reply
@@ -389,20 +464,20 @@ cap_statement:
 |
 	TOK_ALLOWDENY TOK_CAP {
 		if ($1 == ACTION_ALLOW)
-			cur_cap->caps |= $2;
+			ctx->cur_cap->caps |= $2;
 		else
-			cur_cap->caps &= ~$2;
+			ctx->cur_cap->caps &= ~$2;
 
-		cur_cap->action = $1;
+		ctx->cur_cap->action = $1;
 	}
 |
 	TOK_ALLOWDENY TOK_FORWARD {
 		if ($1 == ACTION_ALLOW)
-			cur_cap->caps |= CAP_FORWARD;
+			ctx->cur_cap->caps |= CAP_FORWARD;
 		else
-			cur_cap->caps &= ~CAP_FORWARD;
+			ctx->cur_cap->caps &= ~CAP_FORWARD;
 
-		cur_cap->action = $1;
+		ctx->cur_cap->action = $1;
 	}
 ;
 
@@ -414,61 +489,40 @@ user_range_rule:
 
 user_reply:
 	TOK_REPLY TOK_STRING {
-		cur_cap->caps = CAP_REPLY;
-		cur_cap->data.replies.num = 1;
-		cur_cap->data.replies.data = xrealloc(cur_cap->data.replies.data,
+		ctx->cur_cap->caps = CAP_REPLY;
+		ctx->cur_cap->data.replies.num = 1;
+		ctx->cur_cap->data.replies.data = xrealloc(ctx->cur_cap->data.replies.data,
 			sizeof(u_char *));
-		cur_cap->data.replies.data[0] = $2;
+		ctx->cur_cap->data.replies.data[0] = $2;
 	}
 |
 	user_reply TOK_STRING {
-		if (cur_cap->data.replies.num < MAX_RANDOM_REPLIES
-				&& cur_cap->data.replies.num < 0xFF) {
-			cur_cap->data.replies.data = xrealloc(cur_cap->data.replies.data,
-				++cur_cap->data.replies.num * sizeof(u_char *));
-			cur_cap->data.replies.data[cur_cap->data.replies.num - 1] = $2;
-		}
+		if (ctx->cur_cap->data.replies.num < MAX_RANDOM_REPLIES
+				&& ctx->cur_cap->data.replies.num < 0xFF) {
+			ctx->cur_cap->data.replies.data = xrealloc(ctx->cur_cap->data.replies.data,
+				++ctx->cur_cap->data.replies.num * sizeof(u_char *));
+			ctx->cur_cap->data.replies.data[ctx->cur_cap->data.replies.num - 1] = $2;
+		} else
+			xfree($2);
 	}
 ;
 
 user_forward:
-	TOK_FORWARD TOK_STRING TOK_STRING {
-		cur_cap->caps = CAP_FORWARD;
-		cur_cap->data.forward.host = xmalloc(sizeof(struct sockaddr_storage));
-
-		if (get_addr($2, cur_cap->data.forward.host) == -1) {
-			if (parser_mode == PARSE_SYSTEM) {
-				o_log(LOG_CRIT, "[line %u] Bad address: \"%s\"",
-					current_line, $2);
-			}
-
-			free($2); free($3);
-			free_cap_entries(cur_cap);
-			YYABORT;
-		}
-
-		if (get_port($3, &cur_cap->data.forward.port) == -1) {
-			if (parser_mode == PARSE_SYSTEM)
-				o_log(LOG_CRIT, "[line %u] Bad port: \"%s\"", current_line, $3);
-
-			free($2); free($3);
-			free_cap_entries(cur_cap);
-			YYABORT;
-		}
-
-		free($2); free($3);
-	}
+	TOK_FORWARD {
+		ctx->cur_cap->caps = CAP_FORWARD;
+		ctx->cur_cap->data.forward.num = 0;
+	} forward_targets
 ;
 
 user_cap_rule:
 	TOK_CAP {
 		if ($1 == CAP_SPOOF || $1 == CAP_SPOOF_ALL || $1 == CAP_SPOOF_PRIVPORT)
 		{
-			free_cap_entries(cur_cap);
+			free_cap_entries(ctx, ctx->cur_cap);
 			YYABORT;
 		}
 
-		cur_cap->caps = $1;
+		ctx->cur_cap->caps = $1;
 	}
 |
 	user_reply
@@ -479,13 +533,117 @@ user_cap_rule:
 %%
 
 /*
-** Read in the system-wide configuration file.
+** Add the host "host" listening on port "port" to the hosts the current
+** capability forwards requests to.
+** Returns 0 on success, -1 on failure.
+*/
+
+static int add_forward_target(struct parse_ctx *ctx, const char *host, const char *port) {
+	struct forward_data *forward = &ctx->cur_cap->data.forward;
+	struct forward_target *target;
+
+	if (forward->num >= MAX_FORWARD_TARGETS) {
+		if (ctx->parser_mode == PARSE_SYSTEM) {
+			o_log(LOG_CRIT, "[line %u] No more than %u forward targets may be specified",
+				ctx->current_line, MAX_FORWARD_TARGETS);
+		}
+
+		return -1;
+	}
+
+	forward->targets = xrealloc(forward->targets,
+		(forward->num + 1) * sizeof(struct forward_target));
+	target = &forward->targets[forward->num];
+
+	target->host = addr_cache_get(ctx->addr_cache, host);
+
+	if (ctx->parser_mode == PARSE_SYSTEM && addr_cache_resolve(target->host) == -1) {
+		o_log(LOG_CRIT, "[line %u] Bad address: \"%s\"", ctx->current_line, host);
+		return -1;
+	}
+
+	if (get_port(port, &target->port) == -1) {
+		if (ctx->parser_mode == PARSE_SYSTEM)
+			o_log(LOG_CRIT, "[line %u] Bad port: \"%s\"", ctx->current_line, port);
+
+		return -1;
+	}
+
+	++forward->num;
+	return 0;
+}
+
+/*
+** Initialize a parser context.
+*/
+
+static void parse_ctx_init(	struct parse_ctx *ctx,
+							int mode,
+							struct user_db *db)
+{
+	memset(ctx, 0, sizeof(*ctx));
+	ctx->parser_mode = mode;
+	ctx->current_line = 1;
+	ctx->db = db;
+	ctx->addr_cache = db->addr_cache;
+}
+
+/*
+** Parse the configuration file "fp" using the context "ctx."
+** Returns 0 on success, non-zero on failure.
+*/
+
+static int parse_config(FILE *fp, struct parse_ctx *ctx) {
+	yyscan_t scanner;
+	int ret;
+
+	if (yylex_init_extra(ctx, &scanner) != 0) {
+		o_log(LOG_CRIT, "Failed to initialize scanner: %s", strerror(errno));
+		return -1;
+	}
+
+	yyset_in(fp, scanner);
+	ret = yyparse(scanner, ctx);
+	yylex_destroy(scanner);
+
+	return ret;
+}
+
+/*
+** Parse the configuration in "buf" using the context "ctx."
+** Returns 0 on success, non-zero on failure.
+*/
+
+static int parse_config_buf(const char *buf, size_t len, struct parse_ctx *ctx) {
+	yyscan_t scanner;
+	int ret;
+
+	if (yylex_init_extra(ctx, &scanner) != 0) {
+		o_log(LOG_CRIT, "Failed to initialize scanner: %s", strerror(errno));
+		return -1;
+	}
+
+	yy_scan_bytes(buf, (int) len, scanner);
+	ret = yyparse(scanner, ctx);
+	yylex_destroy(scanner);
+
+	return ret;
+}
+
+/*
+** Read in the system-wide configuration file.  The rules are compiled
+** into a new database, which replaces the current one only if the file
+** was read successfully.
 */
 
 int read_config(const char *path) {
+	struct parse_ctx ctx;
+	struct user_db *db;
 	FILE *fp;
 	int ret;
 
+	db = user_db_create();
+
 	fp = fopen(path, "r");
 	if (!fp) {
 		if (errno == ENOENT) {
@@ -496,96 +654,399 @@ int read_config(const char *path) {
 			*/
 
 			if (!strcmp(path, CONFFILE)) {
-				struct user_info *temp_default;
-
-				temp_default = user_db_create_default();
-				user_db_set_default(temp_default);
+				user_db_set_default(db, user_db_create_default());
+				user_db_publish(db);
 				return 0;
 			}
 		}
 
 		o_log(LOG_CRIT, "Error opening configuration file: %s: %s",
 			path, strerror(errno));
+		user_db_release(db);
 		return -1;
 	}
 
-	yyrestart(fp);
-	current_line = 1;
-	parser_mode = PARSE_SYSTEM;
-	ret = yyparse();
+	parse_ctx_init(&ctx, PARSE_SYSTEM, db);
+	ret = parse_config(fp, &ctx);
 
 	fclose(fp);
 
+	if (ret != 0) {
+		user_db_release(db);
+		return ret;
+	}
+
 	/*
 	** Make sure there's a default to fall back on.
 	*/
 
-	if (!default_user) {
-		struct user_info *temp_default;
+	if (!db->default_user)
+		user_db_set_default(db, user_db_create_default());
+
+	user_db_publish(db);
+	return 0;
+}
+
+/*
+** Find the top-level blocks of a lazily parsed configuration file.  Only
+** comments, strings and braces are recognized; anything unexpected makes
+** this fail, so that the file is parsed normally and errors are reported
+** as usual.
+** Returns 0 on success, -1 on failure.
+*/
+
+static int lazy_index(struct lazy_config *lazy) {
+	const char *p = lazy->map;
+	const char *end = lazy->map + lazy->len;
+	const char *hdr_start = NULL;
+	const char *name = NULL;
+	size_t name_len = 0;
+	size_t nwords = 0;
+	bool is_user = false;
+	u_int32_t line = 1;
+	u_int32_t hdr_line = 0;
+	u_int32_t depth = 0;
+
+	while (p < end) {
+		const char *word;
+		size_t word_len;
+		bool quoted = false;
+
+		switch (*p) {
+			case '\n':
+				++line;
+				/* fall through */
+			case ' ':
+			case '\t':
+				++p;
+				continue;
+
+			case '#':
+				while (p < end && *p != '\n')
+					++p;
+				continue;
+
+			/* left for the complete parse to report */
+			case '\0':
+				return -1;
+
+			case '{':
+				if (depth++ == 0) {
+					if (!hdr_start || (is_user ? nwords != 2 : nwords != 1))
+						return -1;
+
+					lazy->blocks = xrealloc(lazy->blocks,
+						(lazy->num_blocks + 1) * sizeof(struct lazy_block));
+					lazy->blocks[lazy->num_blocks].name = NULL;
+					lazy->blocks[lazy->num_blocks].start = hdr_start - lazy->map;
+					lazy->blocks[lazy->num_blocks].line = hdr_line;
+
+					if (is_user) {
+						char *copy = xmalloc(name_len + 1);
+
+						memcpy(copy, name, name_len);
+						copy[name_len] = '\0';
+						lazy->blocks[lazy->num_blocks].name = copy;
+					}
+				}
+
+				++p;
+				continue;
+
+			case '}':
+				if (depth == 0)
+					return -1;
+
+				if (--depth == 0) {
+					lazy->blocks[lazy->num_blocks++].end = p + 1 - lazy->map;
+					hdr_start = NULL;
+					nwords = 0;
+				}
+
+				++p;
+				continue;
+
+			default:
+				break;
+		}
+
+		if (*p == '/' && p + 1 < end && p[1] == '*') {
+			for (p += 2; p + 1 < end && !(p[0] == '*' && p[1] == '/'); ++p) {
+				if (*p == '\n')
+					++line;
+			}
+
+			if (p + 1 >= end)
+				return -1;
+
+			p += 2;
+			continue;
+		}
+
+		if (*p == '"') {
+			quoted = true;
+			word = ++p;
+
+			while (p < end && *p != '"') {
+				/* escape sequences are only allowed inside blocks */
+				if (*p == '\n' || *p == '\0' || (*p == '\\' && depth == 0))
+					return -1;
+
+				if (*p == '\\')
+					++p;
+
+				++p;
+			}
+
+			if (p >= end)
+				return -1;
+
+			word_len = p++ - word;
+		} else {
+			word = p;
+
+			while (p < end && !strchr(" \t\n{}", *p))
+				++p;
+
+			word_len = p - word;
+		}
+
+		if (depth > 0)
+			continue;
+
+		if (nwords == 0) {
+			hdr_start = quoted ? word - 1 : word;
+			hdr_line = line;
+
+			if (quoted)
+				return -1;
+
+			if (word_len == 4 && !strncasecmp(word, "user", 4))
+				is_user = true;
+			else if (word_len == 7 && !strncasecmp(word, "default", 7))
+				is_user = false;
+			else
+				return -1;
+		} else if (nwords == 1 && is_user) {
+			name = word;
+			name_len = word_len;
+		} else
+			return -1;
+
+		++nwords;
+	}
+
+	if (depth != 0 || nwords != 0)
+		return -1;
+
+	return 0;
+}
+
+/*
+** Returns true if the block for user "name" applies to "pw."  Names other
+** than the user's own are taken to belong to other users without asking
+** the name service, so that a query costs one lookup however many blocks
+** there are.  Only names made of digits, which may be user names or UIDs,
+** are resolved the way the parser does.
+*/
+
+static bool lazy_match(const char *name, const struct passwd *pw) {
+	uid_t block_uid;
+
+	if (!strcmp(name, pw->pw_name))
+		return true;
+
+	if (name[strspn(name, "0123456789")] != '\0')
+		return false;
+
+	return find_user(name, &block_uid) == 0 && block_uid == pw->pw_uid;
+}
+
+/*
+** Free the index of a lazily parsed configuration file.
+*/
+
+void lazy_config_free(struct lazy_config *lazy) {
+	size_t i;
+
+	for (i = 0; i < lazy->num_blocks; ++i)
+		xfree(lazy->blocks[i].name);
+
+	xfree(lazy->blocks);
+	munmap(lazy->map, lazy->len);
+	xfree(lazy);
+}
+
+/*
+** Index the system-wide configuration file without parsing it.  The
+** default rules and the rules for a user are parsed by
+** user_db_load_lazy() once they are needed.  Files that can't be indexed
+** are read normally.
+** Returns 0 on success, non-zero on failure.
+*/
+
+int read_config_lazy(const char *path) {
+	struct lazy_config *lazy;
+	struct user_db *db;
+	struct stat st;
+	void *map;
+	int fd;
 
-		temp_default = user_db_create_default();
-		user_db_set_default(temp_default);
+	fd = open(path, O_RDONLY);
+	if (fd == -1)
+		return read_config(path);
+
+	if (fstat(fd, &st) != 0 || st.st_size == 0) {
+		close(fd);
+		return read_config(path);
 	}
 
+	map = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+	close(fd);
+
+	if (map == MAP_FAILED)
+		return read_config(path);
+
+	lazy = xcalloc(1, sizeof(struct lazy_config));
+	lazy->map = map;
+	lazy->len = st.st_size;
+
+	if (lazy_index(lazy) != 0) {
+		debug("Could not index %s; parsing it completely", path);
+		lazy_config_free(lazy);
+		return read_config(path);
+	}
+
+	db = user_db_create();
+	db->lazy = lazy;
+	user_db_publish(db);
+
+	return 0;
+}
+
+/*
+** Parse the default blocks and the blocks for user "pw" of a lazily
+** parsed configuration file into "db," in the order they appear in.
+** Returns 0 on success, non-zero on failure.
+*/
+
+int user_db_load_lazy(struct user_db *db, const struct passwd *pw) {
+	struct lazy_config *lazy = db->lazy;
+	struct parse_ctx ctx;
+	int ret = 0;
+	enum mem_tag prev;
+	size_t i;
+
+	prev = mem_enter(MEM_CONFIG);
+	db->lazy = NULL;
+	parse_ctx_init(&ctx, PARSE_SYSTEM, db);
+
+	for (i = 0; i < lazy->num_blocks; ++i) {
+		struct lazy_block *block = &lazy->blocks[i];
+
+		if (block->name && !lazy_match(block->name, pw))
+			continue;
+
+		ctx.current_line = block->line;
+		ret = parse_config_buf(lazy->map + block->start,
+				block->end - block->start, &ctx);
+		if (ret != 0)
+			break;
+	}
+
+	lazy_config_free(lazy);
+
+	if (ret == 0 && !db->default_user)
+		user_db_set_default(db, user_db_create_default());
+
+	mem_leave(prev);
 	return ret;
 }
 
 /*
-** Open the user's configuration file for reading by the parser.
+** Returns true if parsing with "ctx" has exceeded the limits on user
+** configuration files, noting which one in "ctx."  Called by the scanner
+** for every token; the clock is only read every few tokens.
 */
 
-static FILE *open_user_config(const struct passwd *pw) {
-	FILE *fp = NULL;
+bool parse_ctx_over_budget(struct parse_ctx *ctx) {
+	struct timeval now;
 
-#if XDGBDIR_SUPPORT
-	if (!fp)
-		fp = safe_open(pw, USER_CONF_XDG);
-#endif
+	if (!ctx->budget)
+		return false;
+
+	if (ctx->over_budget)
+		return true;
+
+	if (ctx->str_bytes > USER_CONF_MAX_STRINGS) {
+		ctx->over_budget = "strings too long";
+		return true;
+	}
 
-	if (!fp)
-		fp = safe_open(pw, USER_CONF);
+	if (++ctx->num_tokens % 64 != 0)
+		return false;
 
-	if (!fp)
-		return NULL;
+	gettimeofday(&now, NULL);
 
-	yyrestart(fp);
-	current_line = 1;
-	parser_mode = PARSE_USER;
+	if (now.tv_sec > ctx->deadline.tv_sec ||
+		(now.tv_sec == ctx->deadline.tv_sec && now.tv_usec > ctx->deadline.tv_usec))
+	{
+		ctx->over_budget = "parsing took too long";
+		return true;
+	}
 
-	return fp;
+	return false;
 }
 
 /*
-** Read in a user's configuration file.
+** Parse the user configuration file "fp" into "pref_list," giving up if
+** it exceeds USER_CONF_MAX_RULES rules, USER_CONF_MAX_STRINGS bytes of
+** strings, or USER_CONF_MAX_MSECS milliseconds of parsing.  "reason" is
+** set if a limit was exceeded.  Host names are entered in "addr_cache,"
+** which must outlive the parsed rules.
+** Returns 0 on success, -1 on failure.
 */
 
-list_t *user_db_get_pref_list(const struct passwd *pw) {
-	FILE *fp;
+int user_db_parse_prefs(	struct user_db *db,
+						FILE *fp,
+						struct addr_cache *addr_cache,
+						list_t **pref_list,
+						const char **reason)
+{
+	struct parse_ctx ctx;
+	long usec;
 	int ret;
 
-	fp = open_user_config(pw);
-	if (!fp)
-		return NULL;
+	parse_ctx_init(&ctx, PARSE_USER, db);
+	ctx.addr_cache = addr_cache;
 
-	cur_cap = NULL;
-	pref_list = NULL;
+	ctx.budget = true;
+	gettimeofday(&ctx.deadline, NULL);
+	usec = ctx.deadline.tv_usec + USER_CONF_MAX_MSECS * 1000L;
+	ctx.deadline.tv_sec += usec / 1000000;
+	ctx.deadline.tv_usec = usec % 1000000;
 
-	ret = yyparse();
-	fclose(fp);
+	ret = parse_config(fp, &ctx);
 
-	if (ret != 0) {
-		list_destroy(pref_list, user_db_cap_destroy_data);
-		return NULL;
+	/* the scanner stops at a limit as if the file had ended */
+	if (ret != 0 || ctx.over_budget) {
+		*reason = ctx.over_budget;
+		list_destroy(ctx.pref_list, user_db_cap_destroy_data);
+		return -1;
 	}
 
-	return pref_list;
+	*pref_list = ctx.pref_list;
+	return 0;
 }
 
-static void yyerror(const char *err) {
-	if (parser_mode == PARSE_USER)
-		free_cap_entries(cur_cap);
+static void yyerror(yyscan_t scanner __notused,
+					struct parse_ctx *ctx,
+					const char *err)
+{
+	if (ctx->parser_mode == PARSE_USER)
+		free_cap_entries(ctx, ctx->cur_cap);
 	else
-		o_log(LOG_CRIT, "[line %u] %s", current_line, err);
+		o_log(LOG_CRIT, "[line %u] %s", ctx->current_line, err);
 }
 
 /*
@@ -616,16 +1077,21 @@ static int extract_port_range(const char *token, struct port_range *range) {
 	return 0;
 }
 
-static void free_cap_entries(struct user_cap *free_cap) {
+static void free_cap_entries(struct parse_ctx *ctx, struct user_cap *free_cap) {
 	user_db_cap_destroy_data(free_cap);
 
-	if (free_cap != cur_cap)
-		free(cur_cap);
+	if (free_cap != ctx->cur_cap)
+		user_db_cap_destroy_data(ctx->cur_cap);
 
-	free(free_cap);
-	free(cur_user);
+	/*
+	** The default user belongs to the database as soon as it is created.
+	*/
+
+	if (ctx->cur_user && ctx->cur_user != ctx->db->default_user) {
+		list_destroy(ctx->cur_user->cap_list, user_db_cap_destroy_data);
+		xfree(ctx->cur_user);
+	}
 
-	cur_cap = NULL;
-	cur_user = NULL;
-	pref_list = NULL;
+	ctx->cur_cap = NULL;
+	ctx->cur_user = NULL;
 }
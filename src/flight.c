@@ -0,0 +1,271 @@
+/*
+** flight.c - oidentd coalescing of concurrent lookups.
+** Copyright (c) 2019      Janik Rabe  <oidentd@janikrabe.com>
+**
+** This program is free software; you can redistribute it and/or modify
+** it under the terms of the GNU General Public License, version 2,
+** as published by the Free Software Foundation.
+**
+** This program is distributed in the hope that it will be useful,
+** but WITHOUT ANY WARRANTY; without even the implied warranty of
+** MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+** GNU General Public License for more details.
+**
+** You should have received a copy of the GNU General Public License
+** along with this program; if not, write to the Free Software
+** Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA
+*/
+
+#include <config.h>
+
+#include <unistd.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <pwd.h>
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+
+#include "oidentd.h"
+#include "util.h"
+#include "inet_util.h"
+#include "flight.h"
+
+#if THREAD_SUPPORT
+#	include <pthread.h>
+
+/*
+** Several hosts often ask about the same connection at once, for example
+** when many IRC servers are rejoined after a netsplit.  Only the first
+** query for a connection asks the kernel; queries for the same connection
+** that arrive while it is in progress wait for its result.
+**
+** Lookups of different connections that have to scan a whole table, such
+** as /proc/net/tcp, are collected into batches instead.  While a table is
+** being scanned, further lookups join the next batch, which is scanned
+** once by one of its members as soon as the current scan has finished.
+*/
+
+struct flight {
+	in_port_t lport;
+	in_port_t fport;
+	struct sockaddr_storage laddr;
+	struct sockaddr_storage faddr;
+	uid_t uid;
+	bool done;
+	u_int32_t refcount;
+	pthread_cond_t cond;
+};
+
+struct scan_batch {
+	struct flight_query **queries;
+	size_t num;
+	bool done;
+	u_int32_t refcount;
+};
+
+struct scan_table {
+	struct scan_batch *next;
+	bool scanning;
+};
+
+DEFINE_LOCK(flight_mutex);
+static list_t *flight_hash[FLIGHT_HASH_SIZE];
+static struct scan_table scan_tables[FLIGHT_TABLES];
+
+/* signalled whenever a scan has finished */
+static pthread_cond_t scan_cond = PTHREAD_COND_INITIALIZER;
+
+static unsigned int flight_hashval(in_port_t lport, in_port_t fport);
+static bool flight_match(	struct flight *flight,
+							in_port_t lport,
+							in_port_t fport,
+							struct sockaddr_storage *laddr,
+							struct sockaddr_storage *faddr);
+static void flight_unlink(list_t **bucket, struct flight *flight);
+
+static unsigned int flight_hashval(in_port_t lport, in_port_t fport) {
+	return ((unsigned int) lport * 31 + fport) % FLIGHT_HASH_SIZE;
+}
+
+static bool flight_match(	struct flight *flight,
+							in_port_t lport,
+							in_port_t fport,
+							struct sockaddr_storage *laddr,
+							struct sockaddr_storage *faddr)
+{
+	if (flight->lport != lport || flight->fport != fport)
+		return false;
+
+	if (flight->laddr.ss_family != laddr->ss_family ||
+		flight->faddr.ss_family != faddr->ss_family)
+	{
+		return false;
+	}
+
+	return sin_equal(&flight->laddr, laddr) && sin_equal(&flight->faddr, faddr);
+}
+
+/*
+** Remove "flight" from "bucket" so that later queries start a new lookup.
+*/
+
+static void flight_unlink(list_t **bucket, struct flight *flight) {
+	list_t **cur;
+
+	for (cur = bucket; *cur; cur = &(*cur)->next) {
+		if ((*cur)->data == flight) {
+			list_t *node = *cur;
+
+			*cur = node->next;
+			xfree(node);
+			return;
+		}
+	}
+}
+
+/*
+** Returns the owner of a connection as determined by "lookup," which is
+** called with "data" unless a lookup for the same connection is already
+** in progress, in which case its result is returned instead.
+*/
+
+uid_t flight_get_user(	in_port_t lport,
+						in_port_t fport,
+						struct sockaddr_storage *laddr,
+						struct sockaddr_storage *faddr,
+						uid_t (*lookup)(void *data),
+						void *data)
+{
+	list_t **bucket = &flight_hash[flight_hashval(lport, fport)];
+	struct flight *flight = NULL;
+	list_t *cur;
+	uid_t uid;
+
+	o_lock(flight_mutex);
+
+	for (cur = *bucket; cur; cur = cur->next) {
+		if (flight_match(cur->data, lport, fport, laddr, faddr)) {
+			flight = cur->data;
+			break;
+		}
+	}
+
+	if (flight) {
+		++flight->refcount;
+
+		while (!flight->done)
+			pthread_cond_wait(&flight->cond, &flight_mutex);
+
+		uid = flight->uid;
+		goto out_release;
+	}
+
+	flight = xcalloc(1, sizeof(struct flight));
+	flight->lport = lport;
+	flight->fport = fport;
+	memcpy(&flight->laddr, laddr, sizeof(struct sockaddr_storage));
+	memcpy(&flight->faddr, faddr, sizeof(struct sockaddr_storage));
+	flight->refcount = 1;
+	pthread_cond_init(&flight->cond, NULL);
+	list_prepend(bucket, flight);
+
+	o_unlock(flight_mutex);
+
+	uid = lookup(data);
+
+	o_lock(flight_mutex);
+
+	flight->uid = uid;
+	flight->done = true;
+	flight_unlink(bucket, flight);
+	pthread_cond_broadcast(&flight->cond);
+
+out_release:
+	if (--flight->refcount == 0) {
+		pthread_cond_destroy(&flight->cond);
+		xfree(flight);
+	}
+
+	o_unlock(flight_mutex);
+	return uid;
+}
+
+/*
+** Look up "query" in "table" using "scan," which looks up all queries
+** passed to it in one pass over the table.  Lookups that arrive while the
+** table is being scanned are scanned for together afterwards.
+*/
+
+void flight_scan(	int table,
+					struct flight_query *query,
+					void (*scan)(struct flight_query **queries, size_t num))
+{
+	struct scan_table *tab = &scan_tables[table];
+	struct scan_batch *batch;
+
+	query->found = false;
+	query->uid = MISSING_UID;
+
+	o_lock(flight_mutex);
+
+	batch = tab->next;
+	if (!batch) {
+		batch = xcalloc(1, sizeof(struct scan_batch));
+		tab->next = batch;
+	}
+
+	batch->queries = xrealloc(batch->queries,
+						(batch->num + 1) * sizeof(struct flight_query *));
+	batch->queries[batch->num++] = query;
+	++batch->refcount;
+
+	while (!batch->done) {
+		if (!tab->scanning && tab->next == batch) {
+			tab->scanning = true;
+			tab->next = NULL;
+			o_unlock(flight_mutex);
+
+			scan(batch->queries, batch->num);
+
+			o_lock(flight_mutex);
+			batch->done = true;
+			tab->scanning = false;
+			pthread_cond_broadcast(&scan_cond);
+			break;
+		}
+
+		pthread_cond_wait(&scan_cond, &flight_mutex);
+	}
+
+	if (--batch->refcount == 0) {
+		xfree(batch->queries);
+		xfree(batch);
+	}
+
+	o_unlock(flight_mutex);
+}
+
+#else
+
+uid_t flight_get_user(	in_port_t lport __notused,
+						in_port_t fport __notused,
+						struct sockaddr_storage *laddr __notused,
+						struct sockaddr_storage *faddr __notused,
+						uid_t (*lookup)(void *data),
+						void *data)
+{
+	return lookup(data);
+}
+
+void flight_scan(	int table __notused,
+					struct flight_query *query,
+					void (*scan)(struct flight_query **queries, size_t num))
+{
+	query->found = false;
+	query->uid = MISSING_UID;
+	scan(&query, 1);
+}
+
+#endif
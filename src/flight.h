@@ -0,0 +1,60 @@
+/*
+** flight.h - oidentd coalescing of concurrent lookups.
+** Copyright (c) 2019      Janik Rabe  <oidentd@janikrabe.com>
+**
+** This program is free software; you can redistribute it and/or modify
+** it under the terms of the GNU General Public License, version 2,
+** as published by the Free Software Foundation.
+**
+** This program is distributed in the hope that it will be useful,
+** but WITHOUT ANY WARRANTY; without even the implied warranty of
+** MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+** GNU General Public License for more details.
+**
+** You should have received a copy of the GNU General Public License
+** along with this program; if not, write to the Free Software
+** Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA
+*/
+
+#ifndef __OIDENTD_FLIGHT_H
+#define __OIDENTD_FLIGHT_H
+
+#define FLIGHT_HASH_SIZE	64
+
+/*
+** The tables of connections that are scanned for several lookups at once.
+*/
+
+enum {
+	FLIGHT_TCP4,
+	FLIGHT_TCP6,
+	FLIGHT_TABLES
+};
+
+/*
+** A lookup of the connection (lport, fport) between "laddr" and "faddr"
+** in one of the tables.  The ports are in host byte order.  The scan
+** sets "found" once it has seen the connection's entry, and stores its
+** owner in "uid," which is MISSING_UID otherwise.
+*/
+
+struct flight_query {
+	in_port_t lport;
+	in_port_t fport;
+	struct sockaddr_storage *laddr;
+	struct sockaddr_storage *faddr;
+	bool found;
+	uid_t uid;
+};
+
+uid_t flight_get_user(	in_port_t lport,
+						in_port_t fport,
+						struct sockaddr_storage *laddr,
+						struct sockaddr_storage *faddr,
+						uid_t (*lookup)(void *data),
+						void *data);
+void flight_scan(	int table,
+					struct flight_query *query,
+					void (*scan)(struct flight_query **queries, size_t num));
+
+#endif
@@ -23,14 +23,14 @@
 #include <unistd.h>
 #include <stdio.h>
 #include <stdlib.h>
-#include <signal.h>
-#include <setjmp.h>
+#include <fcntl.h>
 #include <syslog.h>
 #include <string.h>
 #include <errno.h>
 #include <pwd.h>
+#include <poll.h>
 #include <sys/types.h>
-#include <sys/wait.h>
+#include <sys/time.h>
 #include <sys/socket.h>
 #include <netinet/in.h>
 #include <arpa/inet.h>
@@ -41,102 +41,382 @@
 #include "inet_util.h"
 #include "options.h"
 #include "forward.h"
+#include "fwd_cache.h"
+#include "peer.h"
+#include "shed.h"
 
-static sigjmp_buf timebuf;
-static int fsock;
-static void fwd_alarm(int sig) __noreturn;
+extern u_int32_t num_threads;
 
 /*
-** Make an ident request to another machine and return its response,
-** if the request was successful.
+** A request forwarded to one of the hosts a rule names.
 */
 
-int forward_request(const struct sockaddr_storage *host,
-					in_port_t port,
-					in_port_t lport,
-					in_port_t fport,
-					char *reply,
-					size_t len)
-{
+#define CONN_IDLE		0
+#define CONN_CONNECTING	1
+#define CONN_WAITING	2
+#define CONN_DONE		3
+
+struct fwd_conn {
 	struct sockaddr_storage addr;
-	char ipbuf[MAX_IPLEN];
-	char user[512];
+	int fd;
+	int state;
+	size_t len;
 	char buf[1024];
+};
+
+static long elapsed_ms(const struct timeval *start);
+static int forward_peer(	struct sockaddr_storage *host,
+							in_port_t lport,
+							in_port_t fport,
+							char *reply,
+							size_t len);
+static int fwd_conn_start(struct fwd_conn *conn, in_port_t lport, in_port_t fport);
+static int fwd_conn_read(struct fwd_conn *conn);
+static void fwd_conn_close(struct fwd_conn *conn);
+
+/*
+** Returns the number of milliseconds since "start."
+*/
+
+static long elapsed_ms(const struct timeval *start) {
+	struct timeval now;
+
+	gettimeofday(&now, NULL);
+
+	return (now.tv_sec - start->tv_sec) * 1000 +
+		(now.tv_usec - start->tv_usec) / 1000;
+}
+
+/*
+** Ask "host" using the peer protocol.
+** Returns 0 if the host replied with a user ID, -1 if it did not, or
+** PEER_UNSUPPORTED if it should be asked using RFC 1413 instead.
+*/
+
+static int forward_peer(	struct sockaddr_storage *host,
+							in_port_t lport,
+							in_port_t fport,
+							char *reply,
+							size_t len)
+{
+	int ret = peer_request(host, lport, fport, reply, len);
+
+	switch (ret) {
+		case 0:
+			fwd_target_result(host, true);
+			fwd_cache_put(host, lport, fport, reply);
+			return 0;
+
+		case PEER_UNSUPPORTED:
+			return PEER_UNSUPPORTED;
+
+		default:
+			fwd_target_result(host, ret != PEER_FAILED);
+			return -1;
+	}
+}
+
+/*
+** Start connecting to the host of "conn," sending the query as soon as
+** the connection is established.
+** Returns 0 on success, -1 if the host can't be asked.
+*/
 
-	sin_copy(&addr, host);
-	sin_set_port(htons(port), &addr);
+static int fwd_conn_start(struct fwd_conn *conn, in_port_t lport, in_port_t fport) {
+	char ipbuf[MAX_IPLEN];
+	int flags;
 
-	fsock = socket(addr.ss_family, SOCK_STREAM, 0);
-	if (fsock == -1) {
+	conn->fd = socket(conn->addr.ss_family, SOCK_STREAM, 0);
+	if (conn->fd == -1) {
 		debug("socket: %s", strerror(errno));
 		return -1;
 	}
 
-	if (sigsetjmp(timebuf, 1) != 0) {
-		debug("sigsetjmp: %s", strerror(errno));
+	flags = fcntl(conn->fd, F_GETFL);
+	if (flags == -1 || fcntl(conn->fd, F_SETFL, flags | O_NONBLOCK) == -1) {
+		debug("fcntl: %s", strerror(errno));
+		fwd_conn_close(conn);
 		return -1;
 	}
 
-	signal(SIGALRM, fwd_alarm);
-
-	/*
-	** Five seconds should be plenty, seeing as we're forwarding to a machine
-	** on a local network.
-	*/
-
-	alarm(5);
-
-	if (connect(fsock, (struct sockaddr *) &addr, (socklen_t) sin_len(&addr)) != 0) {
-		get_ip(&addr, ipbuf, sizeof(ipbuf));
+	if (connect(conn->fd, (struct sockaddr *) &conn->addr,
+			(socklen_t) sin_len(&conn->addr)) == 0)
+	{
+		conn->state = CONN_WAITING;
+	} else if (errno == EINPROGRESS) {
+		conn->state = CONN_CONNECTING;
+		return 0;
+	} else {
+		get_ip(&conn->addr, ipbuf, sizeof(ipbuf));
 		debug("connect to %s:%d: %s",
-			ipbuf, ntohs(sin_port(&addr)), strerror(errno));
-		goto out_fail;
-	}
+			ipbuf, ntohs(sin_port(&conn->addr)), strerror(errno));
 
-	if (sockprintf(fsock, "%d,%d\r\n", lport, fport) < 1) {
-		debug("write: %s", strerror(errno));
-		goto out_fail;
+		fwd_target_result(&conn->addr, false);
+		fwd_conn_close(conn);
+		return -1;
 	}
 
-	if (!sock_read(fsock, buf, sizeof(buf))) {
-		debug("read(%d): %s", fsock, strerror(errno));
-		goto out_fail;
+	if (sockprintf(conn->fd, "%d,%d\r\n", lport, fport) < 1) {
+		debug("write: %s", strerror(errno));
+		fwd_target_result(&conn->addr, false);
+		fwd_conn_close(conn);
+		return -1;
 	}
 
-	/*
-	** Don't time out once we've finished processing the request.
-	*/
+	return 0;
+}
 
-	alarm(0);
-	close(fsock);
+/*
+** Read the response of the host of "conn."
+** Returns 0 once a line has been received, 1 if more data is expected, or
+** -1 on failure.
+*/
 
-	if (sscanf(buf, "%*d , %*d : USERID :%*[^:]:%511s", user) != 1) {
-		char *p = strchr(buf, '\r');
+static int fwd_conn_read(struct fwd_conn *conn) {
+	ssize_t ret;
 
-		if (p)
-			*p = '\0';
+	ret = read(conn->fd, conn->buf + conn->len, sizeof(conn->buf) - conn->len - 1);
+	if (ret == -1) {
+		if (errno == EAGAIN || errno == EWOULDBLOCK || errno == EINTR)
+			return 1;
 
-		get_ip(&addr, ipbuf, sizeof(ipbuf));
-		debug("[%s] Remote response: \"%s\"", ipbuf, buf);
+		debug("read(%d): %s", conn->fd, strerror(errno));
 		return -1;
 	}
 
-	xstrncpy(reply, user, len);
-	return 0;
+	if (ret == 0)
+		return conn->len > 0 ? 0 : -1;
+
+	conn->len += ret;
+	conn->buf[conn->len] = '\0';
+
+	if (!strchr(conn->buf, '\n') && conn->len < sizeof(conn->buf) - 1)
+		return 1;
 
-out_fail:
-	alarm(0);
-	close(fsock);
-	return -1;
+	return 0;
 }
 
 /*
-** Handle the timeout of a forward request.
+** Close the connection of "conn," if it is open.
 */
 
-static void fwd_alarm(int sig) {
-	o_log(LOG_INFO, "Forward timed out");
-	close(fsock);
-	siglongjmp(timebuf, sig);
+static void fwd_conn_close(struct fwd_conn *conn) {
+	if (conn->fd != -1)
+		close(conn->fd);
+
+	conn->fd = -1;
+	conn->state = CONN_DONE;
 }
 
+/*
+** Make an ident request to the "num" hosts in "hosts," listening on the
+** corresponding ports in "ports," and return the first USERID response.
+**
+** The hosts are asked in order.  If a host has not answered after
+** FORWARD_HEDGE_DELAY milliseconds, or has failed, the next one is asked
+** as well, without giving up on the first.  Once a host has answered, the
+** requests to the others are abandoned.  No more than FORWARD_TIMEOUT
+** seconds are spent in total; socket timeouts are used rather than
+** alarm(2) so forwarding works the same when requests are served by
+** threads.
+**
+** Recent replies are answered from the cache, and hosts that keep failing
+** are not asked for a while.  Requests forwarded to a single host use the
+** peer protocol if it is enabled and the host speaks it.
+*/
+
+int forward_request(const struct sockaddr_storage *hosts,
+					const in_port_t *ports,
+					size_t num,
+					in_port_t lport,
+					in_port_t fport,
+					char *reply,
+					size_t len)
+{
+	struct fwd_conn conns[MAX_FORWARD_TARGETS];
+	struct timeval start;
+	char ipbuf[MAX_IPLEN];
+	char user[512];
+	size_t launched = 0;
+	size_t checked = 0;
+	size_t active = 0;
+	long next_launch = 0;
+	int ret = -1;
+	size_t i;
+
+	num = MIN(num, MAX_FORWARD_TARGETS);
+
+	for (i = 0; i < num; ++i) {
+		struct fwd_conn *conn = &conns[i];
+
+		sin_copy(&conn->addr, &hosts[i]);
+		sin_set_port(htons(ports[i]), &conn->addr);
+		conn->fd = -1;
+		conn->state = CONN_IDLE;
+		conn->len = 0;
+
+		if (fwd_cache_get(&conn->addr, lport, fport, reply, len) == 0)
+			return 0;
+	}
+
+	/* only cached replies are used while oidentd is overloaded */
+	if (shed_active()) {
+		debug("Not forwarding request: overloaded");
+		return -1;
+	}
+
+	/*
+	** Peer sessions can only be shared between requests served by threads
+	** of the same process.
+	*/
+
+	if (num == 1 && opt_enabled(PEER) && num_threads > 0) {
+		if (!fwd_target_allow(&conns[0].addr)) {
+			get_ip(&conns[0].addr, ipbuf, sizeof(ipbuf));
+			debug("Not forwarding to %s: host is not responding", ipbuf);
+			return -1;
+		}
+
+		ret = forward_peer(&conns[0].addr, lport, fport, reply, len);
+		if (ret != PEER_UNSUPPORTED)
+			return ret;
+
+		/* don't count the fallback as a second request */
+		checked = 1;
+		ret = -1;
+	}
+
+	gettimeofday(&start, NULL);
+
+	for (;;) {
+		struct pollfd pfds[MAX_FORWARD_TARGETS];
+		long now = elapsed_ms(&start);
+		long wait;
+
+		while (launched < num && (active == 0 || now >= next_launch)) {
+			struct fwd_conn *conn = &conns[launched++];
+
+			if (launched > checked && !fwd_target_allow(&conn->addr)) {
+				get_ip(&conn->addr, ipbuf, sizeof(ipbuf));
+				debug("Not forwarding to %s: host is not responding", ipbuf);
+				conn->state = CONN_DONE;
+				continue;
+			}
+
+			if (fwd_conn_start(conn, lport, fport) == 0) {
+				next_launch = now + FORWARD_HEDGE_DELAY;
+				++active;
+				break;
+			}
+		}
+
+		if (active == 0)
+			break;
+
+		wait = FORWARD_TIMEOUT * 1000 - now;
+		if (wait <= 0) {
+			o_log(LOG_INFO, "Forward timed out");
+			break;
+		}
+
+		if (launched < num)
+			wait = MIN(wait, next_launch - now);
+
+		/*
+		** Worker threads may hold descriptors beyond FD_SETSIZE, so
+		** select() can't be used here.
+		*/
+
+		for (i = 0; i < launched; ++i) {
+			pfds[i].fd = -1;
+			pfds[i].events = 0;
+			pfds[i].revents = 0;
+
+			if (conns[i].state == CONN_CONNECTING) {
+				pfds[i].fd = conns[i].fd;
+				pfds[i].events = POLLOUT;
+			} else if (conns[i].state == CONN_WAITING) {
+				pfds[i].fd = conns[i].fd;
+				pfds[i].events = POLLIN;
+			}
+		}
+
+		if (poll(pfds, launched, (int) wait) <= 0)
+			continue;
+
+		for (i = 0; i < launched; ++i) {
+			struct fwd_conn *conn = &conns[i];
+
+			if (pfds[i].revents == 0)
+				continue;
+
+			if (conn->state == CONN_CONNECTING) {
+				int err;
+				socklen_t errlen = sizeof(err);
+
+				if (getsockopt(conn->fd, SOL_SOCKET, SO_ERROR, &err, &errlen) != 0)
+					err = errno;
+
+				if (err == 0 &&
+					sockprintf(conn->fd, "%d,%d\r\n", lport, fport) < 1)
+				{
+					err = errno;
+				}
+
+				if (err != 0) {
+					get_ip(&conn->addr, ipbuf, sizeof(ipbuf));
+					debug("connect to %s:%d: %s",
+						ipbuf, ntohs(sin_port(&conn->addr)), strerror(err));
+
+					fwd_target_result(&conn->addr, false);
+					fwd_conn_close(conn);
+					--active;
+					continue;
+				}
+
+				conn->state = CONN_WAITING;
+			} else if (conn->state == CONN_WAITING) {
+				int status = fwd_conn_read(conn);
+
+				if (status == 1)
+					continue;
+
+				fwd_target_result(&conn->addr, status == 0);
+				fwd_conn_close(conn);
+				--active;
+
+				if (status != 0)
+					continue;
+
+				if (sscanf(conn->buf, "%*d , %*d : USERID :%*[^:]:%511s", user) == 1) {
+					fwd_cache_put(&conn->addr, lport, fport, user);
+					xstrncpy(reply, user, len);
+					ret = 0;
+					goto out;
+				} else {
+					char *p = strchr(conn->buf, '\r');
+
+					if (p)
+						*p = '\0';
+
+					get_ip(&conn->addr, ipbuf, sizeof(ipbuf));
+					debug("[%s] Remote response: \"%s\"", ipbuf, conn->buf);
+				}
+			}
+		}
+	}
+
+out:
+	/* hosts that were still being asked when time ran out have failed */
+	for (i = 0; i < launched; ++i) {
+		if (conns[i].state == CONN_DONE)
+			continue;
+
+		if (ret != 0)
+			fwd_target_result(&conns[i].addr, false);
+
+		fwd_conn_close(&conns[i]);
+	}
+
+	return ret;
+}
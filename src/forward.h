@@ -21,8 +21,9 @@
 #ifndef __OIDENTD_FORWARD_H
 #define __OIDENTD_FORWARD_H
 
-int forward_request(const struct sockaddr_storage *host,
-					in_port_t port,
+int forward_request(const struct sockaddr_storage *hosts,
+					const in_port_t *ports,
+					size_t num,
 					in_port_t lport,
 					in_port_t fport,
 					char *reply,
@@ -0,0 +1,63 @@
+/*
+** fuzz.h - oidentd entry points for fuzzing harnesses.
+** Copyright (c) 2019      Janik Rabe  <oidentd@janikrabe.com>
+**
+** This program is free software; you can redistribute it and/or modify
+** it under the terms of the GNU General Public License, version 2,
+** as published by the Free Software Foundation.
+**
+** This program is distributed in the hope that it will be useful,
+** but WITHOUT ANY WARRANTY; without even the implied warranty of
+** MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+** GNU General Public License for more details.
+**
+** You should have received a copy of the GNU General Public License
+** along with this program; if not, write to the Free Software
+** Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA
+*/
+
+#ifndef __OIDENTD_FUZZ_H
+#define __OIDENTD_FUZZ_H
+
+#ifdef FUZZING_BUILD_MODE_UNSAFE_FOR_PRODUCTION
+
+/*
+** The connection that fuzzed queries and files are looked up for.  The
+** ports are in host byte order.
+*/
+
+#define FUZZ_LADDR		"127.0.0.1"
+#define FUZZ_FADDR		"192.0.2.1"
+#define FUZZ_LADDR6		"::1"
+#define FUZZ_FADDR6		"2001:db8::1"
+#define FUZZ_LPORT		6667
+#define FUZZ_FPORT		49152
+
+/*
+** Search "fp," in the format of /proc/net/tcp and /proc/net/tcp6, for
+** the owner of the fuzzed connection.
+*/
+
+void fuzz_proc_net_tcp(FILE *fp);
+
+#if MASQ_SUPPORT
+
+/*
+** Search "fp," in each of the supported connection tracking formats, for
+** the fuzzed connection.
+*/
+
+void fuzz_conntrack(FILE *fp);
+
+/*
+** Search "fp," in the format of the masquerading map, for the entry of
+** the fuzzed querying host.
+*/
+
+void fuzz_masq_map(FILE *fp);
+
+#endif
+
+#endif
+
+#endif
@@ -0,0 +1,354 @@
+/*
+** fwd_cache.c - oidentd forwarding target health and reply cache.
+** Copyright (c) 2019      Janik Rabe  <oidentd@janikrabe.com>
+**
+** This program is free software; you can redistribute it and/or modify
+** it under the terms of the GNU General Public License, version 2,
+** as published by the Free Software Foundation.
+**
+** This program is distributed in the hope that it will be useful,
+** but WITHOUT ANY WARRANTY; without even the implied warranty of
+** MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+** GNU General Public License for more details.
+**
+** You should have received a copy of the GNU General Public License
+** along with this program; if not, write to the Free Software
+** Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA
+*/
+
+#include <config.h>
+
+#include <unistd.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <syslog.h>
+#include <time.h>
+#include <pwd.h>
+#include <sys/types.h>
+#include <sys/mman.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+
+#include "oidentd.h"
+#include "util.h"
+#include "missing.h"
+#include "inet_util.h"
+#include "fwd_cache.h"
+
+#if THREAD_SUPPORT
+#	include <pthread.h>
+#endif
+
+#if !defined MAP_ANONYMOUS && defined MAP_ANON
+#	define MAP_ANONYMOUS MAP_ANON
+#endif
+
+/*
+** A host requests are forwarded to.  After FWD_FAIL_THRESHOLD consecutive
+** failures, requests to the host fail immediately until "open_until."
+** After that, a single request is let through as a probe; if it fails,
+** the backoff period is doubled, up to FWD_BACKOFF_MAX seconds.
+*/
+
+struct fwd_target {
+	struct sockaddr_storage addr;
+	u_int32_t failures;
+	time_t open_until;
+	time_t backoff;
+	time_t last_used;
+};
+
+/*
+** A reply returned by a host for the connection (lport, fport).
+*/
+
+struct fwd_entry {
+	struct sockaddr_storage target;
+	in_port_t lport;
+	in_port_t fport;
+	time_t expires;
+	char reply[MAX_ULEN];
+};
+
+/*
+** Children serving connections in separate processes share this state,
+** so it is kept in memory that is shared across fork(2).
+*/
+
+struct fwd_state {
+#if THREAD_SUPPORT
+	pthread_mutex_t lock;
+#endif
+	struct fwd_target targets[FWD_TARGETS];
+	struct fwd_entry cache[FWD_CACHE_SIZE];
+};
+
+static struct fwd_state *state;
+
+static void fwd_lock(void);
+static void fwd_unlock(void);
+static bool fwd_addr_equal(	struct sockaddr_storage *a,
+							struct sockaddr_storage *b);
+static struct fwd_entry *fwd_cache_slot(	struct sockaddr_storage *target,
+										in_port_t lport,
+										in_port_t fport);
+static struct fwd_target *fwd_target_find(struct sockaddr_storage *target);
+
+/*
+** Lock the shared state.  A process that was killed while holding the
+** lock (for instance, because its request timed out) does not leave it
+** locked for everyone else if robust mutexes are supported.
+*/
+
+static void fwd_lock(void) {
+#if THREAD_SUPPORT
+	int ret = pthread_mutex_lock(&state->lock);
+
+#	ifdef HAVE_PTHREAD_MUTEX_CONSISTENT
+	if (ret == EOWNERDEAD)
+		pthread_mutex_consistent(&state->lock);
+#	else
+	(void) ret;
+#	endif
+#endif
+}
+
+static void fwd_unlock(void) {
+#if THREAD_SUPPORT
+	pthread_mutex_unlock(&state->lock);
+#endif
+}
+
+/*
+** Returns true if "a" and "b" refer to the same address and port.
+*/
+
+static bool fwd_addr_equal(	struct sockaddr_storage *a,
+							struct sockaddr_storage *b)
+{
+	return a->ss_family == b->ss_family &&
+		sin_port(a) == sin_port(b) && sin_equal(a, b);
+}
+
+/*
+** Set up the shared state.  This must be called before any processes or
+** threads that forward requests are started.
+** Returns 0 on success, -1 on failure.
+*/
+
+int fwd_cache_init(void) {
+#if THREAD_SUPPORT
+	pthread_mutexattr_t attr;
+#endif
+	void *map;
+
+#if THREAD_SUPPORT && defined MAP_ANONYMOUS
+	map = mmap(NULL, sizeof(struct fwd_state), PROT_READ | PROT_WRITE,
+			MAP_SHARED | MAP_ANONYMOUS, -1, 0);
+	if (map == MAP_FAILED) {
+		debug("mmap: %s", strerror(errno));
+		return -1;
+	}
+
+	memset(map, 0, sizeof(struct fwd_state));
+#else
+	/* without a process-shared lock, each process keeps its own state */
+	map = xcalloc(1, sizeof(struct fwd_state));
+#endif
+
+	state = map;
+
+#if THREAD_SUPPORT
+	pthread_mutexattr_init(&attr);
+	pthread_mutexattr_setpshared(&attr, PTHREAD_PROCESS_SHARED);
+#	ifdef HAVE_PTHREAD_MUTEX_CONSISTENT
+	pthread_mutexattr_setrobust(&attr, PTHREAD_MUTEX_ROBUST);
+#	endif
+	pthread_mutex_init(&state->lock, &attr);
+	pthread_mutexattr_destroy(&attr);
+#endif
+
+	return 0;
+}
+
+/*
+** Returns the cache slot for a reply from "target" for (lport, fport).
+*/
+
+static struct fwd_entry *fwd_cache_slot(	struct sockaddr_storage *target,
+										in_port_t lport,
+										in_port_t fport)
+{
+	const unsigned char *p = sin_addr(target);
+	unsigned int hash = 5381;
+	size_t i;
+
+	for (i = 0; i < sin_addr_len(target); ++i)
+		hash = hash * 33 + p[i];
+
+	hash = hash * 33 + sin_port(target);
+	hash = hash * 33 + lport;
+	hash = hash * 33 + fport;
+
+	return &state->cache[hash % FWD_CACHE_SIZE];
+}
+
+/*
+** Copy a cached reply from "target" for (lport, fport) to "reply."
+** Returns 0 if a reply was found, -1 otherwise.
+*/
+
+int fwd_cache_get(	struct sockaddr_storage *target,
+					in_port_t lport,
+					in_port_t fport,
+					char *reply,
+					size_t len)
+{
+	struct fwd_entry *entry;
+	int ret = -1;
+
+	if (!state)
+		return -1;
+
+	fwd_lock();
+
+	entry = fwd_cache_slot(target, lport, fport);
+	if (entry->expires > time(NULL) && entry->lport == lport &&
+		entry->fport == fport && fwd_addr_equal(&entry->target, target))
+	{
+		xstrncpy(reply, entry->reply, len);
+		ret = 0;
+	}
+
+	fwd_unlock();
+	return ret;
+}
+
+/*
+** Cache the reply "reply" from "target" for (lport, fport) for
+** FWD_CACHE_TTL seconds.
+*/
+
+void fwd_cache_put(	struct sockaddr_storage *target,
+					in_port_t lport,
+					in_port_t fport,
+					const char *reply)
+{
+	struct fwd_entry *entry;
+
+	if (!state)
+		return;
+
+	fwd_lock();
+
+	entry = fwd_cache_slot(target, lport, fport);
+	memcpy(&entry->target, target, sizeof(entry->target));
+	entry->lport = lport;
+	entry->fport = fport;
+	entry->expires = time(NULL) + FWD_CACHE_TTL;
+	xstrncpy(entry->reply, reply, sizeof(entry->reply));
+
+	fwd_unlock();
+}
+
+/*
+** Find the health record of "target," replacing the least recently used
+** record if there is none.  Must be called with the lock held.
+*/
+
+static struct fwd_target *fwd_target_find(struct sockaddr_storage *target) {
+	struct fwd_target *oldest = &state->targets[0];
+	size_t i;
+
+	for (i = 0; i < FWD_TARGETS; ++i) {
+		struct fwd_target *cur = &state->targets[i];
+
+		if (cur->last_used != 0 && fwd_addr_equal(&cur->addr, target))
+			return cur;
+
+		if (cur->last_used < oldest->last_used)
+			oldest = cur;
+	}
+
+	memset(oldest, 0, sizeof(*oldest));
+	memcpy(&oldest->addr, target, sizeof(oldest->addr));
+
+	return oldest;
+}
+
+/*
+** Returns false if requests to "target" should fail immediately because
+** it has failed repeatedly.  Once the backoff period has expired, the
+** caller of the first request to be allowed is expected to report its
+** result with fwd_target_result().
+*/
+
+bool fwd_target_allow(struct sockaddr_storage *target) {
+	struct fwd_target *cur;
+	time_t now = time(NULL);
+	bool ret = true;
+
+	if (!state)
+		return true;
+
+	fwd_lock();
+
+	cur = fwd_target_find(target);
+	cur->last_used = now;
+
+	if (cur->failures >= FWD_FAIL_THRESHOLD) {
+		if (now < cur->open_until)
+			ret = false;
+		else {
+			/* let this request probe the host; hold off the others */
+			cur->open_until = now + FORWARD_TIMEOUT;
+		}
+	}
+
+	fwd_unlock();
+	return ret;
+}
+
+/*
+** Record whether a request to "target" was answered.
+*/
+
+void fwd_target_result(struct sockaddr_storage *target, bool ok) {
+	struct fwd_target *cur;
+	time_t now = time(NULL);
+	char ipbuf[MAX_IPLEN];
+
+	if (!state)
+		return;
+
+	fwd_lock();
+
+	cur = fwd_target_find(target);
+	cur->last_used = now;
+
+	if (ok) {
+		if (cur->failures >= FWD_FAIL_THRESHOLD) {
+			get_ip(target, ipbuf, sizeof(ipbuf));
+			o_log(LOG_INFO, "Forwarding to %s resumed", ipbuf);
+		}
+
+		cur->failures = 0;
+		cur->backoff = 0;
+	} else if (++cur->failures >= FWD_FAIL_THRESHOLD) {
+		if (cur->backoff == 0)
+			cur->backoff = FWD_BACKOFF;
+		else if (cur->failures > FWD_FAIL_THRESHOLD)
+			cur->backoff = MIN(cur->backoff * 2, FWD_BACKOFF_MAX);
+
+		cur->open_until = now + cur->backoff;
+
+		get_ip(target, ipbuf, sizeof(ipbuf));
+		o_log(LOG_INFO, "Forwarding to %s failed %u times; "
+			"suspending it for %ld seconds",
+			ipbuf, cur->failures, (long) cur->backoff);
+	}
+
+	fwd_unlock();
+}
@@ -0,0 +1,43 @@
+/*
+** fwd_cache.h - oidentd forwarding target health and reply cache.
+** Copyright (c) 2019      Janik Rabe  <oidentd@janikrabe.com>
+**
+** This program is free software; you can redistribute it and/or modify
+** it under the terms of the GNU General Public License, version 2,
+** as published by the Free Software Foundation.
+**
+** This program is distributed in the hope that it will be useful,
+** but WITHOUT ANY WARRANTY; without even the implied warranty of
+** MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+** GNU General Public License for more details.
+**
+** You should have received a copy of the GNU General Public License
+** along with this program; if not, write to the Free Software
+** Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA
+*/
+
+#ifndef __OIDENTD_FWD_CACHE_H
+#define __OIDENTD_FWD_CACHE_H
+
+/*
+** The number of forwarding targets whose health is tracked, and the
+** number of forwarded replies that are cached.
+*/
+
+#define FWD_TARGETS		64
+#define FWD_CACHE_SIZE	256
+
+int fwd_cache_init(void);
+int fwd_cache_get(	struct sockaddr_storage *target,
+					in_port_t lport,
+					in_port_t fport,
+					char *reply,
+					size_t len);
+void fwd_cache_put(	struct sockaddr_storage *target,
+					in_port_t lport,
+					in_port_t fport,
+					const char *reply);
+bool fwd_target_allow(struct sockaddr_storage *target);
+void fwd_target_result(struct sockaddr_storage *target, bool ok);
+
+#endif
@@ -0,0 +1,289 @@
+/*
+** handover.c - oidentd listening socket handover.
+** Copyright (c) 2019      Janik Rabe  <oidentd@janikrabe.com>
+**
+** This program is free software; you can redistribute it and/or modify
+** it under the terms of the GNU General Public License, version 2,
+** as published by the Free Software Foundation.
+**
+** This program is distributed in the hope that it will be useful,
+** but WITHOUT ANY WARRANTY; without even the implied warranty of
+** MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+** GNU General Public License for more details.
+**
+** You should have received a copy of the GNU General Public License
+** along with this program; if not, write to the Free Software
+** Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA
+*/
+
+#include <config.h>
+
+#include <unistd.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <fcntl.h>
+#include <string.h>
+#include <errno.h>
+#include <syslog.h>
+#include <pwd.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <sys/time.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <netinet/in.h>
+
+#include "oidentd.h"
+#include "util.h"
+#include "missing.h"
+#include "inet_util.h"
+#include "handover.h"
+
+/*
+** A running instance hands its listening sockets to a new one over a
+** UNIX socket.  The new instance connects to the control socket of the
+** running one and receives a single message: the number of sockets,
+** followed by the sockets themselves as SCM_RIGHTS ancillary data.  It
+** then binds a control socket of its own in the same place, so that it
+** can be replaced in turn, and the old instance stops accepting
+** connections and exits once it has served the ones it already accepted.
+**
+** Since the listening sockets are shared rather than closed and reopened,
+** connections waiting to be accepted are never lost.
+*/
+
+static int handover_addr(const char *path, struct sockaddr_un *sun);
+
+/*
+** Fill in the address of the control socket at "path."
+** Returns 0 on success, -1 if the path is too long.
+*/
+
+static int handover_addr(const char *path, struct sockaddr_un *sun) {
+	memset(sun, 0, sizeof(*sun));
+	sun->sun_family = AF_UNIX;
+
+	if (strlen(path) >= sizeof(sun->sun_path)) {
+		o_log(LOG_CRIT, "Control socket path too long: %s", path);
+		return -1;
+	}
+
+	xstrncpy(sun->sun_path, path, sizeof(sun->sun_path));
+	return 0;
+}
+
+/*
+** Take over the listening sockets of the instance whose control socket is
+** at "path."  Returns a -1-terminated array of sockets, or NULL if no
+** instance is running there or the handover failed.
+*/
+
+int *handover_receive(const char *path) {
+	struct sockaddr_un sun;
+	struct msghdr msg;
+	struct cmsghdr *cmsg;
+	struct iovec iov;
+	union {
+		struct cmsghdr hdr;
+		char buf[CMSG_SPACE(HANDOVER_MAX_FDS * sizeof(int))];
+	} control;
+	u_int32_t num;
+	size_t nfds;
+	int *fds;
+	int sock;
+	size_t i;
+
+	if (handover_addr(path, &sun) != 0)
+		return NULL;
+
+	sock = socket(AF_UNIX, SOCK_STREAM, 0);
+	if (sock == -1) {
+		debug("socket: %s", strerror(errno));
+		return NULL;
+	}
+
+	if (connect(sock, (struct sockaddr *) &sun, sizeof(sun)) != 0) {
+		/* no instance is running */
+		debug("connect: %s: %s", path, strerror(errno));
+		close(sock);
+		return NULL;
+	}
+
+	sock_set_timeout(sock, FORWARD_TIMEOUT);
+
+	memset(&msg, 0, sizeof(msg));
+	memset(&control, 0, sizeof(control));
+
+	iov.iov_base = &num;
+	iov.iov_len = sizeof(num);
+	msg.msg_iov = &iov;
+	msg.msg_iovlen = 1;
+	msg.msg_control = control.buf;
+	msg.msg_controllen = sizeof(control.buf);
+
+	if (recvmsg(sock, &msg, 0) != (ssize_t) sizeof(num)) {
+		o_log(LOG_CRIT, "Failed to receive listening sockets from %s", path);
+		close(sock);
+		return NULL;
+	}
+
+	close(sock);
+
+	cmsg = CMSG_FIRSTHDR(&msg);
+	if (!cmsg || cmsg->cmsg_level != SOL_SOCKET || cmsg->cmsg_type != SCM_RIGHTS)
+	{
+		o_log(LOG_CRIT, "No listening sockets received from %s", path);
+		return NULL;
+	}
+
+	nfds = (cmsg->cmsg_len - CMSG_LEN(0)) / sizeof(int);
+	fds = xmalloc((nfds + 1) * sizeof(int));
+	memcpy(fds, CMSG_DATA(cmsg), nfds * sizeof(int));
+	fds[nfds] = -1;
+
+	if (nfds == 0 || nfds != num || (msg.msg_flags & MSG_CTRUNC)) {
+		o_log(LOG_CRIT, "Received %lu of %u listening sockets from %s",
+			(unsigned long) nfds, num, path);
+		goto out_fail;
+	}
+
+	for (i = 0; i < nfds; ++i) {
+		int flags;
+
+		fcntl(fds[i], F_SETFD, FD_CLOEXEC);
+
+		/* worker threads of the previous instance use non-blocking sockets */
+		flags = fcntl(fds[i], F_GETFL);
+		if (flags != -1)
+			fcntl(fds[i], F_SETFL, flags & ~O_NONBLOCK);
+	}
+
+	o_log(LOG_INFO, "Took over %lu listening socket(s) from %s",
+		(unsigned long) nfds, path);
+	return fds;
+
+out_fail:
+	for (i = 0; i < nfds; ++i)
+		close(fds[i]);
+
+	xfree(fds);
+	return NULL;
+}
+
+/*
+** Create the control socket at "path," replacing any existing one.  The
+** socket is bound under a temporary name and renamed into place so that
+** there is always a socket to connect to.
+** Returns the socket on success, -1 on failure.
+*/
+
+int handover_listen(const char *path) {
+	struct sockaddr_un sun;
+	char tmp_path[sizeof(sun.sun_path)];
+	mode_t old_umask;
+	int sock;
+	int ret;
+
+	ret = snprintf(tmp_path, sizeof(tmp_path), "%s.%lu",
+			path, (unsigned long) getpid());
+	if (ret < 0 || (size_t) ret >= sizeof(tmp_path)) {
+		o_log(LOG_CRIT, "Control socket path too long: %s", path);
+		return -1;
+	}
+
+	if (handover_addr(tmp_path, &sun) != 0)
+		return -1;
+
+	sock = socket(AF_UNIX, SOCK_STREAM, 0);
+	if (sock == -1) {
+		debug("socket: %s", strerror(errno));
+		return -1;
+	}
+
+	fcntl(sock, F_SETFD, FD_CLOEXEC);
+	unlink(tmp_path);
+
+	/* whoever can connect can take the listening sockets */
+	old_umask = umask(0077);
+	ret = bind(sock, (struct sockaddr *) &sun, sizeof(sun));
+	umask(old_umask);
+
+	if (ret != 0) {
+		o_log(LOG_CRIT, "Failed to bind control socket %s: %s",
+			tmp_path, strerror(errno));
+		close(sock);
+		return -1;
+	}
+
+	if (listen(sock, 1) != 0 || rename(tmp_path, path) != 0) {
+		o_log(LOG_CRIT, "Failed to set up control socket %s: %s",
+			path, strerror(errno));
+		unlink(tmp_path);
+		close(sock);
+		return -1;
+	}
+
+	return sock;
+}
+
+/*
+** Accept a connection on the control socket "ctl_fd" and pass the
+** -1-terminated array of listening sockets "fds" to the new instance.
+** Returns 0 on success, -1 on failure.
+*/
+
+int handover_send(int ctl_fd, const int *fds) {
+	struct msghdr msg;
+	struct cmsghdr *cmsg;
+	struct iovec iov;
+	union {
+		struct cmsghdr hdr;
+		char buf[CMSG_SPACE(HANDOVER_MAX_FDS * sizeof(int))];
+	} control;
+	u_int32_t num = 0;
+	int sock;
+
+	while (fds[num] != -1)
+		++num;
+
+	if (num == 0 || num > HANDOVER_MAX_FDS) {
+		o_log(LOG_CRIT, "Cannot hand over %u listening sockets", num);
+		return -1;
+	}
+
+	sock = accept(ctl_fd, NULL, NULL);
+	if (sock == -1) {
+		debug("accept: %s", strerror(errno));
+		return -1;
+	}
+
+	sock_set_timeout(sock, FORWARD_TIMEOUT);
+
+	memset(&msg, 0, sizeof(msg));
+	memset(&control, 0, sizeof(control));
+
+	iov.iov_base = &num;
+	iov.iov_len = sizeof(num);
+	msg.msg_iov = &iov;
+	msg.msg_iovlen = 1;
+	msg.msg_control = control.buf;
+	msg.msg_controllen = CMSG_SPACE(num * sizeof(int));
+
+	cmsg = CMSG_FIRSTHDR(&msg);
+	cmsg->cmsg_level = SOL_SOCKET;
+	cmsg->cmsg_type = SCM_RIGHTS;
+	cmsg->cmsg_len = CMSG_LEN(num * sizeof(int));
+	memcpy(CMSG_DATA(cmsg), fds, num * sizeof(int));
+
+	if (sendmsg(sock, &msg, 0) != (ssize_t) sizeof(num)) {
+		o_log(LOG_CRIT, "Failed to hand over listening sockets: %s",
+			strerror(errno));
+		close(sock);
+		return -1;
+	}
+
+	close(sock);
+	o_log(LOG_INFO, "Handed over %u listening socket(s)", num);
+
+	return 0;
+}
@@ -0,0 +1,32 @@
+/*
+** handover.h - oidentd listening socket handover.
+** Copyright (c) 2019      Janik Rabe  <oidentd@janikrabe.com>
+**
+** This program is free software; you can redistribute it and/or modify
+** it under the terms of the GNU General Public License, version 2,
+** as published by the Free Software Foundation.
+**
+** This program is distributed in the hope that it will be useful,
+** but WITHOUT ANY WARRANTY; without even the implied warranty of
+** MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+** GNU General Public License for more details.
+**
+** You should have received a copy of the GNU General Public License
+** along with this program; if not, write to the Free Software
+** Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA
+*/
+
+#ifndef __OIDENTD_HANDOVER_H
+#define __OIDENTD_HANDOVER_H
+
+/*
+** The maximum number of listening sockets that can be handed over.
+*/
+
+#define HANDOVER_MAX_FDS	64
+
+int *handover_receive(const char *path);
+int handover_listen(const char *path);
+int handover_send(int ctl_fd, const int *fds);
+
+#endif
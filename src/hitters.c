@@ -0,0 +1,446 @@
+/*
+** hitters.c - oidentd tracking of the most frequent queriers.
+** Copyright (c) 2019      Janik Rabe  <oidentd@janikrabe.com>
+**
+** This program is free software; you can redistribute it and/or modify
+** it under the terms of the GNU General Public License, version 2,
+** as published by the Free Software Foundation.
+**
+** This program is distributed in the hope that it will be useful,
+** but WITHOUT ANY WARRANTY; without even the implied warranty of
+** MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+** GNU General Public License for more details.
+**
+** You should have received a copy of the GNU General Public License
+** along with this program; if not, write to the Free Software
+** Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA
+*/
+
+#include <config.h>
+
+#include <unistd.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <syslog.h>
+#include <time.h>
+#include <pwd.h>
+#include <sys/types.h>
+#include <sys/mman.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
+
+#include "oidentd.h"
+#include "util.h"
+#include "missing.h"
+#include "inet_util.h"
+#include "hitters.h"
+
+#if THREAD_SUPPORT
+#	include <pthread.h>
+#endif
+
+#if !defined MAP_ANONYMOUS && defined MAP_ANON
+#	define MAP_ANONYMOUS MAP_ANON
+#endif
+
+/*
+** The querying hosts, the owners of queried connections, and the queried
+** local ports are counted with the space-saving algorithm: each sketch
+** tracks HITTERS_SIZE keys, and a key that isn't tracked replaces the one
+** with the lowest count, inheriting that count as its possible error.
+** Any key counted more often than the total divided by HITTERS_SIZE is
+** guaranteed to be tracked.  All counts are halved every HITTERS_DECAY
+** seconds, so that the sketches follow the recent load.
+**
+** The sketches are shared by all processes, like the lookup cache.
+*/
+
+#define HITTERS_KEY_LEN	17
+
+enum {
+	HITTER_PEER,
+	HITTER_USER,
+	HITTER_PORT
+};
+
+#if THREAD_SUPPORT && defined MAP_ANONYMOUS
+
+struct hitter {
+	unsigned char key[HITTERS_KEY_LEN];
+	u_int8_t keylen;
+	u_int32_t count;
+	u_int32_t error;
+};
+
+struct sketch {
+	pthread_mutex_t lock;
+	time_t decayed;
+	u_int32_t total;
+	u_int32_t used;
+	struct hitter slots[HITTERS_SIZE];
+};
+
+struct hitters_segment {
+	struct sketch peers;
+	struct sketch users;
+	struct sketch ports;
+};
+
+static struct hitters_segment *segment;
+
+static bool sketch_lock(struct sketch *sketch);
+static void sketch_init(struct sketch *sketch, const pthread_mutexattr_t *attr);
+static void sketch_decay(struct sketch *sketch, time_t now);
+static void sketch_add(struct sketch *sketch, const void *key, size_t keylen);
+static int hitter_cmp(const void *a, const void *b);
+static size_t sketch_top(	struct sketch *sketch,
+							struct hitter *top,
+							u_int32_t *total);
+static size_t peer_key(const struct sockaddr_storage *peer, unsigned char *key);
+static void hitters_log(const char *what, struct sketch *sketch, int kind);
+
+/*
+** Lock a sketch.  As with the lookup cache, a sketch that may have been
+** left locked by a process that was killed is skipped if robust mutexes
+** are not supported.
+** Returns true if the sketch was locked.
+*/
+
+static bool sketch_lock(struct sketch *sketch) {
+#ifdef HAVE_PTHREAD_MUTEX_CONSISTENT
+	int ret = pthread_mutex_lock(&sketch->lock);
+
+	if (ret == EOWNERDEAD) {
+		pthread_mutex_consistent(&sketch->lock);
+		ret = 0;
+	}
+#else
+	int ret = pthread_mutex_trylock(&sketch->lock);
+#endif
+
+	return ret == 0;
+}
+
+static void sketch_init(struct sketch *sketch, const pthread_mutexattr_t *attr) {
+	pthread_mutex_init(&sketch->lock, attr);
+	sketch->decayed = time(NULL);
+}
+
+/*
+** Halve all counts once for every HITTERS_DECAY seconds that have passed,
+** and forget keys whose count drops to zero.  Must be called with the
+** sketch locked.
+*/
+
+static void sketch_decay(struct sketch *sketch, time_t now) {
+	time_t periods = (now - sketch->decayed) / HITTERS_DECAY;
+	u_int32_t i, j;
+
+	if (periods <= 0)
+		return;
+
+	sketch->decayed += periods * HITTERS_DECAY;
+
+	if (periods > 31)
+		periods = 31;
+
+	sketch->total >>= periods;
+
+	for (i = 0, j = 0; i < sketch->used; ++i) {
+		struct hitter *hitter = &sketch->slots[i];
+
+		hitter->count >>= periods;
+		hitter->error >>= periods;
+
+		if (hitter->count > 0)
+			sketch->slots[j++] = *hitter;
+	}
+
+	sketch->used = j;
+}
+
+/*
+** Count one occurrence of "key."
+*/
+
+static void sketch_add(struct sketch *sketch, const void *key, size_t keylen) {
+	struct hitter *min = NULL;
+	u_int32_t i;
+
+	if (!sketch_lock(sketch))
+		return;
+
+	sketch_decay(sketch, time(NULL));
+	++sketch->total;
+
+	for (i = 0; i < sketch->used; ++i) {
+		struct hitter *hitter = &sketch->slots[i];
+
+		if (hitter->keylen == keylen && !memcmp(hitter->key, key, keylen)) {
+			++hitter->count;
+			pthread_mutex_unlock(&sketch->lock);
+			return;
+		}
+
+		if (!min || hitter->count < min->count)
+			min = hitter;
+	}
+
+	if (sketch->used < HITTERS_SIZE) {
+		min = &sketch->slots[sketch->used++];
+		min->count = 0;
+	}
+
+	memcpy(min->key, key, keylen);
+	min->keylen = keylen;
+	min->error = min->count;
+	++min->count;
+
+	pthread_mutex_unlock(&sketch->lock);
+}
+
+static int hitter_cmp(const void *a, const void *b) {
+	const struct hitter *ha = a;
+	const struct hitter *hb = b;
+
+	if (ha->count != hb->count)
+		return ha->count < hb->count ? 1 : -1;
+
+	return 0;
+}
+
+/*
+** Copy the entries of "sketch" to "top," which has room for HITTERS_SIZE
+** entries, most frequent first, and store the total count in "total."
+** Returns the number of entries.
+*/
+
+static size_t sketch_top(	struct sketch *sketch,
+							struct hitter *top,
+							u_int32_t *total)
+{
+	size_t num;
+
+	if (!sketch_lock(sketch))
+		return 0;
+
+	sketch_decay(sketch, time(NULL));
+	num = sketch->used;
+	memcpy(top, sketch->slots, num * sizeof(struct hitter));
+	*total = sketch->total;
+
+	pthread_mutex_unlock(&sketch->lock);
+
+	qsort(top, num, sizeof(struct hitter), hitter_cmp);
+	return num;
+}
+
+/*
+** Store the key of a querying host in "key," which has room for
+** HITTERS_KEY_LEN bytes.
+** Returns the length of the key, or 0 if the host can't be tracked.
+*/
+
+static size_t peer_key(const struct sockaddr_storage *peer, unsigned char *key) {
+	const unsigned char *bytes = cidr_bytes(peer, peer->ss_family);
+	size_t len = peer->ss_family == AF_INET ? 4 : 16;
+
+	if (!bytes)
+		return 0;
+
+	key[0] = peer->ss_family == AF_INET ? 4 : 6;
+	memcpy(key + 1, bytes, len);
+
+	return len + 1;
+}
+
+/*
+** Set up the shared sketches.  This must be called before any processes
+** or threads that count queries are started.
+** Returns 0 on success, -1 on failure.
+*/
+
+int hitters_init(void) {
+	pthread_mutexattr_t attr;
+	void *map;
+
+	map = mmap(NULL, sizeof(struct hitters_segment), PROT_READ | PROT_WRITE,
+			MAP_SHARED | MAP_ANONYMOUS, -1, 0);
+	if (map == MAP_FAILED) {
+		debug("mmap: %s", strerror(errno));
+		return -1;
+	}
+
+	memset(map, 0, sizeof(struct hitters_segment));
+	segment = map;
+
+	pthread_mutexattr_init(&attr);
+	pthread_mutexattr_setpshared(&attr, PTHREAD_PROCESS_SHARED);
+#	ifdef HAVE_PTHREAD_MUTEX_CONSISTENT
+	pthread_mutexattr_setrobust(&attr, PTHREAD_MUTEX_ROBUST);
+#	endif
+
+	sketch_init(&segment->peers, &attr);
+	sketch_init(&segment->users, &attr);
+	sketch_init(&segment->ports, &attr);
+
+	pthread_mutexattr_destroy(&attr);
+	return 0;
+}
+
+/*
+** Count a query from "peer" for a connection on local port "lport."
+*/
+
+void hitters_query(const struct sockaddr_storage *peer, in_port_t lport) {
+	unsigned char key[HITTERS_KEY_LEN];
+	size_t len;
+
+	if (!segment)
+		return;
+
+	len = peer_key(peer, key);
+	if (len > 0)
+		sketch_add(&segment->peers, key, len);
+
+	sketch_add(&segment->ports, &lport, sizeof(lport));
+}
+
+/*
+** Count a query for a connection owned by "uid."
+*/
+
+void hitters_user(uid_t uid) {
+	if (segment)
+		sketch_add(&segment->users, &uid, sizeof(uid));
+}
+
+/*
+** Returns true if "peer" has sent at least HITTERS_HEAVY_SHARE percent of
+** the recent queries.  Only the count the host is guaranteed to have is
+** considered.
+*/
+
+bool hitters_heavy_peer(const struct sockaddr_storage *peer) {
+	unsigned char key[HITTERS_KEY_LEN];
+	struct sketch *sketch;
+	bool ret = false;
+	size_t len;
+	u_int32_t i;
+
+	if (!segment)
+		return false;
+
+	len = peer_key(peer, key);
+	if (len == 0)
+		return false;
+
+	sketch = &segment->peers;
+	if (!sketch_lock(sketch))
+		return false;
+
+	for (i = 0; i < sketch->used; ++i) {
+		struct hitter *hitter = &sketch->slots[i];
+
+		if (hitter->keylen != len || memcmp(hitter->key, key, len) != 0)
+			continue;
+
+		ret = sketch->total >= HITTERS_MIN_QUERIES &&
+			(unsigned long long) (hitter->count - hitter->error) * 100 >=
+			(unsigned long long) sketch->total * HITTERS_HEAVY_SHARE;
+		break;
+	}
+
+	pthread_mutex_unlock(&sketch->lock);
+	return ret;
+}
+
+/*
+** Log the HITTERS_SHOWN most frequent keys of "sketch" on one line, with
+** their estimated counts and shares of the total.
+*/
+
+static void hitters_log(const char *what, struct sketch *sketch, int kind) {
+	struct hitter top[HITTERS_SIZE];
+	char line[HITTERS_SHOWN * (MAX_IPLEN + 32)];
+	size_t off = 0;
+	u_int32_t total;
+	size_t num;
+	size_t i;
+
+	num = sketch_top(sketch, top, &total);
+	if (num == 0 || total == 0)
+		return;
+
+	line[0] = '\0';
+
+	for (i = 0; i < num && i < HITTERS_SHOWN; ++i) {
+		char name[MAX_IPLEN];
+
+		if (kind == HITTER_PEER) {
+			int af = top[i].key[0] == 4 ? AF_INET : AF_INET6;
+
+			if (!inet_ntop(af, top[i].key + 1, name, sizeof(name)))
+				xstrncpy(name, "?", sizeof(name));
+		} else if (kind == HITTER_USER) {
+			uid_t uid;
+
+			memcpy(&uid, top[i].key, sizeof(uid));
+			snprintf(name, sizeof(name), "%lu", (unsigned long) uid);
+		} else {
+			in_port_t port;
+
+			memcpy(&port, top[i].key, sizeof(port));
+			snprintf(name, sizeof(name), "%u", port);
+		}
+
+		off += snprintf(line + off, sizeof(line) - off, "%s%s (%u, %u%%)",
+			i > 0 ? ", " : "", name, top[i].count,
+			(unsigned int) ((unsigned long long) top[i].count * 100 / total));
+
+		if (off >= sizeof(line))
+			break;
+	}
+
+	o_log(LOG_INFO, "Most frequent %s of %u recent queries: %s",
+		what, total, line);
+}
+
+/*
+** Log the most frequent querying hosts, owners, and local ports.
+*/
+
+void hitters_log_stats(void) {
+	if (!segment)
+		return;
+
+	hitters_log("hosts", &segment->peers, HITTER_PEER);
+	hitters_log("users", &segment->users, HITTER_USER);
+	hitters_log("local ports", &segment->ports, HITTER_PORT);
+}
+
+#else
+
+int hitters_init(void) {
+	return -1;
+}
+
+void hitters_query(	const struct sockaddr_storage *peer __notused,
+					in_port_t lport __notused)
+{
+}
+
+void hitters_user(uid_t uid __notused) {
+}
+
+bool hitters_heavy_peer(const struct sockaddr_storage *peer __notused) {
+	return false;
+}
+
+void hitters_log_stats(void) {
+}
+
+#endif
@@ -0,0 +1,28 @@
+/*
+** hitters.h - oidentd tracking of the most frequent queriers.
+** Copyright (c) 2019      Janik Rabe  <oidentd@janikrabe.com>
+**
+** This program is free software; you can redistribute it and/or modify
+** it under the terms of the GNU General Public License, version 2,
+** as published by the Free Software Foundation.
+**
+** This program is distributed in the hope that it will be useful,
+** but WITHOUT ANY WARRANTY; without even the implied warranty of
+** MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+** GNU General Public License for more details.
+**
+** You should have received a copy of the GNU General Public License
+** along with this program; if not, write to the Free Software
+** Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA
+*/
+
+#ifndef __OIDENTD_HITTERS_H
+#define __OIDENTD_HITTERS_H
+
+int hitters_init(void);
+void hitters_query(const struct sockaddr_storage *peer, in_port_t lport);
+void hitters_user(uid_t uid);
+bool hitters_heavy_peer(const struct sockaddr_storage *peer);
+void hitters_log_stats(void);
+
+#endif
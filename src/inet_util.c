@@ -32,9 +32,12 @@
 #include <syslog.h>
 #include <netdb.h>
 #include <pwd.h>
+#include <poll.h>
 #include <sys/types.h>
+#include <sys/time.h>
 #include <sys/socket.h>
 #include <netinet/in.h>
+#include <netinet/tcp.h>
 #include <arpa/inet.h>
 
 #include "oidentd.h"
@@ -42,8 +45,22 @@
 #include "missing.h"
 #include "inet_util.h"
 #include "options.h"
+#include "offload.h"
+
+/*
+** An address lookup run by the offload pool.
+*/
+
+struct addr_job {
+	char *name;
+	int ret;
+	struct sockaddr_storage addr;
+};
 
 static int setup_bind(const struct addrinfo *ai, in_port_t listen_port);
+static int get_addr_direct(const char *hostname, struct sockaddr_storage *addr);
+static void addr_job_run(void *data);
+static void addr_job_free(void *data);
 
 static int setup_bind(const struct addrinfo *ai, in_port_t listen_port) {
 	int ret;
@@ -82,6 +99,17 @@ static int setup_bind(const struct addrinfo *ai, in_port_t listen_port) {
 		return -1;
 	}
 
+#ifdef SO_REUSEPORT
+	/* each pinned worker thread has its own listening sockets */
+	if (opt_enabled(CPU_AFFINITY)) {
+		ret = setsockopt(listenfd, SOL_SOCKET, SO_REUSEPORT, &one, sizeof(one));
+		if (ret != 0) {
+			debug("setsockopt SO_REUSEPORT: %s", strerror(errno));
+			return -1;
+		}
+	}
+#endif
+
 	ret = bind(listenfd, ai->ai_addr, ai->ai_addrlen);
 	if (ret != 0) {
 		debug("bind: %s", strerror(errno));
@@ -96,6 +124,66 @@ static int setup_bind(const struct addrinfo *ai, in_port_t listen_port) {
 	return listenfd;
 }
 
+/*
+** Returns the listening sockets passed by a service manager such as
+** systemd, following the sd_listen_fds(3) protocol, or NULL if none were
+** passed.  The sockets start at file descriptor 3 and are described by the
+** LISTEN_PID and LISTEN_FDS environment variables, which are removed so
+** that they are not inherited.
+*/
+
+int *get_activated_fds(void) {
+	const char *env;
+	unsigned long pid, num;
+	int *fds;
+	char *end;
+	size_t i;
+
+	env = getenv("LISTEN_PID");
+	if (!env)
+		return NULL;
+
+	pid = strtoul(env, &end, 10);
+	if (*end != '\0' || pid != (unsigned long) getpid())
+		return NULL;
+
+	env = getenv("LISTEN_FDS");
+	if (!env)
+		return NULL;
+
+	num = strtoul(env, &end, 10);
+	if (*end != '\0' || num == 0 || num > 64)
+		return NULL;
+
+	unsetenv("LISTEN_PID");
+	unsetenv("LISTEN_FDS");
+	unsetenv("LISTEN_FDNAMES");
+
+	fds = xmalloc((num + 1) * sizeof(int));
+
+	for (i = 0; i < num; ++i) {
+		int fd = LISTEN_FDS_START + i;
+		int type;
+		socklen_t len = sizeof(type);
+
+		if (getsockopt(fd, SOL_SOCKET, SO_TYPE, &type, &len) != 0 ||
+			type != SOCK_STREAM)
+		{
+			o_log(LOG_CRIT, "File descriptor %d is not a stream socket", fd);
+			xfree(fds);
+			return NULL;
+		}
+
+		fcntl(fd, F_SETFD, FD_CLOEXEC);
+		fds[i] = fd;
+	}
+
+	fds[num] = -1;
+
+	o_log(LOG_INFO, "Using %lu listening socket(s) passed by the service manager", num);
+	return fds;
+}
+
 /*
 ** Setup the listening socket(s).
 */
@@ -124,8 +212,7 @@ int *setup_listen(struct sockaddr_storage **listen_addr, in_port_t listen_port)
 					break;
 				default:
 					debug("address family %d not supported", cur->ai_family);
-					free(cur);
-					free(listen_addr[naddr]);
+					xfree(cur);
 					return NULL;
 			}
 
@@ -133,9 +220,8 @@ int *setup_listen(struct sockaddr_storage **listen_addr, in_port_t listen_port)
 			memcpy(cur->ai_addr, listen_addr[naddr], cur->ai_addrlen);
 
 			ret = setup_bind(cur, listen_port);
-			free(cur->ai_addr);
-			free(cur);
-			free(listen_addr[naddr]);
+			xfree(cur->ai_addr);
+			xfree(cur);
 
 			if (ret == -1)
 				return NULL;
@@ -193,6 +279,118 @@ int *setup_listen(struct sockaddr_storage **listen_addr, in_port_t listen_port)
 	return bound_fds;
 }
 
+/*
+** Make reads from and writes to "sock" fail after "secs" seconds.
+** Returns 0 on success, -1 on failure.
+*/
+
+int sock_set_timeout(int sock, u_int32_t secs) {
+	struct timeval tv;
+
+	tv.tv_sec = secs;
+	tv.tv_usec = 0;
+
+	if (setsockopt(sock, SOL_SOCKET, SO_RCVTIMEO, &tv, sizeof(tv)) != 0) {
+		debug("setsockopt SO_RCVTIMEO: %s", strerror(errno));
+		return -1;
+	}
+
+	if (setsockopt(sock, SOL_SOCKET, SO_SNDTIMEO, &tv, sizeof(tv)) != 0) {
+		debug("setsockopt SO_SNDTIMEO: %s", strerror(errno));
+		return -1;
+	}
+
+	return 0;
+}
+
+/*
+** Send the data written to "sock" at once.  Ident exchanges consist of a
+** single request and reply, so there is nothing to gain from waiting to
+** fill a segment.
+** Returns 0 on success, -1 on failure.
+*/
+
+int sock_set_nodelay(int sock) {
+	int one = 1;
+
+	if (setsockopt(sock, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one)) != 0) {
+		debug("setsockopt TCP_NODELAY: %s", strerror(errno));
+		return -1;
+	}
+
+	return 0;
+}
+
+/*
+** Close the connection "sock" to a client that has been answered.
+**
+** The side of a TCP connection that closes first keeps it in TIME_WAIT
+** for a minute or more, which adds up on a busy server and makes socket
+** lookups slower.  Clients normally close the connection once they have
+** read the reply, so they are given "msecs" milliseconds to do so first.
+** Clients that don't are reset if "reset" is set, which leaves no
+** TIME_WAIT state behind either, but may make them lose a reply they
+** haven't read yet.
+*/
+
+void sock_close_wait(int sock, u_int32_t msecs, bool reset) {
+	struct timeval deadline;
+
+	gettimeofday(&deadline, NULL);
+	deadline.tv_sec += msecs / 1000;
+	deadline.tv_usec += (msecs % 1000) * 1000;
+
+	if (deadline.tv_usec >= 1000000) {
+		++deadline.tv_sec;
+		deadline.tv_usec -= 1000000;
+	}
+
+	for (;;) {
+		struct timeval now;
+		struct pollfd pfd;
+		char buf[128];
+		ssize_t len;
+		long left;
+
+		gettimeofday(&now, NULL);
+		left = (deadline.tv_sec - now.tv_sec) * 1000 +
+			(deadline.tv_usec - now.tv_usec) / 1000;
+
+		if (left <= 0)
+			break;
+
+		/* clients of worker threads may have descriptors beyond FD_SETSIZE */
+		pfd.fd = sock;
+		pfd.events = POLLIN;
+		pfd.revents = 0;
+
+		if (poll(&pfd, 1, (int) left) <= 0)
+			break;
+
+		/* anything the client sends after its query is discarded */
+		len = read(sock, buf, sizeof(buf));
+		if (len == 0) {
+			close(sock);
+			return;
+		}
+
+		if (len == -1)
+			break;
+	}
+
+	if (reset) {
+		struct linger linger;
+
+		linger.l_onoff = 1;
+		linger.l_linger = 0;
+
+		if (setsockopt(sock, SOL_SOCKET, SO_LINGER, &linger, sizeof(linger)) != 0)
+			debug("setsockopt SO_LINGER: %s", strerror(errno));
+	}
+
+	close(sock);
+}
+
 /*
 ** Read at most "len" bytes from socket "sock" into "buf".
 */
@@ -287,8 +485,16 @@ inline int get_hostname(struct sockaddr_storage *addr,
 {
 	int ret;
 
+#ifdef FUZZING_BUILD_MODE_UNSAFE_FOR_PRODUCTION
+	/* the cost of fuzzed inputs must not depend on the name service */
+	(void) addr;
+	(void) hostbuf;
+	(void) len;
+	ret = EAI_NONAME;
+#else
 	ret = getnameinfo((struct sockaddr *) addr, sizeof(struct sockaddr_storage),
 					hostbuf, len, NULL, 0, NI_NAMEREQD);
+#endif
 
 	return ret;
 }
@@ -300,10 +506,13 @@ inline int get_hostname(struct sockaddr_storage *addr,
 int get_port(const char *name, in_port_t *port) {
 	struct servent *servent;
 
+	nss_lock();
 	servent = getservbyname(name, "tcp");
-	if (servent) {
+	if (servent)
 		*port = ntohs(servent->s_port);
-	} else {
+	nss_unlock();
+
+	if (!servent) {
 		char *end;
 		long temp_port;
 
@@ -325,7 +534,7 @@ int get_port(const char *name, in_port_t *port) {
 ** Return a network byte ordered IPv4 or IPv6 address.
 */
 
-int get_addr(const char *hostname, struct sockaddr_storage *addr) {
+static int get_addr_direct(const char *hostname, struct sockaddr_storage *addr) {
 	struct addrinfo *res;
 	size_t len;
 
@@ -358,6 +567,40 @@ out_fail:
 	return -1;
 }
 
+static void addr_job_run(void *data) {
+	struct addr_job *job = data;
+
+	job->ret = get_addr_direct(job->name, &job->addr);
+}
+
+static void addr_job_free(void *data) {
+	struct addr_job *job = data;
+
+	xfree(job->name);
+	xfree(job);
+}
+
+/*
+** Like get_addr_direct(), but run by the offload pool.
+*/
+
+int get_addr(const char *hostname, struct sockaddr_storage *addr) {
+	struct addr_job *job = xcalloc(1, sizeof(struct addr_job));
+	int ret;
+
+	job->name = xstrdup(hostname);
+
+	if (offload_call("hosts", addr_job_run, job, addr_job_free) != 0)
+		return -1;
+
+	ret = job->ret;
+	if (ret == 0)
+		memcpy(addr, &job->addr, sizeof(struct sockaddr_storage));
+
+	addr_job_free(job);
+	return ret;
+}
+
 /*
 ** Returns the address set in the appropriate
 ** sockaddr struct.
@@ -421,7 +664,7 @@ inline bool sin6_equal(	struct sockaddr_storage *ss1,
 void sin_setv6(struct in6_addr *sin6, struct sockaddr_storage *ss) {
 	memset(ss, 0, sizeof(struct sockaddr_storage));
 	ss->ss_family = AF_INET6;
-	memcpy(&SIN6(ss)->sin6_addr, sin6, sizeof(struct sockaddr_in6));
+	memcpy(&SIN6(ss)->sin6_addr, sin6, sizeof(struct in6_addr));
 }
 
 #endif
@@ -525,3 +768,81 @@ inline void sin_mapv4to6(void *in4, struct in6_addr *in6) {
 	memset(in6_ptr + 10, 0xFF, 2);
 	memcpy(in6_ptr + 12, in4, sizeof(struct in_addr));
 }
+
+/*
+** Returns the bytes of the address in "ss" as an address of "family," or
+** NULL if it isn't one.  IPv6-mapped IPv4 addresses are IPv4 addresses.
+*/
+
+const unsigned char *cidr_bytes(	const struct sockaddr_storage *ss,
+								int family)
+{
+#if WANT_IPV6
+	if (ss->ss_family == AF_INET6) {
+		const struct in6_addr *in6 = &SIN6(ss)->sin6_addr;
+
+		if (family == AF_INET6)
+			return in6->s6_addr;
+
+		if (family == AF_INET && IN6_IS_ADDR_V4MAPPED(in6))
+			return in6->s6_addr + 12;
+
+		return NULL;
+	}
+#endif
+
+	if (ss->ss_family == AF_INET && family == AF_INET)
+		return (const unsigned char *) &SIN4(ss)->sin_addr;
+
+	return NULL;
+}
+
+/*
+** Parse a network of the form "address[/bits]" into "cidr."  Without a
+** prefix length, the network contains the address alone.
+** Returns 0 on success, -1 on failure.
+*/
+
+int cidr_parse(const char *str, struct cidr *cidr) {
+	const char *slash = strchr(str, '/');
+	size_t len = slash ? (size_t) (slash - str) : strlen(str);
+	char buf[MAX_IPLEN];
+	u_int32_t max;
+	u_int32_t i;
+
+	if (len >= sizeof(buf))
+		return -1;
+
+	memcpy(buf, str, len);
+	buf[len] = '\0';
+	memset(cidr, 0, sizeof(struct cidr));
+
+	if (inet_pton(AF_INET, buf, cidr->addr) == 1) {
+		cidr->family = AF_INET;
+		max = 32;
+#if WANT_IPV6
+	} else if (inet_pton(AF_INET6, buf, cidr->addr) == 1) {
+		cidr->family = AF_INET6;
+		max = 128;
+#endif
+	} else
+		return -1;
+
+	cidr->bits = max;
+
+	if (slash) {
+		char *end;
+
+		if (!isdigit((unsigned char) slash[1]))
+			return -1;
+
+		cidr->bits = strtoul(slash + 1, &end, 10);
+		if (*end != '\0' || cidr->bits > max)
+			return -1;
+	}
+
+	for (i = cidr->bits; i < max; ++i)
+		cidr->addr[i / 8] &= ~(0x80 >> (i % 8));
+
+	return 0;
+}
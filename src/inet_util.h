@@ -23,13 +23,29 @@
 #define SIN4(x) ((struct sockaddr_in *) (x))
 #define SIN6(x) ((struct sockaddr_in6 *) (x))
 
+/*
+** A network given by an address and a prefix length.  The bits of "addr"
+** after the prefix are zero.
+*/
+
+struct cidr {
+	int family;
+	u_int32_t bits;
+	unsigned char addr[16];
+};
+
 int *setup_listen(struct sockaddr_storage **listen_addr, in_port_t listen_port);
+int *get_activated_fds(void);
 
 int get_port(const char *name, in_port_t *port);
 int get_addr(const char *const hostname, struct sockaddr_storage *g_addr);
 void get_ip(struct sockaddr_storage *ss, char *buf, socklen_t len);
 int get_hostname(struct sockaddr_storage *addr, char *hostname, socklen_t len);
 
+int sock_set_timeout(int sock, u_int32_t secs);
+int sock_set_nodelay(int sock);
+void sock_close_wait(int sock, u_int32_t msecs, bool reset);
+
 ssize_t sockprintf(int fd, const char *fmt, ...) __format((printf, 2, 3));
 ssize_t sock_read(int fd, char *srbuf, ssize_t len);
 ssize_t sock_write(int sock, void *buf, ssize_t len);
@@ -59,4 +75,7 @@ bool sin4_equal(struct sockaddr_storage *ss1, struct sockaddr_storage *ss2);
 bool sin6_equal(struct sockaddr_storage *ss1, struct sockaddr_storage *ss2);
 bool sin_equal(struct sockaddr_storage *ss1, struct sockaddr_storage *ss2);
 
+const unsigned char *cidr_bytes(const struct sockaddr_storage *ss, int family);
+int cidr_parse(const char *str, struct cidr *cidr);
+
 #endif
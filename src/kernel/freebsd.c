@@ -70,6 +70,7 @@
 #include "missing.h"
 #include "options.h"
 #include "masq.h"
+#include "audit.h"
 
 extern struct sockaddr_storage proxy;
 
@@ -109,7 +110,7 @@ int k_open(void) {
 
 	kinfo->kd = kvm_open(NULL, NULL, NULL, O_RDONLY, NULL);
 	if (!kinfo->kd) {
-		free(kinfo);
+		xfree(kinfo);
 		debug("kvm_open: %s", strerror(errno));
 		return -1;
 	}
@@ -127,7 +128,7 @@ int k_open(void) {
 
 	if (kvm_nlist(kinfo->kd, kinfo->nl) != 0) {
 		kvm_close(kinfo->kd);
-		free(kinfo);
+		xfree(kinfo);
 		debug("kvm_nlist: %s", strerror(errno));
 		return -1;
 	}
@@ -361,7 +362,7 @@ static uid_t get_user(	in_port_t lport,
 					pfd.fd_nfiles * sizeof(struct file *));
 
 			if (ret == -1) {
-				free(ofiles);
+				xfree(ofiles);
 				return MISSING_UID;
 			}
 
@@ -373,7 +374,7 @@ static uid_t get_user(	in_port_t lport,
 
 				ret = getbuf((u_long) ofiles[j], &ofile, sizeof(struct file));
 				if (ret == -1) {
-					free(ofiles);
+					xfree(ofiles);
 					return MISSING_UID;
 				}
 
@@ -388,16 +389,16 @@ static uid_t get_user(	in_port_t lport,
 					ret = getbuf((u_long) kp[i].kp_proc.p_cred,
 							&pc, sizeof(pc));
 					if (ret == -1) {
-						free(ofiles);
+						xfree(ofiles);
 						return MISSING_UID;
 					}
 
-					free(ofiles);
+					xfree(ofiles);
 					return pc.p_ruid;
 				}
 			}
 
-			free(ofiles);
+			xfree(ofiles);
 		}
 	}
 
@@ -511,6 +512,7 @@ int masq(	int sock,
 
 			sockprintf(sock, "%d,%d:USERID:%s:%s\r\n",
 				lport, fport, os, user);
+			audit_reply(AUDIT_MASQ, AUDIT_USERID, MISSING_UID, user);
 
 			get_ip(faddr, ipbuf, sizeof(ipbuf));
 
@@ -71,6 +71,7 @@
 #include "missing.h"
 #include "options.h"
 #include "masq.h"
+#include "audit.h"
 
 extern struct sockaddr_storage proxy;
 
@@ -110,7 +111,7 @@ int k_open(void) {
 
 	kinfo->kd = kvm_open(NULL, NULL, NULL, O_RDONLY, NULL);
 	if (!kinfo->kd) {
-		free(kinfo);
+		xfree(kinfo);
 		debug("kvm_open: %s", strerror(errno));
 		return -1;
 	}
@@ -128,7 +129,7 @@ int k_open(void) {
 
 	if (kvm_nlist(kinfo->kd, kinfo->nl) != 0) {
 		kvm_close(kinfo->kd);
-		free(kinfo);
+		xfree(kinfo);
 		debug("kvm_nlist: %s", strerror(errno));
 		return -1;
 	}
@@ -346,7 +347,7 @@ static uid_t get_user(	in_port_t lport,
 					pfd.fd_nfiles * sizeof(struct file *));
 
 			if (ret == -1) {
-				free(ofiles);
+				xfree(ofiles);
 				return MISSING_UID;
 			}
 
@@ -358,7 +359,7 @@ static uid_t get_user(	in_port_t lport,
 
 				ret = getbuf((u_long) ofiles[j], &ofile, sizeof(struct file));
 				if (ret == -1) {
-					free(ofiles);
+					xfree(ofiles);
 					return MISSING_UID;
 				}
 
@@ -369,13 +370,13 @@ static uid_t get_user(	in_port_t lport,
 					(struct socket *) ofile.f_data == sockp)
 				{
 
-					free(ofiles);
+					xfree(ofiles);
 
 					return kp[i].ki_ruid;
 				}
 			}
 
-			free(ofiles);
+			xfree(ofiles);
 		}
 
 	}
@@ -490,6 +491,7 @@ int masq(	int sock,
 
 			sockprintf(sock, "%d,%d:USERID:%s:%s\r\n",
 				lport, fport, os, user);
+			audit_reply(AUDIT_MASQ, AUDIT_USERID, MISSING_UID, user);
 
 			get_ip(faddr, ipbuf, sizeof(ipbuf));
 
@@ -23,6 +23,7 @@
 
 #include <unistd.h>
 #include <stdio.h>
+#include <stdlib.h>
 #include <string.h>
 #include <errno.h>
 #include <syslog.h>
@@ -34,6 +35,15 @@
 #include <arpa/inet.h>
 #include <linux/netlink.h>
 
+#ifdef HAVE_SETNS
+#	include <sched.h>
+#	include <fcntl.h>
+#	include <dirent.h>
+#	include <time.h>
+#	include <sys/stat.h>
+#	include <linux/rtnetlink.h>
+#endif
+
 #include "oidentd.h"
 #include "util.h"
 #include "user_db.h"
@@ -42,6 +52,10 @@
 #include "masq.h"
 #include "options.h"
 #include "netlink.h"
+#include "shed.h"
+#include "audit.h"
+#include "flight.h"
+#include "fuzz.h"
 
 #if !MASQ_SUPPORT
 #	undef LIBNFCT_SUPPORT
@@ -55,13 +69,131 @@
 #	include <udb.h>
 #endif
 
+#if THREAD_SUPPORT
+#	include <pthread.h>
+#endif
+
+#if BPF_SUPPORT
+#	include <fcntl.h>
+#	include <mntent.h>
+#	include <stddef.h>
+#	include <stdint.h>
+#	include <sys/syscall.h>
+#	include <linux/bpf.h>
+#endif
+
 #define CFILE		"/proc/net/tcp"
 #define CFILE6		"/proc/net/tcp6"
 #define MASQFILE	"/proc/net/ip_masquerade"
 #define IPCONNTRACK	"/proc/net/ip_conntrack"
 #define NFCONNTRACK	"/proc/net/nf_conntrack"
 
-static int netlink_sock;
+/*
+** Each thread uses its own netlink socket so replies to concurrent
+** queries can't be mixed up.  Threads other than the one calling k_open()
+** open their socket on first use, provided netlink is available at all.
+*/
+
+static bool netlink_avail;
+static bool netlink_trusted;
+#if THREAD_SUPPORT
+static pthread_key_t netlink_key;
+static void netlink_close_cb(void *data);
+#else
+static int netlink_fd = -1;
+#endif
+
+static int *netlink_sock(void);
+
+#if BPF_SUPPORT
+
+/*
+** With --bpf, programs attached to the root of the cgroup v2 hierarchy
+** keep a map of the owners of the TCP connections made from this host.
+** The program run on connect() records the UID of the calling process
+** under the cookie of its socket.  Once the connection is established,
+** a sock_ops program moves the UID to an entry keyed by the connection's
+** network namespace, addresses and ports, and removes that entry when
+** the socket is closed.  Looking up an owner then takes a single map
+** lookup.
+**
+** Connections accepted by this host are not in the map, because the
+** process that will accept them isn't known when they are established.
+** Connections made before oidentd started are not in it either.  Both are
+** looked up with netlink, as are all connections if the programs can't be
+** loaded.  The programs are detached when oidentd exits.
+*/
+
+struct bpf_owner_key {
+	u_int64_t netns;
+	u_int32_t family;
+	u_int32_t lport;
+	u_int32_t fport;
+	u_int32_t laddr[4];
+	u_int32_t faddr[4];
+	u_int32_t pad;
+};
+
+/*
+** The sizes of the maps of connections being made and of established
+** connections, and the most instructions a program has.  Connections
+** beyond BPF_OWNERS_MAX are looked up with netlink.
+*/
+
+#define BPF_PENDING_MAX		65536
+#define BPF_OWNERS_MAX		1048576
+#define BPF_PROG_MAX		256
+
+static int bpf_owners_fd = -1;
+static int bpf_links[3] = { -1, -1, -1 };
+static u_int64_t bpf_netns;
+
+static void bpf_open(int *nl_sock);
+static int bpf_selftest(int *nl_sock);
+static int bpf_get_user(	struct sockaddr_storage *laddr,
+							struct sockaddr_storage *faddr,
+							in_port_t lport,
+							in_port_t fport,
+							uid_t *uid);
+#endif
+
+#ifdef HAVE_SETNS
+
+/*
+** Connections masqueraded for containers are owned by sockets in other
+** network namespaces, which can't be seen from our own.  A socket stays
+** in the namespace it was opened in, so a diag socket and a route socket
+** are opened in each namespace given with --netns while we still have
+** the privileges to enter it.  The route socket is used to learn the
+** addresses of the namespace, which map the source address of a conntrack
+** entry to the one namespace that needs to be asked.
+*/
+
+struct netns {
+	char *path;
+	int diag_sock;
+	int route_sock;
+	size_t num_addrs;
+	struct sockaddr_storage *addrs;
+};
+
+static struct netns *netns_pool;
+static size_t netns_num;
+static time_t netns_loaded;
+DEFINE_LOCK(netns_mutex);
+
+extern list_t *netns_paths;
+
+static int netns_open_path(const char *path, bool dir_entry);
+static int netns_open(const char *path, int self_fd, const struct stat *self_st);
+static int netns_load_addrs(struct netns *ns);
+static struct netns *netns_find(struct sockaddr_storage *addr);
+static uid_t netns_get_user(	in_port_t lport,
+							in_port_t fport,
+							struct sockaddr_storage *laddr,
+							struct sockaddr_storage *faddr);
+#endif
+
 extern struct sockaddr_storage proxy;
 extern char *ret_os;
 
@@ -77,13 +209,55 @@ struct ct_masq_query {
 #endif
 
 #if MASQ_SUPPORT
-static int masq_ct_line(char *line,
+/*
+** A connection tracking entry that matches a query.  "local_nat" is set
+** if the connection was made from this host.
+*/
+
+struct ct_entry {
+	bool local_nat;
+	in_port_t masq_lport;
+	in_port_t masq_fport;
+	struct sockaddr_storage localm;
+	struct sockaddr_storage remotem;
+};
+
+static int masq_reply_user(	int sock,
+							uid_t con_uid,
+							in_port_t lport,
+							in_port_t masq_lport,
+							in_port_t fport,
+							in_port_t masq_fport,
+							struct sockaddr_storage *laddr,
+							struct sockaddr_storage *remote,
+							struct sockaddr_storage *faddr);
+static int masq_ct_scan(FILE *fp,
+			int ct_type,
+			in_port_t lport,
+			in_port_t fport,
+			struct sockaddr_storage *faddr,
+			struct ct_entry *entry);
+static int masq_ct_match(const char *line,
+			int ct_type,
+			in_port_t lport,
+			in_port_t fport,
+			struct sockaddr_storage *faddr,
+			struct ct_entry *entry);
+static int masq_ct_reply(int sock,
+			const struct ct_entry *entry,
+			in_port_t lport,
+			in_port_t fport,
+			struct sockaddr_storage *laddr,
+			struct sockaddr_storage *faddr);
+#	if LIBNFCT_SUPPORT
+static int masq_ct_line(const char *line,
 			int sock,
 			int ct_type,
 			in_port_t lport,
 			in_port_t fport,
 			struct sockaddr_storage *laddr,
 			struct sockaddr_storage *faddr);
+#	endif
 #endif
 
 #if LIBNFCT_SUPPORT
@@ -93,10 +267,36 @@ static int callback_nfct(enum nf_conntrack_msg_type type,
 			void *data);
 #endif
 
-static uid_t lookup_tcp_diag(	struct sockaddr_storage *src_addr,
+/*
+** Results of lookup_tcp_diag().  DIAG_ABSENT means the kernel reported
+** that no live socket has the given address, which is only taken as the
+** final answer once netlink_selftest() has passed.
+*/
+
+#define DIAG_FOUND		0
+#define DIAG_ABSENT		1
+#define DIAG_FAILED		(-1)
+
+#if WANT_IPV6
+static void proc_tcp6_lookup(struct flight_query **queries, size_t num);
+static void proc_tcp6_scan(	FILE *fp,
+							struct flight_query **queries,
+							size_t num);
+#endif
+static void proc_tcp4_lookup(struct flight_query **queries, size_t num);
+static void proc_tcp4_scan(	FILE *fp,
+							struct flight_query **queries,
+							size_t num);
+static void proc_tcp_found(	struct flight_query *query,
+							unsigned long uid,
+							unsigned long inode);
+static int lookup_tcp_diag(	int *sock,
+							struct sockaddr_storage *src_addr,
 							struct sockaddr_storage *dst_addr,
 							in_port_t src_port,
-							in_port_t dst_port);
+							in_port_t dst_port,
+							uid_t *uid);
+static void netlink_selftest(int *sock);
 
 #if MASQ_SUPPORT
 enum {
@@ -107,6 +307,7 @@ enum {
 };
 FILE *masq_fp;
 static int conntrack = CT_UNKNOWN;
+DEFINE_LOCK(masq_mutex);
 #endif
 
 #if LIBNFCT_SUPPORT
@@ -241,33 +442,70 @@ uid_t get_user6(	in_port_t lport,
 				struct sockaddr_storage *laddr,
 				struct sockaddr_storage *faddr)
 {
-	FILE *fp;
-	char buf[1024];
+	struct flight_query query;
+	uid_t uid;
+	int *nl_sock = netlink_sock();
+
+#if BPF_SUPPORT
+	if (bpf_owners_fd != -1 && bpf_get_user(laddr, faddr, lport, fport, &uid) == 0)
+		return uid;
+#endif
 
-	if (netlink_sock != -1) {
-		uid_t uid = lookup_tcp_diag(laddr, faddr, lport, fport);
+	if (*nl_sock != -1) {
+		int ret = lookup_tcp_diag(nl_sock, laddr, faddr, lport, fport, &uid);
 
-		if (uid != MISSING_UID)
+		if (ret == DIAG_FOUND)
 			return uid;
+
+		/* spare hosts with many sockets the scan below */
+		if (ret == DIAG_ABSENT && (netlink_trusted || shed_active()))
+			return MISSING_UID;
 	}
 
-	lport = ntohs(lport);
-	fport = ntohs(fport);
+	query.lport = ntohs(lport);
+	query.fport = ntohs(fport);
+	query.laddr = laddr;
+	query.faddr = faddr;
+
+	flight_scan(FLIGHT_TCP6, &query, proc_tcp6_lookup);
+	return query.uid;
+}
+
+/*
+** Look up the "num" queries in "queries" in /proc/net/tcp6.
+*/
+
+static void proc_tcp6_lookup(struct flight_query **queries, size_t num) {
+	FILE *fp = fopen(CFILE6, "r");
 
-	fp = fopen(CFILE6, "r");
 	if (!fp) {
 		debug("fopen: %s: %s", CFILE6, strerror(errno));
-		return MISSING_UID;
+		return;
 	}
 
+	proc_tcp6_scan(fp, queries, num);
+	fclose(fp);
+}
+
+/*
+** Find the IPv6 connections of the "num" queries in "queries" in "fp,"
+** which has the format of /proc/net/tcp6, in one pass.
+*/
+
+static void proc_tcp6_scan(	FILE *fp,
+							struct flight_query **queries,
+							size_t num)
+{
+	size_t left = num;
+	char buf[1024];
+
 	/* Eat the header line. */
 	if (!fgets(buf, sizeof(buf), fp)) {
 		debug("fgets: %s: Could not read header", CFILE6);
-		fclose(fp);
-		return MISSING_UID;
+		return;
 	}
 
-	while (fgets(buf, sizeof(buf), fp)) {
+	while (left > 0 && fgets(buf, sizeof(buf), fp)) {
 		struct in6_addr remote6;
 		struct in6_addr local6;
 		u_int32_t portl_temp;
@@ -276,6 +514,7 @@ uid_t get_user6(	in_port_t lport,
 		in_port_t portf;
 		unsigned long uid;
 		unsigned long inode;
+		size_t i;
 		int ret;
 
 		ret = sscanf(buf,
@@ -292,22 +531,20 @@ uid_t get_user6(	in_port_t lport,
 		portl = (in_port_t) portl_temp;
 		portf = (in_port_t) portf_temp;
 
-		if (!memcmp(&local6, sin_addr(laddr), sizeof(local6)) &&
-			!memcmp(&remote6, sin_addr(faddr), sizeof(remote6)) &&
-			portl == lport &&
-			portf == fport)
-		{
-			fclose(fp);
-
-			if (inode == 0 && uid == 0)
-				return MISSING_UID;
+		for (i = 0; i < num; ++i) {
+			struct flight_query *query = queries[i];
 
-			return (uid_t) uid;
+			if (!query->found &&
+				!memcmp(&local6, sin_addr(query->laddr), sizeof(local6)) &&
+				!memcmp(&remote6, sin_addr(query->faddr), sizeof(remote6)) &&
+				portl == query->lport &&
+				portf == query->fport)
+			{
+				proc_tcp_found(query, uid, inode);
+				--left;
+			}
 		}
 	}
-
-	fclose(fp);
-	return MISSING_UID;
 }
 
 #endif
@@ -322,44 +559,79 @@ uid_t get_user4(	in_port_t lport,
 				struct sockaddr_storage *laddr,
 				struct sockaddr_storage *faddr)
 {
-	unsigned long uid;
-	unsigned long inode;
-	FILE *fp;
-	char buf[1024];
-	in_addr_t laddr4;
-	in_addr_t faddr4;
+	struct flight_query query;
+	int *nl_sock = netlink_sock();
+
+#if BPF_SUPPORT
+	uid_t uid;
+
+	if (bpf_owners_fd != -1 && bpf_get_user(laddr, faddr, lport, fport, &uid) == 0)
+		return uid;
+#endif
 
-	if (netlink_sock != -1) {
-		uid_t nluid = lookup_tcp_diag(laddr, faddr, lport, fport);
+	if (*nl_sock != -1) {
+		uid_t nluid;
+		int nlret = lookup_tcp_diag(nl_sock, laddr, faddr, lport, fport, &nluid);
 
-		if (nluid != MISSING_UID)
+		if (nlret == DIAG_FOUND)
 			return nluid;
+
+		/* with a proxy, the scan below also matches other addresses */
+		if (nlret == DIAG_ABSENT &&
+			((netlink_trusted && !opt_enabled(PROXY)) || shed_active()))
+		{
+			return MISSING_UID;
+		}
 	}
 
-	laddr4 = SIN4(laddr)->sin_addr.s_addr;
-	faddr4 = SIN4(faddr)->sin_addr.s_addr;
+	query.lport = ntohs(lport);
+	query.fport = ntohs(fport);
+	query.laddr = laddr;
+	query.faddr = faddr;
 
-	lport = ntohs(lport);
-	fport = ntohs(fport);
+	flight_scan(FLIGHT_TCP4, &query, proc_tcp4_lookup);
+	return query.uid;
+}
+
+/*
+** Look up the "num" queries in "queries" in /proc/net/tcp.
+*/
+
+static void proc_tcp4_lookup(struct flight_query **queries, size_t num) {
+	FILE *fp = fopen(CFILE, "r");
 
-	fp = fopen(CFILE, "r");
 	if (!fp) {
 		debug("fopen: %s: %s", CFILE, strerror(errno));
-		return MISSING_UID;
+		return;
 	}
 
+	proc_tcp4_scan(fp, queries, num);
+	fclose(fp);
+}
+
+/*
+** Find the IPv4 connections of the "num" queries in "queries" in "fp,"
+** which has the format of /proc/net/tcp, in one pass.
+*/
+
+static void proc_tcp4_scan(	FILE *fp,
+							struct flight_query **queries,
+							size_t num)
+{
+	size_t left = num;
+	char buf[1024];
+
 	/* Eat the header line. */
 	if (!fgets(buf, sizeof(buf), fp)) {
 		debug("fgets: %s: Could not read header", CFILE);
-		fclose(fp);
-		return MISSING_UID;
+		return;
 	}
 
 	/*
 	** The line should never be longer than 1024 chars, so fgets should be OK.
 	*/
 
-	while (fgets(buf, sizeof(buf), fp)) {
+	while (left > 0 && fgets(buf, sizeof(buf), fp)) {
 		int ret;
 		u_int32_t portl_temp;
 		u_int32_t portf_temp;
@@ -367,6 +639,9 @@ uid_t get_user4(	in_port_t lport,
 		in_port_t portf;
 		in_addr_t local;
 		in_addr_t remote;
+		unsigned long uid;
+		unsigned long inode;
+		size_t i;
 
 		ret = sscanf(buf,
 			"%*d: %x:%x %x:%x %*x %*x:%*x %*x:%*x %*x %lu %*d %lu",
@@ -378,30 +653,43 @@ uid_t get_user4(	in_port_t lport,
 		portl = (in_port_t) portl_temp;
 		portf = (in_port_t) portf_temp;
 
-		if (opt_enabled(PROXY)) {
-			if (faddr4 == SIN4(&proxy)->sin_addr.s_addr &&
-				remote != SIN4(&proxy)->sin_addr.s_addr &&
-				lport == portl &&
-				fport == portf)
+		for (i = 0; i < num; ++i) {
+			struct flight_query *query = queries[i];
+			in_addr_t laddr4 = SIN4(query->laddr)->sin_addr.s_addr;
+			in_addr_t faddr4 = SIN4(query->faddr)->sin_addr.s_addr;
+			bool match;
+
+			if (query->found ||
+				portl != query->lport ||
+				portf != query->fport)
 			{
-				goto out_success;
+				continue;
 			}
-		}
 
-		if (local == laddr4 &&
-			remote == faddr4 &&
-			portl == lport &&
-			portf == fport)
-		{
-			goto out_success;
+			match = local == laddr4 && remote == faddr4;
+
+			if (!match && opt_enabled(PROXY)) {
+				match = faddr4 == SIN4(&proxy)->sin_addr.s_addr &&
+					remote != SIN4(&proxy)->sin_addr.s_addr;
+			}
+
+			if (match) {
+				proc_tcp_found(query, uid, inode);
+				--left;
+			}
 		}
 	}
+}
 
-	fclose(fp);
-	return MISSING_UID;
+/*
+** Record the owner of the entry found for "query."
+*/
 
-out_success:
-	fclose(fp);
+static void proc_tcp_found(	struct flight_query *query,
+							unsigned long uid,
+							unsigned long inode)
+{
+	query->found = true;
 
 	/*
 	** If the inode is zero, the socket is dead, and its owner
@@ -410,9 +698,9 @@ out_success:
 	*/
 
 	if (inode == 0 && uid == 0)
-		return MISSING_UID;
-
-	return (uid_t) uid;
+		query->uid = MISSING_UID;
+	else
+		query->uid = (uid_t) uid;
 }
 
 #if MASQ_SUPPORT
@@ -428,7 +716,6 @@ int masq(	int sock,
 			struct sockaddr_storage *laddr,
 			struct sockaddr_storage *faddr)
 {
-	char buf[1024];
 #if LIBNFCT_SUPPORT
 	struct ct_masq_query query;
 #endif
@@ -444,24 +731,27 @@ int masq(	int sock,
 #endif
 
 	if (masq_fp) {
+		struct ct_entry entry;
+		int ret;
+
+		/*
+		** The file position is shared by all threads.  The lock is
+		** released before replying, which may forward the query.
+		*/
+
+		o_lock(masq_mutex);
+
 		/* rewind fp to read new contents */
 		rewind(masq_fp);
 
-		if (conntrack == CT_MASQFILE) {
-			/* eat the header line */
-			if (!fgets(buf, sizeof(buf), masq_fp)) {
-				debug("fgets: conntrack file: Could not read header");
-				return -1;
-			}
-		}
+		ret = masq_ct_scan(masq_fp, conntrack, lport, fport, faddr, &entry);
 
-		while (fgets(buf, sizeof(buf), masq_fp)) {
-			int ret = masq_ct_line(buf, sock, conntrack,
-				lport, fport, laddr, faddr);
-			if (ret == 1)
-				continue;
-			return ret;
-		}
+		o_unlock(masq_mutex);
+
+		if (ret != 0)
+			return -1;
+
+		return masq_ct_reply(sock, &entry, lport, fport, laddr, faddr);
 	} else if (conntrack != CT_UNKNOWN)
 		debug("Connection tracking file is in use but not open");
 
@@ -469,28 +759,118 @@ int masq(	int sock,
 }
 
 /*
-** Process a connection tracking file entry.
+** Find the entry for the masqueraded connection (lport, fport) in the
+** connection tracking file "fp," of type "ct_type."  The ports are in
+** host byte order.
+** Returns 0 if a matching entry was stored in "entry," -1 otherwise.
+*/
+
+static int masq_ct_scan(FILE *fp,
+			int ct_type,
+			in_port_t lport,
+			in_port_t fport,
+			struct sockaddr_storage *faddr,
+			struct ct_entry *entry)
+{
+	char buf[1024];
+
+	/* eat the header line */
+	if (ct_type == CT_MASQFILE && !fgets(buf, sizeof(buf), fp)) {
+		debug("fgets: conntrack file: Could not read header");
+		return -1;
+	}
+
+	while (fgets(buf, sizeof(buf), fp)) {
+		int ret = masq_ct_match(buf, ct_type, lport, fport, faddr, entry);
+
+		if (ret != 1)
+			return ret;
+	}
+
+	return -1;
+}
+
+/*
+** Reply to a request for a masqueraded connection owned by the local user
+** "con_uid."  The connection is identified by (masq_lport, masq_fport)
+** between "laddr" and "remote."
+** Returns 0 if a reply was sent, -1 if the owner is unknown.
+*/
+
+static int masq_reply_user(	int sock,
+							uid_t con_uid,
+							in_port_t lport,
+							in_port_t masq_lport,
+							in_port_t fport,
+							in_port_t masq_fport,
+							struct sockaddr_storage *laddr,
+							struct sockaddr_storage *remote,
+							struct sockaddr_storage *faddr)
+{
+	struct passwd pwd;
+	char suser[MAX_ULEN];
+	char ipbuf[MAX_IPLEN];
+	int ret;
+
+	if (con_uid == MISSING_UID)
+		return -1;
+
+	get_ip(faddr, ipbuf, sizeof(ipbuf));
+
+	if (get_pwuid(con_uid, &pwd) != 0) {
+		sockprintf(sock, "%d,%d:ERROR:%s\r\n",
+			lport, fport, ERROR("NO-USER"));
+		audit_reply(AUDIT_MASQ, AUDIT_ERROR, con_uid, ERROR("NO-USER"));
+
+		debug("getpwuid(%lu): %s", (unsigned long) con_uid, strerror(errno));
+		return 0;
+	}
+
+	ret = get_ident(&pwd, masq_lport, masq_fport, laddr, remote, suser, sizeof(suser));
+	if (ret == -1) {
+		sockprintf(sock, "%d,%d:ERROR:%s\r\n",
+			lport, fport, ERROR("HIDDEN-USER"));
+		audit_reply(AUDIT_MASQ, AUDIT_ERROR, con_uid, ERROR("HIDDEN-USER"));
+
+		o_log(LOG_INFO, "[%s] %d (%d) , %d (%d) : HIDDEN-USER (%s)",
+			ipbuf, lport, masq_lport, fport, masq_fport, pwd.pw_name);
+
+		free_pw(&pwd);
+		return 0;
+	}
+
+	sockprintf(sock, "%d,%d:USERID:%s:%s\r\n",
+		lport, fport, ret_os, suser);
+	audit_reply(AUDIT_MASQ, AUDIT_USERID, con_uid, suser);
+
+	o_log(LOG_INFO, "[%s] Successful lookup: %d (%d) , %d (%d) : %s (%s)",
+		ipbuf, lport, masq_lport, fport, masq_fport, pwd.pw_name, suser);
+
+	free_pw(&pwd);
+	return 0;
+}
+
+/*
+** Parse a connection tracking file entry and store it in "entry" if it
+** matches the query.
 ** The lport and fport arguments are in host byte order.
 ** Returns -1 if an error occurred.
-** Returns  0 if the entry matched and the request has been handled.
+** Returns  0 if the entry matched.
 ** Returns  1 if the entry did not match the query.
 **/
 
-static int masq_ct_line(char *line,
-			int sock,
+static int masq_ct_match(const char *line,
 			int ct_type,
 			in_port_t lport,
 			in_port_t fport,
-			struct sockaddr_storage *laddr,
-			struct sockaddr_storage *faddr) {
-	char os[24];
+			struct sockaddr_storage *faddr,
+			struct ct_entry *entry) {
 	char family[16];
 	char proto[16];
 	in_port_t mport;
 	in_port_t nport;
 	in_port_t masq_lport;
 	in_port_t masq_fport;
-	char user[MAX_ULEN];
 	struct sockaddr_storage localm_ss;
 	struct sockaddr_storage remotem_ss;
 	struct sockaddr_storage localn_ss;
@@ -679,63 +1059,79 @@ static int masq_ct_line(char *line,
 	if (nport != fport)
 		return 1;
 
-	/* Local NAT, don't forward or do masquerade entry lookup. */
-	if (sin_equal(&localm_ss, &remoten_ss)) {
-		uid_t con_uid = MISSING_UID;
-		struct passwd *pw;
-		char suser[MAX_ULEN];
-		char ipbuf[MAX_IPLEN];
+	entry->masq_lport = masq_lport;
+	entry->masq_fport = masq_fport;
+	sin_copy(&entry->localm, &localm_ss);
+	sin_copy(&entry->remotem, &remotem_ss);
 
-		get_ip(faddr, ipbuf, sizeof(ipbuf));
+	/* Local NAT, don't forward or do masquerade entry lookup. */
+	entry->local_nat = sin_equal(&localm_ss, &remoten_ss);
+	if (entry->local_nat)
+		return 0;
 
-		if (con_uid == MISSING_UID && faddr->ss_family == AF_INET)
-			con_uid = get_user4(htons(masq_lport), htons(masq_fport), laddr, &remotem_ss);
+	if (!sin_equal(&localn_ss, faddr)) {
+		if (!opt_enabled(PROXY))
+			return 1;
 
-		if (con_uid == MISSING_UID && faddr->ss_family == AF_INET6)
-			con_uid = get_user6(htons(masq_lport), htons(masq_fport), laddr, &remotem_ss);
+		if (!sin_equal(faddr, &proxy))
+			return 1;
 
-		if (con_uid == MISSING_UID)
-			return -1;
+		if (sin_equal(&localn_ss, &proxy))
+			return 1;
+	}
 
-		pw = getpwuid(con_uid);
-		if (!pw) {
-			sockprintf(sock, "%d,%d:ERROR:%s\r\n",
-				lport, fport, ERROR("NO-USER"));
+	return 0;
+}
 
-			debug("getpwuid(%lu): %s", (unsigned long) con_uid, strerror(errno));
-			return 0;
-		}
+/*
+** Handle a request for the masqueraded connection described by "entry."
+** The lport and fport arguments are in host byte order.
+** Returns 0 if the request has been handled, -1 otherwise.
+*/
 
-		ret = get_ident(pw, masq_lport, masq_fport, laddr, &remotem_ss, suser, sizeof(suser));
-		if (ret == -1) {
-			sockprintf(sock, "%d,%d:ERROR:%s\r\n",
-				lport, fport, ERROR("HIDDEN-USER"));
+static int masq_ct_reply(int sock,
+			const struct ct_entry *entry,
+			in_port_t lport,
+			in_port_t fport,
+			struct sockaddr_storage *laddr,
+			struct sockaddr_storage *faddr)
+{
+	struct sockaddr_storage localm_ss;
+	struct sockaddr_storage remotem_ss;
+	in_port_t masq_lport = entry->masq_lport;
+	in_port_t masq_fport = entry->masq_fport;
+	char user[MAX_ULEN];
+	char os[24];
+	int ret;
 
-			o_log(LOG_INFO, "[%s] %d (%d) , %d (%d) : HIDDEN-USER (%s)",
-				ipbuf, lport, masq_lport, fport, masq_fport, pw->pw_name);
+	sin_copy(&localm_ss, &entry->localm);
+	sin_copy(&remotem_ss, &entry->remotem);
 
-			return 0;
-		}
+	if (entry->local_nat) {
+		uid_t con_uid = MISSING_UID;
 
-		sockprintf(sock, "%d,%d:USERID:%s:%s\r\n",
-			lport, fport, ret_os, suser);
+		if (faddr->ss_family == AF_INET)
+			con_uid = get_user4(htons(masq_lport), htons(masq_fport), laddr, &remotem_ss);
 
-		o_log(LOG_INFO, "[%s] Successful lookup: %d (%d) , %d (%d) : %s (%s)",
-			ipbuf, lport, masq_lport, fport, masq_fport, pw->pw_name, suser);
+		if (faddr->ss_family == AF_INET6)
+			con_uid = get_user6(htons(masq_lport), htons(masq_fport), laddr, &remotem_ss);
 
-		return 0;
+		return masq_reply_user(sock, con_uid, lport, masq_lport, fport,
+				masq_fport, laddr, &remotem_ss, faddr);
 	}
 
-	if (!sin_equal(&localn_ss, faddr)) {
-		if (!opt_enabled(PROXY))
-			return 1;
-
-		if (!sin_equal(faddr, &proxy))
-			return 1;
+#ifdef HAVE_SETNS
+	/* a container on this host, masqueraded from its own namespace */
+	if (netns_num > 0) {
+		uid_t con_uid = netns_get_user(htons(masq_lport), htons(masq_fport),
+							&localm_ss, &remotem_ss);
 
-		if (sin_equal(&localn_ss, &proxy))
-			return 1;
+		if (con_uid != MISSING_UID) {
+			return masq_reply_user(sock, con_uid, lport, masq_lport, fport,
+					masq_fport, &localm_ss, &remotem_ss, faddr);
+		}
 	}
+#endif
 
 	ret = find_masq_entry(&localm_ss, user, sizeof(user), os, sizeof(os));
 
@@ -755,6 +1151,7 @@ static int masq_ct_line(char *line,
 
 		sockprintf(sock, "%d,%d:USERID:%s:%s\r\n",
 			lport, fport, os, user);
+		audit_reply(AUDIT_MASQ, AUDIT_USERID, MISSING_UID, user);
 
 		get_ip(faddr, ipbuf, sizeof(ipbuf));
 
@@ -768,21 +1165,56 @@ static int masq_ct_line(char *line,
 	return -1;
 }
 
-#endif
+#	if LIBNFCT_SUPPORT
 
 /*
-** Much of the code for this function has been borrowed from
-** a patch to pidentd written by Alexey Kuznetsov <kuznet@ms2.inr.ac.ru>
-** and distributed with the iproute2 package.
-**
-** Ryan McCabe <ryan@numb.org> has made some cleanups and converted the
-** routine to support both IPv4 and IPv6 queries.
+** Process a connection tracking entry reported by libnetfilter_conntrack.
+** The lport and fport arguments are in host byte order.
+** Returns -1 if an error occurred.
+** Returns  0 if the entry matched and the request has been handled.
+** Returns  1 if the entry did not match the query.
 */
 
-static uid_t lookup_tcp_diag(	struct sockaddr_storage *src_addr,
-							struct sockaddr_storage *dst_addr,
+static int masq_ct_line(const char *line,
+			int sock,
+			int ct_type,
+			in_port_t lport,
+			in_port_t fport,
+			struct sockaddr_storage *laddr,
+			struct sockaddr_storage *faddr)
+{
+	struct ct_entry entry;
+	int ret = masq_ct_match(line, ct_type, lport, fport, faddr, &entry);
+
+	if (ret != 0)
+		return ret;
+
+	return masq_ct_reply(sock, &entry, lport, fport, laddr, faddr);
+}
+
+#	endif
+
+#endif
+
+/*
+** Much of the code for this function has been borrowed from
+** a patch to pidentd written by Alexey Kuznetsov <kuznet@ms2.inr.ac.ru>
+** and distributed with the iproute2 package.
+**
+** Ryan McCabe <ryan@numb.org> has made some cleanups and converted the
+** routine to support both IPv4 and IPv6 queries.
+**
+** Stores the UID of the owner of the connection in "uid" and returns
+** DIAG_FOUND, or returns DIAG_ABSENT if there is no live socket for the
+** connection, or DIAG_FAILED if the kernel could not be asked.
+*/
+
+static int lookup_tcp_diag(	int *sock,
+							struct sockaddr_storage *src_addr,
+							struct sockaddr_storage *dst_addr,
 							in_port_t src_port,
-							in_port_t dst_port)
+							in_port_t dst_port,
+							uid_t *uid)
 {
 	struct sockaddr_nl nladdr;
 	struct {
@@ -825,13 +1257,13 @@ static uid_t lookup_tcp_diag(	struct sockaddr_storage *src_addr,
 	msghdr.msg_controllen = 0;
 	msghdr.msg_flags = 0;
 
-	if (sendmsg(netlink_sock, &msghdr, 0) < 0) {
+	if (sendmsg(*sock, &msghdr, 0) < 0) {
 		if (errno == ECONNREFUSED) {
-			close(netlink_sock);
-			netlink_sock = -1;
+			close(*sock);
+			*sock = -1;
 		}
 
-		return MISSING_UID;
+		return DIAG_FAILED;
 	}
 
 	iov[0].iov_base = buf;
@@ -850,16 +1282,16 @@ static uid_t lookup_tcp_diag(	struct sockaddr_storage *src_addr,
 		msghdr.msg_controllen = 0;
 		msghdr.msg_flags = 0;
 
-		ret = recvmsg(netlink_sock, &msghdr, 0);
+		ret = recvmsg(*sock, &msghdr, 0);
 		if (ret < 0) {
 			if (errno == EINTR || errno == EAGAIN)
 				continue;
 
-			return MISSING_UID;
+			return DIAG_FAILED;
 		}
 
 		if (ret == 0)
-			return MISSING_UID;
+			return DIAG_FAILED;
 
 		h = (struct nlmsghdr *) buf;
 
@@ -872,8 +1304,14 @@ static uid_t lookup_tcp_diag(	struct sockaddr_storage *src_addr,
 				continue;
 			}
 
-			if (h->nlmsg_type == NLMSG_DONE || h->nlmsg_type == NLMSG_ERROR)
-				return MISSING_UID;
+			if (h->nlmsg_type == NLMSG_ERROR) {
+				struct nlmsgerr *err = NLMSG_DATA(h);
+
+				return err->error == -ENOENT ? DIAG_ABSENT : DIAG_FAILED;
+			}
+
+			if (h->nlmsg_type == NLMSG_DONE)
+				return DIAG_FAILED;
 
 			r = NLMSG_DATA(h);
 
@@ -882,20 +1320,960 @@ static uid_t lookup_tcp_diag(	struct sockaddr_storage *src_addr,
 				!memcmp(r->id.tcpdiag_dst, sin_addr(dst_addr), addr_len) &&
 				!memcmp(r->id.tcpdiag_src, sin_addr(src_addr), addr_len))
 			{
+				/* the socket is dead; see get_user4() */
 				if (r->tcpdiag_inode == 0 && r->tcpdiag_uid == 0)
-					return MISSING_UID;
+					return DIAG_ABSENT;
 
-				return r->tcpdiag_uid;
+				*uid = r->tcpdiag_uid;
+				return DIAG_FOUND;
 			}
 
-			return MISSING_UID;
+			/* a listening socket, found when no connection matched */
+			return DIAG_ABSENT;
 		}
 
 		if ((msghdr.msg_flags & MSG_TRUNC) || uret != 0)
-			return MISSING_UID;
+			return DIAG_FAILED;
+	}
+
+	return DIAG_FAILED;
+}
+
+/*
+** Check that netlink lookups work on this kernel before relying on them
+** alone: a loopback connection we own must be found with our UID, and a
+** connection that does not exist must be reported as absent.  Only then
+** are misses taken as final, rather than confirmed by scanning
+** /proc/net/tcp, which can take long on hosts with many sockets.
+** "sock" is closed and set to -1 if the kernel refuses the requests.
+*/
+
+static void netlink_selftest(int *sock) {
+	struct sockaddr_storage laddr;
+	struct sockaddr_storage faddr;
+	socklen_t len = sizeof(laddr);
+	int lsock = -1;
+	int csock = -1;
+	uid_t uid = MISSING_UID;
+	int found;
+	int absent;
+
+	memset(&laddr, 0, sizeof(laddr));
+	sin_setv4(htonl(INADDR_LOOPBACK), &laddr);
+
+	lsock = socket(AF_INET, SOCK_STREAM, 0);
+	csock = socket(AF_INET, SOCK_STREAM, 0);
+
+	if (lsock == -1 || csock == -1 ||
+		bind(lsock, (struct sockaddr *) &laddr, sin_len(&laddr)) != 0 ||
+		listen(lsock, 1) != 0 ||
+		getsockname(lsock, (struct sockaddr *) &laddr, &len) != 0 ||
+		connect(csock, (struct sockaddr *) &laddr, sin_len(&laddr)) != 0 ||
+		getsockname(csock, (struct sockaddr *) &faddr, &len) != 0)
+	{
+		debug("netlink self-test: %s", strerror(errno));
+		goto out;
+	}
+
+	found = lookup_tcp_diag(sock, &faddr, &laddr,
+				sin_port(&faddr), sin_port(&laddr), &uid);
+
+	/* nothing listens on the client's port, so this can't exist */
+	absent = DIAG_FAILED;
+	if (*sock != -1) {
+		absent = lookup_tcp_diag(sock, &faddr, &laddr,
+					sin_port(&faddr), htons(ntohs(sin_port(&laddr)) ^ 1), &uid);
+	}
+
+	if (found == DIAG_FOUND && uid == geteuid() && absent == DIAG_ABSENT)
+		netlink_trusted = true;
+	else {
+		o_log(LOG_INFO, "Netlink lookups could not be verified; "
+			"falling back to /proc/net/tcp when they fail");
+	}
+
+out:
+	if (csock != -1)
+		close(csock);
+
+	if (lsock != -1)
+		close(lsock);
+}
+
+#if BPF_SUPPORT
+
+/*
+** Build the BPF instructions used below.  Jumps are emitted with an
+** offset of 0 and pointed at their target by bpf_patch() once it is known.
+*/
+
+#define INSN(c, d, s, o, i) \
+	((struct bpf_insn) { .code = (c), .dst_reg = (d), .src_reg = (s), .off = (o), .imm = (i) })
+
+#define INSN_MOV64_REG(d, s)		INSN(BPF_ALU64 | BPF_MOV | BPF_X, d, s, 0, 0)
+#define INSN_MOV64_IMM(d, i)		INSN(BPF_ALU64 | BPF_MOV | BPF_K, d, 0, 0, i)
+#define INSN_ALU64_IMM(op, d, i)	INSN(BPF_ALU64 | (op) | BPF_K, d, 0, 0, i)
+#define INSN_LDX_W(d, s, o)			INSN(BPF_LDX | BPF_MEM | BPF_W, d, s, o, 0)
+#define INSN_STX(size, d, s, o)		INSN(BPF_STX | BPF_MEM | (size), d, s, o, 0)
+#define INSN_JMP_IMM(op, d, i)		INSN(BPF_JMP | (op) | BPF_K, d, 0, 0, i)
+#define INSN_JMP_A()				INSN(BPF_JMP | BPF_JA, 0, 0, 0, 0)
+#define INSN_CALL(f)				INSN(BPF_JMP | BPF_CALL, 0, 0, 0, f)
+#define INSN_EXIT()					INSN(BPF_JMP | BPF_EXIT, 0, 0, 0, 0)
+
+/* the stack slots used by the programs */
+#define STACK_KEY		(-(int) sizeof(struct bpf_owner_key))
+#define STACK_COOKIE	(STACK_KEY - 8)
+#define STACK_UID		(STACK_COOKIE - 8)
+
+#define KEY_OFF(field)		(STACK_KEY + (int) offsetof(struct bpf_owner_key, field))
+#define SOCK_OPS_OFF(field)	((int) offsetof(struct bpf_sock_ops, field))
+
+/*
+** Point the jump at "insns[from]" to the instruction at "insns[to]."
+*/
+
+static void bpf_patch(struct bpf_insn *insns, size_t from, size_t to) {
+	insns[from].off = (int16_t) (to - from - 1);
+}
+
+/*
+** Emit instructions loading the map "fd" into register "reg."
+** Returns the index of the next instruction.
+*/
+
+static size_t bpf_emit_map(struct bpf_insn *insns, size_t n, int reg, int fd) {
+	insns[n++] = INSN(BPF_LD | BPF_DW | BPF_IMM, reg, BPF_PSEUDO_MAP_FD, 0, fd);
+	insns[n++] = INSN(0, 0, 0, 0, 0);
+	return n;
+}
+
+/*
+** Emit instructions pointing register "reg" at the stack slot "off."
+** Returns the index of the next instruction.
+*/
+
+static size_t bpf_emit_stack(struct bpf_insn *insns, size_t n, int reg, int off) {
+	insns[n++] = INSN_MOV64_REG(reg, BPF_REG_10);
+	insns[n++] = INSN_ALU64_IMM(BPF_ADD, reg, off);
+	return n;
+}
+
+/*
+** Emit instructions storing the key of the connection whose sock_ops
+** context is in register 6 at STACK_KEY.  The remote port is in network
+** byte order; some kernels shift it into the upper half of its field,
+** which is undone.
+** Returns the index of the next instruction.
+*/
+
+static size_t bpf_emit_key(struct bpf_insn *insns, size_t n) {
+	size_t not_v4;
+	size_t v4_done;
+	size_t low_port;
+	int i;
+
+	insns[n++] = INSN_MOV64_IMM(BPF_REG_1, 0);
+	for (i = 0; i < (int) sizeof(struct bpf_owner_key); i += 8)
+		insns[n++] = INSN_STX(BPF_DW, BPF_REG_10, BPF_REG_1, STACK_KEY + i);
+
+	insns[n++] = INSN_MOV64_REG(BPF_REG_1, BPF_REG_6);
+	insns[n++] = INSN_CALL(BPF_FUNC_get_netns_cookie);
+	insns[n++] = INSN_STX(BPF_DW, BPF_REG_10, BPF_REG_0, KEY_OFF(netns));
+
+	insns[n++] = INSN_LDX_W(BPF_REG_3, BPF_REG_6, SOCK_OPS_OFF(family));
+	insns[n++] = INSN_STX(BPF_W, BPF_REG_10, BPF_REG_3, KEY_OFF(family));
+
+	insns[n++] = INSN_LDX_W(BPF_REG_2, BPF_REG_6, SOCK_OPS_OFF(local_port));
+	insns[n++] = INSN_STX(BPF_W, BPF_REG_10, BPF_REG_2, KEY_OFF(lport));
+
+	insns[n++] = INSN_LDX_W(BPF_REG_2, BPF_REG_6, SOCK_OPS_OFF(remote_port));
+	low_port = n;
+	insns[n++] = INSN_JMP_IMM(BPF_JLE, BPF_REG_2, 0xffff);
+	insns[n++] = INSN_ALU64_IMM(BPF_RSH, BPF_REG_2, 16);
+	bpf_patch(insns, low_port, n);
+	insns[n++] = INSN_STX(BPF_W, BPF_REG_10, BPF_REG_2, KEY_OFF(fport));
+
+	not_v4 = n;
+	insns[n++] = INSN_JMP_IMM(BPF_JNE, BPF_REG_3, AF_INET);
+
+	insns[n++] = INSN_LDX_W(BPF_REG_2, BPF_REG_6, SOCK_OPS_OFF(local_ip4));
+	insns[n++] = INSN_STX(BPF_W, BPF_REG_10, BPF_REG_2, KEY_OFF(laddr));
+	insns[n++] = INSN_LDX_W(BPF_REG_2, BPF_REG_6, SOCK_OPS_OFF(remote_ip4));
+	insns[n++] = INSN_STX(BPF_W, BPF_REG_10, BPF_REG_2, KEY_OFF(faddr));
+	v4_done = n;
+	insns[n++] = INSN_JMP_A();
+
+	bpf_patch(insns, not_v4, n);
+
+	for (i = 0; i < 4; ++i) {
+		insns[n++] = INSN_LDX_W(BPF_REG_2, BPF_REG_6, SOCK_OPS_OFF(local_ip6) + 4 * i);
+		insns[n++] = INSN_STX(BPF_W, BPF_REG_10, BPF_REG_2, KEY_OFF(laddr) + 4 * i);
+		insns[n++] = INSN_LDX_W(BPF_REG_2, BPF_REG_6, SOCK_OPS_OFF(remote_ip6) + 4 * i);
+		insns[n++] = INSN_STX(BPF_W, BPF_REG_10, BPF_REG_2, KEY_OFF(faddr) + 4 * i);
 	}
 
-	return MISSING_UID;
+	bpf_patch(insns, v4_done, n);
+	return n;
+}
+
+/*
+** Emit the program run on connect(), which records the UID of the calling
+** process under the cookie of its TCP socket in the map "pending_fd."
+** Returns the number of instructions.
+*/
+
+static size_t bpf_prog_connect(struct bpf_insn *insns, int pending_fd) {
+	size_t n = 0;
+	size_t not_tcp;
+
+	insns[n++] = INSN_MOV64_REG(BPF_REG_6, BPF_REG_1);
+	insns[n++] = INSN_LDX_W(BPF_REG_2, BPF_REG_6,
+					offsetof(struct bpf_sock_addr, protocol));
+	not_tcp = n;
+	insns[n++] = INSN_JMP_IMM(BPF_JNE, BPF_REG_2, IPPROTO_TCP);
+
+	insns[n++] = INSN_MOV64_REG(BPF_REG_1, BPF_REG_6);
+	insns[n++] = INSN_CALL(BPF_FUNC_get_socket_cookie);
+	insns[n++] = INSN_STX(BPF_DW, BPF_REG_10, BPF_REG_0, STACK_COOKIE);
+	insns[n++] = INSN_CALL(BPF_FUNC_get_current_uid_gid);
+	insns[n++] = INSN_STX(BPF_W, BPF_REG_10, BPF_REG_0, STACK_UID);
+
+	n = bpf_emit_map(insns, n, BPF_REG_1, pending_fd);
+	n = bpf_emit_stack(insns, n, BPF_REG_2, STACK_COOKIE);
+	n = bpf_emit_stack(insns, n, BPF_REG_3, STACK_UID);
+	insns[n++] = INSN_MOV64_IMM(BPF_REG_4, BPF_ANY);
+	insns[n++] = INSN_CALL(BPF_FUNC_map_update_elem);
+
+	/* connections are never refused */
+	bpf_patch(insns, not_tcp, n);
+	insns[n++] = INSN_MOV64_IMM(BPF_REG_0, 1);
+	insns[n++] = INSN_EXIT();
+
+	return n;
+}
+
+/*
+** Emit the sock_ops program, which moves the UID recorded by the connect()
+** program from "pending_fd" to the key of the connection in "owners_fd"
+** once it is established, and removes it when the socket is closed.
+** Returns the number of instructions.
+*/
+
+static size_t bpf_prog_sockops(	struct bpf_insn *insns,
+								int pending_fd,
+								int owners_fd)
+{
+	size_t n = 0;
+	size_t established;
+	size_t not_state;
+	size_t not_closed;
+	size_t deleted;
+	size_t not_pending;
+
+	insns[n++] = INSN_MOV64_REG(BPF_REG_6, BPF_REG_1);
+	insns[n++] = INSN_LDX_W(BPF_REG_2, BPF_REG_6, SOCK_OPS_OFF(op));
+	established = n;
+	insns[n++] = INSN_JMP_IMM(BPF_JEQ, BPF_REG_2, BPF_SOCK_OPS_ACTIVE_ESTABLISHED_CB);
+	not_state = n;
+	insns[n++] = INSN_JMP_IMM(BPF_JNE, BPF_REG_2, BPF_SOCK_OPS_STATE_CB);
+
+	/* the new state is the second argument */
+	insns[n++] = INSN_LDX_W(BPF_REG_2, BPF_REG_6, SOCK_OPS_OFF(args[1]));
+	not_closed = n;
+	insns[n++] = INSN_JMP_IMM(BPF_JNE, BPF_REG_2, BPF_TCP_CLOSE);
+
+	n = bpf_emit_key(insns, n);
+	n = bpf_emit_map(insns, n, BPF_REG_1, owners_fd);
+	n = bpf_emit_stack(insns, n, BPF_REG_2, STACK_KEY);
+	insns[n++] = INSN_CALL(BPF_FUNC_map_delete_elem);
+	deleted = n;
+	insns[n++] = INSN_JMP_A();
+
+	/* ask to be told when the connection changes state */
+	bpf_patch(insns, established, n);
+	insns[n++] = INSN_LDX_W(BPF_REG_2, BPF_REG_6, SOCK_OPS_OFF(bpf_sock_ops_cb_flags));
+	insns[n++] = INSN_ALU64_IMM(BPF_OR, BPF_REG_2, BPF_SOCK_OPS_STATE_CB_FLAG);
+	insns[n++] = INSN_MOV64_REG(BPF_REG_1, BPF_REG_6);
+	insns[n++] = INSN_CALL(BPF_FUNC_sock_ops_cb_flags_set);
+
+	insns[n++] = INSN_MOV64_REG(BPF_REG_1, BPF_REG_6);
+	insns[n++] = INSN_CALL(BPF_FUNC_get_socket_cookie);
+	insns[n++] = INSN_STX(BPF_DW, BPF_REG_10, BPF_REG_0, STACK_COOKIE);
+
+	n = bpf_emit_map(insns, n, BPF_REG_1, pending_fd);
+	n = bpf_emit_stack(insns, n, BPF_REG_2, STACK_COOKIE);
+	insns[n++] = INSN_CALL(BPF_FUNC_map_lookup_elem);
+	not_pending = n;
+	insns[n++] = INSN_JMP_IMM(BPF_JEQ, BPF_REG_0, 0);
+	insns[n++] = INSN_LDX_W(BPF_REG_7, BPF_REG_0, 0);
+	insns[n++] = INSN_STX(BPF_W, BPF_REG_10, BPF_REG_7, STACK_UID);
+
+	n = bpf_emit_map(insns, n, BPF_REG_1, pending_fd);
+	n = bpf_emit_stack(insns, n, BPF_REG_2, STACK_COOKIE);
+	insns[n++] = INSN_CALL(BPF_FUNC_map_delete_elem);
+
+	n = bpf_emit_key(insns, n);
+	n = bpf_emit_map(insns, n, BPF_REG_1, owners_fd);
+	n = bpf_emit_stack(insns, n, BPF_REG_2, STACK_KEY);
+	n = bpf_emit_stack(insns, n, BPF_REG_3, STACK_UID);
+	insns[n++] = INSN_MOV64_IMM(BPF_REG_4, BPF_ANY);
+	insns[n++] = INSN_CALL(BPF_FUNC_map_update_elem);
+
+	bpf_patch(insns, not_state, n);
+	bpf_patch(insns, not_closed, n);
+	bpf_patch(insns, deleted, n);
+	bpf_patch(insns, not_pending, n);
+	insns[n++] = INSN_MOV64_IMM(BPF_REG_0, 1);
+	insns[n++] = INSN_EXIT();
+
+	return n;
+}
+
+/*
+** Invoke the bpf() system call.
+*/
+
+static int sys_bpf(int cmd, union bpf_attr *attr) {
+	return syscall(__NR_bpf, cmd, attr, sizeof(*attr));
+}
+
+/*
+** Create a hash map of "max" entries.
+** Returns its descriptor, or -1 with errno set.
+*/
+
+static int bpf_map_create(	u_int32_t type,
+							u_int32_t key_size,
+							u_int32_t max,
+							u_int32_t flags)
+{
+	union bpf_attr attr;
+
+	memset(&attr, 0, sizeof(attr));
+	attr.map_type = type;
+	attr.key_size = key_size;
+	attr.value_size = sizeof(u_int32_t);
+	attr.max_entries = max;
+	attr.map_flags = flags;
+
+	return sys_bpf(BPF_MAP_CREATE, &attr);
+}
+
+/*
+** Load the "num" instructions in "insns" as a program of type "type,"
+** and attach it to the cgroup "cgroup_fd" as "attach."
+** Returns the descriptor of the link, which detaches the program once it
+** is closed, or -1 with errno set.
+*/
+
+static int bpf_attach(	int cgroup_fd,
+						u_int32_t type,
+						u_int32_t attach,
+						const struct bpf_insn *insns,
+						size_t num)
+{
+	union bpf_attr attr;
+	int prog_fd;
+	int link_fd;
+	int err;
+
+	memset(&attr, 0, sizeof(attr));
+	attr.prog_type = type;
+	attr.expected_attach_type = attach;
+	attr.insns = (uintptr_t) insns;
+	attr.insn_cnt = num;
+	attr.license = (uintptr_t) "GPL";
+
+	prog_fd = sys_bpf(BPF_PROG_LOAD, &attr);
+	if (prog_fd == -1)
+		return -1;
+
+	memset(&attr, 0, sizeof(attr));
+	attr.link_create.prog_fd = prog_fd;
+	attr.link_create.target_fd = cgroup_fd;
+	attr.link_create.attach_type = attach;
+
+	link_fd = sys_bpf(BPF_LINK_CREATE, &attr);
+
+	err = errno;
+	close(prog_fd);
+	errno = err;
+
+	return link_fd;
+}
+
+/*
+** Open the root of the cgroup v2 hierarchy.
+** Returns its descriptor, or -1 with errno set.
+*/
+
+static int bpf_cgroup_open(void) {
+	struct mntent *ent;
+	FILE *fp;
+	int fd = -1;
+
+	fp = setmntent("/proc/self/mounts", "r");
+	if (!fp)
+		return -1;
+
+	errno = ENOENT;
+	while (fd == -1 && (ent = getmntent(fp)))
+		if (!strcmp(ent->mnt_type, "cgroup2"))
+			fd = open(ent->mnt_dir, O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+
+	endmntent(fp);
+	return fd;
+}
+
+/*
+** Fill "key" with the key of the connection from "laddr":"lport" to
+** "faddr":"fport," as it is filled by bpf_emit_key().  If "mapped" is
+** set, the key of an IPv4 connection made from an IPv6 socket is filled.
+*/
+
+static void bpf_owner_key(	struct bpf_owner_key *key,
+							struct sockaddr_storage *laddr,
+							struct sockaddr_storage *faddr,
+							in_port_t lport,
+							in_port_t fport,
+							bool mapped)
+{
+	memset(key, 0, sizeof(*key));
+	key->netns = bpf_netns;
+	key->family = laddr->ss_family;
+	key->lport = ntohs(lport);
+	key->fport = fport;
+
+	if (laddr->ss_family == AF_INET6) {
+		memcpy(key->laddr, sin_addr(laddr), sizeof(struct in6_addr));
+		memcpy(key->faddr, sin_addr(faddr), sizeof(struct in6_addr));
+	} else if (mapped) {
+		key->family = AF_INET6;
+		key->laddr[2] = key->faddr[2] = htonl(0xffff);
+		memcpy(&key->laddr[3], sin_addr(laddr), sizeof(struct in_addr));
+		memcpy(&key->faddr[3], sin_addr(faddr), sizeof(struct in_addr));
+	} else {
+		memcpy(&key->laddr[0], sin_addr(laddr), sizeof(struct in_addr));
+		memcpy(&key->faddr[0], sin_addr(faddr), sizeof(struct in_addr));
+	}
+}
+
+/*
+** Look up the owner of the connection from "laddr":"lport" to
+** "faddr":"fport" in the owner map, storing it in "uid."
+** Returns 0 if it was found, -1 otherwise.
+*/
+
+static int bpf_get_user(	struct sockaddr_storage *laddr,
+							struct sockaddr_storage *faddr,
+							in_port_t lport,
+							in_port_t fport,
+							uid_t *uid)
+{
+	struct bpf_owner_key key;
+	union bpf_attr attr;
+	u_int32_t val;
+	int pass;
+
+	for (pass = 0; pass < (laddr->ss_family == AF_INET ? 2 : 1); ++pass) {
+		bpf_owner_key(&key, laddr, faddr, lport, fport, pass == 1);
+
+		memset(&attr, 0, sizeof(attr));
+		attr.map_fd = bpf_owners_fd;
+		attr.key = (uintptr_t) &key;
+		attr.value = (uintptr_t) &val;
+
+		if (sys_bpf(BPF_MAP_LOOKUP_ELEM, &attr) == 0) {
+			*uid = val;
+			return 0;
+		}
+	}
+
+	return -1;
+}
+
+/*
+** Check that the owner map works on this kernel: a loopback connection
+** we make must be found with our UID, which netlink, if available, must
+** agree with.
+** Returns 0 on success, -1 on failure.
+*/
+
+static int bpf_selftest(int *nl_sock) {
+	struct sockaddr_storage laddr;
+	struct sockaddr_storage faddr;
+	socklen_t len = sizeof(faddr);
+	int lsock = -1;
+	int csock = -1;
+	uid_t uid = MISSING_UID;
+	uid_t nluid = MISSING_UID;
+	socklen_t cookie_len = sizeof(bpf_netns);
+	int ret = -1;
+
+	memset(&faddr, 0, sizeof(faddr));
+	sin_setv4(htonl(INADDR_LOOPBACK), &faddr);
+
+	lsock = socket(AF_INET, SOCK_STREAM, 0);
+	csock = socket(AF_INET, SOCK_STREAM, 0);
+
+	if (lsock == -1 || csock == -1 ||
+		bind(lsock, (struct sockaddr *) &faddr, sin_len(&faddr)) != 0 ||
+		listen(lsock, 1) != 0 ||
+		getsockname(lsock, (struct sockaddr *) &faddr, &len) != 0 ||
+		connect(csock, (struct sockaddr *) &faddr, sin_len(&faddr)) != 0 ||
+		getsockname(csock, (struct sockaddr *) &laddr, &len) != 0 ||
+		getsockopt(csock, SOL_SOCKET, SO_NETNS_COOKIE, &bpf_netns, &cookie_len) != 0)
+	{
+		debug("eBPF self-test: %s", strerror(errno));
+		goto out;
+	}
+
+	if (bpf_get_user(&laddr, &faddr, sin_port(&laddr), sin_port(&faddr), &uid) != 0 ||
+		uid != getuid())
+	{
+		goto out;
+	}
+
+	if (*nl_sock != -1 &&
+		lookup_tcp_diag(nl_sock, &laddr, &faddr, sin_port(&laddr),
+			sin_port(&faddr), &nluid) == DIAG_FOUND && nluid != uid)
+	{
+		goto out;
+	}
+
+	ret = 0;
+
+out:
+	if (csock != -1)
+		close(csock);
+
+	if (lsock != -1)
+		close(lsock);
+
+	return ret;
+}
+
+/*
+** Attach the programs maintaining the owner map to the root of the
+** cgroup v2 hierarchy, and check that the map works.  On failure, owners
+** are looked up with netlink alone.
+*/
+
+static void bpf_open(int *nl_sock) {
+	struct bpf_insn insns[BPF_PROG_MAX];
+	int cgroup_fd;
+	int pending_fd = -1;
+	size_t num;
+	size_t i;
+
+	cgroup_fd = bpf_cgroup_open();
+	if (cgroup_fd == -1)
+		goto fail;
+
+	pending_fd = bpf_map_create(BPF_MAP_TYPE_LRU_HASH, sizeof(u_int64_t),
+					BPF_PENDING_MAX, 0);
+	bpf_owners_fd = bpf_map_create(BPF_MAP_TYPE_HASH,
+					sizeof(struct bpf_owner_key), BPF_OWNERS_MAX, BPF_F_NO_PREALLOC);
+
+	if (pending_fd == -1 || bpf_owners_fd == -1)
+		goto fail;
+
+	/* the programs keep the maps they use */
+	num = bpf_prog_sockops(insns, pending_fd, bpf_owners_fd);
+	bpf_links[0] = bpf_attach(cgroup_fd, BPF_PROG_TYPE_SOCK_OPS,
+						BPF_CGROUP_SOCK_OPS, insns, num);
+	if (bpf_links[0] == -1)
+		goto fail;
+
+	num = bpf_prog_connect(insns, pending_fd);
+	bpf_links[1] = bpf_attach(cgroup_fd, BPF_PROG_TYPE_CGROUP_SOCK_ADDR,
+						BPF_CGROUP_INET4_CONNECT, insns, num);
+	bpf_links[2] = bpf_attach(cgroup_fd, BPF_PROG_TYPE_CGROUP_SOCK_ADDR,
+						BPF_CGROUP_INET6_CONNECT, insns, num);
+	if (bpf_links[1] == -1 || bpf_links[2] == -1)
+		goto fail;
+
+	close(cgroup_fd);
+	close(pending_fd);
+
+	if (bpf_selftest(nl_sock) != 0) {
+		o_log(LOG_INFO, "The eBPF owner map could not be verified; "
+			"looking up connections with netlink");
+		goto detach;
+	}
+
+	return;
+
+fail:
+	o_log(LOG_INFO, "Unable to set up the eBPF owner map: %s; "
+		"looking up connections with netlink", strerror(errno));
+
+	if (cgroup_fd != -1)
+		close(cgroup_fd);
+
+	if (pending_fd != -1)
+		close(pending_fd);
+
+detach:
+	for (i = 0; i < sizeof(bpf_links) / sizeof(bpf_links[0]); ++i) {
+		if (bpf_links[i] != -1)
+			close(bpf_links[i]);
+
+		bpf_links[i] = -1;
+	}
+
+	if (bpf_owners_fd != -1)
+		close(bpf_owners_fd);
+
+	bpf_owners_fd = -1;
+}
+
+#endif
+
+#ifdef HAVE_SETNS
+
+/*
+** Open the namespace at "path," or every namespace in it if it is a
+** directory, such as /run/netns.  Entries of directories that can't be
+** opened are skipped.
+** Returns 0 on success, -1 on failure.
+*/
+
+static int netns_open_path(const char *path, bool dir_entry) {
+	struct stat self_st;
+	struct stat st;
+	int self_fd;
+	int ret;
+
+	if (stat(path, &st) != 0) {
+		o_log(LOG_CRIT, "stat: %s: %s", path, strerror(errno));
+		return dir_entry ? 0 : -1;
+	}
+
+	if (S_ISDIR(st.st_mode) && !dir_entry) {
+		struct dirent *ent;
+		DIR *dir = opendir(path);
+
+		if (!dir) {
+			o_log(LOG_CRIT, "opendir: %s: %s", path, strerror(errno));
+			return -1;
+		}
+
+		while ((ent = readdir(dir))) {
+			char buf[PATH_MAX];
+
+			if (ent->d_name[0] == '.')
+				continue;
+
+			snprintf(buf, sizeof(buf), "%s/%s", path, ent->d_name);
+			netns_open_path(buf, true);
+		}
+
+		closedir(dir);
+		return 0;
+	}
+
+	self_fd = open("/proc/self/ns/net", O_RDONLY | O_CLOEXEC);
+	if (self_fd == -1 || fstat(self_fd, &self_st) != 0) {
+		o_log(LOG_CRIT, "open: /proc/self/ns/net: %s", strerror(errno));
+
+		if (self_fd != -1)
+			close(self_fd);
+
+		return -1;
+	}
+
+	ret = netns_open(path, self_fd, &self_st);
+	close(self_fd);
+
+	return dir_entry ? 0 : ret;
+}
+
+/*
+** Enter the namespace at "path," open its sockets, and return to the
+** namespace referred to by "self_fd."  Our own namespace and namespaces
+** that are already open are skipped.
+** Returns 0 on success, -1 on failure.
+*/
+
+static int netns_open(const char *path, int self_fd, const struct stat *self_st) {
+	struct netns *ns;
+	struct stat st;
+	size_t i;
+	int fd;
+
+	fd = open(path, O_RDONLY | O_CLOEXEC);
+	if (fd == -1 || fstat(fd, &st) != 0) {
+		o_log(LOG_CRIT, "open: %s: %s", path, strerror(errno));
+		goto out_fail;
+	}
+
+	if (st.st_dev == self_st->st_dev && st.st_ino == self_st->st_ino) {
+		close(fd);
+		return 0;
+	}
+
+	for (i = 0; i < netns_num; ++i) {
+		struct stat cur;
+
+		if (stat(netns_pool[i].path, &cur) == 0 &&
+			cur.st_dev == st.st_dev && cur.st_ino == st.st_ino)
+		{
+			close(fd);
+			return 0;
+		}
+	}
+
+	if (setns(fd, CLONE_NEWNET) != 0) {
+		o_log(LOG_CRIT, "setns: %s: %s", path, strerror(errno));
+		goto out_fail;
+	}
+
+	netns_pool = xrealloc(netns_pool, (netns_num + 1) * sizeof(struct netns));
+	ns = &netns_pool[netns_num];
+	memset(ns, 0, sizeof(*ns));
+
+	ns->diag_sock = socket(AF_NETLINK, SOCK_DGRAM | SOCK_CLOEXEC, NETLINK_TCPDIAG);
+	ns->route_sock = socket(AF_NETLINK, SOCK_RAW | SOCK_CLOEXEC, NETLINK_ROUTE);
+
+	if (setns(self_fd, CLONE_NEWNET) != 0) {
+		/* we can't tell which namespace our sockets would end up in */
+		o_log(LOG_CRIT, "Fatal: setns: %s", strerror(errno));
+		exit(EXIT_FAILURE);
+	}
+
+	close(fd);
+
+	if (ns->diag_sock == -1 || ns->route_sock == -1) {
+		o_log(LOG_CRIT, "Failed to open netlink sockets in %s", path);
+
+		if (ns->diag_sock != -1)
+			close(ns->diag_sock);
+
+		if (ns->route_sock != -1)
+			close(ns->route_sock);
+
+		return -1;
+	}
+
+	ns->path = xstrdup(path);
+	++netns_num;
+
+	netns_load_addrs(ns);
+	debug("Opened network namespace %s", path);
+
+	return 0;
+
+out_fail:
+	if (fd != -1)
+		close(fd);
+
+	return -1;
+}
+
+/*
+** Read the addresses of the namespace "ns" using its route socket.
+** Called with the pool locked, or before threads are started.
+** Returns 0 on success, -1 on failure.
+*/
+
+static int netns_load_addrs(struct netns *ns) {
+	struct sockaddr_nl nladdr;
+	struct {
+		struct nlmsghdr nlh;
+		struct ifaddrmsg ifa;
+	} req;
+	char buf[8192];
+
+	memset(&req, 0, sizeof(req));
+	req.nlh.nlmsg_len = sizeof(req);
+	req.nlh.nlmsg_type = RTM_GETADDR;
+	req.nlh.nlmsg_flags = NLM_F_REQUEST | NLM_F_DUMP;
+	req.nlh.nlmsg_seq = 1;
+	req.ifa.ifa_family = AF_UNSPEC;
+
+	memset(&nladdr, 0, sizeof(nladdr));
+	nladdr.nl_family = AF_NETLINK;
+
+	if (sendto(ns->route_sock, &req, sizeof(req), 0,
+			(struct sockaddr *) &nladdr, sizeof(nladdr)) < 0)
+	{
+		debug("sendto: %s: %s", ns->path, strerror(errno));
+		return -1;
+	}
+
+	ns->num_addrs = 0;
+
+	for (;;) {
+		struct nlmsghdr *h = (struct nlmsghdr *) buf;
+		ssize_t ret = recv(ns->route_sock, buf, sizeof(buf), 0);
+		size_t uret;
+
+		if (ret < 0) {
+			if (errno == EINTR)
+				continue;
+
+			debug("recv: %s: %s", ns->path, strerror(errno));
+			return -1;
+		}
+
+		uret = (size_t) ret;
+
+		for (; NLMSG_OK(h, uret); h = NLMSG_NEXT(h, uret)) {
+			struct ifaddrmsg *ifa = NLMSG_DATA(h);
+			struct rtattr *rta = IFA_RTA(ifa);
+			size_t rta_len = IFA_PAYLOAD(h);
+			struct sockaddr_storage addr;
+
+			if (h->nlmsg_type == NLMSG_DONE)
+				return 0;
+
+			if (h->nlmsg_type == NLMSG_ERROR)
+				return -1;
+
+			if (h->nlmsg_type != RTM_NEWADDR)
+				continue;
+
+			for (; RTA_OK(rta, rta_len); rta = RTA_NEXT(rta, rta_len)) {
+				if (rta->rta_type != IFA_ADDRESS)
+					continue;
+
+				memset(&addr, 0, sizeof(addr));
+
+				if (ifa->ifa_family == AF_INET)
+					sin_setv4(*(in_addr_t *) RTA_DATA(rta), &addr);
+#if WANT_IPV6
+				else if (ifa->ifa_family == AF_INET6)
+					sin_setv6(RTA_DATA(rta), &addr);
+#endif
+				else
+					continue;
+
+				ns->addrs = xrealloc(ns->addrs,
+					(ns->num_addrs + 1) * sizeof(struct sockaddr_storage));
+				ns->addrs[ns->num_addrs++] = addr;
+			}
+		}
+	}
+}
+
+/*
+** Find the namespace that "addr" belongs to.  If no namespace has the
+** address, the addresses of all namespaces are read again, at most once
+** every NETNS_REFRESH seconds.  Called with the pool locked.
+** Returns NULL if the address belongs to none of the namespaces.
+*/
+
+static struct netns *netns_find(struct sockaddr_storage *addr) {
+	bool reloaded = false;
+	enum mem_tag prev;
+
+	for (;;) {
+		time_t now;
+		size_t i;
+
+		for (i = 0; i < netns_num; ++i) {
+			struct netns *ns = &netns_pool[i];
+			size_t j;
+
+			for (j = 0; j < ns->num_addrs; ++j) {
+				if (ns->addrs[j].ss_family == addr->ss_family &&
+					sin_equal(&ns->addrs[j], addr))
+				{
+					return ns;
+				}
+			}
+		}
+
+		now = time(NULL);
+		if (reloaded || now < netns_loaded + NETNS_REFRESH)
+			return NULL;
+
+		prev = mem_enter(MEM_MASQ);
+
+		for (i = 0; i < netns_num; ++i)
+			netns_load_addrs(&netns_pool[i]);
+
+		mem_leave(prev);
+
+		netns_loaded = now;
+		reloaded = true;
+	}
+}
+
+/*
+** Returns the UID of the owner of the connection (lport, fport) between
+** "laddr" and "faddr" in the namespace "laddr" belongs to, or MISSING_UID
+** on failure.  The ports are in network byte order.
+*/
+
+static uid_t netns_get_user(	in_port_t lport,
+							in_port_t fport,
+							struct sockaddr_storage *laddr,
+							struct sockaddr_storage *faddr)
+{
+	struct netns *ns;
+	uid_t uid = MISSING_UID;
+
+	o_lock(netns_mutex);
+
+	ns = netns_find(laddr);
+	if (ns && ns->diag_sock != -1 &&
+		lookup_tcp_diag(&ns->diag_sock, laddr, faddr, lport, fport, &uid) != DIAG_FOUND)
+	{
+		uid = MISSING_UID;
+	}
+
+	if (ns)
+		debug("Lookup in %s: %lu", ns->path, (unsigned long) uid);
+
+	o_unlock(netns_mutex);
+	return uid;
+}
+
+#endif
+
+#if THREAD_SUPPORT
+/*
+** Close the netlink socket of a thread that is exiting.
+*/
+
+static void netlink_close_cb(void *data) {
+	int *sock = data;
+
+	if (*sock != -1)
+		close(*sock);
+
+	xfree(sock);
+}
+#endif
+
+/*
+** Returns a pointer to the netlink socket of the calling thread,
+** which is -1 if netlink is unavailable.
+*/
+
+static int *netlink_sock(void) {
+#if THREAD_SUPPORT
+	int *sock = pthread_getspecific(netlink_key);
+
+	if (!sock) {
+		sock = xmalloc(sizeof(int));
+		*sock = -1;
+
+		if (netlink_avail) {
+			*sock = socket(AF_NETLINK, SOCK_DGRAM, NETLINK_TCPDIAG);
+			if (*sock == -1)
+				debug("Failed to open netlink socket: %s", strerror(errno));
+		}
+
+		pthread_setspecific(netlink_key, sock);
+	}
+
+	return sock;
+#else
+	return &netlink_fd;
+#endif
 }
 
 /*
@@ -910,12 +2288,128 @@ static uid_t lookup_tcp_diag(	struct sockaddr_storage *src_addr,
 */
 
 int k_open(void) {
-	netlink_sock = socket(AF_NETLINK, SOCK_DGRAM, NETLINK_TCPDIAG);
+	int sock;
+#if THREAD_SUPPORT
+	int *slot;
+	int ret;
 
-	if (netlink_sock == -1) {
+	ret = pthread_key_create(&netlink_key, netlink_close_cb);
+	if (ret != 0) {
+		errno = ret;
+		return -1;
+	}
+#endif
+
+	sock = socket(AF_NETLINK, SOCK_DGRAM, NETLINK_TCPDIAG);
+
+	if (sock == -1) {
 		/* Not a fatal error, just log a debug message */
 		debug("Failed to open netlink socket: %s", strerror(errno));
+	} else {
+		netlink_selftest(&sock);
+
+		/* the socket is closed if the kernel refused the requests */
+		netlink_avail = sock != -1;
+	}
+
+#if BPF_SUPPORT
+	if (opt_enabled(BPF_OWNERS))
+		bpf_open(&sock);
+#endif
+
+#if THREAD_SUPPORT
+	slot = xmalloc(sizeof(int));
+	*slot = sock;
+	pthread_setspecific(netlink_key, slot);
+#else
+	netlink_fd = sock;
+#endif
+
+#ifdef HAVE_SETNS
+	{
+		enum mem_tag prev = mem_enter(MEM_MASQ);
+		list_t *cur;
+
+		for (cur = netns_paths; cur; cur = cur->next) {
+			if (netns_open_path(cur->data, false) != 0) {
+				mem_leave(prev);
+				return -1;
+			}
+		}
+
+		mem_leave(prev);
+		netns_loaded = time(NULL);
 	}
+#endif
 
 	return 0;
 }
+
+#ifdef FUZZING_BUILD_MODE_UNSAFE_FOR_PRODUCTION
+
+void fuzz_proc_net_tcp(FILE *fp) {
+	struct flight_query query;
+	struct flight_query *queryp = &query;
+	struct sockaddr_storage laddr;
+	struct sockaddr_storage faddr;
+	in_addr_t addr4;
+#if WANT_IPV6
+	struct in6_addr in6;
+#endif
+
+	memset(&query, 0, sizeof(query));
+	query.lport = FUZZ_LPORT;
+	query.fport = FUZZ_FPORT;
+	query.laddr = &laddr;
+	query.faddr = &faddr;
+
+	(void) inet_pton(AF_INET, FUZZ_LADDR, &addr4);
+	sin_setv4(addr4, &laddr);
+	(void) inet_pton(AF_INET, FUZZ_FADDR, &addr4);
+	sin_setv4(addr4, &faddr);
+	proc_tcp4_scan(fp, &queryp, 1);
+
+#if WANT_IPV6
+	(void) inet_pton(AF_INET6, FUZZ_LADDR6, &in6);
+	sin_setv6(&in6, &laddr);
+	(void) inet_pton(AF_INET6, FUZZ_FADDR6, &in6);
+	sin_setv6(&in6, &faddr);
+
+	query.found = false;
+	rewind(fp);
+	proc_tcp6_scan(fp, &queryp, 1);
+#endif
+}
+
+#	if MASQ_SUPPORT
+
+void fuzz_conntrack(FILE *fp) {
+	static const int ct_types[] = {
+		CT_MASQFILE,
+		CT_IPCONNTRACK,
+		CT_NFCONNTRACK,
+	};
+	struct sockaddr_storage laddr;
+	struct sockaddr_storage faddr;
+	in_addr_t addr4;
+	size_t i;
+
+	(void) inet_pton(AF_INET, FUZZ_LADDR, &addr4);
+	sin_setv4(addr4, &laddr);
+	(void) inet_pton(AF_INET, FUZZ_FADDR, &addr4);
+	sin_setv4(addr4, &faddr);
+
+	for (i = 0; i < sizeof(ct_types) / sizeof(ct_types[0]); ++i) {
+		struct ct_entry entry;
+
+		rewind(fp);
+		if (masq_ct_scan(fp, ct_types[i], FUZZ_LPORT, FUZZ_FPORT,
+				&faddr, &entry) == 0)
+		{
+			masq_ct_reply(-1, &entry, FUZZ_LPORT, FUZZ_FPORT, &laddr, &faddr);
+		}
+	}
+}
+
+#	endif
+#endif
@@ -54,6 +54,7 @@
 #include "inet_util.h"
 #include "missing.h"
 #include "masq.h"
+#include "audit.h"
 #include "options.h"
 
 #define PF_DEVICE "/dev/pf"
@@ -200,6 +201,7 @@ int masq(	int sock,
 
 		sockprintf(sock, "%d,%d:USERID:%s:%s\r\n",
 				lport, fport, os, user);
+		audit_reply(AUDIT_MASQ, AUDIT_USERID, MISSING_UID, user);
 
 		get_ip(faddr, ipbuf, sizeof(ipbuf));
 
@@ -0,0 +1,126 @@
+/*
+** lpm.c - oidentd longest-prefix match of network addresses.
+** Copyright (c) 2019      Janik Rabe  <oidentd@janikrabe.com>
+**
+** This program is free software; you can redistribute it and/or modify
+** it under the terms of the GNU General Public License, version 2,
+** as published by the Free Software Foundation.
+**
+** This program is distributed in the hope that it will be useful,
+** but WITHOUT ANY WARRANTY; without even the implied warranty of
+** MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+** GNU General Public License for more details.
+**
+** You should have received a copy of the GNU General Public License
+** along with this program; if not, write to the Free Software
+** Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA
+*/
+
+#include <config.h>
+
+#include <unistd.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <syslog.h>
+#include <pwd.h>
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+
+#include "oidentd.h"
+#include "util.h"
+#include "missing.h"
+#include "inet_util.h"
+#include "lpm.h"
+
+#define LPM_BIT(bytes, i)	(((bytes)[(i) / 8] >> (7 - (i) % 8)) & 1)
+
+static u_int32_t lpm_node_new(struct lpm_trie *trie);
+
+/*
+** Append an empty node to "trie."
+** Returns the index of the node.
+*/
+
+static u_int32_t lpm_node_new(struct lpm_trie *trie) {
+	struct lpm_node *node;
+
+	trie->nodes = xrealloc(trie->nodes, (trie->num + 1) * sizeof(struct lpm_node));
+
+	node = &trie->nodes[trie->num];
+	node->child[0] = 0;
+	node->child[1] = 0;
+	node->value = -1;
+
+	return trie->num++;
+}
+
+/*
+** Give the network "cidr" the value "value," replacing any value it
+** already had.  Networks are only ever added; the trie is built before
+** it is used.
+*/
+
+void lpm_insert(struct lpm *lpm, const struct cidr *cidr, int value) {
+	struct lpm_trie *trie = cidr->family == AF_INET ? &lpm->v4 : &lpm->v6;
+	u_int32_t node;
+	u_int32_t i;
+
+	if (trie->num == 0)
+		lpm_node_new(trie);
+
+	node = 0;
+
+	for (i = 0; i < cidr->bits; ++i) {
+		int bit = LPM_BIT(cidr->addr, i);
+
+		if (trie->nodes[node].child[bit] == 0) {
+			u_int32_t child = lpm_node_new(trie);
+			trie->nodes[node].child[bit] = child;
+		}
+
+		node = trie->nodes[node].child[bit];
+	}
+
+	trie->nodes[node].value = value;
+}
+
+/*
+** Find the most specific network containing "ss."  IPv6-mapped IPv4
+** addresses are looked up as IPv4 addresses.  The cost depends on the
+** prefix lengths only, not on the number of networks.
+** Returns the value of the network, or -1 if "ss" isn't in any.
+*/
+
+int lpm_lookup(const struct lpm *lpm, const struct sockaddr_storage *ss) {
+	const struct lpm_trie *trie = &lpm->v4;
+	const unsigned char *bytes;
+	u_int32_t max = 32;
+	u_int32_t node = 0;
+	int ret;
+	u_int32_t i;
+
+	bytes = cidr_bytes(ss, AF_INET);
+	if (!bytes) {
+		trie = &lpm->v6;
+		max = 128;
+		bytes = cidr_bytes(ss, AF_INET6);
+	}
+
+	if (!bytes || trie->num == 0)
+		return -1;
+
+	ret = trie->nodes[0].value;
+
+	for (i = 0; i < max; ++i) {
+		node = trie->nodes[node].child[LPM_BIT(bytes, i)];
+		if (node == 0)
+			break;
+
+		if (trie->nodes[node].value != -1)
+			ret = trie->nodes[node].value;
+	}
+
+	return ret;
+}
@@ -0,0 +1,46 @@
+/*
+** lpm.h - oidentd longest-prefix match of network addresses.
+** Copyright (c) 2019      Janik Rabe  <oidentd@janikrabe.com>
+**
+** This program is free software; you can redistribute it and/or modify
+** it under the terms of the GNU General Public License, version 2,
+** as published by the Free Software Foundation.
+**
+** This program is distributed in the hope that it will be useful,
+** but WITHOUT ANY WARRANTY; without even the implied warranty of
+** MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+** GNU General Public License for more details.
+**
+** You should have received a copy of the GNU General Public License
+** along with this program; if not, write to the Free Software
+** Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA
+*/
+
+#ifndef __OIDENTD_LPM_H
+#define __OIDENTD_LPM_H
+
+/*
+** A binary trie per address family.  Node 0 is the root; a child index
+** of 0 means there is no child.  "value" is that of the network ending at
+** the node, or -1.
+*/
+
+struct lpm_node {
+	u_int32_t child[2];
+	int value;
+};
+
+struct lpm_trie {
+	struct lpm_node *nodes;
+	u_int32_t num;
+};
+
+struct lpm {
+	struct lpm_trie v4;
+	struct lpm_trie v6;
+};
+
+void lpm_insert(struct lpm *lpm, const struct cidr *cidr, int value);
+int lpm_lookup(const struct lpm *lpm, const struct sockaddr_storage *ss);
+
+#endif
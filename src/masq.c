@@ -27,6 +27,7 @@
 #include <errno.h>
 #include <pwd.h>
 #include <sys/types.h>
+#include <sys/stat.h>
 #include <sys/wait.h>
 #include <sys/socket.h>
 #include <netinet/in.h>
@@ -43,6 +44,9 @@
 #include "masq.h"
 #include "options.h"
 #include "forward.h"
+#include "shm_cache.h"
+#include "audit.h"
+#include "fuzz.h"
 
 struct sockaddr_storage proxy;
 
@@ -52,7 +56,38 @@ in_port_t fwdport;
 
 extern char *ret_os;
 
+/*
+** Entries of the masquerading map are cached for the address of the host
+** and the version of the file they were read from.  Hosts without an
+** entry are cached as well.
+*/
+
+struct masq_key {
+	int family;
+	unsigned char addr[16];
+	ino_t ino;
+	off_t size;
+	time_t mtime;
+};
+
+struct masq_val {
+	bool found;
+	char user[192];
+	char os[64];
+};
+
 static bool blank_line(const char *buf);
+static int read_masq_map(	struct sockaddr_storage *host,
+							char *user,
+							size_t user_len,
+							char *os,
+							size_t os_len);
+static int masq_map_scan(	FILE *fp,
+							struct sockaddr_storage *host,
+							char *user,
+							size_t user_len,
+							char *os,
+							size_t os_len);
 
 /*
 ** Returns true if the buffer contains only
@@ -72,7 +107,8 @@ static bool blank_line(const char *buf) {
 }
 
 /*
-** Parse the masquerading map file.
+** Find the user and operating system the masquerading map file gives for
+** "host," using the shared lookup cache if possible.
 ** Returns 0 on success, -1 on failure.
 */
 
@@ -82,10 +118,12 @@ int find_masq_entry(struct sockaddr_storage *host,
 					char *os,
 					size_t os_len)
 {
-	FILE *fp;
-	struct sockaddr_storage addr;
-	u_int32_t line_num;
-	char buf[4096];
+	struct masq_key key;
+	struct masq_val val;
+	struct stat st;
+	const unsigned char *bytes;
+	bool cacheable;
+	int ret;
 
 #if HAVE_LIBUDB
 	if (opt_enabled(USEUDB)) {
@@ -110,6 +148,65 @@ int find_masq_entry(struct sockaddr_storage *host,
 	}
 #endif
 
+	memset(&key, 0, sizeof(key));
+	key.family = host->ss_family;
+	bytes = cidr_bytes(host, key.family);
+	cacheable = bytes && stat(MASQ_MAP, &st) == 0;
+
+	if (cacheable) {
+		memcpy(key.addr, bytes, key.family == AF_INET ? 4 : 16);
+		key.ino = st.st_ino;
+		key.size = st.st_size;
+		key.mtime = st.st_mtime;
+
+		if (shm_cache_get(SHM_MASQ, &key, sizeof(key),
+				&val, sizeof(val)) == sizeof(val))
+		{
+			if (!val.found)
+				return -1;
+
+			if (strlen(val.user) < user_len && strlen(val.os) < os_len) {
+				xstrncpy(user, val.user, user_len);
+				xstrncpy(os, val.os, os_len);
+				return 0;
+			}
+		}
+	}
+
+	ret = read_masq_map(host, user, user_len, os, os_len);
+
+	if (cacheable && (ret != 0 ||
+		(strlen(user) < sizeof(val.user) && strlen(os) < sizeof(val.os))))
+	{
+		memset(&val, 0, sizeof(val));
+		val.found = ret == 0;
+
+		if (val.found) {
+			xstrncpy(val.user, user, sizeof(val.user));
+			xstrncpy(val.os, os, sizeof(val.os));
+		}
+
+		shm_cache_put(SHM_MASQ, &key, sizeof(key),
+			&val, sizeof(val), SHM_MASQ_TTL);
+	}
+
+	return ret;
+}
+
+/*
+** Look up the entry for "host" in the masquerading map file.
+** Returns 0 on success, -1 on failure.
+*/
+
+static int read_masq_map(	struct sockaddr_storage *host,
+							char *user,
+							size_t user_len,
+							char *os,
+							size_t os_len)
+{
+	FILE *fp;
+	int ret;
+
 	fp = fopen(MASQ_MAP, "r");
 	if (!fp) {
 		if (errno != EEXIST)
@@ -117,11 +214,34 @@ int find_masq_entry(struct sockaddr_storage *host,
 		return -1;
 	}
 
+	ret = masq_map_scan(fp, host, user, user_len, os, os_len);
+
+	fclose(fp);
+	return ret;
+}
+
+/*
+** Look up the entry for "host" in "fp," which has the format of the
+** masquerading map file.
+** Returns 0 on success, -1 on failure.
+*/
+
+static int masq_map_scan(	FILE *fp,
+							struct sockaddr_storage *host,
+							char *user,
+							size_t user_len,
+							char *os,
+							size_t os_len)
+{
+	struct sockaddr_storage addr;
+	u_int32_t line_num;
+	char buf[4096];
+
 	line_num = 0;
 
 	while (fgets(buf, sizeof(buf), fp)) {
 		struct sockaddr_storage stemp;
-		char *p, *temp;
+		char *p, *temp, *save;
 
 		++line_num;
 		p = strchr(buf, '\n');
@@ -141,7 +261,7 @@ int find_masq_entry(struct sockaddr_storage *host,
 		if (p)
 			*p = '\0';
 
-		p = strtok(buf, " \t");
+		p = strtok_r(buf, " \t", &save);
 		if (!p) {
 			debug("[%s:%d] Missing address parameter", MASQ_MAP, line_num);
 			goto failure;
@@ -191,7 +311,7 @@ int find_masq_entry(struct sockaddr_storage *host,
 		if (!sin_equal(&addr, host))
 			continue;
 
-		p = strtok(NULL, " \t");
+		p = strtok_r(NULL, " \t", &save);
 		if (!p) {
 			debug("[%s:%d] Missing user parameter", MASQ_MAP, line_num);
 			goto failure;
@@ -206,7 +326,7 @@ int find_masq_entry(struct sockaddr_storage *host,
 
 		xstrncpy(user, p, user_len);
 
-		p = strtok(NULL, " \t");
+		p = strtok_r(NULL, " \t", &save);
 		if (!p) {
 			debug("[%s:%d] Missing OS parameter", MASQ_MAP, line_num);
 
@@ -222,12 +342,10 @@ int find_masq_entry(struct sockaddr_storage *host,
 
 		xstrncpy(os, p, os_len);
 
-		fclose(fp);
 		return 0;
 	}
 
 failure:
-	fclose(fp);
 	return -1;
 }
 
@@ -247,13 +365,14 @@ int fwd_request(	int sock,
 	char user[512];
 	int ret;
 
-	ret = forward_request(mrelay, fwdport, masq_lport, masq_fport,
+	ret = forward_request(mrelay, &fwdport, 1, masq_lport, masq_fport,
 		user, sizeof user);
 	if (ret == -1)
 		return -1;
 
 	sockprintf(sock, "%d,%d:USERID:%s:%s\r\n",
 		real_lport, real_fport, ret_os, user);
+	audit_reply(AUDIT_FORWARD, AUDIT_USERID, MISSING_UID, user);
 
 	get_ip(mrelay, ipbuf, sizeof(ipbuf));
 	o_log(LOG_INFO,
@@ -263,6 +382,22 @@ int fwd_request(	int sock,
 	return 0;
 }
 
+#	ifdef FUZZING_BUILD_MODE_UNSAFE_FOR_PRODUCTION
+
+void fuzz_masq_map(FILE *fp) {
+	struct sockaddr_storage host;
+	in_addr_t addr4;
+	char user[MAX_ULEN];
+	char os[24];
+
+	(void) inet_pton(AF_INET, FUZZ_FADDR, &addr4);
+	sin_setv4(addr4, &host);
+
+	masq_map_scan(fp, &host, user, sizeof(user), os, sizeof(os));
+}
+
+#	endif
+
 #else
 
 /*
@@ -0,0 +1,402 @@
+/*
+** offload.c - oidentd pool for blocking operations.
+** Copyright (c) 2019      Janik Rabe  <oidentd@janikrabe.com>
+**
+** This program is free software; you can redistribute it and/or modify
+** it under the terms of the GNU General Public License, version 2,
+** as published by the Free Software Foundation.
+**
+** This program is distributed in the hope that it will be useful,
+** but WITHOUT ANY WARRANTY; without even the implied warranty of
+** MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+** GNU General Public License for more details.
+**
+** You should have received a copy of the GNU General Public License
+** along with this program; if not, write to the Free Software
+** Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA
+*/
+
+#include <config.h>
+
+#include <unistd.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <signal.h>
+#include <string.h>
+#include <errno.h>
+#include <syslog.h>
+#include <time.h>
+#include <pwd.h>
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+
+#include "oidentd.h"
+#include "util.h"
+#include "offload.h"
+#include "trust.h"
+
+#if THREAD_SUPPORT
+#	include <pthread.h>
+#endif
+
+/*
+** Name service lookups and file accesses in home directories can block
+** for a long time if an LDAP server or NFS mount stops responding.  When
+** worker threads are used, these operations are run by a small pool of
+** threads instead, and the requesting thread gives up after
+** OFFLOAD_TIMEOUT seconds.  A stuck operation then only delays the
+** requests that depend on it.
+**
+** A thread that runs a stuck operation can't be taken back, so each job
+** names the service it depends on, such as the name service or a user's
+** home directory, and at most OFFLOAD_KEY_THREADS jobs for the same
+** service run at once.  The other threads keep serving the remaining
+** services while, say, an LDAP server or one user's NFS home is down.
+*/
+
+#if THREAD_SUPPORT
+
+struct offload_job {
+	char *key;
+	void (*fn)(void *);
+	void (*cleanup)(void *);
+	void *data;
+	bool done;
+	bool abandoned;
+	bool detached;
+	pthread_cond_t cond;
+};
+
+DEFINE_LOCK(pool_mutex);
+static pthread_cond_t pool_cond = PTHREAD_COND_INITIALIZER;
+
+static struct offload_job *queue[OFFLOAD_QUEUE_LEN];
+static size_t queue_head;
+static size_t queue_len;
+static bool pool_running;
+
+static const char *running[OFFLOAD_THREADS];
+static size_t num_running;
+
+static void offload_job_free(struct offload_job *job);
+static struct offload_job *offload_take(void);
+static void offload_done(const struct offload_job *job);
+static struct offload_job *offload_push(const char *key,
+										void (*fn)(void *),
+										void *data,
+										void (*cleanup)(void *));
+static void *offload_main(void *unused);
+
+/*
+** Free a job, including its data.
+*/
+
+static void offload_job_free(struct offload_job *job) {
+	if (job->cleanup)
+		job->cleanup(job->data);
+
+	pthread_cond_destroy(&job->cond);
+	xfree(job->key);
+	xfree(job);
+}
+
+/*
+** Remove the first queued job that has been abandoned or whose service
+** is not at its limit, and count it as running unless it was abandoned.
+** Returns NULL if there is no such job.  Called with pool_mutex held.
+*/
+
+static struct offload_job *offload_take(void) {
+	size_t i;
+
+	for (i = 0; i < queue_len; ++i) {
+		struct offload_job *job = queue[(queue_head + i) % OFFLOAD_QUEUE_LEN];
+		size_t busy = 0;
+		size_t j;
+
+		for (j = 0; j < num_running; ++j) {
+			if (!strcmp(running[j], job->key))
+				++busy;
+		}
+
+		if (!job->abandoned && busy >= OFFLOAD_KEY_THREADS)
+			continue;
+
+		for (j = i; j + 1 < queue_len; ++j) {
+			queue[(queue_head + j) % OFFLOAD_QUEUE_LEN] =
+				queue[(queue_head + j + 1) % OFFLOAD_QUEUE_LEN];
+		}
+
+		--queue_len;
+
+		if (!job->abandoned)
+			running[num_running++] = job->key;
+
+		return job;
+	}
+
+	return NULL;
+}
+
+/*
+** Stop counting "job" as running, and wake the pool threads if that lets
+** a queued job run.  Called with pool_mutex held.
+*/
+
+static void offload_done(const struct offload_job *job) {
+	size_t i;
+
+	for (i = 0; i < num_running; ++i) {
+		if (running[i] == job->key) {
+			running[i] = running[--num_running];
+			break;
+		}
+	}
+
+	if (queue_len > 0)
+		pthread_cond_broadcast(&pool_cond);
+}
+
+/*
+** Queue a job running "fn" with "data."  Called with pool_mutex held.
+** Returns NULL if the queue is full.
+*/
+
+static struct offload_job *offload_push(const char *key,
+										void (*fn)(void *),
+										void *data,
+										void (*cleanup)(void *))
+{
+	struct offload_job *job;
+
+	if (queue_len == OFFLOAD_QUEUE_LEN) {
+		debug("Offload queue is full");
+		return NULL;
+	}
+
+	job = xcalloc(1, sizeof(struct offload_job));
+	job->key = xstrdup(key);
+	job->fn = fn;
+	job->cleanup = cleanup;
+	job->data = data;
+	pthread_cond_init(&job->cond, NULL);
+
+	/* lookups for trusted hosts go ahead of the others */
+	if (trust_current()) {
+		queue_head = (queue_head + OFFLOAD_QUEUE_LEN - 1) % OFFLOAD_QUEUE_LEN;
+		queue[queue_head] = job;
+	} else
+		queue[(queue_head + queue_len) % OFFLOAD_QUEUE_LEN] = job;
+
+	++queue_len;
+	pthread_cond_signal(&pool_cond);
+
+	return job;
+}
+
+/*
+** Run queued jobs.  Jobs whose caller has given up, and jobs nobody
+** waits for, are cleaned up by the pool thread once they are done.
+*/
+
+static void *offload_main(void *unused __notused) {
+	mem_enter(MEM_CONN);
+
+	for (;;) {
+		struct offload_job *job;
+		bool abandoned;
+
+		o_lock(pool_mutex);
+
+		while (!(job = offload_take()))
+			pthread_cond_wait(&pool_cond, &pool_mutex);
+
+		abandoned = job->abandoned;
+
+		o_unlock(pool_mutex);
+
+		if (!abandoned)
+			job->fn(job->data);
+
+		o_lock(pool_mutex);
+
+		if (!abandoned)
+			offload_done(job);
+
+		job->done = true;
+		abandoned = job->abandoned || job->detached;
+		if (!abandoned)
+			pthread_cond_signal(&job->cond);
+		o_unlock(pool_mutex);
+
+		if (abandoned)
+			offload_job_free(job);
+	}
+
+	return NULL;
+}
+
+/*
+** Start "num" pool threads.  Until this is called, offloaded operations
+** are run by the calling thread.
+** Returns 0 on success, -1 on failure.
+*/
+
+int offload_init(u_int32_t num) {
+	sigset_t set, oldset;
+	u_int32_t started;
+
+	sigfillset(&set);
+	sigdelset(&set, SIGSEGV);
+	pthread_sigmask(SIG_BLOCK, &set, &oldset);
+
+	for (started = 0; started < num; ++started) {
+		pthread_t thread;
+		int ret;
+
+		ret = pthread_create(&thread, NULL, offload_main, NULL);
+		if (ret != 0) {
+			o_log(LOG_CRIT, "Failed to create thread: %s", strerror(ret));
+			break;
+		}
+
+		pthread_detach(thread);
+	}
+
+	pthread_sigmask(SIG_SETMASK, &oldset, NULL);
+
+	if (started == 0)
+		return -1;
+
+	o_lock(pool_mutex);
+	pool_running = true;
+	o_unlock(pool_mutex);
+
+	return 0;
+}
+
+/*
+** Run "fn" with "data," which depends on the service "key," and wait for
+** it to complete.
+**
+** Returns 0 once "fn" has completed; the caller still owns "data."
+**
+** Returns -1 with errno set if the queue is full or "fn" did not complete
+** within OFFLOAD_TIMEOUT seconds.  "data" is then owned by the pool, which
+** passes it to "cleanup" once it is no longer used.
+*/
+
+int offload_call(	const char *key,
+					void (*fn)(void *),
+					void *data,
+					void (*cleanup)(void *))
+{
+	struct offload_job *job;
+	struct timespec deadline;
+	int ret = 0;
+
+	o_lock(pool_mutex);
+
+	if (!pool_running) {
+		o_unlock(pool_mutex);
+		fn(data);
+		return 0;
+	}
+
+	job = offload_push(key, fn, data, cleanup);
+	if (!job) {
+		o_unlock(pool_mutex);
+
+		if (cleanup)
+			cleanup(data);
+
+		errno = EAGAIN;
+		return -1;
+	}
+
+	clock_gettime(CLOCK_REALTIME, &deadline);
+	deadline.tv_sec += OFFLOAD_TIMEOUT;
+
+	while (!job->done && ret != ETIMEDOUT)
+		ret = pthread_cond_timedwait(&job->cond, &pool_mutex, &deadline);
+
+	if (!job->done) {
+		job->abandoned = true;
+		o_unlock(pool_mutex);
+
+		debug("Offloaded operation timed out");
+		errno = ETIMEDOUT;
+		return -1;
+	}
+
+	o_unlock(pool_mutex);
+
+	job->cleanup = NULL;
+	offload_job_free(job);
+
+	return 0;
+}
+
+/*
+** Run "fn" with "data," which depends on the service "key," without
+** waiting for it.  "data" is owned by the pool, which passes it to
+** "cleanup" once "fn" has completed.
+** Returns 0 on success, or -1 if the pool is not running or its queue is
+** full.  "data" is then passed to "cleanup" right away.
+*/
+
+int offload_queue(	const char *key,
+					void (*fn)(void *),
+					void *data,
+					void (*cleanup)(void *))
+{
+	struct offload_job *job = NULL;
+
+	o_lock(pool_mutex);
+
+	if (pool_running)
+		job = offload_push(key, fn, data, cleanup);
+
+	if (job)
+		job->detached = true;
+
+	o_unlock(pool_mutex);
+
+	if (!job) {
+		if (cleanup)
+			cleanup(data);
+
+		return -1;
+	}
+
+	return 0;
+}
+
+#else
+
+int offload_init(u_int32_t num __notused) {
+	return 0;
+}
+
+int offload_call(	const char *key __notused,
+					void (*fn)(void *),
+					void *data,
+					void (*cleanup)(void *) __notused)
+{
+	fn(data);
+	return 0;
+}
+
+int offload_queue(	const char *key __notused,
+					void (*fn)(void *) __notused,
+					void *data,
+					void (*cleanup)(void *))
+{
+	if (cleanup)
+		cleanup(data);
+
+	return -1;
+}
+
+#endif
@@ -45,6 +45,24 @@
 #include "user_db.h"
 #include "options.h"
 #include "masq.h"
+#include "addr_cache.h"
+#include "worker.h"
+#include "offload.h"
+#include "flight.h"
+#include "handover.h"
+#include "fwd_cache.h"
+#include "peer.h"
+#include "shed.h"
+#include "trust.h"
+#include "acl.h"
+#include "shm_cache.h"
+#include "audit.h"
+#include "hitters.h"
+#include "fuzz.h"
+
+#if THREAD_SUPPORT
+#	include <pthread.h>
+#endif
 
 #if HAVE_LIBUDB
 #	warning "libudb support is deprecated"
@@ -56,16 +74,60 @@ static void sig_segv(int unused __notused) __noreturn;
 static void sig_child(int sig);
 static void sig_alarm(int unused __notused) __noreturn;
 static void sig_hup(int unused);
+static void sig_usr1(int unused);
 #endif
 
-static void copy_pw(const struct passwd *pw, struct passwd *pwd);
-static void free_pw(struct passwd *pwd);
+/*
+** A connection whose owner is looked up by lookup_owner().
+*/
+
+struct owner_query {
+	in_port_t lport;
+	in_port_t fport;
+	struct sockaddr_storage *laddr;
+	struct sockaddr_storage *faddr;
+	struct sockaddr_storage *laddr6;
+	struct sockaddr_storage *faddr6;
+};
+
+/*
+** A connection from a client, with the addresses in the forms the lookups
+** need them in.
+*/
 
-static int service_request(int insock, int outsock);
+struct ident_conn {
+	struct sockaddr_storage laddr;
+	struct sockaddr_storage faddr;
+	struct sockaddr_storage laddr6;
+	struct sockaddr_storage faddr6;
+	char host_buf[MAX_HOSTLEN];
+	bool trusted;
+};
+
+static int serve_peer(struct ident_conn *conn, int insock, int outsock);
+static int answer_query(	struct ident_conn *conn,
+						int outsock,
+						in_port_t lport,
+						in_port_t fport);
+static int answer_lookup(	struct ident_conn *conn,
+						int outsock,
+						in_port_t lport,
+						in_port_t fport,
+						int shed);
+static uid_t lookup_owner(void *data);
+static long housekeeping(void);
+static void reload_config(void);
+static int *all_listen_fds(int **fd_sets, u_int32_t num);
 
 u_int32_t timeout = DEFAULT_TIMEOUT;
 u_int32_t connection_limit;
 u_int32_t current_connections = 0;
+u_int32_t num_threads;
+u_int32_t max_threads;
+char *audit_path;
+u_int32_t latency_target;
+u_int32_t memory_limit;
+u_int32_t close_wait;
 
 uid_t target_uid;
 gid_t target_gid;
@@ -73,19 +135,60 @@ gid_t target_gid;
 char *ret_os;
 char *failuser;
 char *config_file;
+char *handover_path;
+list_t *netns_paths;
 
 in_port_t listen_port;
 struct sockaddr_storage **addr;
 
+static volatile sig_atomic_t reload_pending;
+static volatile sig_atomic_t stats_pending;
+static bool mem_exceeded;
+
+/*
+** Kernel drivers that keep state between lookups can only be used by one
+** thread at a time.
+*/
+
+#if KERNEL_THREADSAFE
+#	define kernel_lock()	do { } while (0)
+#	define kernel_unlock()	do { } while (0)
+#else
+DEFINE_LOCK(kernel_mutex);
+#	define kernel_lock()	o_lock(kernel_mutex)
+#	define kernel_unlock()	o_unlock(kernel_mutex)
+#endif
+
 int main(int argc, char **argv) {
 	int *listen_fds = NULL;
+	int *handover_fds = NULL;
+	int ctl_fd = -1;
+	int prefs_fd;
+	int ret;
+#if THREAD_SUPPORT
+	int **worker_fds = NULL;
+	bool activated = false;
+#endif
 
 	if (get_options(argc, argv) != 0)
 		exit(EXIT_FAILURE);
 
 	openlog(PACKAGE_NAME, LOG_PID | LOG_CONS | LOG_NDELAY, LOG_DAEMON);
+	mem_enter(MEM_CONFIG);
+
+	/*
+	** A single request is served in stdio mode, so only the parts of the
+	** configuration that apply to it are parsed.
+	*/
+
+	if (opt_enabled(STDIO))
+		ret = read_config_lazy(config_file);
+	else
+		ret = read_config(config_file);
 
-	if (read_config(config_file) != 0) {
+	mem_leave(MEM_OTHER);
+
+	if (ret != 0) {
 		o_log(LOG_CRIT, "Fatal: Error reading configuration file");
 		exit(EXIT_FAILURE);
 	}
@@ -99,8 +202,31 @@ int main(int argc, char **argv) {
 		exit(EXIT_FAILURE);
 	}
 
+	if (audit_path && audit_open(audit_path, AUDIT_RECORDS) != 0) {
+		o_log(LOG_CRIT, "Fatal: Unable to set up audit log");
+		exit(EXIT_FAILURE);
+	}
+
 	if (!opt_enabled(STDIO)) {
-		listen_fds = setup_listen(addr, htons(listen_port));
+		if (fwd_cache_init() != 0)
+			o_log(LOG_INFO, "Unable to set up forwarding cache; continuing without it");
+
+		if (shm_cache_init() != 0)
+			o_log(LOG_INFO, "Unable to set up lookup cache; continuing without it");
+
+		if (hitters_init() != 0)
+			o_log(LOG_INFO, "Unable to set up query statistics; continuing without them");
+
+		listen_fds = get_activated_fds();
+		if (!listen_fds && handover_path)
+			listen_fds = handover_receive(handover_path);
+		if (!listen_fds)
+			listen_fds = setup_listen(addr, htons(listen_port));
+#if THREAD_SUPPORT
+		else
+			activated = true;
+#endif
+
 		if (!listen_fds || listen_fds[0] == -1) {
 			o_log(LOG_CRIT, "Fatal: Unable to set up listening socket");
 			o_log(LOG_CRIT, "  (try running " PACKAGE_NAME " as root)");
@@ -108,6 +234,65 @@ int main(int argc, char **argv) {
 		}
 	}
 
+#if THREAD_SUPPORT
+	/*
+	** Pinned workers get their own listening sockets so that the kernel
+	** can hand each connection to the worker on the CPU it arrived on.
+	** Sockets passed by a service manager or a previous instance are
+	** shared by all workers.
+	*/
+
+	if (num_threads > 0) {
+		u_int32_t i;
+
+		worker_fds = xmalloc(num_threads * sizeof(int *));
+		worker_fds[0] = listen_fds;
+
+		for (i = 1; i < num_threads; ++i) {
+			if (!opt_enabled(CPU_AFFINITY) || activated) {
+				worker_fds[i] = listen_fds;
+				continue;
+			}
+
+			worker_fds[i] = setup_listen(addr, htons(listen_port));
+			if (!worker_fds[i] || worker_fds[i][0] == -1) {
+				o_log(LOG_CRIT, "Fatal: Unable to set up listening socket for thread %u", i);
+				exit(EXIT_FAILURE);
+			}
+		}
+	}
+#endif
+
+	if (addr) {
+		size_t i;
+
+		for (i = 0; addr[i]; ++i)
+			xfree(addr[i]);
+
+		xfree(addr);
+		addr = NULL;
+	}
+
+	/*
+	** Every listening socket is handed over, including those of pinned
+	** workers, so that no connection waiting in a queue is dropped.
+	*/
+
+	if (handover_path && !opt_enabled(STDIO)) {
+#if THREAD_SUPPORT
+		if (num_threads > 0)
+			handover_fds = all_listen_fds(worker_fds, num_threads);
+		else
+#endif
+			handover_fds = all_listen_fds(&listen_fds, 1);
+
+		ctl_fd = handover_listen(handover_path);
+		if (ctl_fd == -1) {
+			o_log(LOG_CRIT, "Fatal: Unable to set up control socket");
+			exit(EXIT_FAILURE);
+		}
+	}
+
 	if (!opt_enabled(FOREGROUND) && go_background() == -1) {
 		o_log(LOG_CRIT, "Fatal: Error creating daemon process");
 		exit(EXIT_FAILURE);
@@ -136,42 +321,145 @@ int main(int argc, char **argv) {
 	signal(SIGALRM, sig_alarm);
 	signal(SIGCHLD, sig_child);
 	signal(SIGHUP, sig_hup);
+	signal(SIGUSR1, sig_usr1);
 	signal(SIGSEGV, sig_segv);
+	signal(SIGPIPE, SIG_IGN);
 #endif
 
+	if (memory_limit > 0)
+		mem_set_limit((size_t) memory_limit * 1024 * 1024);
+
 	if (opt_enabled(STDIO)) {
+		mem_enter(MEM_CONN);
 		service_request(fileno(stdin), fileno(stdout));
 		exit(EXIT_SUCCESS);
 	}
 
+#if THREAD_SUPPORT
+	if (num_threads > 0) {
+		if (seed_prng() != 0) {
+			o_log(LOG_CRIT, "Fatal: Failed to seed PRNG");
+			exit(EXIT_FAILURE);
+		}
+
+		if (offload_init(OFFLOAD_THREADS) != 0) {
+			o_log(LOG_CRIT, "Fatal: Unable to start lookup threads");
+			exit(EXIT_FAILURE);
+		}
+
+		shed_init(latency_target);
+
+		if (worker_start(worker_fds, num_threads, MAX(num_threads, max_threads)) != 0) {
+			o_log(LOG_CRIT, "Fatal: Unable to start worker threads");
+			exit(EXIT_FAILURE);
+		}
+
+		/* the workers serve all requests; only housekeeping is left */
+		for (;;) {
+			long refresh = housekeeping();
+			long tune = worker_tune();
+			struct timeval tv;
+			fd_set rfds;
+
+			if (tune != -1 && (refresh == -1 || tune < refresh))
+				refresh = tune;
+
+			tv.tv_sec = refresh;
+			tv.tv_usec = 0;
+
+			FD_ZERO(&rfds);
+			if (ctl_fd != -1)
+				FD_SET(ctl_fd, &rfds);
+
+			ret = select(ctl_fd + 1, &rfds, NULL, NULL,
+				refresh == -1 ? NULL : &tv);
+
+			if (ret > 0 && ctl_fd != -1 && FD_ISSET(ctl_fd, &rfds) &&
+				handover_send(ctl_fd, handover_fds) == 0)
+			{
+				worker_stop();
+				o_log(LOG_INFO, "Finished serving connections; exiting");
+				exit(EXIT_SUCCESS);
+			}
+		}
+	}
+#endif
+
+	/* children send the user configuration files they parse back here */
+	prefs_fd = user_db_share_init();
+
 	for (;;) {
 		fd_set rfds;
-		int ret;
 		size_t fdlen = 0;
+		int maxfd = MAX(ctl_fd, prefs_fd);
+		long refresh;
+		struct timeval tv;
+
+		refresh = housekeeping();
+		tv.tv_sec = refresh;
+		tv.tv_usec = 0;
 
 		FD_ZERO(&rfds);
+		if (ctl_fd != -1)
+			FD_SET(ctl_fd, &rfds);
+
+		if (prefs_fd != -1)
+			FD_SET(prefs_fd, &rfds);
 
 		do {
 			int fd = listen_fds[fdlen++];
 			FD_SET(fd, &rfds);
+
+			if (fd > maxfd)
+				maxfd = fd;
 		} while (listen_fds[fdlen] != -1);
 
-		ret = select(listen_fds[fdlen - 1] + 1, &rfds, NULL, NULL, NULL);
+		ret = select(maxfd + 1, &rfds, NULL, NULL,
+			refresh == -1 ? NULL : &tv);
+
+		/*
+		** Once the listening sockets have been handed over, wait for the
+		** children serving connections that were already accepted.
+		*/
+
+		if (ret > 0 && ctl_fd != -1 && FD_ISSET(ctl_fd, &rfds) &&
+			handover_send(ctl_fd, handover_fds) == 0)
+		{
+			signal(SIGCHLD, SIG_DFL);
+
+			while (wait(NULL) > 0 || errno == EINTR)
+				;
+
+			o_log(LOG_INFO, "Finished serving connections; exiting");
+			exit(EXIT_SUCCESS);
+		}
+
+		if (ret > 0 && prefs_fd != -1 && FD_ISSET(prefs_fd, &rfds))
+			user_db_receive_prefs(prefs_fd);
+
 		if (ret > 0) {
 			size_t i;
 
 			for (i = 0; i < fdlen; ++i) {
 				if (FD_ISSET(listen_fds[i], &rfds)) {
+					struct sockaddr_storage peer;
+					socklen_t peerlen = sizeof(peer);
 					int connectfd;
 					pid_t child;
 
-					connectfd = accept(listen_fds[i], NULL, NULL);
+					connectfd = accept(listen_fds[i], (struct sockaddr *) &peer, &peerlen);
 					if (connectfd == -1) {
 						debug("accept: %s", strerror(errno));
 						continue;
 					}
 
-					if (current_connections >= connection_limit) {
+					if (!acl_permit(&peer)) {
+						close(connectfd);
+						continue;
+					}
+
+					/* trusted hosts are served beyond the limit */
+					if (current_connections >= connection_limit && !trust_match(&peer)) {
 						o_log(LOG_INFO, "Connection limit exceeded; "
 							"closing incoming connection");
 						close(connectfd);
@@ -190,10 +478,24 @@ int main(int argc, char **argv) {
 						for (idx = 0; listen_fds[idx] != -1; ++idx)
 							close(listen_fds[idx]);
 
-						free(listen_fds);
+						if (ctl_fd != -1)
+							close(ctl_fd);
+
+						if (prefs_fd != -1)
+							close(prefs_fd);
+
+						xfree(listen_fds);
+						mem_enter(MEM_CONN);
 						alarm(timeout);
+						sock_set_nodelay(connectfd);
 						service_request(connectfd, connectfd);
 
+						if (close_wait > 0)
+							sock_close_wait(connectfd, close_wait, opt_enabled(CLOSE_RESET));
+						else
+							close(connectfd);
+
+						addr_cache_resolve_wanted();
 						exit(EXIT_SUCCESS);
 					}
 
@@ -204,80 +506,117 @@ int main(int argc, char **argv) {
 	}
 }
 
+/*
+** Returns a -1-terminated array of the distinct listening sockets in the
+** "num" socket arrays in "fd_sets."  Arrays may be shared between sets.
+*/
+
+static int *all_listen_fds(int **fd_sets, u_int32_t num) {
+	int *fds = NULL;
+	size_t len = 0;
+	u_int32_t i;
+
+	for (i = 0; i < num; ++i) {
+		u_int32_t j;
+		size_t k;
+
+		for (j = 0; j < i && fd_sets[j] != fd_sets[i]; ++j)
+			;
+
+		if (j < i)
+			continue;
+
+		for (k = 0; fd_sets[i][k] != -1; ++k) {
+			fds = xrealloc(fds, (len + 2) * sizeof(int));
+			fds[len++] = fd_sets[i][k];
+		}
+	}
+
+	if (!fds)
+		fds = xmalloc(sizeof(int));
+
+	fds[len] = -1;
+	return fds;
+}
+
 /*
 ** Handle the client's request: read the client data and send the ident reply.
 */
 
-static int service_request(int insock, int outsock) {
+int service_request(int insock, int outsock) {
 	int len;
-	int ret;
-	uid_t con_uid;
 	int lport_temp;
 	int fport_temp;
-	in_port_t lport;
 	in_port_t fport;
 	char line[128];
-	char suser[MAX_ULEN];
-	char host_buf[MAX_HOSTLEN];
 	char ip_buf[MAX_IPLEN];
-	struct sockaddr_storage laddr, laddr6, faddr, faddr6;
-	struct passwd *pw, pwd;
+	struct ident_conn conn;
 
 #ifdef FUZZING_BUILD_MODE_UNSAFE_FOR_PRODUCTION
 	in_addr_t fuzz_faddr, fuzz_laddr;
-	(void) inet_pton(AF_INET, "192.0.2.1", &fuzz_faddr);
-	(void) inet_pton(AF_INET, "127.0.0.1", &fuzz_laddr);
-	sin_setv4(fuzz_faddr, &faddr);
-	sin_setv4(fuzz_laddr, &laddr);
-	sin_set_port(49152, &faddr);
-	sin_set_port(113, &faddr);
+	(void) inet_pton(AF_INET, FUZZ_FADDR, &fuzz_faddr);
+	(void) inet_pton(AF_INET, FUZZ_LADDR, &fuzz_laddr);
+	sin_setv4(fuzz_faddr, &conn.faddr);
+	sin_setv4(fuzz_laddr, &conn.laddr);
+	sin_set_port(FUZZ_FPORT, &conn.faddr);
+	sin_set_port(113, &conn.faddr);
 #else
-	static socklen_t socklen = sizeof(struct sockaddr_storage);
+	socklen_t socklen = sizeof(struct sockaddr_storage);
 
-	if (getpeername(insock, (struct sockaddr *) &faddr, &socklen) != 0) {
+	if (getpeername(insock, (struct sockaddr *) &conn.faddr, &socklen) != 0) {
 		debug("getpeername: %s", strerror(errno));
 		return -1;
 	}
 
-	if (getsockname(insock, (struct sockaddr *) &laddr, &socklen) != 0) {
+	if (getsockname(insock, (struct sockaddr *) &conn.laddr, &socklen) != 0) {
 		debug("getsockname: %s", strerror(errno));
 		return -1;
 	}
+
+	/* otherwise, connections are checked as soon as they are accepted */
+	if (opt_enabled(STDIO) && !acl_permit(&conn.faddr))
+		return 0;
 #endif
 
-	fport = htons(sin_port(&faddr));
+	fport = htons(sin_port(&conn.faddr));
 
 #if WANT_IPV6
-	laddr6 = laddr;
-	faddr6 = faddr;
+	conn.laddr6 = conn.laddr;
+	conn.faddr6 = conn.faddr;
 
-	if (laddr.ss_family == AF_INET6 &&
-		IN6_IS_ADDR_V4MAPPED(&SIN6(&laddr)->sin6_addr))
+	if (conn.laddr.ss_family == AF_INET6 &&
+		IN6_IS_ADDR_V4MAPPED(&SIN6(&conn.laddr)->sin6_addr))
 	{
 		struct in_addr in4;
 
-		sin_extractv4(&SIN6(&laddr)->sin6_addr, &in4);
-		sin_setv4(in4.s_addr, &laddr);
+		sin_extractv4(&SIN6(&conn.laddr)->sin6_addr, &in4);
+		sin_setv4(in4.s_addr, &conn.laddr);
 
-		sin_extractv4(&SIN6(&faddr)->sin6_addr, &in4);
-		sin_setv4(in4.s_addr, &faddr);
+		sin_extractv4(&SIN6(&conn.faddr)->sin6_addr, &in4);
+		sin_setv4(in4.s_addr, &conn.faddr);
 	}
 #endif
 
-	get_ip(&faddr, ip_buf, sizeof(ip_buf));
+	conn.trusted = trust_match(&conn.faddr);
+	trust_set_current(conn.trusted);
+
+	get_ip(&conn.faddr, ip_buf, sizeof(ip_buf));
 
-	if (get_hostname(&faddr, host_buf, sizeof(host_buf)) != 0) {
+	if (get_hostname(&conn.faddr, conn.host_buf, sizeof(conn.host_buf)) != 0) {
 		o_log(LOG_INFO, "Connection from %s:%d", ip_buf, fport);
-		xstrncpy(host_buf, ip_buf, sizeof(host_buf));
+		xstrncpy(conn.host_buf, ip_buf, sizeof(conn.host_buf));
 	} else
-		o_log(LOG_INFO, "Connection from %s (%s):%d", host_buf, ip_buf, fport);
+		o_log(LOG_INFO, "Connection from %s (%s):%d", conn.host_buf, ip_buf, fport);
 
 	if (!sock_read(insock, line, sizeof(line)))
 		return -1;
 
+	if (opt_enabled(PEER) && peer_is_hello(line))
+		return serve_peer(&conn, insock, outsock);
+
 	len = sscanf(line, "%d , %d", &lport_temp, &fport_temp);
 	if (len < 2) {
-		debug("[%s] Malformed request: \"%s\"", host_buf, line);
+		debug("[%s] Malformed request: \"%s\"", conn.host_buf, line);
 		return 0;
 	}
 
@@ -286,13 +625,142 @@ static int service_request(int insock, int outsock) {
 				lport_temp, fport_temp, ERROR("INVALID-PORT"));
 
 		debug("[%s] %d , %d : ERROR : INVALID-PORT",
-			host_buf, lport_temp, fport_temp);
+			conn.host_buf, lport_temp, fport_temp);
 
 		return 0;
 	}
 
-	lport = (in_port_t) lport_temp;
-	fport = (in_port_t) fport_temp;
+	return answer_query(&conn, outsock,
+			(in_port_t) lport_temp, (in_port_t) fport_temp);
+}
+
+/*
+** Serve a session of the oidentd peer protocol: answer tagged queries
+** until the peer disconnects or stays idle for too long.  Each query is
+** answered as if it had arrived on a connection of its own, and the
+** reply is then translated into a reply frame.  Queries are answered one
+** at a time, in the order they arrive, so the window is 1.
+*/
+
+static int serve_peer(struct ident_conn *conn, int insock, int outsock) {
+	int capture[2];
+	int flags;
+
+	if (socketpair(AF_UNIX, SOCK_STREAM, 0, capture) != 0) {
+		debug("socketpair: %s", strerror(errno));
+		return -1;
+	}
+
+	/* queries that fail without a reply must not block the session */
+	flags = fcntl(capture[1], F_GETFL);
+	if (flags == -1 || fcntl(capture[1], F_SETFL, flags | O_NONBLOCK) == -1) {
+		debug("fcntl: %s", strerror(errno));
+		goto out;
+	}
+
+	sockprintf(outsock, "%s OK %u\r\n", PEER_HELLO, PEER_SERVE_WINDOW);
+	o_log(LOG_INFO, "[%s] Peer session started", conn->host_buf);
+
+	for (;;) {
+		char line[128];
+		char reply[MAX_ULEN + 128];
+		char tag[PEER_TAG_LEN];
+		int lport;
+		int fport;
+
+		/* child processes are limited per request, not per connection */
+		if (num_threads == 0)
+			alarm(timeout);
+
+		if (!sock_read(insock, line, sizeof(line)))
+			break;
+
+		if (peer_parse_query(line, tag, sizeof(tag), &lport, &fport) != 0) {
+			debug("[%s] Malformed peer query: \"%s\"", conn->host_buf, line);
+			break;
+		}
+
+		if (!VALID_PORT(lport) || !VALID_PORT(fport)) {
+			snprintf(reply, sizeof(reply), "%d,%d:ERROR:%s\r\n",
+				lport, fport, ERROR("INVALID-PORT"));
+		} else {
+			answer_query(conn, capture[0], (in_port_t) lport, (in_port_t) fport);
+
+			if (!sock_read(capture[1], reply, sizeof(reply)))
+				reply[0] = '\0';
+		}
+
+		if (peer_send_reply(outsock, tag, reply) == -1)
+			break;
+	}
+
+	o_log(LOG_INFO, "[%s] Peer session ended", conn->host_buf);
+
+out:
+	close(capture[0]);
+	close(capture[1]);
+	return 0;
+}
+
+/*
+** Answer the query for the connection (lport, fport) related to the
+** client connection "conn," writing the ident reply to "outsock."  While
+** oidentd is overloaded, the reply to untrusted hosts is an error or the
+** lookup is kept cheap.
+** Returns 0 on success, -1 on failure.
+*/
+
+static int answer_query(	struct ident_conn *conn,
+						int outsock,
+						in_port_t lport,
+						in_port_t fport)
+{
+	struct audit_ctx audit;
+	struct timeval start;
+	int shed;
+	int ret;
+
+	hitters_query(&conn->faddr, lport);
+
+	shed = conn->trusted ? SHED_NONE : shed_admit(&conn->faddr);
+	audit_begin(&audit, &conn->laddr, &conn->faddr, lport, fport);
+
+	if (shed == SHED_ERROR) {
+		sockprintf(outsock, "%d,%d:ERROR:UNKNOWN-ERROR\r\n", lport, fport);
+		audit_reply(AUDIT_SHED, AUDIT_ERROR, MISSING_UID, "UNKNOWN-ERROR");
+
+		debug("[%s] %d , %d : ERROR : UNKNOWN-ERROR (overloaded)",
+			conn->host_buf, lport, fport);
+
+		audit_end();
+		return 0;
+	}
+
+	gettimeofday(&start, NULL);
+	ret = answer_lookup(conn, outsock, lport, fport, shed);
+	shed_record(&start);
+
+	audit_end();
+	return ret;
+}
+
+/*
+** Look up the owner of the connection (lport, fport) related to the
+** client connection "conn," and write the ident reply to "outsock."
+** Masqueraded connections are not looked up if "shed" is SHED_CHEAP.
+** Returns 0 on success, -1 on failure.
+*/
+
+static int answer_lookup(	struct ident_conn *conn,
+						int outsock,
+						in_port_t lport,
+						in_port_t fport,
+						int shed)
+{
+	int ret;
+	uid_t con_uid;
+	char suser[MAX_ULEN];
+	struct passwd pwd;
 
 	/* User ID is unknown. */
 	con_uid = MISSING_UID;
@@ -300,93 +768,97 @@ static int service_request(int insock, int outsock) {
 #if HAVE_LIBUDB
 	if (opt_enabled(USEUDB)) {
 		struct udb_lookup_res udb_res = get_udb_user(
-				lport, fport, &laddr, &faddr, insock);
+				lport, fport, &conn->laddr, &conn->faddr, outsock);
 		if (udb_res.status == 2)
 			return 0;
 		con_uid = udb_res.uid;
 	}
 #endif
 
-	if (con_uid == MISSING_UID && laddr.ss_family == AF_INET)
-		con_uid = get_user4(htons(lport), htons(fport), &laddr, &faddr);
+	if (con_uid == MISSING_UID) {
+		struct owner_query query;
 
-#if WANT_IPV6
-	/*
-	 * Check for IPv6-mapped IPv4 addresses. This ensures that the correct
-	 * ident response is returned for connections to a mapped address.
-	 */
-	if (con_uid == MISSING_UID && laddr.ss_family == AF_INET) {
-		struct sockaddr_storage laddr_m6, faddr_m6;
-		struct in6_addr in6;
+		query.lport = lport;
+		query.fport = fport;
+		query.laddr = &conn->laddr;
+		query.faddr = &conn->faddr;
+		query.laddr6 = &conn->laddr6;
+		query.faddr6 = &conn->faddr6;
 
-		sin_mapv4to6(&SIN4(&laddr)->sin_addr, &in6);
-		sin_setv6(&in6, &laddr_m6);
+		con_uid = flight_get_user(lport, fport, &conn->laddr, &conn->faddr,
+					lookup_owner, &query);
+	}
 
-		sin_mapv4to6(&SIN4(&faddr)->sin_addr, &in6);
-		sin_setv6(&in6, &faddr_m6);
+	if (opt_enabled(MASQ) && shed == SHED_NONE) {
+		if (con_uid == MISSING_UID && conn->laddr.ss_family == AF_INET) {
+			enum mem_tag prev = mem_enter(MEM_MASQ);
 
-		con_uid = get_user6(htons(lport), htons(fport), &laddr_m6, &faddr_m6);
-	}
+			kernel_lock();
+			ret = masq(outsock, htons(lport), htons(fport), &conn->laddr, &conn->faddr);
+			kernel_unlock();
 
-	if (con_uid == MISSING_UID && laddr6.ss_family == AF_INET6)
-		con_uid = get_user6(htons(lport), htons(fport), &laddr6, &faddr6);
-#endif
+			mem_leave(prev);
 
-	if (opt_enabled(MASQ)) {
-		if (con_uid == MISSING_UID && laddr.ss_family == AF_INET)
-			if (masq(insock, htons(lport), htons(fport), &laddr, &faddr) == 0)
+			if (ret == 0)
 				return 0;
+		}
 	}
 
 	if (con_uid == MISSING_UID) {
 		if (failuser) {
 			sockprintf(outsock, "%d,%d:USERID:%s:%s\r\n",
 				lport, fport, ret_os, failuser);
+			audit_reply(AUDIT_LOCAL, AUDIT_USERID, MISSING_UID, failuser);
 
 			o_log(LOG_INFO, "[%s] Failed lookup: %d , %d : (returned %s)",
-				host_buf, lport, fport, failuser);
+				conn->host_buf, lport, fport, failuser);
 		} else {
 			sockprintf(outsock, "%d,%d:ERROR:%s\r\n",
 				lport, fport, ERROR("NO-USER"));
+			audit_reply(AUDIT_LOCAL, AUDIT_ERROR, MISSING_UID, ERROR("NO-USER"));
 
 			o_log(LOG_INFO, "[%s] %d , %d : ERROR : NO-USER",
-				host_buf, lport, fport);
+				conn->host_buf, lport, fport);
 		}
 
 		return 0;
 	}
 
-	pw = getpwuid(con_uid);
-	if (!pw) {
+	hitters_user(con_uid);
+
+	if (get_pwuid(con_uid, &pwd) != 0) {
 		sockprintf(outsock, "%d,%d:ERROR:%s\r\n",
 			lport, fport, ERROR("NO-USER"));
+		audit_reply(AUDIT_LOCAL, AUDIT_ERROR, con_uid, ERROR("NO-USER"));
 
 		debug("getpwuid(%lu): %s", (unsigned long) con_uid, strerror(errno));
 		return 0;
-	} else
-		copy_pw(pw, &pwd);
+	}
 
-	if (seed_prng() != 0) {
+	/* worker threads share a generator that is seeded once at startup */
+	if (num_threads == 0 && seed_prng() != 0) {
 		o_log(LOG_CRIT, "Failed to seed PRNG");
 		goto out_fail;
 	}
 
-	ret = get_ident(&pwd, lport, fport, &laddr, &faddr, suser, sizeof(suser));
+	ret = get_ident(&pwd, lport, fport, &conn->laddr, &conn->faddr, suser, sizeof(suser));
 	if (ret == -1) {
 		sockprintf(outsock, "%d,%d:ERROR:%s\r\n",
 			lport, fport, ERROR("HIDDEN-USER"));
+		audit_reply(AUDIT_LOCAL, AUDIT_ERROR, con_uid, ERROR("HIDDEN-USER"));
 
 		o_log(LOG_INFO, "[%s] %d , %d : HIDDEN-USER (%s)",
-			host_buf, lport, fport, pwd.pw_name);
+			conn->host_buf, lport, fport, pwd.pw_name);
 
 		goto out;
 	}
 
 	sockprintf(outsock, "%d,%d:USERID:%s:%s\r\n",
 		lport, fport, ret_os, suser);
+	audit_reply(AUDIT_LOCAL, AUDIT_USERID, con_uid, suser);
 
 	o_log(LOG_INFO, "[%s] Successful lookup: %d , %d : %s (%s)",
-		host_buf, lport, fport, pwd.pw_name, suser);
+		conn->host_buf, lport, fport, pwd.pw_name, suser);
 
 out:
 	free_pw(&pwd);
@@ -397,26 +869,6 @@ out_fail:
 	return -1;
 }
 
-/*
-** Copy the needed fields from a passwd struct.
-*/
-
-static void copy_pw(const struct passwd *pw, struct passwd *pwd) {
-	pwd->pw_name = xstrdup(pw->pw_name);
-	pwd->pw_uid = pw->pw_uid;
-	pwd->pw_gid = pw->pw_gid;
-	pwd->pw_dir = xstrdup(pw->pw_dir);
-}
-
-/*
-** Free a copied passwd struct.
-*/
-
-static void free_pw(struct passwd *pw) {
-	free(pw->pw_name);
-	free(pw->pw_dir);
-}
-
 #ifndef FUZZING_BUILD_MODE_UNSAFE_FOR_PRODUCTION
 /*
 ** Handle SIGSEGV.
@@ -432,8 +884,12 @@ static void sig_segv(int unused __notused) {
 */
 
 static void sig_child(int sig) {
-	while (waitpid(-1, &sig, WNOHANG) > 0)
-		--current_connections;
+	pid_t pid;
+
+	while ((pid = waitpid(-1, &sig, WNOHANG)) > 0) {
+		if (!addr_cache_reap(pid))
+			--current_connections;
+	}
 
 	signal(SIGCHLD, sig_child);
 }
@@ -449,14 +905,151 @@ static void sig_alarm(int unused __notused) {
 
 /*
 ** Handle SIGHUP - This causes oidentd to reload its configuration file.
+** The configuration is reloaded by the main loop.
 */
 
 static void sig_hup(int unused __notused) {
-	user_db_destroy();
+	reload_pending = 1;
+	signal(SIGHUP, sig_hup);
+}
 
-	if (read_config(CONFFILE) != 0) {
-		o_log(LOG_CRIT, "Error parsing configuration file");
-		exit(EXIT_FAILURE);
+/*
+** Handle SIGUSR1 - This causes oidentd to log statistics about its worker
+** threads, the most frequent queries, and its memory use.  The statistics
+** are logged by the main loop.
+*/
+
+static void sig_usr1(int unused __notused) {
+	stats_pending = 1;
+	signal(SIGUSR1, sig_usr1);
+}
+#endif
+
+/*
+** Ask the kernel for the owner of the connection described by "data."
+** Returns the owner's UID or MISSING_UID.
+*/
+
+static uid_t lookup_owner(void *data) {
+	struct owner_query *query = data;
+	in_port_t lport = htons(query->lport);
+	in_port_t fport = htons(query->fport);
+	uid_t con_uid = MISSING_UID;
+
+	kernel_lock();
+
+	if (query->laddr->ss_family == AF_INET)
+		con_uid = get_user4(lport, fport, query->laddr, query->faddr);
+
+#if WANT_IPV6
+	/*
+	 * Check for IPv6-mapped IPv4 addresses. This ensures that the correct
+	 * ident response is returned for connections to a mapped address.
+	 */
+	if (con_uid == MISSING_UID && query->laddr->ss_family == AF_INET) {
+		struct sockaddr_storage laddr_m6, faddr_m6;
+		struct in6_addr in6;
+
+		sin_mapv4to6(&SIN4(query->laddr)->sin_addr, &in6);
+		sin_setv6(&in6, &laddr_m6);
+
+		sin_mapv4to6(&SIN4(query->faddr)->sin_addr, &in6);
+		sin_setv6(&in6, &faddr_m6);
+
+		con_uid = get_user6(lport, fport, &laddr_m6, &faddr_m6);
 	}
+
+	if (con_uid == MISSING_UID && query->laddr6->ss_family == AF_INET6)
+		con_uid = get_user6(lport, fport, query->laddr6, query->faddr6);
+#endif
+
+	kernel_unlock();
+	return con_uid;
 }
+
+/*
+** Reload the configuration if requested and refresh cached host names.
+** This runs between requests (or beside the worker threads) so that
+** lookups never wait for DNS.
+** Returns the number of seconds until the next refresh is due, or -1.
+*/
+
+static long housekeeping(void) {
+	struct user_db *db;
+	long refresh;
+
+	if (reload_pending) {
+		reload_pending = 0;
+		reload_config();
+	}
+
+	if (stats_pending) {
+		stats_pending = 0;
+#if THREAD_SUPPORT
+		worker_log_stats();
+		shed_log_stats();
 #endif
+		hitters_log_stats();
+		mem_log_stats();
+	}
+
+	/*
+	** Without worker threads, this process accepts the connections, so
+	** names are resolved by a child process instead.
+	*/
+
+	db = user_db_acquire();
+	if (num_threads > 0)
+		refresh = addr_cache_refresh(db->addr_cache);
+	else
+		refresh = addr_cache_refresh_async(db->addr_cache);
+
+	/*
+	** Freed memory isn't always returned to the system, so the resident
+	** size may exceed the limit although allocations are within budget.
+	*/
+
+	if (memory_limit > 0) {
+		bool over = mem_over_limit();
+
+		if (over) {
+			user_db_trim(db);
+			mem_trim();
+			over = mem_over_limit();
+		}
+
+		if (over != mem_exceeded) {
+			mem_exceeded = over;
+
+			if (over)
+				o_log(LOG_INFO, "Memory use exceeds the limit of %u MiB", memory_limit);
+			else
+				o_log(LOG_INFO, "Memory use is back below the limit of %u MiB", memory_limit);
+		}
+
+		if (refresh == -1 || refresh > MEM_CHECK_INTERVAL)
+			refresh = MEM_CHECK_INTERVAL;
+	}
+
+	user_db_release(db);
+
+	return refresh;
+}
+
+/*
+** Reload the configuration file.  Requests that are being served keep
+** using the previous configuration; it is kept entirely if the new one
+** can't be parsed.
+*/
+
+static void reload_config(void) {
+	enum mem_tag prev = mem_enter(MEM_CONFIG);
+
+	if (read_config(CONFFILE) != 0)
+		o_log(LOG_CRIT, "Error parsing configuration file; keeping previous configuration");
+
+	mem_leave(prev);
+
+	/* users and the masquerading map may have changed as well */
+	shm_cache_flush();
+}
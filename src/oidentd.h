@@ -100,6 +100,158 @@
 
 #define DEFAULT_TIMEOUT	30
 
+/*
+** The number of seconds oidentd will wait for a host it forwards a request
+** to.
+*/
+
+#define FORWARD_TIMEOUT	5
+
+/*
+** The number of milliseconds to wait for a host a request is forwarded to
+** before the request is also sent to the next host named by the rule, and
+** the maximum number of hosts a rule may name.
+*/
+
+#define FORWARD_HEDGE_DELAY	250
+#define MAX_FORWARD_TARGETS	8
+
+/*
+** The number of seconds replies from hosts requests are forwarded to are
+** cached.  After the given number of consecutive failures, requests to a
+** host fail immediately for a backoff period that starts at FWD_BACKOFF
+** seconds and doubles, up to FWD_BACKOFF_MAX seconds, for as long as the
+** host keeps failing.
+*/
+
+#define FWD_CACHE_TTL		10
+#define FWD_FAIL_THRESHOLD	3
+#define FWD_BACKOFF			15
+#define FWD_BACKOFF_MAX		300
+
+/*
+** The number of seconds password database entries and entries of the
+** masquerading map are cached in memory that is shared between all
+** processes.
+*/
+
+#define SHM_PASSWD_TTL		60
+#define SHM_MASQ_TTL		30
+
+/*
+** The maximum number of threads that may be used to serve requests.
+*/
+
+#define MAX_THREADS		1024
+
+/*
+** The number of querying hosts, owners, and local ports whose queries are
+** counted, the number of seconds after which all counts are halved, and
+** how many of each are logged on SIGUSR1.  While oidentd is overloaded,
+** hosts that sent at least HITTERS_HEAVY_SHARE percent of the recent
+** queries, out of at least HITTERS_MIN_QUERIES, are answered with errors
+** first.
+*/
+
+#define HITTERS_SIZE			64
+#define HITTERS_DECAY			60
+#define HITTERS_SHOWN			10
+#define HITTERS_HEAVY_SHARE		25
+#define HITTERS_MIN_QUERIES		100
+
+/*
+** The number of records an audit log created with --audit-log holds
+** before the oldest ones are overwritten.  Each takes 256 bytes.
+*/
+
+#define AUDIT_RECORDS		65536
+
+/*
+** With --max-threads, the number of seconds between adjustments of the
+** number of threads, the percentage of time threads must be busy for more
+** of them to be started, and the percentage below which one of them is
+** stopped per adjustment once it has stayed below it for POOL_SHRINK_DELAY
+** seconds.
+*/
+
+#define POOL_INTERVAL		1
+#define POOL_GROW_UTIL		75
+#define POOL_SHRINK_UTIL	25
+#define POOL_SHRINK_DELAY	30
+
+/*
+** The number of threads that run blocking lookups for worker threads, the
+** number of them that may run lookups depending on the same service, the
+** maximum number of lookups that may be waiting for them, and the number
+** of seconds a worker waits for a lookup to complete.
+*/
+
+#define OFFLOAD_THREADS		8
+#define OFFLOAD_KEY_THREADS	3
+#define OFFLOAD_QUEUE_LEN	256
+#define OFFLOAD_TIMEOUT		10
+
+/*
+** The first file descriptor used to pass listening sockets to a daemon
+** started by socket activation.
+*/
+
+#define LISTEN_FDS_START	3
+
+/*
+** The number of seconds host names used in the configuration are cached
+** before they are resolved again, the number of seconds after which
+** resolution is retried if it failed, and the number of seconds the
+** process resolving them in the background may take.
+*/
+
+#define ADDR_CACHE_TTL		300
+#define ADDR_CACHE_NEG_TTL	60
+#define ADDR_CACHE_TIMEOUT	60
+
+/*
+** The number of seconds after which the addresses of the network
+** namespaces given with --netns are read again, if a connection could not
+** be mapped to any of them.
+*/
+
+#define NETNS_REFRESH		10
+
+/*
+** Limits on users' configuration files: their size in bytes, the number
+** of rules, the number of bytes of strings, and the number of milliseconds
+** spent parsing them.  Files exceeding a limit are ignored.
+**
+** Parsed files are used until they change, which is checked at most once
+** every USER_CONF_RECHECK seconds.  Ignored files are logged at most once
+** every USER_CONF_LOG_INTERVAL seconds per user.
+*/
+
+#define USER_CONF_MAX_SIZE		65536
+#define USER_CONF_MAX_RULES		256
+#define USER_CONF_MAX_STRINGS	16384
+#define USER_CONF_MAX_MSECS		50
+#define USER_CONF_RECHECK		2
+#define USER_CONF_LOG_INTERVAL	300
+
+/*
+** With --latency-target, the number of requests latencies are roughly
+** averaged over, how often a request is still looked up while others are
+** answered with errors, and the minimum number of seconds between log
+** messages about the load.
+*/
+
+#define SHED_SMOOTHING			8
+#define SHED_PROBE_INTERVAL		16
+#define SHED_LOG_INTERVAL		10
+
+/*
+** With --memory-limit, the number of seconds between checks of the
+** resident size.
+*/
+
+#define MEM_CHECK_INTERVAL		5
+
 /*
 ** Nothing below here should need to be changed.
 */
@@ -226,5 +378,7 @@ uid_t get_user6(	in_port_t lport,
 				struct sockaddr_storage *faddr);
 
 int read_config(const char *config_file);
+int read_config_lazy(const char *config_file);
+int service_request(int insock, int outsock);
 
 #endif
@@ -39,20 +39,30 @@
 #include "inet_util.h"
 #include "user_db.h"
 #include "options.h"
+#include "trust.h"
+#include "acl.h"
 
 #if MASQ_SUPPORT
-#	define OPTSTRING "a:c:C:def::g:hiIl:mMo::p:P:qr:St:u:Uv"
+#	define OPTSTRING "a:Ab:B:c:C:dD:ef::Fg:hH:iIKl:L:mMnN:o::p:P:qr:R:St:T:u:Uvw:W:X:"
 	extern in_port_t fwdport;
 #else
-#	define OPTSTRING "a:c:C:deg:hiIl:o::p:P:qr:St:u:Uv"
+#	define OPTSTRING "a:Ab:B:c:C:dD:eFg:hH:iIKl:L:nN:o::p:P:qr:R:St:T:u:Uvw:W:X:"
 #endif
 
 extern struct sockaddr_storage proxy;
 extern char *failuser;
 extern char *ret_os;
 extern char *config_file;
+extern char *handover_path;
+extern list_t *netns_paths;
 extern u_int32_t timeout;
 extern u_int32_t connection_limit;
+extern u_int32_t num_threads;
+extern u_int32_t max_threads;
+extern char *audit_path;
+extern u_int32_t latency_target;
+extern u_int32_t memory_limit;
+extern u_int32_t close_wait;
 extern in_port_t listen_port;
 extern struct sockaddr_storage **addr;
 extern uid_t target_uid;
@@ -66,21 +76,40 @@ static inline void enable_opt(u_int32_t option);
 
 static const struct option longopts[] = {
 	{"address",				required_argument,	0, 'a'},
+	{"affinity",				no_argument,		0, 'A'},
+	{"allow",				required_argument,	0, 'w'},
+	{"audit-log",				required_argument,	0, 'b'},
+#if BPF_SUPPORT
+	{"bpf",					no_argument,		0, 'F'},
+#endif
 	{"charset",				required_argument,	0, 'c'},
+	{"close-reset",				no_argument,		0, 'K'},
+	{"close-wait",				required_argument,	0, 'W'},
 	{"config",				required_argument,	0, 'C'},
 	{"debug",				no_argument,		0, 'd'},
+	{"deny",				required_argument,	0, 'D'},
 	{"error",				no_argument,		0, 'e'},
 	{"group",				required_argument,	0, 'g'},
 	{"help",				no_argument,		0, 'h'},
+	{"handover",				required_argument,	0, 'H'},
 	{"foreground",				no_argument,		0, 'i'},
 	{"stdio",				no_argument,		0, 'I'},
 	{"limit",				required_argument,	0, 'l'},
+	{"latency-target",			required_argument,	0, 'L'},
+	{"max-threads",				required_argument,	0, 'X'},
+	{"memory-limit",			required_argument,	0, 'B'},
+	{"peer",				no_argument,		0, 'n'},
+#ifdef HAVE_SETNS
+	{"netns",				required_argument,	0, 'N'},
+#endif
 	{"other",				optional_argument,	0, 'o'},
 	{"port",				required_argument,	0, 'p'},
 	{"quiet",				no_argument,		0, 'q'},
 	{"reply",				required_argument,	0, 'r'},
+	{"trusted",				required_argument,	0, 'R'},
 	{"nosyslog",				no_argument,		0, 'S'},
 	{"timeout",				required_argument,	0, 't'},
+	{"threads",				required_argument,	0, 'T'},
 	{"user",				required_argument,	0, 'u'},
 #if HAVE_LIBUDB
 	{"udb",					no_argument,		0, 'U'},
@@ -161,7 +190,7 @@ int get_options(int argc, char *const argv[]) {
 
 				if (get_addr(optarg, temp_ss) == -1) {
 					o_log(LOG_CRIT, "Fatal: Unknown host: \"%s\"", optarg);
-					free(temp_ss);
+					xfree(temp_ss);
 					return -1;
 				}
 
@@ -169,13 +198,27 @@ int get_options(int argc, char *const argv[]) {
 				break;
 			}
 
+			case 'b':
+				xfree(audit_path);
+				audit_path = xstrdup(optarg);
+				break;
+
+			case 'A':
+#if THREAD_SUPPORT && defined HAVE_PTHREAD_SETAFFINITY_NP
+				enable_opt(CPU_AFFINITY);
+				break;
+#else
+				o_log(LOG_CRIT, "Fatal: CPU affinity is not supported in this build");
+				return -1;
+#endif
+
 			case 'c':
-				free(charset);
+				xfree(charset);
 				charset = xstrdup(optarg);
 				break;
 
 			case 'C':
-				free(config_file);
+				xfree(config_file);
 				config_file = xstrdup(optarg);
 				break;
 
@@ -187,10 +230,24 @@ int get_options(int argc, char *const argv[]) {
 #endif
 				break;
 
+			case 'D':
+			case 'w':
+				if (acl_add(optarg, opt == 'w') != 0) {
+					o_log(LOG_CRIT, "Fatal: Bad network: \"%s\"", optarg);
+					return -1;
+				}
+				break;
+
 			case 'e':
 				enable_opt(HIDE_ERRORS);
 				break;
 
+#if BPF_SUPPORT
+			case 'F':
+				enable_opt(BPF_OWNERS);
+				break;
+#endif
+
 #if MASQ_SUPPORT
 			case 'f':
 			{
@@ -239,6 +296,11 @@ int get_options(int argc, char *const argv[]) {
 				}
 				break;
 
+			case 'H':
+				xfree(handover_path);
+				handover_path = xstrdup(optarg);
+				break;
+
 			/* pre-connected, as when run from inetd */
 			case 'I':
 				enable_opt(STDIO | FOREGROUND);
@@ -264,8 +326,51 @@ int get_options(int argc, char *const argv[]) {
 				break;
 			}
 
+			case 'K':
+				enable_opt(CLOSE_RESET);
+				break;
+
+			case 'B':
+			{
+				unsigned long temp_limit;
+				char *end;
+
+				temp_limit = strtoul(optarg, &end, 10);
+				if (*end != '\0' || temp_limit < 1 || temp_limit > 0xffffffffUL ||
+					temp_limit > (size_t) -1 / (1024 * 1024))
+				{
+					o_log(LOG_CRIT, "Fatal: Bad memory limit: \"%s\"", optarg);
+					return -1;
+				}
+
+				memory_limit = temp_limit;
+				break;
+			}
+
+			case 'L':
+			{
+				char *end;
+
+				latency_target = strtoul(optarg, &end, 10);
+				if (*end != '\0' || latency_target < 1) {
+					o_log(LOG_CRIT, "Fatal: Bad latency target: \"%s\"", optarg);
+					return -1;
+				}
+				break;
+			}
+
+			case 'n':
+				enable_opt(PEER);
+				break;
+
+#ifdef HAVE_SETNS
+			case 'N':
+				list_prepend(&netns_paths, xstrdup(optarg));
+				break;
+#endif
+
 			case 'o':
-				free(temp_os);
+				xfree(temp_os);
 
 				if (optarg) {
 					char *p;
@@ -296,10 +401,17 @@ int get_options(int argc, char *const argv[]) {
 				break;
 
 			case 'r':
-				free(failuser);
+				xfree(failuser);
 				failuser = xstrdup(optarg);
 				break;
 
+			case 'R':
+				if (trust_add(optarg) != 0) {
+					o_log(LOG_CRIT, "Fatal: Bad network: \"%s\"", optarg);
+					return -1;
+				}
+				break;
+
 			case 'S':
 				enable_opt(NOSYSLOG);
 				break;
@@ -316,6 +428,54 @@ int get_options(int argc, char *const argv[]) {
 				break;
 			}
 
+			case 'T':
+			{
+#if THREAD_SUPPORT
+				char *end;
+
+				num_threads = strtoul(optarg, &end, 10);
+				if (*end != '\0' || num_threads < 1 || num_threads > MAX_THREADS) {
+					o_log(LOG_CRIT, "Fatal: Bad number of threads: \"%s\" "
+						"(must be between 1 and %u)", optarg, MAX_THREADS);
+					return -1;
+				}
+				break;
+#else
+				o_log(LOG_CRIT, "Fatal: Thread support is not available in this build");
+				return -1;
+#endif
+			}
+
+			case 'X':
+			{
+#if THREAD_SUPPORT
+				char *end;
+
+				max_threads = strtoul(optarg, &end, 10);
+				if (*end != '\0' || max_threads < 1 || max_threads > MAX_THREADS) {
+					o_log(LOG_CRIT, "Fatal: Bad maximum number of threads: \"%s\" "
+						"(must be between 1 and %u)", optarg, MAX_THREADS);
+					return -1;
+				}
+				break;
+#else
+				o_log(LOG_CRIT, "Fatal: Thread support is not available in this build");
+				return -1;
+#endif
+			}
+
+			case 'W':
+			{
+				char *end;
+
+				close_wait = strtoul(optarg, &end, 10);
+				if (*end != '\0' || close_wait < 1) {
+					o_log(LOG_CRIT, "Fatal: Bad close wait time: \"%s\"", optarg);
+					return -1;
+				}
+				break;
+			}
+
 			case 'u':
 				enable_opt(CHANGE_UID);
 				if (find_user(optarg, &target_uid) != 0) {
@@ -353,8 +513,8 @@ int get_options(int argc, char *const argv[]) {
 
 		ret_os = xmalloc(len);
 		snprintf(ret_os, len, "%s,%s", temp_os, charset);
-		free(temp_os);
-		free(charset);
+		xfree(temp_os);
+		xfree(charset);
 	} else {
 		ret_os = temp_os;
 	}
@@ -364,6 +524,52 @@ int get_options(int argc, char *const argv[]) {
 		return -1;
 	}
 
+	if (num_threads > 0 && opt_enabled(STDIO)) {
+		o_log(LOG_CRIT, "Fatal: The '--threads' and '--stdio' flags are incompatible");
+		return -1;
+	}
+
+	if (handover_path && opt_enabled(STDIO)) {
+		o_log(LOG_CRIT, "Fatal: The '--handover' and '--stdio' flags are incompatible");
+		return -1;
+	}
+
+	if (opt_enabled(CPU_AFFINITY) && num_threads == 0) {
+		o_log(LOG_CRIT, "Fatal: The '--affinity' flag requires '--threads'");
+		return -1;
+	}
+
+	if (opt_enabled(CLOSE_RESET) && close_wait == 0) {
+		o_log(LOG_CRIT, "Fatal: The '--close-reset' flag requires '--close-wait'");
+		return -1;
+	}
+
+	if (max_threads > 0 && num_threads == 0) {
+		o_log(LOG_CRIT, "Fatal: The '--max-threads' flag requires '--threads'");
+		return -1;
+	}
+
+	if (max_threads > 0 && max_threads < num_threads) {
+		o_log(LOG_CRIT, "Fatal: The maximum number of threads is below '--threads'");
+		return -1;
+	}
+
+	if (latency_target > 0 && num_threads == 0) {
+		o_log(LOG_CRIT, "Fatal: The '--latency-target' flag requires '--threads'");
+		return -1;
+	}
+
+	if (netns_paths && !opt_enabled(MASQ)) {
+		o_log(LOG_CRIT, "Fatal: The '--netns' flag requires '--masquerade'");
+		return -1;
+	}
+
+	/* the owner map only knows connections made after it was set up */
+	if (opt_enabled(BPF_OWNERS) && opt_enabled(STDIO)) {
+		o_log(LOG_CRIT, "Fatal: The '--bpf' flag can't be used with '--stdio'");
+		return -1;
+	}
+
 #if NEED_ROOT
 	/*
 	** Warn the user that privileges will not be dropped automatically.
@@ -422,8 +628,22 @@ static void print_usage(void) {
 	const char usage[] =
 "\nUsage: " PACKAGE_NAME " [options]\n"
 "-a or --address <address>    Bind to <address> (can be specified multiple times)\n"
+
+#if THREAD_SUPPORT && defined HAVE_PTHREAD_SETAFFINITY_NP
+"-A or --affinity             Pin each thread to a CPU and give it its own listening sockets\n"
+#endif
+
+"-b or --audit-log <file>     Record every answer in binary audit log <file> (see oidentd-audit)\n"
+
+#if BPF_SUPPORT
+"-F or --bpf                  Keep the owners of outgoing connections in an eBPF map, falling back to netlink\n"
+#endif
+
+"-B or --memory-limit <MiB>   Drop cached user configuration files to keep memory use below <MiB> mebibytes\n"
 "-c or --charset <charset>    Specify an alternate charset\n"
 "-C or --config <config file> Use the specified configuration file instead of the default\n"
+"-W or --close-wait <ms>      Give clients up to <ms> to close the connection first, avoiding TIME_WAIT\n"
+"-K or --close-reset          Reset connections of clients that don't close them within --close-wait\n"
 
 #if ENABLE_DEBUGGING
 "-d or --debug                Enable debugging\n"
@@ -431,6 +651,7 @@ static void print_usage(void) {
 "-d or --debug                Enable debugging (not available in this build)\n"
 #endif
 
+"-D or --deny <net>           Close connections from network <net> (address[/bits]) at once\n"
 "-e or --error                Return \"UNKNOWN-ERROR\" for all errors\n"
 
 #if MASQ_SUPPORT
@@ -441,14 +662,32 @@ static void print_usage(void) {
 
 "-P or --proxy <host>         Let <host> act as a proxy, forwarding connections to us\n"
 "-g or --group <group>        Run with specified group or GID\n"
+"-H or --handover <path>      Take over the listening sockets of the instance at <path>, then accept handovers there\n"
 "-i or --foreground           Don't run as a daemon\n"
 "-I or --stdio                Service a single client connected to stdin/stdout, then exit (use with inetd/xinetd/etc.)\n"
 "-l or --limit <number>       Limit the number of open connections to the specified number\n"
+
+#if THREAD_SUPPORT
+"-L or --latency-target <ms>  Answer cheaply or with errors while requests take longer than <ms>\n"
+#endif
+
+"-n or --peer                 Speak the oidentd peer protocol with hosts requests are forwarded to\n"
+
+#ifdef HAVE_SETNS
+"-N or --netns <path>         Look up masqueraded connections in the network namespace at <path>, or in each one in directory <path>\n"
+#endif
+
 "-o or --other [<os>]         Return <os> instead of the operating system.  Uses \"OTHER\" if no argument is given.\n"
 "-p or --port <port>          Listen for connections on specified port\n"
 "-q or --quiet                Suppress normal logging\n"
 "-S or --nosyslog             Write messages to stderr instead of syslog\n"
 "-t or --timeout <seconds>    Wait at most <seconds> before closing connections\n"
+
+#if THREAD_SUPPORT
+"-T or --threads <number>     Serve requests using <number> threads instead of child processes\n"
+"-X or --max-threads <number> Add threads while busy, up to <number>, and remove them while idle\n"
+#endif
+
 "-u or --user <user>          Run as specified user or UID\n"
 
 #if HAVE_LIBUDB
@@ -456,7 +695,9 @@ static void print_usage(void) {
 #endif
 
 "-v or --version              Display version information and exit\n"
+"-w or --allow <net>          Close connections from hosts outside the networks given with --allow at once\n"
 "-r or --reply <string>       If a query fails, pretend it succeeded, returning <string>\n"
+"-R or --trusted <net>        Serve hosts in network <net> (address[/bits]) first and beyond the connection limit\n"
 "-h or --help                 Display this help and exit\n";
 
 	print_version(false);
@@ -486,7 +727,9 @@ static void print_version(bool verbose) {
 		print_version_bool("Masquerading support", MASQ_SUPPORT);
 		print_version_bool("IPv6 support", WANT_IPV6);
 		print_version_bool("Linux libnfct support", LIBNFCT_SUPPORT);
+		print_version_bool("Linux eBPF support", BPF_SUPPORT);
 		print_version_bool("UDB library support", HAVE_LIBUDB);
+		print_version_bool("Thread support", THREAD_SUPPORT);
 
 		printf("\nBuild settings:\n");
 		print_version_str("Configuration directory", SYSCONFDIR);
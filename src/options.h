@@ -35,6 +35,10 @@
 #define NOSYSLOG      (1 << 0x0a)
 #define STDIO         (1 << 0x0b)
 #define MASQ_OVERRIDE (1 << 0x0c)
+#define CPU_AFFINITY  (1 << 0x0d)
+#define PEER          (1 << 0x0e)
+#define CLOSE_RESET   (1 << 0x0f)
+#define BPF_OWNERS    (1 << 0x10)
 
 #ifndef LIBNFCT_SUPPORT
 #define LIBNFCT_SUPPORT 0
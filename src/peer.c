@@ -0,0 +1,624 @@
+/*
+** peer.c - oidentd peer protocol.
+** Copyright (c) 2019      Janik Rabe  <oidentd@janikrabe.com>
+**
+** This program is free software; you can redistribute it and/or modify
+** it under the terms of the GNU General Public License, version 2,
+** as published by the Free Software Foundation.
+**
+** This program is distributed in the hope that it will be useful,
+** but WITHOUT ANY WARRANTY; without even the implied warranty of
+** MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+** GNU General Public License for more details.
+**
+** You should have received a copy of the GNU General Public License
+** along with this program; if not, write to the Free Software
+** Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA
+*/
+
+#include <config.h>
+
+#include <unistd.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <fcntl.h>
+#include <string.h>
+#include <errno.h>
+#include <syslog.h>
+#include <time.h>
+#include <pwd.h>
+#include <poll.h>
+#include <sys/types.h>
+#include <sys/time.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+
+#include "oidentd.h"
+#include "util.h"
+#include "missing.h"
+#include "inet_util.h"
+#include "options.h"
+#include "peer.h"
+
+#if THREAD_SUPPORT
+#	include <pthread.h>
+#endif
+
+/*
+** oidentd instances that forward requests to each other may use a
+** session protocol instead of opening a connection per request.  The
+** forwarding host sends PEER_HELLO as its first line; a host that speaks
+** the protocol answers
+**
+**   OIDENTD-PEER 1 OK <window>
+**
+** after which the forwarding host may send up to <window> queries without
+** waiting for their replies:
+**
+**   Q <tag> <lport>,<fport>
+**
+** Each query is answered with one of
+**
+**   R <tag> USERID <os> <user>
+**   R <tag> ERROR <error>
+**
+** Replies are matched to queries by tag.  oidentd answers the queries of a
+** session one at a time and announces a window of 1.  Hosts that answer
+** the greeting with anything else are asked using RFC 1413 instead.
+*/
+
+#ifdef MSG_NOSIGNAL
+#	define PEER_SEND_FLAGS	MSG_NOSIGNAL
+#else
+#	define PEER_SEND_FLAGS	0
+#endif
+
+/*
+** Returns true if "line" starts a peer session.
+*/
+
+bool peer_is_hello(const char *line) {
+	size_t len = strlen(PEER_HELLO);
+
+	return !strncmp(line, PEER_HELLO, len) &&
+		(line[len] == '\r' || line[len] == '\n' || line[len] == '\0');
+}
+
+/*
+** Parse the query frame "line."
+** Returns 0 on success, -1 on failure.
+*/
+
+int peer_parse_query(	const char *line,
+						char *tag,
+						size_t tag_len,
+						int *lport,
+						int *fport)
+{
+	char buf[PEER_TAG_LEN];
+
+	if (sscanf(line, "Q %15s %d , %d", buf, lport, fport) != 3)
+		return -1;
+
+	xstrncpy(tag, buf, tag_len);
+	return 0;
+}
+
+/*
+** Translate the RFC 1413 reply "line" into a reply frame for the query
+** tagged "tag," and send it to "sock."  Replies that can't be parsed are
+** sent as errors.
+** Returns 0 on success, -1 on failure.
+*/
+
+int peer_send_reply(int sock, const char *tag, const char *line) {
+	char buf[MAX_ULEN + 128];
+	char *p, *end;
+
+	xstrncpy(buf, line, sizeof(buf));
+
+	end = strpbrk(buf, "\r\n");
+	if (end)
+		*end = '\0';
+
+	/* skip the port pair */
+	p = strchr(buf, ':');
+	if (p && !strncmp(p + 1, "USERID:", 7)) {
+		char *os = p + 8;
+		char *user = strchr(os, ':');
+
+		if (user) {
+			*user++ = '\0';
+			return sockprintf(sock, "R %s USERID %s %s\r\n", tag, os, user) > 0 ? 0 : -1;
+		}
+	} else if (p && !strncmp(p + 1, "ERROR:", 6))
+		return sockprintf(sock, "R %s ERROR %s\r\n", tag, p + 7) > 0 ? 0 : -1;
+
+	return sockprintf(sock, "R %s ERROR %s\r\n", tag, ERROR("UNKNOWN-ERROR")) > 0 ? 0 : -1;
+}
+
+#if THREAD_SUPPORT
+
+/*
+** A query waiting for its reply.  "status" is 0 for a USERID reply, -1
+** for an ERROR reply, or PEER_FAILED.
+*/
+
+struct peer_wait {
+	unsigned int tag;
+	bool done;
+	int status;
+	char *reply;
+	size_t len;
+	struct peer_wait *next;
+};
+
+/*
+** A session with another host.  Threads asking the host share the
+** session; one of them at a time reads replies for all of them.
+*/
+
+struct peer {
+	bool used;
+	struct sockaddr_storage addr;
+	pthread_mutex_t lock;
+	pthread_cond_t cond;
+	int fd;
+	bool reading;
+	bool broken;
+	time_t unsupported_until;
+	u_int32_t window;
+	u_int32_t outstanding;
+	unsigned int next_tag;
+	struct peer_wait *waiting;
+	size_t buf_len;
+	char buf[1024];
+};
+
+DEFINE_LOCK(peers_mutex);
+static struct peer peers[PEER_MAX_HOSTS];
+
+static long remaining_ms(const struct timespec *deadline);
+static struct peer *peer_find(const struct sockaddr_storage *host);
+static int peer_wait_fd(int fd, bool write, const struct timespec *deadline);
+static int peer_read_line(struct peer *peer, char *line, size_t len, const struct timespec *deadline);
+static int peer_connect(struct peer *peer, const struct timespec *deadline);
+static void peer_fail(struct peer *peer);
+static void peer_dispatch(struct peer *peer, char *line);
+static void peer_unlink(struct peer *peer, struct peer_wait *wait);
+
+/*
+** Returns the number of milliseconds left until "deadline," or 0 if it
+** has passed.
+*/
+
+static long remaining_ms(const struct timespec *deadline) {
+	struct timeval now;
+	long ms;
+
+	gettimeofday(&now, NULL);
+
+	ms = (deadline->tv_sec - now.tv_sec) * 1000 +
+		(deadline->tv_nsec / 1000 - now.tv_usec) / 1000;
+
+	return ms > 0 ? ms : 0;
+}
+
+/*
+** Find the session with "host," setting one up if there is none.
+** Returns NULL if all sessions are in use.
+*/
+
+static struct peer *peer_find(const struct sockaddr_storage *host) {
+	struct sockaddr_storage addr;
+	struct peer *free_peer = NULL;
+	size_t i;
+
+	memcpy(&addr, host, sizeof(addr));
+	o_lock(peers_mutex);
+
+	for (i = 0; i < PEER_MAX_HOSTS; ++i) {
+		struct peer *peer = &peers[i];
+
+		if (!peer->used) {
+			if (!free_peer)
+				free_peer = peer;
+
+			continue;
+		}
+
+		if (peer->addr.ss_family == addr.ss_family &&
+			sin_port(&peer->addr) == sin_port(&addr) &&
+			sin_equal(&peer->addr, &addr))
+		{
+			o_unlock(peers_mutex);
+			return peer;
+		}
+	}
+
+	if (free_peer) {
+		memcpy(&free_peer->addr, &addr, sizeof(addr));
+		pthread_mutex_init(&free_peer->lock, NULL);
+		pthread_cond_init(&free_peer->cond, NULL);
+		free_peer->fd = -1;
+		free_peer->used = true;
+	}
+
+	o_unlock(peers_mutex);
+	return free_peer;
+}
+
+/*
+** Wait until "fd" is readable, or writable if "write" is set.
+** Returns 0 on success, -1 on failure or if "deadline" has passed.
+*/
+
+static int peer_wait_fd(int fd, bool write, const struct timespec *deadline) {
+	for (;;) {
+		long ms = remaining_ms(deadline);
+		struct pollfd pfd;
+		int ret;
+
+		if (ms == 0) {
+			errno = ETIMEDOUT;
+			return -1;
+		}
+
+		/* sessions are opened by threads that may hold many descriptors */
+		pfd.fd = fd;
+		pfd.events = write ? POLLOUT : POLLIN;
+		pfd.revents = 0;
+
+		ret = poll(&pfd, 1, (int) ms);
+		if (ret > 0)
+			return 0;
+
+		if (ret == -1 && errno != EINTR)
+			return -1;
+	}
+}
+
+/*
+** Read a line from the session with "peer" into "line."
+** Returns 0 on success, -1 on failure or if "deadline" has passed.
+*/
+
+static int peer_read_line(	struct peer *peer,
+							char *line,
+							size_t len,
+							const struct timespec *deadline)
+{
+	for (;;) {
+		char *end = memchr(peer->buf, '\n', peer->buf_len);
+		ssize_t ret;
+
+		if (end) {
+			size_t line_len = end - peer->buf + 1;
+
+			*end = '\0';
+			xstrncpy(line, peer->buf, len);
+
+			peer->buf_len -= line_len;
+			memmove(peer->buf, end + 1, peer->buf_len);
+			return 0;
+		}
+
+		if (peer->buf_len == sizeof(peer->buf)) {
+			debug("Peer sent an overlong line");
+			return -1;
+		}
+
+		if (peer_wait_fd(peer->fd, false, deadline) != 0)
+			return -1;
+
+		ret = read(peer->fd, peer->buf + peer->buf_len,
+				sizeof(peer->buf) - peer->buf_len);
+
+		if (ret == 0) {
+			errno = ECONNRESET;
+			return -1;
+		}
+
+		if (ret == -1) {
+			if (errno == EAGAIN || errno == EWOULDBLOCK || errno == EINTR)
+				continue;
+
+			return -1;
+		}
+
+		peer->buf_len += ret;
+	}
+}
+
+/*
+** Open a session with "peer."  Called with the session locked.
+** Returns 0 on success, PEER_FAILED if the host could not be reached, or
+** PEER_UNSUPPORTED if it does not speak the peer protocol.
+*/
+
+static int peer_connect(struct peer *peer, const struct timespec *deadline) {
+	char line[128];
+	unsigned int window;
+	int flags;
+	int err;
+	socklen_t errlen = sizeof(err);
+
+	peer->fd = socket(peer->addr.ss_family, SOCK_STREAM, 0);
+	if (peer->fd == -1) {
+		debug("socket: %s", strerror(errno));
+		return PEER_FAILED;
+	}
+
+	fcntl(peer->fd, F_SETFD, FD_CLOEXEC);
+
+	flags = fcntl(peer->fd, F_GETFL);
+	if (flags == -1 || fcntl(peer->fd, F_SETFL, flags | O_NONBLOCK) == -1)
+		goto out_fail;
+
+	if (connect(peer->fd, (struct sockaddr *) &peer->addr,
+			(socklen_t) sin_len(&peer->addr)) != 0)
+	{
+		if (errno != EINPROGRESS || peer_wait_fd(peer->fd, true, deadline) != 0)
+			goto out_fail;
+
+		if (getsockopt(peer->fd, SOL_SOCKET, SO_ERROR, &err, &errlen) != 0 || err != 0)
+			goto out_fail;
+	}
+
+	peer->buf_len = 0;
+
+	if (send(peer->fd, PEER_HELLO "\r\n", strlen(PEER_HELLO "\r\n"),
+			PEER_SEND_FLAGS) == -1)
+	{
+		goto out_fail;
+	}
+
+	if (peer_read_line(peer, line, sizeof(line), deadline) != 0) {
+		/* RFC 1413 servers usually drop connections with bad requests */
+		if (errno == ETIMEDOUT)
+			goto out_fail;
+
+		goto out_unsupported;
+	}
+
+	if (sscanf(line, PEER_HELLO " OK %u", &window) != 1 || window == 0)
+		goto out_unsupported;
+
+	peer->window = MIN(window, PEER_WINDOW);
+	peer->outstanding = 0;
+	peer->broken = false;
+
+	return 0;
+
+out_unsupported:
+	peer->unsupported_until = time(NULL) + PEER_RECHECK;
+	close(peer->fd);
+	peer->fd = -1;
+	return PEER_UNSUPPORTED;
+
+out_fail:
+	debug("Failed to open peer session: %s", strerror(errno));
+	close(peer->fd);
+	peer->fd = -1;
+	return PEER_FAILED;
+}
+
+/*
+** Fail all queries waiting on the session with "peer" and close it.  If
+** a thread is reading from the session, it closes the session once it is
+** done.  Called with the session locked.
+*/
+
+static void peer_fail(struct peer *peer) {
+	struct peer_wait *wait;
+
+	for (wait = peer->waiting; wait; wait = wait->next) {
+		wait->status = PEER_FAILED;
+		wait->done = true;
+	}
+
+	peer->waiting = NULL;
+	peer->outstanding = 0;
+
+	if (peer->reading)
+		peer->broken = true;
+	else if (peer->fd != -1) {
+		close(peer->fd);
+		peer->fd = -1;
+	}
+
+	pthread_cond_broadcast(&peer->cond);
+}
+
+/*
+** Remove "wait" from the queries waiting on the session with "peer."
+** Called with the session locked.
+*/
+
+static void peer_unlink(struct peer *peer, struct peer_wait *wait) {
+	struct peer_wait **cur;
+
+	for (cur = &peer->waiting; *cur; cur = &(*cur)->next) {
+		if (*cur == wait) {
+			*cur = wait->next;
+			--peer->outstanding;
+			break;
+		}
+	}
+}
+
+/*
+** Hand the reply frame "line" to the query it answers.  Replies to
+** queries that have been given up on are ignored.  Called with the
+** session locked.
+*/
+
+static void peer_dispatch(struct peer *peer, char *line) {
+	struct peer_wait *wait;
+	char status[16];
+	char os[64];
+	unsigned int tag;
+	int pos = 0;
+
+	if (sscanf(line, "R %u %15s %n", &tag, status, &pos) != 2 || pos == 0) {
+		debug("Malformed peer reply: \"%s\"", line);
+		return;
+	}
+
+	for (wait = peer->waiting; wait; wait = wait->next) {
+		if (wait->tag == tag)
+			break;
+	}
+
+	if (!wait)
+		return;
+
+	line[strcspn(line, "\r")] = '\0';
+	wait->status = -1;
+
+	if (!strcmp(status, "USERID")) {
+		int user_pos = 0;
+
+		if (sscanf(line + pos, "%63s %n", os, &user_pos) == 1 && user_pos > 0) {
+			xstrncpy(wait->reply, line + pos + user_pos, wait->len);
+			wait->status = 0;
+		}
+	} else {
+		char ipbuf[MAX_IPLEN];
+
+		get_ip(&peer->addr, ipbuf, sizeof(ipbuf));
+		debug("[%s] Remote response: %s %s", ipbuf, status, line + pos);
+	}
+
+	peer_unlink(peer, wait);
+	wait->done = true;
+	pthread_cond_broadcast(&peer->cond);
+}
+
+/*
+** Ask "host" for the owner of the connection (lport, fport) using the
+** peer protocol, opening a session if there is none.
+** Returns 0 if the host replied with a user ID, which is stored in
+** "reply," -1 if it replied with an error, or PEER_FAILED or
+** PEER_UNSUPPORTED.
+*/
+
+int peer_request(	const struct sockaddr_storage *host,
+					in_port_t lport,
+					in_port_t fport,
+					char *reply,
+					size_t len)
+{
+	struct peer_wait wait;
+	struct timespec deadline;
+	struct timeval now;
+	struct peer *peer;
+	char frame[64];
+	int ret;
+
+	peer = peer_find(host);
+	if (!peer)
+		return PEER_UNSUPPORTED;
+
+	gettimeofday(&now, NULL);
+	deadline.tv_sec = now.tv_sec + FORWARD_TIMEOUT;
+	deadline.tv_nsec = now.tv_usec * 1000;
+
+	pthread_mutex_lock(&peer->lock);
+
+	if (peer->fd == -1) {
+		if (time(NULL) < peer->unsupported_until) {
+			pthread_mutex_unlock(&peer->lock);
+			return PEER_UNSUPPORTED;
+		}
+
+		ret = peer_connect(peer, &deadline);
+		if (ret != 0) {
+			pthread_mutex_unlock(&peer->lock);
+			return ret;
+		}
+	}
+
+	/* flow control: wait for a free slot in the peer's window */
+	while (peer->fd != -1 && !peer->broken && peer->outstanding >= peer->window) {
+		if (pthread_cond_timedwait(&peer->cond, &peer->lock, &deadline) == ETIMEDOUT) {
+			pthread_mutex_unlock(&peer->lock);
+			return PEER_FAILED;
+		}
+	}
+
+	if (peer->fd == -1 || peer->broken) {
+		pthread_mutex_unlock(&peer->lock);
+		return PEER_FAILED;
+	}
+
+	memset(&wait, 0, sizeof(wait));
+	wait.tag = peer->next_tag++;
+	wait.reply = reply;
+	wait.len = len;
+	wait.next = peer->waiting;
+	peer->waiting = &wait;
+	++peer->outstanding;
+
+	snprintf(frame, sizeof(frame), "Q %u %d,%d\r\n", wait.tag, lport, fport);
+	if (send(peer->fd, frame, strlen(frame), PEER_SEND_FLAGS) != (ssize_t) strlen(frame)) {
+		debug("send: %s", strerror(errno));
+		peer_fail(peer);
+	}
+
+	while (!wait.done) {
+		if (!peer->reading) {
+			char line[MAX_ULEN + 128];
+
+			peer->reading = true;
+			pthread_mutex_unlock(&peer->lock);
+
+			ret = peer_read_line(peer, line, sizeof(line), &deadline);
+
+			pthread_mutex_lock(&peer->lock);
+			peer->reading = false;
+
+			if (peer->broken) {
+				peer->broken = false;
+				close(peer->fd);
+				peer->fd = -1;
+			}
+
+			if (ret == 0)
+				peer_dispatch(peer, line);
+			else if (errno != ETIMEDOUT || remaining_ms(&deadline) > 0) {
+				debug("Peer session failed: %s", strerror(errno));
+				peer_fail(peer);
+			} else
+				break;
+
+			/* let another thread take over reading */
+			pthread_cond_broadcast(&peer->cond);
+		} else if (pthread_cond_timedwait(&peer->cond, &peer->lock, &deadline) == ETIMEDOUT)
+			break;
+	}
+
+	if (!wait.done) {
+		peer_unlink(peer, &wait);
+		pthread_mutex_unlock(&peer->lock);
+
+		o_log(LOG_INFO, "Forward timed out");
+		return PEER_FAILED;
+	}
+
+	pthread_mutex_unlock(&peer->lock);
+	return wait.status;
+}
+
+#else
+
+int peer_request(	const struct sockaddr_storage *host __notused,
+					in_port_t lport __notused,
+					in_port_t fport __notused,
+					char *reply __notused,
+					size_t len __notused)
+{
+	return PEER_UNSUPPORTED;
+}
+
+#endif
@@ -0,0 +1,64 @@
+/*
+** peer.h - oidentd peer protocol.
+** Copyright (c) 2019      Janik Rabe  <oidentd@janikrabe.com>
+**
+** This program is free software; you can redistribute it and/or modify
+** it under the terms of the GNU General Public License, version 2,
+** as published by the Free Software Foundation.
+**
+** This program is distributed in the hope that it will be useful,
+** but WITHOUT ANY WARRANTY; without even the implied warranty of
+** MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+** GNU General Public License for more details.
+**
+** You should have received a copy of the GNU General Public License
+** along with this program; if not, write to the Free Software
+** Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA
+*/
+
+#ifndef __OIDENTD_PEER_H
+#define __OIDENTD_PEER_H
+
+/*
+** The greeting that starts a peer session, the largest number of queries
+** kept outstanding on a session to another host, the number this host
+** accepts on the sessions it serves, and the maximum length of a query
+** tag.  Queries of a served session are answered one at a time.
+*/
+
+#define PEER_HELLO			"OIDENTD-PEER 1"
+#define PEER_WINDOW			16
+#define PEER_SERVE_WINDOW	1
+#define PEER_TAG_LEN		16
+
+/*
+** The number of hosts peer sessions are kept open to, and the number of
+** seconds after which a host that did not speak the peer protocol is
+** asked again.
+*/
+
+#define PEER_MAX_HOSTS	16
+#define PEER_RECHECK	600
+
+/*
+** Returned by peer_request() if the host could not be asked, or if it
+** does not speak the peer protocol.
+*/
+
+#define PEER_FAILED			(-2)
+#define PEER_UNSUPPORTED	(-3)
+
+bool peer_is_hello(const char *line);
+int peer_parse_query(	const char *line,
+						char *tag,
+						size_t tag_len,
+						int *lport,
+						int *fport);
+int peer_send_reply(int sock, const char *tag, const char *line);
+int peer_request(	const struct sockaddr_storage *host,
+					in_port_t lport,
+					in_port_t fport,
+					char *reply,
+					size_t len);
+
+#endif
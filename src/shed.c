@@ -0,0 +1,320 @@
+/*
+** shed.c - oidentd load shedding.
+** Copyright (c) 2019      Janik Rabe  <oidentd@janikrabe.com>
+**
+** This program is free software; you can redistribute it and/or modify
+** it under the terms of the GNU General Public License, version 2,
+** as published by the Free Software Foundation.
+**
+** This program is distributed in the hope that it will be useful,
+** but WITHOUT ANY WARRANTY; without even the implied warranty of
+** MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+** GNU General Public License for more details.
+**
+** You should have received a copy of the GNU General Public License
+** along with this program; if not, write to the Free Software
+** Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA
+*/
+
+#include <config.h>
+
+#include <unistd.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <syslog.h>
+#include <pwd.h>
+#include <time.h>
+#include <sys/time.h>
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+
+#ifdef HAVE_STRUCT_TCP_INFO_TCPI_LAST_ACK_RECV
+#	include <netinet/tcp.h>
+#endif
+
+#include "oidentd.h"
+#include "util.h"
+#include "missing.h"
+#include "shed.h"
+#include "trust.h"
+#include "hitters.h"
+
+#if THREAD_SUPPORT
+#	include <pthread.h>
+#endif
+
+/*
+** The latency of lookups and the time connections wait to be accepted
+** are smoothed separately, in microseconds.  The worse of the two decides
+** the level: it is raised as soon as the target (or twice the target) is
+** exceeded, and lowered only once the latency has dropped to half of the
+** respective threshold, so that it doesn't flap.  Both are halved for
+** every second without requests, so that a daemon that has become idle
+** stops shedding load.
+*/
+
+DEFINE_LOCK(shed_mutex);
+static unsigned long target_usecs;
+static unsigned long latency;
+static unsigned long queued;
+static int level = SHED_NONE;
+static unsigned long admitted;
+static unsigned long num_cheap;
+static unsigned long num_error;
+static time_t sampled;
+static time_t logged;
+
+static unsigned long shed_smooth(unsigned long avg, unsigned long sample);
+static void shed_decay(time_t now);
+static int shed_update(void);
+static void shed_log_level(int new_level, unsigned long worst);
+
+/*
+** Enable load shedding with a latency target of "target" milliseconds.
+*/
+
+void shed_init(u_int32_t target) {
+	target_usecs = target * 1000UL;
+}
+
+static unsigned long shed_smooth(unsigned long avg, unsigned long sample) {
+	return avg - avg / SHED_SMOOTHING + sample / SHED_SMOOTHING;
+}
+
+/*
+** Halve the averages for every full second since the last request.  Must
+** be called with shed_mutex held.
+*/
+
+static void shed_decay(time_t now) {
+	if (now > sampled + 1) {
+		unsigned long secs = now - sampled - 1;
+
+		latency = secs < 32 ? latency >> secs : 0;
+		queued = secs < 32 ? queued >> secs : 0;
+	}
+
+	sampled = now;
+}
+
+/*
+** Recompute the level from the smoothed latencies.  Must be called with
+** shed_mutex held.
+** Returns the new level if it changed, or -1.
+*/
+
+static int shed_update(void) {
+	unsigned long worst = MAX(latency, queued);
+	int new_level;
+
+	if (worst > 2 * target_usecs)
+		new_level = SHED_ERROR;
+	else if (worst > target_usecs)
+		new_level = level == SHED_ERROR ? SHED_ERROR : SHED_CHEAP;
+	else if (worst > target_usecs / 2)
+		new_level = level == SHED_NONE ? SHED_NONE : SHED_CHEAP;
+	else
+		new_level = SHED_NONE;
+
+	if (new_level == level)
+		return -1;
+
+	level = new_level;
+	return new_level;
+}
+
+/*
+** Log a change of the level.  The level may change several times a second
+** under a steady overload, so changes are logged at most once every
+** SHED_LOG_INTERVAL seconds; shed_log_stats() reports the current level.
+*/
+
+static void shed_log_level(int new_level, unsigned long worst) {
+	time_t now = time(NULL);
+
+	o_lock(shed_mutex);
+	if (now < logged + SHED_LOG_INTERVAL) {
+		o_unlock(shed_mutex);
+		return;
+	}
+
+	logged = now;
+	o_unlock(shed_mutex);
+
+	switch (new_level) {
+		case SHED_NONE:
+			o_log(LOG_INFO, "Latency is down to %lu ms; answering all requests",
+				worst / 1000);
+			break;
+
+		case SHED_CHEAP:
+			o_log(LOG_INFO, "Latency of %lu ms exceeds target of %lu ms; "
+				"skipping forwarding and slow lookups",
+				worst / 1000, target_usecs / 1000);
+			break;
+
+		case SHED_ERROR:
+			o_log(LOG_INFO, "Latency of %lu ms exceeds target of %lu ms; "
+				"answering requests with errors",
+				worst / 1000, target_usecs / 1000);
+			break;
+	}
+}
+
+/*
+** Decide how much work the next request, from "peer," may do.  While
+** requests are answered cheaply, those from hosts sending most of the
+** queries are answered with errors.  While requests are answered with
+** errors, every SHED_PROBE_INTERVAL-th one is still looked up cheaply so
+** that its latency can show when the load has dropped.
+*/
+
+int shed_admit(const struct sockaddr_storage *peer) {
+	unsigned long worst;
+	time_t now;
+	int changed;
+	int ret;
+
+	if (target_usecs == 0)
+		return SHED_NONE;
+
+	now = time(NULL);
+
+	o_lock(shed_mutex);
+
+	shed_decay(now);
+	changed = shed_update();
+
+	worst = MAX(latency, queued);
+	ret = level;
+
+	if (ret == SHED_CHEAP) {
+		o_unlock(shed_mutex);
+
+		if (hitters_heavy_peer(peer))
+			ret = SHED_ERROR;
+
+		o_lock(shed_mutex);
+	}
+
+	if (ret == SHED_ERROR && ++admitted % SHED_PROBE_INTERVAL == 0)
+		ret = SHED_CHEAP;
+
+	if (ret == SHED_CHEAP)
+		++num_cheap;
+	else if (ret == SHED_ERROR)
+		++num_error;
+
+	o_unlock(shed_mutex);
+
+	if (changed != -1)
+		shed_log_level(changed, worst);
+
+	return ret;
+}
+
+/*
+** Returns true if expensive lookups should be skipped for the request
+** served by the calling thread.
+*/
+
+bool shed_active(void) {
+	bool ret;
+
+	if (target_usecs == 0 || trust_current())
+		return false;
+
+	o_lock(shed_mutex);
+	ret = level != SHED_NONE;
+	o_unlock(shed_mutex);
+
+	return ret;
+}
+
+/*
+** Account for the time the newly accepted connection "sock" spent waiting
+** to be accepted.  The kernel reports the time since the last packet from
+** the client, which is the handshake or the request itself.
+*/
+
+void shed_accepted(int sock) {
+#ifdef HAVE_STRUCT_TCP_INFO_TCPI_LAST_ACK_RECV
+	struct tcp_info info;
+	socklen_t len = sizeof(info);
+	unsigned long worst;
+	int changed;
+
+	if (target_usecs == 0)
+		return;
+
+	if (getsockopt(sock, IPPROTO_TCP, TCP_INFO, &info, &len) != 0) {
+		debug("getsockopt TCP_INFO: %s", strerror(errno));
+		return;
+	}
+
+	o_lock(shed_mutex);
+	shed_decay(time(NULL));
+	queued = shed_smooth(queued, info.tcpi_last_ack_recv * 1000UL);
+	changed = shed_update();
+	worst = MAX(latency, queued);
+	o_unlock(shed_mutex);
+
+	if (changed != -1)
+		shed_log_level(changed, worst);
+#else
+	(void) sock;
+#endif
+}
+
+/*
+** Account for a lookup that started at "start" and has just finished.
+*/
+
+void shed_record(const struct timeval *start) {
+	struct timeval now;
+	unsigned long usecs;
+	unsigned long worst;
+	int changed;
+
+	if (target_usecs == 0)
+		return;
+
+	gettimeofday(&now, NULL);
+	usecs = (now.tv_sec - start->tv_sec) * 1000000UL +
+		now.tv_usec - start->tv_usec;
+
+	o_lock(shed_mutex);
+	shed_decay(now.tv_sec);
+	latency = shed_smooth(latency, usecs);
+	changed = shed_update();
+	worst = MAX(latency, queued);
+	o_unlock(shed_mutex);
+
+	if (changed != -1)
+		shed_log_level(changed, worst);
+}
+
+/*
+** Log the current level, the smoothed latencies, and the number of
+** requests that were answered cheaply or with an error.
+*/
+
+void shed_log_stats(void) {
+	static const char *const names[] = { "off", "cheap lookups", "errors" };
+
+	if (target_usecs == 0)
+		return;
+
+	o_lock(shed_mutex);
+
+	o_log(LOG_INFO, "Load shedding (%s): lookup latency %lu ms, queueing "
+		"delay %lu ms, target %lu ms; %lu requests answered without slow "
+		"lookups, %lu with errors",
+		names[level], latency / 1000, queued / 1000, target_usecs / 1000,
+		num_cheap, num_error);
+
+	o_unlock(shed_mutex);
+}
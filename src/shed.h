@@ -0,0 +1,42 @@
+/*
+** shed.h - oidentd load shedding.
+** Copyright (c) 2019      Janik Rabe  <oidentd@janikrabe.com>
+**
+** This program is free software; you can redistribute it and/or modify
+** it under the terms of the GNU General Public License, version 2,
+** as published by the Free Software Foundation.
+**
+** This program is distributed in the hope that it will be useful,
+** but WITHOUT ANY WARRANTY; without even the implied warranty of
+** MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+** GNU General Public License for more details.
+**
+** You should have received a copy of the GNU General Public License
+** along with this program; if not, write to the Free Software
+** Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA
+*/
+
+#ifndef __OIDENTD_SHED_H
+#define __OIDENTD_SHED_H
+
+/*
+** How much work a request may do.  Requests are answered without
+** forwarding and slow fallback lookups while the latency target is
+** exceeded, and with an error, without any lookup, while it is exceeded
+** by far.
+*/
+
+enum {
+	SHED_NONE,
+	SHED_CHEAP,
+	SHED_ERROR
+};
+
+void shed_init(u_int32_t target);
+int shed_admit(const struct sockaddr_storage *peer);
+bool shed_active(void);
+void shed_accepted(int sock);
+void shed_record(const struct timeval *start);
+void shed_log_stats(void);
+
+#endif
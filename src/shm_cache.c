@@ -0,0 +1,341 @@
+/*
+** shm_cache.c - oidentd lookup cache shared between processes.
+** Copyright (c) 2019      Janik Rabe  <oidentd@janikrabe.com>
+**
+** This program is free software; you can redistribute it and/or modify
+** it under the terms of the GNU General Public License, version 2,
+** as published by the Free Software Foundation.
+**
+** This program is distributed in the hope that it will be useful,
+** but WITHOUT ANY WARRANTY; without even the implied warranty of
+** MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+** GNU General Public License for more details.
+**
+** You should have received a copy of the GNU General Public License
+** along with this program; if not, write to the Free Software
+** Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA
+*/
+
+#include <config.h>
+
+#include <unistd.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <syslog.h>
+#include <time.h>
+#include <pwd.h>
+#include <sys/types.h>
+#include <sys/mman.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+
+#include "oidentd.h"
+#include "util.h"
+#include "missing.h"
+#include "shm_cache.h"
+
+#if THREAD_SUPPORT
+#	include <pthread.h>
+#endif
+
+#if !defined MAP_ANONYMOUS && defined MAP_ANON
+#	define MAP_ANONYMOUS MAP_ANON
+#endif
+
+/*
+** When connections are served by child processes, each child only lives
+** for one request, so lookups can only be cached in memory that is shared
+** across fork(2).  The segment is set up before the first child is
+** created and has a fixed size.
+**
+** An entry is stored in one of SHM_CACHE_WAYS slots chosen by its hash,
+** and each group of slots is protected by one of SHM_CACHE_STRIPES
+** process-shared locks.  An entry is valid only if its generation is the
+** current one: writers clear it before changing the entry and set it once
+** they are done, so an entry that a process was killed while writing is
+** ignored, and shm_cache_flush() invalidates all entries at once.
+*/
+
+#if THREAD_SUPPORT && defined MAP_ANONYMOUS
+
+struct shm_slot {
+	u_int32_t gen;
+	u_int8_t type;
+	u_int8_t keylen;
+	u_int16_t vallen;
+	time_t expires;
+	unsigned char key[SHM_CACHE_KEY_LEN];
+	unsigned char val[SHM_CACHE_VAL_LEN];
+};
+
+struct shm_segment {
+	u_int32_t gen;
+	pthread_mutex_t locks[SHM_CACHE_STRIPES];
+	struct shm_slot slots[SHM_CACHE_SLOTS];
+};
+
+static struct shm_segment *segment;
+
+static bool shm_lock(size_t stripe);
+static void shm_unlock(size_t stripe);
+static size_t shm_group(int type, const void *key, size_t keylen);
+static bool shm_slot_match(	const struct shm_slot *slot,
+							int type,
+							const void *key,
+							size_t keylen);
+
+/*
+** Lock a stripe.  A process that was killed while holding the lock does
+** not leave it locked if robust mutexes are supported.  Otherwise, a
+** stripe that is locked is skipped rather than waited for, since it may
+** never be unlocked.
+** Returns true if the stripe was locked.
+*/
+
+static bool shm_lock(size_t stripe) {
+#ifdef HAVE_PTHREAD_MUTEX_CONSISTENT
+	int ret = pthread_mutex_lock(&segment->locks[stripe]);
+
+	if (ret == EOWNERDEAD) {
+		pthread_mutex_consistent(&segment->locks[stripe]);
+		ret = 0;
+	}
+#else
+	int ret = pthread_mutex_trylock(&segment->locks[stripe]);
+#endif
+
+	return ret == 0;
+}
+
+static void shm_unlock(size_t stripe) {
+	pthread_mutex_unlock(&segment->locks[stripe]);
+}
+
+/*
+** Returns the index of the first slot an entry may be stored in.
+*/
+
+static size_t shm_group(int type, const void *key, size_t keylen) {
+	const unsigned char *p = key;
+	unsigned int hash = 5381 + type;
+	size_t i;
+
+	for (i = 0; i < keylen; ++i)
+		hash = hash * 33 + p[i];
+
+	return (hash % (SHM_CACHE_SLOTS / SHM_CACHE_WAYS)) * SHM_CACHE_WAYS;
+}
+
+static bool shm_slot_match(	const struct shm_slot *slot,
+							int type,
+							const void *key,
+							size_t keylen)
+{
+	return slot->gen == segment->gen && slot->type == type &&
+		slot->keylen == keylen && !memcmp(slot->key, key, keylen);
+}
+
+/*
+** Set up the shared segment.  This must be called before any processes
+** or threads that use the cache are started.
+** Returns 0 on success, -1 on failure.
+*/
+
+int shm_cache_init(void) {
+	pthread_mutexattr_t attr;
+	void *map;
+	size_t i;
+
+	map = mmap(NULL, sizeof(struct shm_segment), PROT_READ | PROT_WRITE,
+			MAP_SHARED | MAP_ANONYMOUS, -1, 0);
+	if (map == MAP_FAILED) {
+		debug("mmap: %s", strerror(errno));
+		return -1;
+	}
+
+	memset(map, 0, sizeof(struct shm_segment));
+	segment = map;
+	segment->gen = 1;
+
+	pthread_mutexattr_init(&attr);
+	pthread_mutexattr_setpshared(&attr, PTHREAD_PROCESS_SHARED);
+#	ifdef HAVE_PTHREAD_MUTEX_CONSISTENT
+	pthread_mutexattr_setrobust(&attr, PTHREAD_MUTEX_ROBUST);
+#	endif
+
+	for (i = 0; i < SHM_CACHE_STRIPES; ++i)
+		pthread_mutex_init(&segment->locks[i], &attr);
+
+	pthread_mutexattr_destroy(&attr);
+	return 0;
+}
+
+/*
+** Returns true if the shared segment has been set up.
+*/
+
+bool shm_cache_enabled(void) {
+	return segment != NULL;
+}
+
+/*
+** Copy the value cached for "key" to "val," which has room for "vallen"
+** bytes.
+** Returns the length of the value, or -1 if none is cached.
+*/
+
+ssize_t shm_cache_get(	int type,
+						const void *key,
+						size_t keylen,
+						void *val,
+						size_t vallen)
+{
+	size_t first;
+	size_t stripe;
+	ssize_t ret = -1;
+	time_t now;
+	size_t i;
+
+	if (!segment || keylen > SHM_CACHE_KEY_LEN)
+		return -1;
+
+	first = shm_group(type, key, keylen);
+	stripe = (first / SHM_CACHE_WAYS) % SHM_CACHE_STRIPES;
+	now = time(NULL);
+
+	if (!shm_lock(stripe))
+		return -1;
+
+	for (i = first; i < first + SHM_CACHE_WAYS; ++i) {
+		struct shm_slot *slot = &segment->slots[i];
+
+		if (!shm_slot_match(slot, type, key, keylen))
+			continue;
+
+		if (slot->expires > now && slot->vallen <= vallen) {
+			memcpy(val, slot->val, slot->vallen);
+			ret = slot->vallen;
+		}
+
+		break;
+	}
+
+	shm_unlock(stripe);
+	return ret;
+}
+
+/*
+** Cache "val" for "key" for "ttl" seconds, replacing the entry that
+** expires first if all slots it may be stored in are in use.  Entries
+** that are too large are not cached.
+*/
+
+void shm_cache_put(	int type,
+					const void *key,
+					size_t keylen,
+					const void *val,
+					size_t vallen,
+					time_t ttl)
+{
+	struct shm_slot *victim = NULL;
+	size_t first;
+	size_t stripe;
+	size_t i;
+
+	if (!segment || keylen > SHM_CACHE_KEY_LEN || vallen > SHM_CACHE_VAL_LEN)
+		return;
+
+	first = shm_group(type, key, keylen);
+	stripe = (first / SHM_CACHE_WAYS) % SHM_CACHE_STRIPES;
+
+	if (!shm_lock(stripe))
+		return;
+
+	for (i = first; i < first + SHM_CACHE_WAYS; ++i) {
+		struct shm_slot *slot = &segment->slots[i];
+
+		if (shm_slot_match(slot, type, key, keylen)) {
+			victim = slot;
+			break;
+		}
+
+		if (slot->gen != segment->gen) {
+			if (!victim || victim->gen == segment->gen)
+				victim = slot;
+		} else if (!victim || (victim->gen == segment->gen &&
+				slot->expires < victim->expires))
+		{
+			victim = slot;
+		}
+	}
+
+	victim->gen = 0;
+	victim->type = type;
+	victim->keylen = keylen;
+	victim->vallen = vallen;
+	victim->expires = time(NULL) + ttl;
+	memcpy(victim->key, key, keylen);
+	memcpy(victim->val, val, vallen);
+	victim->gen = segment->gen;
+
+	shm_unlock(stripe);
+}
+
+/*
+** Invalidate all entries, as after the configuration has been reloaded.
+*/
+
+void shm_cache_flush(void) {
+	size_t locked;
+	size_t i;
+
+	if (!segment)
+		return;
+
+	for (locked = 0; locked < SHM_CACHE_STRIPES; ++locked) {
+		if (!shm_lock(locked))
+			break;
+	}
+
+	/* generation 0 marks entries being written */
+	if (locked == SHM_CACHE_STRIPES && ++segment->gen == 0)
+		segment->gen = 1;
+
+	for (i = 0; i < locked; ++i)
+		shm_unlock(i);
+}
+
+#else
+
+int shm_cache_init(void) {
+	return -1;
+}
+
+bool shm_cache_enabled(void) {
+	return false;
+}
+
+ssize_t shm_cache_get(	int type __notused,
+						const void *key __notused,
+						size_t keylen __notused,
+						void *val __notused,
+						size_t vallen __notused)
+{
+	return -1;
+}
+
+void shm_cache_put(	int type __notused,
+					const void *key __notused,
+					size_t keylen __notused,
+					const void *val __notused,
+					size_t vallen __notused,
+					time_t ttl __notused)
+{
+}
+
+void shm_cache_flush(void) {
+}
+
+#endif
@@ -0,0 +1,59 @@
+/*
+** shm_cache.h - oidentd lookup cache shared between processes.
+** Copyright (c) 2019      Janik Rabe  <oidentd@janikrabe.com>
+**
+** This program is free software; you can redistribute it and/or modify
+** it under the terms of the GNU General Public License, version 2,
+** as published by the Free Software Foundation.
+**
+** This program is distributed in the hope that it will be useful,
+** but WITHOUT ANY WARRANTY; without even the implied warranty of
+** MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+** GNU General Public License for more details.
+**
+** You should have received a copy of the GNU General Public License
+** along with this program; if not, write to the Free Software
+** Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA
+*/
+
+#ifndef __OIDENTD_SHM_CACHE_H
+#define __OIDENTD_SHM_CACHE_H
+
+/*
+** The number of cached entries, how many of them an entry may be stored
+** in, the number of locks protecting them, and the maximum sizes of keys
+** and values.
+*/
+
+#define SHM_CACHE_SLOTS		1024
+#define SHM_CACHE_WAYS		4
+#define SHM_CACHE_STRIPES	16
+#define SHM_CACHE_KEY_LEN	48
+#define SHM_CACHE_VAL_LEN	320
+
+/*
+** The kinds of cached lookups.
+*/
+
+enum {
+	SHM_PASSWD = 1,
+	SHM_MASQ,
+	SHM_ADDR
+};
+
+int shm_cache_init(void);
+bool shm_cache_enabled(void);
+ssize_t shm_cache_get(	int type,
+						const void *key,
+						size_t keylen,
+						void *val,
+						size_t vallen);
+void shm_cache_put(	int type,
+					const void *key,
+					size_t keylen,
+					const void *val,
+					size_t vallen,
+					time_t ttl);
+void shm_cache_flush(void);
+
+#endif
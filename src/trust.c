@@ -0,0 +1,120 @@
+/*
+** trust.c - oidentd trusted hosts.
+** Copyright (c) 2019      Janik Rabe  <oidentd@janikrabe.com>
+**
+** This program is free software; you can redistribute it and/or modify
+** it under the terms of the GNU General Public License, version 2,
+** as published by the Free Software Foundation.
+**
+** This program is distributed in the hope that it will be useful,
+** but WITHOUT ANY WARRANTY; without even the implied warranty of
+** MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+** GNU General Public License for more details.
+**
+** You should have received a copy of the GNU General Public License
+** along with this program; if not, write to the Free Software
+** Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA
+*/
+
+#include <config.h>
+
+#include <unistd.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <syslog.h>
+#include <pwd.h>
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+
+#include "oidentd.h"
+#include "util.h"
+#include "missing.h"
+#include "inet_util.h"
+#include "lpm.h"
+#include "trust.h"
+
+#if THREAD_SUPPORT
+#	include <pthread.h>
+#endif
+
+/*
+** Hosts in the networks given with --trusted are not subject to the
+** connection limit, are never shed, and have their blocking lookups run
+** first.  The networks are set up before any connection is accepted and
+** never change afterwards.
+*/
+
+static struct lpm trusted_nets;
+
+#if THREAD_SUPPORT
+static pthread_key_t current_key;
+static pthread_once_t current_once = PTHREAD_ONCE_INIT;
+
+static void trust_key_create(void);
+#else
+static bool current;
+#endif
+
+/*
+** Trust the hosts in the network "net," of the form "address[/bits]."
+** Returns 0 on success, -1 if "net" is invalid.
+*/
+
+int trust_add(const char *net) {
+	struct cidr cidr;
+
+	if (cidr_parse(net, &cidr) != 0)
+		return -1;
+
+	lpm_insert(&trusted_nets, &cidr, 1);
+	return 0;
+}
+
+/*
+** Returns true if "addr" is the address of a trusted host.
+*/
+
+bool trust_match(const struct sockaddr_storage *addr) {
+	return lpm_lookup(&trusted_nets, addr) == 1;
+}
+
+#if THREAD_SUPPORT
+
+static void trust_key_create(void) {
+	if (pthread_key_create(&current_key, NULL) != 0)
+		o_log(LOG_CRIT, "Failed to create thread-specific key");
+}
+
+/*
+** Record whether the request served by the calling thread comes from a
+** trusted host.
+*/
+
+void trust_set_current(bool trusted) {
+	pthread_once(&current_once, trust_key_create);
+	pthread_setspecific(current_key, trusted ? &current_key : NULL);
+}
+
+/*
+** Returns true if the request served by the calling thread comes from a
+** trusted host.
+*/
+
+bool trust_current(void) {
+	pthread_once(&current_once, trust_key_create);
+	return pthread_getspecific(current_key) != NULL;
+}
+
+#else
+
+void trust_set_current(bool trusted) {
+	current = trusted;
+}
+
+bool trust_current(void) {
+	return current;
+}
+
+#endif
@@ -0,0 +1,27 @@
+/*
+** trust.h - oidentd trusted hosts.
+** Copyright (c) 2019      Janik Rabe  <oidentd@janikrabe.com>
+**
+** This program is free software; you can redistribute it and/or modify
+** it under the terms of the GNU General Public License, version 2,
+** as published by the Free Software Foundation.
+**
+** This program is distributed in the hope that it will be useful,
+** but WITHOUT ANY WARRANTY; without even the implied warranty of
+** MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+** GNU General Public License for more details.
+**
+** You should have received a copy of the GNU General Public License
+** along with this program; if not, write to the Free Software
+** Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA
+*/
+
+#ifndef __OIDENTD_TRUST_H
+#define __OIDENTD_TRUST_H
+
+int trust_add(const char *net);
+bool trust_match(const struct sockaddr_storage *addr);
+void trust_set_current(bool trusted);
+bool trust_current(void);
+
+#endif
@@ -26,6 +26,7 @@
 #include <ctype.h>
 #include <errno.h>
 #include <syslog.h>
+#include <time.h>
 #include <pwd.h>
 #include <netdb.h>
 #include <sys/types.h>
@@ -41,22 +42,116 @@
 #include "user_db.h"
 #include "options.h"
 #include "forward.h"
+#include "addr_cache.h"
+
+#if THREAD_SUPPORT
+#	include <pthread.h>
+#endif
 
 #define USER_DB_HASH(x) ((x) % DB_HASH_SIZE)
 
-int parser_mode;
-struct user_cap *pref_cap;
+/*
+** A user's configuration file, parsed once and shared by the lookups for
+** the user until the file changes.  "caps" is NULL if the user has no
+** file, or if it was rejected for exceeding a limit.  Without worker
+** threads, each connection is served by a new child process, whose cache
+** is lost when it exits; children therefore send the files they parse to
+** the parent (see user_db_share_init()), whose cache the next children
+** inherit.
+*/
+
+struct user_prefs {
+	uid_t uid;
+	bool exists;
+	dev_t dev;
+	ino_t ino;
+	off_t size;
+	time_t mtime;
+	time_t ctime;
+	time_t checked;
+	time_t logged;
+	list_t *caps;
+	struct addr_cache *addr_cache;
+	u_int32_t refcount;
+};
+
+/*
+** A configuration file sent by a child to the parent.  The contents of
+** the file follow if PREFS_PARSED is set.  Files that were only checked
+** for changes are sent without PREFS_PARSED.
+*/
+
+struct prefs_msg {
+	uid_t uid;
+	u_int32_t flags;
+	dev_t dev;
+	ino_t ino;
+	off_t size;
+	time_t mtime;
+	time_t ctime;
+	time_t logged;
+};
+
+#define PREFS_EXISTS	0x01
+#define PREFS_REJECTED	0x02
+#define PREFS_PARSED	0x04
+
+DEFINE_LOCK(prefs_mutex);
+
+/*
+** The socket children send parsed configuration files to, or -1.
+*/
+
+static int prefs_share_fd = -1;
+
+/*
+** The bucket of the user configuration file cache searched first for files
+** to evict.  Protected by prefs_mutex.
+*/
+
+static size_t evict_next;
 
-static list_t *user_hash[DB_HASH_SIZE];
-struct user_info *default_user;
+/*
+** The database currently in use, and the lock protecting it and the
+** reference counts of all databases.
+*/
+
+static struct user_db *cur_db;
+DEFINE_LOCK(db_mutex);
 
 static char *select_reply(const struct user_cap *user);
+static int forward_ident(	const struct user_cap *user_cap,
+							in_port_t lport,
+							in_port_t fport,
+							char *reply,
+							size_t len);
 static void db_destroy_user_cb(void *data);
+static void user_db_free(struct user_db *db);
+static void user_db_clear(struct user_db *db);
+
+static FILE *open_user_config(const struct passwd *pw);
+static struct user_prefs *user_prefs_acquire(	struct user_db *db,
+												const struct passwd *pw);
+static void user_prefs_release(void *data);
+static bool user_prefs_evict(struct user_db *db, bool all);
+static void user_prefs_cache(struct user_db *db, struct user_prefs *prefs);
+static bool user_prefs_same(	const struct user_prefs *prefs,
+								bool exists,
+								const struct stat *st);
+static void user_prefs_share(	const struct user_prefs *prefs,
+								FILE *fp,
+								u_int32_t flags);
+
+static int user_db_get_ident(	struct user_db *db,
+								const struct passwd *pwd,
+								in_port_t lport,
+								in_port_t fport,
+								struct sockaddr_storage *laddr,
+								struct sockaddr_storage *faddr,
+								char *reply,
+								size_t len);
 
 static bool port_match(in_port_t port, const struct port_range *cap_ports);
-static bool addr_match(	struct sockaddr_storage *addr,
-						struct sockaddr_storage *cap_addr);
-
 static bool user_db_have_cap(	const struct user_cap *user_cap,
 								u_int16_t cap_flag);
 
@@ -71,11 +166,13 @@ static struct user_cap *user_db_cap_lookup(	struct user_info *user_info,
 											struct sockaddr_storage *laddr,
 											struct sockaddr_storage *faddr);
 
-static struct user_cap *user_db_get_pref(	const struct passwd *pw,
+static struct user_cap *user_db_get_pref(	struct user_db *db,
+											const struct passwd *pw,
 											in_port_t lport,
 											in_port_t fport,
 											struct sockaddr_storage *laddr,
-											struct sockaddr_storage *faddr);
+											struct sockaddr_storage *faddr,
+											struct user_prefs **prefs_ret);
 
 /*
 ** Generate a pseudo-random ident response consisting of a string of "len"
@@ -101,6 +198,35 @@ static inline char *select_reply(const struct user_cap *user) {
 	return user->data.replies.data[randval(user->data.replies.num)];
 }
 
+/*
+** Forward the request to the hosts named by "user_cap."
+** Returns 0 on success, -1 on failure.
+*/
+
+static int forward_ident(	const struct user_cap *user_cap,
+							in_port_t lport,
+							in_port_t fport,
+							char *reply,
+							size_t len)
+{
+	struct sockaddr_storage hosts[MAX_FORWARD_TARGETS];
+	in_port_t ports[MAX_FORWARD_TARGETS];
+	size_t num = 0;
+	size_t i;
+
+	for (i = 0; i < user_cap->data.forward.num && num < MAX_FORWARD_TARGETS; ++i) {
+		const struct forward_target *target = &user_cap->data.forward.targets[i];
+
+		if (addr_cache_first(target->host, &hosts[num]) == 0)
+			ports[num++] = target->port;
+	}
+
+	if (num == 0)
+		return -1;
+
+	return forward_request(hosts, ports, num, lport, fport, reply, len);
+}
+
 /*
 ** Use a user's UID as the ident reply.
 */
@@ -140,15 +266,53 @@ int get_ident(	const struct passwd *pwd,
 				struct sockaddr_storage *faddr,
 				char *reply,
 				size_t len)
+{
+	struct user_db *db;
+	int ret;
+
+	db = user_db_acquire();
+	ret = user_db_get_ident(db, pwd, lport, fport, laddr, faddr, reply, len);
+	user_db_release(db);
+
+	return ret;
+}
+
+/*
+** Stores the ident reply for a request in "reply," using the rules
+** in "db."
+** Returns 0 if user is not hidden, -1 if the user is hidden.
+*/
+
+static int user_db_get_ident(	struct user_db *db,
+								const struct passwd *pwd,
+								in_port_t lport,
+								in_port_t fport,
+								struct sockaddr_storage *laddr,
+								struct sockaddr_storage *faddr,
+								char *reply,
+								size_t len)
 {
 	struct user_cap *user_cap;
 	struct user_cap *user_pref;
+	struct user_prefs *prefs = NULL;
+
+	/*
+	** Lazily loaded databases are only used in stdio mode, where there
+	** is a single request, so they are filled in without locking.
+	*/
+
+	if (db->lazy && user_db_load_lazy(db, pwd) != 0) {
+		o_log(LOG_CRIT, "Error reading configuration file; using default rules");
+		user_db_clear(db);
+	}
 
-	user_cap = user_db_cap_lookup(user_db_lookup(pwd->pw_uid),
+	user_cap = user_db_cap_lookup(user_db_lookup(db, pwd->pw_uid),
 				lport, fport, laddr, faddr);
 
-	if (!user_cap)
-		user_cap = user_db_cap_lookup(default_user, lport, fport, laddr, faddr);
+	if (!user_cap) {
+		user_cap = user_db_cap_lookup(db->default_user,
+					lport, fport, laddr, faddr);
+	}
 
 	if (user_cap->action == ACTION_FORCE) {
 		switch (user_cap->caps) {
@@ -157,8 +321,7 @@ int get_ident(	const struct passwd *pwd,
 				break;
 
 			case CAP_FORWARD:
-				return forward_request(user_cap->data.forward.host,
-					user_cap->data.forward.port, lport, fport, reply, len);
+				return forward_ident(user_cap, lport, fport, reply, len);
 				break;
 
 			case CAP_HIDE:
@@ -184,7 +347,7 @@ int get_ident(	const struct passwd *pwd,
 		return 0;
 	}
 
-	user_pref = user_db_get_pref(pwd, lport, fport, laddr, faddr);
+	user_pref = user_db_get_pref(db, pwd, lport, fport, laddr, faddr, &prefs);
 	if (user_pref) {
 		u_int16_t caps = user_pref->caps;
 
@@ -212,10 +375,7 @@ int get_ident(	const struct passwd *pwd,
 				if (user_db_have_cap(user_cap, CAP_FORWARD)) {
 					int ret;
 
-					ret = forward_request(user_pref->data.forward.host,
-						user_pref->data.forward.port, lport, fport,
-						reply, len);
-
+					ret = forward_ident(user_pref, lport, fport, reply, len);
 					if (ret == 0) {
 						if (user_db_can_reply(user_cap, pwd, reply, fport))
 							goto out_success;
@@ -254,7 +414,7 @@ int get_ident(	const struct passwd *pwd,
 				goto out_default;
 		}
 
-		user_db_cap_destroy_data(user_pref);
+		user_prefs_release(prefs);
 	}
 
 out_implicit:
@@ -262,15 +422,15 @@ out_implicit:
 	return 0;
 
 out_default:
-	user_db_cap_destroy_data(user_pref);
+	user_prefs_release(prefs);
 	goto out_implicit;
 
 out_success:
-	user_db_cap_destroy_data(user_pref);
+	user_prefs_release(prefs);
 	return 0;
 
 out_hide:
-	user_db_cap_destroy_data(user_pref);
+	user_prefs_release(prefs);
 	return -1;
 }
 
@@ -285,23 +445,20 @@ void user_db_cap_destroy_data(void *data) {
 	if (!data)
 		return;
 
-	free(user_cap->lport);
-	free(user_cap->fport);
-	free(user_cap->src);
-	free(user_cap->dest);
+	xfree(user_cap->lport);
+	xfree(user_cap->fport);
 
 	if (user_cap->caps == CAP_REPLY) {
 		size_t i;
 
 		for (i = 0; i < user_cap->data.replies.num; ++i)
-			free(user_cap->data.replies.data[i]);
+			xfree(user_cap->data.replies.data[i]);
 
-		free(user_cap->data.replies.data);
-	}
+		xfree(user_cap->data.replies.data);
+	} else if (user_cap->caps == CAP_FORWARD)
+		xfree(user_cap->data.forward.targets);
 
-	if (user_cap->caps == CAP_FORWARD) {
-		free(user_cap->data.forward.host);
-	}
+	xfree(user_cap);
 }
 
 /*
@@ -312,33 +469,119 @@ void user_db_cap_destroy_data(void *data) {
 static inline void db_destroy_user_cb(void *data) {
 	struct user_info *user_info = data;
 
+	if (!user_info)
+		return;
+
 	list_destroy(user_info->cap_list, user_db_cap_destroy_data);
+	xfree(user_info);
 }
 
 /*
 ** Add an entry to the hash table.
 */
 
-inline void user_db_add(struct user_info *user_info) {
-	list_prepend(&user_hash[USER_DB_HASH(user_info->user)], user_info);
+inline void user_db_add(struct user_db *db, struct user_info *user_info) {
+	list_prepend(&db->user_hash[USER_DB_HASH(user_info->user)], user_info);
+}
+
+/*
+** Create an empty user capability database.  The caller holds the only
+** reference to it.
+*/
+
+struct user_db *user_db_create(void) {
+	struct user_db *db = xcalloc(1, sizeof(struct user_db));
+
+	db->addr_cache = addr_cache_create(false);
+	db->refcount = 1;
+
+	return db;
+}
+
+/*
+** Make "db" the database used for new requests.  The caller's reference
+** is transferred to the database; requests still using the previous
+** database keep it until they release it.
+*/
+
+void user_db_publish(struct user_db *db) {
+	struct user_db *old;
+
+	o_lock(db_mutex);
+	old = cur_db;
+	cur_db = db;
+	o_unlock(db_mutex);
+
+	if (old)
+		user_db_release(old);
+}
+
+/*
+** Returns a reference to the current database.  The reference must be
+** dropped with user_db_release().
+*/
+
+struct user_db *user_db_acquire(void) {
+	struct user_db *db;
+
+	o_lock(db_mutex);
+	db = cur_db;
+	++db->refcount;
+	o_unlock(db_mutex);
+
+	return db;
 }
 
 /*
-** Destroy the user capability database.
+** Drop a reference to "db," destroying it if it was the last one.
 */
 
-void user_db_destroy(void) {
+void user_db_release(struct user_db *db) {
+	bool last;
+
+	o_lock(db_mutex);
+	last = --db->refcount == 0;
+	o_unlock(db_mutex);
+
+	if (last)
+		user_db_free(db);
+}
+
+/*
+** Destroy the user capability database "db."
+*/
+
+static void user_db_free(struct user_db *db) {
 	size_t i;
 
 	for (i = 0; i < DB_HASH_SIZE; ++i) {
-		if (user_hash[i]) {
-			list_destroy(user_hash[i], db_destroy_user_cb);
-			user_hash[i] = NULL;
-		}
+		list_destroy(db->user_hash[i], db_destroy_user_cb);
+		list_destroy(db->prefs_hash[i], user_prefs_release);
+	}
+
+	db_destroy_user_cb(db->default_user);
+	addr_cache_destroy(db->addr_cache);
+
+	if (db->lazy)
+		lazy_config_free(db->lazy);
+
+	xfree(db);
+}
+
+/*
+** Drop the rules in "db," leaving only the built-in default rules.
+*/
+
+static void user_db_clear(struct user_db *db) {
+	size_t i;
+
+	for (i = 0; i < DB_HASH_SIZE; ++i) {
+		list_destroy(db->user_hash[i], db_destroy_user_cb);
+		db->user_hash[i] = NULL;
 	}
 
-	db_destroy_user_cb(default_user);
-	default_user = NULL;
+	db->default_caps = 0;
+	user_db_set_default(db, user_db_create_default());
 }
 
 /*
@@ -352,23 +595,30 @@ static bool user_db_can_reply(	const struct user_cap *user_cap,
 								const char *reply,
 								in_port_t fport)
 {
-	struct passwd *spoof_pwd;
+	struct passwd spoof_pwd;
+
+	if (get_pwnam(reply, &spoof_pwd) == 0) {
+		uid_t spoof_uid = spoof_pwd.pw_uid;
+
+		free_pw(&spoof_pwd);
 
-	spoof_pwd = getpwnam(reply);
-	if (spoof_pwd) {
 		/*
 		** A user can always reply with their own username.
 		*/
 
-		if (spoof_pwd->pw_uid == user_pwd->pw_uid)
+		if (spoof_uid == user_pwd->pw_uid)
 			return true;
 
 		if (!user_db_have_cap(user_cap, CAP_SPOOF_ALL)) {
 			o_log(LOG_INFO, "User %s tried to masquerade as user %s",
-				user_pwd->pw_name, spoof_pwd->pw_name);
+				user_pwd->pw_name, reply);
 
 			return false;
 		}
+	} else if (errno == ETIMEDOUT || errno == EAGAIN) {
+		/* don't let users spoof names that merely failed to resolve */
+		debug("Lookup of user %s failed: %s", reply, strerror(errno));
+		return false;
 	}
 
 	if (!user_db_have_cap(user_cap, CAP_SPOOF))
@@ -386,10 +636,10 @@ static bool user_db_can_reply(	const struct user_cap *user_cap,
 ** Find the entry in the hash table for the given UID.
 */
 
-struct user_info *user_db_lookup(uid_t uid) {
+struct user_info *user_db_lookup(struct user_db *db, uid_t uid) {
 	list_t *cur;
 
-	cur = user_hash[USER_DB_HASH(uid)];
+	cur = db->user_hash[USER_DB_HASH(uid)];
 	while (cur) {
 		struct user_info *user_info = cur->data;
 
@@ -426,10 +676,10 @@ static struct user_cap *user_db_cap_lookup(	struct user_info *user_info,
 		if (!port_match(fport, user_cap->fport))
 			continue;
 
-		if (!addr_match(laddr, user_cap->src))
+		if (!addr_cache_match(user_cap->src, laddr))
 			continue;
 
-		if (!addr_match(faddr, user_cap->dest))
+		if (!addr_cache_match(user_cap->dest, faddr))
 			continue;
 
 		return user_cap;
@@ -460,31 +710,475 @@ struct user_info *user_db_create_default(void) {
 ** Sets "user_info" as the default user.
 */
 
-void user_db_set_default(struct user_info *user_info) {
-	if (default_user) {
-		list_destroy(default_user->cap_list, user_db_cap_destroy_data);
-		free(default_user);
+void user_db_set_default(struct user_db *db, struct user_info *user_info) {
+	db_destroy_user_cb(db->default_user);
+	db->default_user = user_info;
+}
+
+/*
+** Open the user's configuration file for reading by the parser.
+*/
+
+static FILE *open_user_config(const struct passwd *pw) {
+	FILE *fp = NULL;
+
+#if XDGBDIR_SUPPORT
+	if (!fp)
+		fp = safe_open(pw, USER_CONF_XDG);
+#endif
+
+	if (!fp)
+		fp = safe_open(pw, USER_CONF);
+
+	return fp;
+}
+
+/*
+** Returns the parsed configuration file of "pw," with a reference held
+** for the caller.  Files are only parsed again once they have changed,
+** which is checked at most once every USER_CONF_RECHECK seconds.  Files
+** larger than USER_CONF_MAX_SIZE bytes, or exceeding the limits enforced
+** by user_db_parse_prefs(), are ignored; this is logged at most once every
+** USER_CONF_LOG_INTERVAL seconds per user.
+*/
+
+static struct user_prefs *user_prefs_acquire(	struct user_db *db,
+												const struct passwd *pw)
+{
+	list_t **bucket = &db->prefs_hash[USER_DB_HASH(pw->pw_uid)];
+	struct user_prefs *prefs = NULL;
+	struct user_prefs *old = NULL;
+	const char *reason = NULL;
+	time_t now = time(NULL);
+	enum mem_tag prev;
+	struct stat st;
+	list_t *cur;
+	FILE *fp;
+
+	o_lock(prefs_mutex);
+
+	for (cur = *bucket; cur; cur = cur->next) {
+		struct user_prefs *entry = cur->data;
+
+		if (entry->uid == pw->pw_uid) {
+			old = entry;
+			++old->refcount;
+			break;
+		}
 	}
 
-	default_user = user_info;
+	if (old && now < old->checked + USER_CONF_RECHECK) {
+		o_unlock(prefs_mutex);
+		return old;
+	}
+
+	o_unlock(prefs_mutex);
+
+	fp = open_user_config(pw);
+	if (fp && fstat(fileno(fp), &st) != 0) {
+		fclose(fp);
+		fp = NULL;
+	}
+
+	if (old && user_prefs_same(old, fp != NULL, &st)) {
+		if (fp)
+			fclose(fp);
+
+		o_lock(prefs_mutex);
+		old->checked = now;
+		o_unlock(prefs_mutex);
+
+		user_prefs_share(old, NULL, 0);
+		return old;
+	}
+
+	prev = mem_enter(MEM_USERS);
+
+	prefs = xcalloc(1, sizeof(struct user_prefs));
+	prefs->uid = pw->pw_uid;
+	prefs->checked = now;
+	prefs->logged = old ? old->logged : 0;
+	prefs->refcount = 1;
+
+	if (fp) {
+		prefs->exists = true;
+		prefs->dev = st.st_dev;
+		prefs->ino = st.st_ino;
+		prefs->size = st.st_size;
+		prefs->mtime = st.st_mtime;
+		prefs->ctime = st.st_ctime;
+
+		if (st.st_size > USER_CONF_MAX_SIZE)
+			reason = "file too large";
+		else {
+			prefs->addr_cache = addr_cache_create(true);
+			user_db_parse_prefs(db, fp, prefs->addr_cache, &prefs->caps, &reason);
+		}
+	}
+
+	if (reason && now >= prefs->logged + USER_CONF_LOG_INTERVAL) {
+		o_log(LOG_INFO, "Ignoring configuration file of %s: %s",
+			pw->pw_name, reason);
+
+		prefs->logged = now;
+	}
+
+	if (fp) {
+		user_prefs_share(prefs, fp, reason ? PREFS_REJECTED : PREFS_PARSED);
+		fclose(fp);
+	} else
+		user_prefs_share(prefs, NULL, PREFS_PARSED);
+
+	user_prefs_cache(db, prefs);
+	mem_leave(prev);
+
+	if (old)
+		user_prefs_release(old);
+
+	return prefs;
+}
+
+/*
+** Returns true if "prefs" was parsed from the file described by "st," or,
+** if "exists" is false, records that the user has no file.
+*/
+
+static bool user_prefs_same(	const struct user_prefs *prefs,
+								bool exists,
+								const struct stat *st)
+{
+	if (!exists)
+		return !prefs->exists;
+
+	return prefs->exists &&
+		prefs->dev == st->st_dev && prefs->ino == st->st_ino &&
+		prefs->size == st->st_size && prefs->mtime == st->st_mtime &&
+		prefs->ctime == st->st_ctime;
+}
+
+/*
+** Make "prefs" the cached configuration file of its user, replacing the
+** cache entry, which may have changed meanwhile.  The cache takes its own
+** reference.  Over the memory budget, the file is only cached if others
+** make room, and the old entry is dropped either way.
+*/
+
+static void user_prefs_cache(struct user_db *db, struct user_prefs *prefs) {
+	list_t **bucket = &db->prefs_hash[USER_DB_HASH(prefs->uid)];
+	enum mem_tag prev;
+	list_t **link;
+	bool cache;
+
+	cache = !mem_over_budget() || user_prefs_evict(db, false);
+
+	prev = mem_enter(MEM_USERS);
+	o_lock(prefs_mutex);
+
+	if (cache)
+		++prefs->refcount;
+
+	for (link = bucket; *link; link = &(*link)->next) {
+		struct user_prefs *entry = (*link)->data;
+
+		if (entry->uid != prefs->uid)
+			continue;
+
+		if (cache)
+			(*link)->data = prefs;
+		else {
+			list_t *cur = *link;
+
+			*link = cur->next;
+			xfree(cur);
+		}
+
+		o_unlock(prefs_mutex);
+		mem_leave(prev);
+
+		user_prefs_release(entry);
+		return;
+	}
+
+	if (cache)
+		list_prepend(bucket, prefs);
+
+	o_unlock(prefs_mutex);
+	mem_leave(prev);
 }
 
 /*
-** Find out if the user has specified any action for this range.
+** Set up the socket over which the children serving connections send the
+** configuration files they parse to the parent, so that the next children
+** start with them in their cache.  Must be called in the parent before
+** the first child is forked.  Returns the socket to pass to
+** user_db_receive_prefs() once it is readable, or -1 on error.
 */
 
-static struct user_cap *user_db_get_pref(	const struct passwd *pw,
+int user_db_share_init(void) {
+#ifdef HAVE_FMEMOPEN
+	int size = sizeof(struct prefs_msg) + USER_CONF_MAX_SIZE;
+	int fds[2];
+	int i;
+
+	if (socketpair(AF_UNIX, SOCK_DGRAM, 0, fds) != 0) {
+		debug("socketpair: %s", strerror(errno));
+		return -1;
+	}
+
+	/* best effort; files that don't fit are not shared */
+	for (i = 0; i < 2; ++i) {
+		setsockopt(fds[i], SOL_SOCKET, SO_SNDBUF, &size, sizeof(size));
+		setsockopt(fds[i], SOL_SOCKET, SO_RCVBUF, &size, sizeof(size));
+	}
+
+	prefs_share_fd = fds[1];
+	return fds[0];
+#else
+	return -1;
+#endif
+}
+
+/*
+** Send "prefs" to the parent, if this is a child serving a connection.
+** If "flags" contains PREFS_PARSED, the file "fp" it was parsed from is
+** sent along, so that the parent can parse it again; otherwise, the file
+** was only found to be unchanged.  Failures only cost the next children a
+** parse, so they are ignored.
+*/
+
+static void user_prefs_share(	const struct user_prefs *prefs,
+								FILE *fp,
+								u_int32_t flags)
+{
+	struct prefs_msg *msg;
+	size_t len = 0;
+
+	if (prefs_share_fd == -1)
+		return;
+
+	msg = xmalloc(sizeof(*msg) + USER_CONF_MAX_SIZE);
+	memset(msg, 0, sizeof(*msg));
+
+	msg->uid = prefs->uid;
+	msg->flags = flags;
+	msg->dev = prefs->dev;
+	msg->ino = prefs->ino;
+	msg->size = prefs->size;
+	msg->mtime = prefs->mtime;
+	msg->ctime = prefs->ctime;
+	msg->logged = prefs->logged;
+
+	if (prefs->exists)
+		msg->flags |= PREFS_EXISTS;
+
+	if (fp && (flags & PREFS_PARSED)) {
+		rewind(fp);
+		len = fread(msg + 1, 1, USER_CONF_MAX_SIZE, fp);
+
+		if (ferror(fp)) {
+			xfree(msg);
+			return;
+		}
+	}
+
+	if (send(prefs_share_fd, msg, sizeof(*msg) + len, MSG_DONTWAIT) == -1)
+		debug("send: %s", strerror(errno));
+
+	xfree(msg);
+}
+
+/*
+** Cache the configuration files sent by children on "fd," parsing those
+** that aren't cached yet.  Called by the parent when "fd" is readable.
+*/
+
+void user_db_receive_prefs(int fd) {
+#ifdef HAVE_FMEMOPEN
+	static char buf[sizeof(struct prefs_msg) + USER_CONF_MAX_SIZE];
+	struct prefs_msg *msg = (struct prefs_msg *) buf;
+	struct user_db *db = user_db_acquire();
+	time_t now = time(NULL);
+	ssize_t len;
+
+	while ((len = recv(fd, buf, sizeof(buf), MSG_DONTWAIT)) != -1 ||
+			errno == EINTR)
+	{
+		struct user_prefs *prefs = NULL;
+		struct stat st;
+		list_t *cur;
+		bool exists;
+
+		if (len < (ssize_t) sizeof(*msg))
+			continue;
+
+		len -= sizeof(*msg);
+		exists = (msg->flags & PREFS_EXISTS) != 0;
+
+		memset(&st, 0, sizeof(st));
+		st.st_dev = msg->dev;
+		st.st_ino = msg->ino;
+		st.st_size = msg->size;
+		st.st_mtime = msg->mtime;
+		st.st_ctime = msg->ctime;
+
+		/* the parent is single-threaded; no locking is needed */
+		for (cur = db->prefs_hash[USER_DB_HASH(msg->uid)]; cur; cur = cur->next) {
+			prefs = cur->data;
+
+			if (prefs->uid == msg->uid)
+				break;
+		}
+
+		if (cur && user_prefs_same(prefs, exists, &st)) {
+			prefs->checked = now;
+			prefs->logged = MAX(prefs->logged, msg->logged);
+			continue;
+		}
+
+		if (!(msg->flags & PREFS_PARSED) && !(msg->flags & PREFS_REJECTED))
+			continue;
+
+		prefs = xcalloc(1, sizeof(struct user_prefs));
+		prefs->uid = msg->uid;
+		prefs->exists = exists;
+		prefs->dev = msg->dev;
+		prefs->ino = msg->ino;
+		prefs->size = msg->size;
+		prefs->mtime = msg->mtime;
+		prefs->ctime = msg->ctime;
+		prefs->checked = now;
+		prefs->logged = msg->logged;
+		prefs->refcount = 1;
+
+		/* the child has logged rejections already */
+		if (exists && !(msg->flags & PREFS_REJECTED)) {
+			const char *reason = NULL;
+
+			prefs->addr_cache = addr_cache_create(true);
+
+			/* an empty file has no rules */
+			if (len > 0) {
+				FILE *fp = fmemopen(msg + 1, len, "r");
+
+				if (!fp) {
+					user_prefs_release(prefs);
+					continue;
+				}
+
+				user_db_parse_prefs(db, fp, prefs->addr_cache, &prefs->caps, &reason);
+				fclose(fp);
+			}
+		}
+
+		user_prefs_cache(db, prefs);
+		user_prefs_release(prefs);
+	}
+
+	user_db_release(db);
+#else
+	(void) fd;
+#endif
+}
+
+/*
+** Drop a reference to the parsed configuration file "data," destroying it
+** once it is no longer used.
+*/
+
+static void user_prefs_release(void *data) {
+	struct user_prefs *prefs = data;
+	bool destroy;
+
+	if (!prefs)
+		return;
+
+	o_lock(prefs_mutex);
+	destroy = --prefs->refcount == 0;
+	o_unlock(prefs_mutex);
+
+	if (destroy) {
+		list_destroy(prefs->caps, user_db_cap_destroy_data);
+		addr_cache_destroy(prefs->addr_cache);
+		xfree(prefs);
+	}
+}
+
+/*
+** Drop cached configuration files that no request is using, until the
+** memory budget is met again or, if "all" is set, until none are left.
+** Returns true if the memory budget is met.
+*/
+
+static bool user_prefs_evict(struct user_db *db, bool all) {
+	while (all || mem_over_budget()) {
+		struct user_prefs *victim = NULL;
+		size_t i;
+
+		o_lock(prefs_mutex);
+
+		for (i = 0; i < DB_HASH_SIZE && !victim; ++i) {
+			list_t **link = &db->prefs_hash[(evict_next + i) % DB_HASH_SIZE];
+
+			for (; *link; link = &(*link)->next) {
+				list_t *node = *link;
+
+				victim = node->data;
+				if (victim->refcount > 1) {
+					victim = NULL;
+					continue;
+				}
+
+				*link = node->next;
+				xfree(node);
+				break;
+			}
+		}
+
+		/* spread evictions over the buckets */
+		evict_next = (evict_next + i) % DB_HASH_SIZE;
+
+		o_unlock(prefs_mutex);
+
+		if (!victim)
+			break;
+
+		debug("Evicting configuration file of UID %lu from the cache",
+			(unsigned long) victim->uid);
+
+		user_prefs_release(victim);
+	}
+
+	return !mem_over_budget();
+}
+
+/*
+** Drop all cached configuration files of users that no request is using.
+*/
+
+void user_db_trim(struct user_db *db) {
+	user_prefs_evict(db, true);
+}
+
+/*
+** Find out if the user has specified any action for this range.  The
+** configuration file the action was found in is stored in "prefs_ret,"
+** and must be released by the caller.
+*/
+
+static struct user_cap *user_db_get_pref(	struct user_db *db,
+											const struct passwd *pw,
 											in_port_t lport,
 											in_port_t fport,
 											struct sockaddr_storage *laddr,
-											struct sockaddr_storage *faddr)
+											struct sockaddr_storage *faddr,
+											struct user_prefs **prefs_ret)
 {
-	list_t *cap_list;
+	struct user_prefs *prefs;
 	list_t *cur;
 
-	cap_list = user_db_get_pref_list(pw);
+	prefs = user_prefs_acquire(db, pw);
 
-	for (cur = cap_list; cur; cur = cur->next) {
+	for (cur = prefs->caps; cur; cur = cur->next) {
 		struct user_cap *cur_cap = cur->data;
 
 		if (!port_match(lport, cur_cap->lport))
@@ -493,39 +1187,20 @@ static struct user_cap *user_db_get_pref(	const struct passwd *pw,
 		if (!port_match(fport, cur_cap->fport))
 			continue;
 
-		if (!addr_match(laddr, cur_cap->src))
+		if (!addr_cache_match(cur_cap->src, laddr))
 			continue;
 
-		if (!addr_match(faddr, cur_cap->dest))
+		if (!addr_cache_match(cur_cap->dest, faddr))
 			continue;
 
-		/*
-		** Don't let list_destroy destroy this one.
-		*/
-		cur->data = NULL;
-
-		list_destroy(cap_list, user_db_cap_destroy_data);
+		*prefs_ret = prefs;
 		return cur_cap;
 	}
 
-	list_destroy(cap_list, user_db_cap_destroy_data);
+	user_prefs_release(prefs);
 	return NULL;
 }
 
-/*
-** Compares two internet addresses.  NULL is treated as a
-** wildcard.
-*/
-
-static bool addr_match(	struct sockaddr_storage *addr,
-						struct sockaddr_storage *cap_addr)
-{
-	if (!cap_addr)
-		return true;
-
-	return sin_equal(addr, cap_addr);
-}
-
 /*
 ** Checks whether "port" is contained in the range "cap_ports"
 ** NULL is treated as a wildcard.
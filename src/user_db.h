@@ -45,8 +45,8 @@ struct user_cap {
 		in_port_t max;
 	} *lport, *fport;
 
-	struct sockaddr_storage *src;
-	struct sockaddr_storage	*dest;
+	struct addr_set *src;
+	struct addr_set *dest;
 
 	u_int16_t caps;
 	u_int16_t action;
@@ -57,8 +57,11 @@ struct user_cap {
 			u_int8_t num;
 		} replies;
 		struct forward_data {
-			struct sockaddr_storage *host;
-			in_port_t port;
+			struct forward_target {
+				struct addr_set *host;
+				in_port_t port;
+			} *targets;
+			u_int8_t num;
 		} forward;
 	} data;
 };
@@ -68,11 +71,40 @@ struct user_info {
 	list_t *cap_list;
 };
 
-struct user_info *user_db_lookup(uid_t uid);
-void user_db_add(struct user_info *user_info);
-void user_db_destroy(void);
+/*
+** The rules of the system-wide configuration file.  A database is not
+** modified after it has been published; requests hold a reference to the
+** database they use, so the configuration can be reloaded while other
+** threads are serving requests.
+**
+** A database read by read_config_lazy() only holds an index of the
+** configuration file ("lazy") until the rules for a user are needed.
+**
+** The parsed configuration files of users ("prefs_hash") are kept with the
+** database whose defaults they were parsed with.  They have a lock of
+** their own, as they are filled in while the database is in use.
+*/
+
+struct user_db {
+	list_t *user_hash[DB_HASH_SIZE];
+	list_t *prefs_hash[DB_HASH_SIZE];
+	struct user_info *default_user;
+	u_int16_t default_caps;
+	struct addr_cache *addr_cache;
+	struct lazy_config *lazy;
+	u_int32_t refcount;
+};
+
+struct user_db *user_db_create(void);
+void user_db_publish(struct user_db *db);
+struct user_db *user_db_acquire(void);
+void user_db_release(struct user_db *db);
+
+struct user_info *user_db_lookup(struct user_db *db, uid_t uid);
+void user_db_add(struct user_db *db, struct user_info *user_info);
 void user_db_cap_destroy_data(void *data);
-void user_db_set_default(struct user_info *user_info);
+void user_db_trim(struct user_db *db);
+void user_db_set_default(struct user_db *db, struct user_info *user_info);
 struct user_info *user_db_create_default(void);
 
 int get_ident(	const struct passwd *pwd,
@@ -83,6 +115,14 @@ int get_ident(	const struct passwd *pwd,
 				char *reply,
 				size_t len);
 
-list_t *user_db_get_pref_list(const struct passwd *pw);
+int user_db_parse_prefs(	struct user_db *db,
+						FILE *fp,
+						struct addr_cache *addr_cache,
+						list_t **pref_list,
+						const char **reason);
+int user_db_load_lazy(struct user_db *db, const struct passwd *pw);
+int user_db_share_init(void);
+void user_db_receive_prefs(int fd);
+void lazy_config_free(struct lazy_config *lazy);
 
 #endif
@@ -46,11 +46,22 @@
 #include "inet_util.h"
 #include "missing.h"
 #include "options.h"
+#include "offload.h"
+#include "shm_cache.h"
+#include "audit.h"
 
 #if HAVE_LIBUDB
 #	include <udb.h>
 #endif
 
+#if THREAD_SUPPORT
+#	include <pthread.h>
+#endif
+
+#ifdef HAVE_MALLOC_TRIM
+#	include <malloc.h>
+#endif
+
 #ifdef HAVE_ARC4RANDOM_UNIFORM
 	/* no rescale required */
 #elif defined HAVE_LRAND48
@@ -59,6 +70,131 @@
 #	define O_RAND_UPPER_EXCL_UL ((unsigned long) RAND_MAX + 1UL)
 #endif
 
+/*
+** A passwd entry as stored in the shared lookup cache.  Entries with
+** longer names or home directories are not cached.
+*/
+
+struct cached_pw {
+	uid_t uid;
+	gid_t gid;
+	char name[64];
+	char dir[240];
+};
+
+/*
+** A passwd lookup or configuration file access run by the offload pool.
+*/
+
+struct pw_job {
+	uid_t uid;
+	char *name;
+	int err;
+	struct passwd pwd;
+};
+
+struct open_job {
+	struct passwd pwd;
+	char *filename;
+	FILE *fp;
+};
+
+/*
+** Every block allocated by xmalloc() and friends starts with a header
+** recording its size and the subsystem it is accounted to, so that the
+** number of bytes held by each subsystem is known without walking the
+** heap.  The union keeps the memory returned to callers suitably aligned
+** for any type.
+*/
+
+union mem_hdr {
+	struct {
+		size_t size;
+		unsigned int tag;
+	} h;
+	long double align;
+};
+
+static const char *const mem_names[MEM_NUM_TAGS] = {
+	"other",
+	"configuration",
+	"user files",
+	"masquerading",
+	"connections",
+	"logging"
+};
+
+static size_t mem_bytes[MEM_NUM_TAGS];
+
+/*
+** With --memory-limit, the resident size oidentd should stay below, and
+** how much of it is left for allocations once the memory that was
+** resident at startup is subtracted.
+*/
+
+static size_t mem_limit;
+static size_t mem_budget;
+
+#if THREAD_SUPPORT
+static pthread_key_t mem_key;
+static pthread_once_t mem_once = PTHREAD_ONCE_INIT;
+
+static void mem_key_create(void);
+#else
+static enum mem_tag mem_tag_current;
+#endif
+
+#ifdef HAVE_SYNC_FETCH_AND_ADD
+#	define mem_count(tag, n)	((void) __sync_fetch_and_add(&mem_bytes[tag], (n)))
+#	define mem_uncount(tag, n)	((void) __sync_fetch_and_sub(&mem_bytes[tag], (n)))
+#	define mem_read(tag)		__sync_fetch_and_add(&mem_bytes[tag], 0)
+#else
+DEFINE_LOCK(mem_mutex);
+
+static void mem_count(enum mem_tag tag, size_t n);
+static void mem_uncount(enum mem_tag tag, size_t n);
+static size_t mem_read(enum mem_tag tag);
+#endif
+
+static enum mem_tag mem_current(void);
+static void *mem_alloc(enum mem_tag tag, size_t size, bool zero);
+static size_t mem_total(void);
+static size_t mem_resident(void);
+static void pw_job_run(void *data);
+static void pw_job_free(void *data);
+static int pw_job_call(struct pw_job *job, struct passwd *pwd);
+static FILE *safe_open_path(const struct passwd *pw, const char *filename);
+static void open_job_run(void *data);
+static void open_job_free(void *data);
+
+/*
+** The passwd, group and services databases return pointers to static
+** storage; lookups are serialized so worker threads don't overwrite each
+** other's results.
+*/
+
+DEFINE_LOCK(nss_mutex);
+
+#ifndef HAVE_ARC4RANDOM_UNIFORM
+DEFINE_LOCK(prng_mutex);
+#endif
+
+/*
+** Lock the passwd, group and services databases.
+*/
+
+void nss_lock(void) {
+	o_lock(nss_mutex);
+}
+
+/*
+** Unlock the passwd, group and services databases.
+*/
+
+void nss_unlock(void) {
+	o_unlock(nss_mutex);
+}
+
 /*
 ** Seed the PRNG.
 ** A time-based seed is sufficient as oidentd does not require
@@ -78,6 +214,10 @@ int seed_prng(void) {
 #	endif
 #endif
 
+#ifndef HAVE_ARC4RANDOM_UNIFORM
+	o_lock(prng_mutex);
+#endif
+
 #ifdef HAVE_ARC4RANDOM_UNIFORM
 	/* automatically reseeded upon fork(2) */
 #elif defined HAVE_LRAND48
@@ -100,6 +240,10 @@ int seed_prng(void) {
 #	endif
 #endif
 
+#ifndef HAVE_ARC4RANDOM_UNIFORM
+	o_unlock(prng_mutex);
+#endif
+
 	return 0;
 }
 
@@ -131,10 +275,14 @@ unsigned int randval(unsigned int i) {
 	unsigned long blk_after_last = blk_size * (unsigned long) i;
 	unsigned long next;
 
+	o_lock(prng_mutex);
+
 	do {
 		next = prng_next();
 	} while (next >= blk_after_last);
 
+	o_unlock(prng_mutex);
+
 	return (unsigned int) (next / blk_size);
 #endif
 }
@@ -147,7 +295,12 @@ unsigned int randval(unsigned int i) {
 int find_user(const char *temp_user, uid_t *uid) {
 	struct passwd *pw;
 
+	nss_lock();
 	pw = getpwnam(temp_user);
+	if (pw)
+		*uid = pw->pw_uid;
+	nss_unlock();
+
 	if (!pw) {
 		char *end;
 		unsigned long int temp_uid = strtoul(temp_user, &end, 10);
@@ -159,8 +312,6 @@ int find_user(const char *temp_user, uid_t *uid) {
 			return -1;
 
 		*uid = (uid_t) temp_uid;
-	} else {
-		*uid = pw->pw_uid;
 	}
 
 	return 0;
@@ -174,7 +325,12 @@ int find_user(const char *temp_user, uid_t *uid) {
 int find_group(const char *temp_group, gid_t *gid) {
 	struct group *gr;
 
+	nss_lock();
 	gr = getgrnam(temp_group);
+	if (gr)
+		*gid = gr->gr_gid;
+	nss_unlock();
+
 	if (!gr) {
 		char *end;
 		unsigned long int temp_gid = strtoul(temp_group, &end, 10);
@@ -186,8 +342,6 @@ int find_group(const char *temp_group, gid_t *gid) {
 			return -1;
 
 		*gid = (gid_t) temp_gid;
-	} else {
-		*gid = gr->gr_gid;
 	}
 
 	return 0;
@@ -256,7 +410,7 @@ int drop_privs(uid_t new_uid, gid_t new_gid) {
 ** NULL on failure.
 */
 
-FILE *safe_open(const struct passwd *pw, const char *filename) {
+static FILE *safe_open_path(const struct passwd *pw, const char *filename) {
 	size_t len;
 	char *path;
 	struct stat st;
@@ -302,14 +456,183 @@ FILE *safe_open(const struct passwd *pw, const char *filename) {
 		goto out_fail;
 	}
 
-	free(path);
+	xfree(path);
 	return fp;
 
 out_fail:
-	free(path);
+	xfree(path);
 	return NULL;
 }
 
+static void open_job_run(void *data) {
+	struct open_job *job = data;
+
+	job->fp = safe_open_path(&job->pwd, job->filename);
+}
+
+static void open_job_free(void *data) {
+	struct open_job *job = data;
+
+	if (job->fp)
+		fclose(job->fp);
+
+	free_pw(&job->pwd);
+	xfree(job->filename);
+	xfree(job);
+}
+
+/*
+** Like safe_open_path(), but run by the offload pool so that a stuck
+** home directory only delays the requests for that user.
+*/
+
+FILE *safe_open(const struct passwd *pw, const char *filename) {
+	struct open_job *job = xcalloc(1, sizeof(struct open_job));
+	FILE *fp;
+
+	copy_pw(pw, &job->pwd);
+	job->filename = xstrdup(filename);
+
+	if (offload_call(pw->pw_dir, open_job_run, job, open_job_free) != 0)
+		return NULL;
+
+	fp = job->fp;
+	job->fp = NULL;
+	open_job_free(job);
+
+	return fp;
+}
+
+static void pw_job_run(void *data) {
+	struct pw_job *job = data;
+	size_t len = 1024;
+
+	for (;;) {
+		struct passwd pw, *res = NULL;
+		char *buf = xmalloc(len);
+
+		if (job->name)
+			job->err = getpwnam_r(job->name, &pw, buf, len, &res);
+		else
+			job->err = getpwuid_r(job->uid, &pw, buf, len, &res);
+
+		if (job->err == ERANGE && len < 65536) {
+			xfree(buf);
+			len *= 2;
+			continue;
+		}
+
+		if (job->err == 0 && !res)
+			job->err = ENOENT;
+		else if (job->err == 0)
+			copy_pw(res, &job->pwd);
+
+		xfree(buf);
+		break;
+	}
+}
+
+static void pw_job_free(void *data) {
+	struct pw_job *job = data;
+
+	if (job->err == 0)
+		free_pw(&job->pwd);
+
+	xfree(job->name);
+	xfree(job);
+}
+
+static int pw_job_call(struct pw_job *job, struct passwd *pwd) {
+	if (offload_call("passwd", pw_job_run, job, pw_job_free) != 0)
+		return -1;
+
+	if (job->err != 0) {
+		errno = job->err;
+		pw_job_free(job);
+		return -1;
+	}
+
+	*pwd = job->pwd;
+	xfree(job->name);
+	xfree(job);
+
+	return 0;
+}
+
+/*
+** Look up the passwd entry for "uid" and store a copy of it in "pwd,"
+** which must be freed with free_pw().  The lookup is run by the offload
+** pool and does not take the NSS lock.
+** Returns 0 on success, -1 with errno set on failure.
+*/
+
+int get_pwuid(uid_t uid, struct passwd *pwd) {
+	struct pw_job *job;
+	struct cached_pw cached;
+
+	if (shm_cache_get(SHM_PASSWD, &uid, sizeof(uid),
+			&cached, sizeof(cached)) == sizeof(cached))
+	{
+		pwd->pw_name = xstrdup(cached.name);
+		pwd->pw_uid = cached.uid;
+		pwd->pw_gid = cached.gid;
+		pwd->pw_dir = xstrdup(cached.dir);
+		return 0;
+	}
+
+	job = xcalloc(1, sizeof(struct pw_job));
+	job->uid = uid;
+
+	if (pw_job_call(job, pwd) != 0)
+		return -1;
+
+	if (strlen(pwd->pw_name) < sizeof(cached.name) &&
+		strlen(pwd->pw_dir) < sizeof(cached.dir))
+	{
+		memset(&cached, 0, sizeof(cached));
+		cached.uid = pwd->pw_uid;
+		cached.gid = pwd->pw_gid;
+		xstrncpy(cached.name, pwd->pw_name, sizeof(cached.name));
+		xstrncpy(cached.dir, pwd->pw_dir, sizeof(cached.dir));
+
+		shm_cache_put(SHM_PASSWD, &uid, sizeof(uid),
+			&cached, sizeof(cached), SHM_PASSWD_TTL);
+	}
+
+	return 0;
+}
+
+/*
+** Like get_pwuid(), but look up the entry for user "name."
+*/
+
+int get_pwnam(const char *name, struct passwd *pwd) {
+	struct pw_job *job = xcalloc(1, sizeof(struct pw_job));
+
+	job->name = xstrdup(name);
+	return pw_job_call(job, pwd);
+}
+
+/*
+** Copy the needed fields from a passwd struct.
+*/
+
+void copy_pw(const struct passwd *pw, struct passwd *pwd) {
+	pwd->pw_name = xstrdup(pw->pw_name);
+	pwd->pw_uid = pw->pw_uid;
+	pwd->pw_gid = pw->pw_gid;
+	pwd->pw_dir = xstrdup(pw->pw_dir);
+}
+
+/*
+** Free a copied passwd struct.
+*/
+
+void free_pw(struct passwd *pwd) {
+	xfree(pwd->pw_name);
+	xfree(pwd->pw_dir);
+}
+
 /*
 ** Go background.
 */
@@ -351,12 +674,123 @@ int go_background(void) {
 	return 0;
 }
 
+#if THREAD_SUPPORT
+
+static void mem_key_create(void) {
+	if (pthread_key_create(&mem_key, NULL) != 0)
+		o_log(LOG_CRIT, "Failed to create thread-specific key");
+}
+
+/*
+** Returns the subsystem allocations of the calling thread are accounted to.
+*/
+
+static enum mem_tag mem_current(void) {
+	pthread_once(&mem_once, mem_key_create);
+	return (enum mem_tag) (unsigned long) pthread_getspecific(mem_key);
+}
+
+/*
+** Account the allocations of the calling thread to "tag" until
+** mem_leave() is called with the returned value.
+*/
+
+enum mem_tag mem_enter(enum mem_tag tag) {
+	enum mem_tag prev = mem_current();
+
+	pthread_setspecific(mem_key, (void *) (unsigned long) tag);
+	return prev;
+}
+
+/*
+** Account the allocations of the calling thread to the subsystem that was
+** current before mem_enter() returned "prev."
+*/
+
+void mem_leave(enum mem_tag prev) {
+	pthread_setspecific(mem_key, (void *) (unsigned long) prev);
+}
+
+#else
+
+static enum mem_tag mem_current(void) {
+	return mem_tag_current;
+}
+
+enum mem_tag mem_enter(enum mem_tag tag) {
+	enum mem_tag prev = mem_tag_current;
+
+	mem_tag_current = tag;
+	return prev;
+}
+
+void mem_leave(enum mem_tag prev) {
+	mem_tag_current = prev;
+}
+
+#endif
+
+#ifndef HAVE_SYNC_FETCH_AND_ADD
+
+static void mem_count(enum mem_tag tag, size_t n) {
+	o_lock(mem_mutex);
+	mem_bytes[tag] += n;
+	o_unlock(mem_mutex);
+}
+
+static void mem_uncount(enum mem_tag tag, size_t n) {
+	o_lock(mem_mutex);
+	mem_bytes[tag] -= n;
+	o_unlock(mem_mutex);
+}
+
+static size_t mem_read(enum mem_tag tag) {
+	size_t ret;
+
+	o_lock(mem_mutex);
+	ret = mem_bytes[tag];
+	o_unlock(mem_mutex);
+
+	return ret;
+}
+
+#endif
+
+/*
+** Allocate "size" bytes accounted to "tag," cleared if "zero" is set.
+** Returns NULL with errno set on failure.
+*/
+
+static void *mem_alloc(enum mem_tag tag, size_t size, bool zero) {
+	union mem_hdr *hdr;
+
+	if (size > (size_t) -1 - sizeof(union mem_hdr)) {
+		errno = ENOMEM;
+		return NULL;
+	}
+
+	if (zero)
+		hdr = calloc(1, sizeof(union mem_hdr) + size);
+	else
+		hdr = malloc(sizeof(union mem_hdr) + size);
+
+	if (!hdr)
+		return NULL;
+
+	hdr->h.size = size;
+	hdr->h.tag = tag;
+	mem_count(tag, sizeof(union mem_hdr) + size);
+
+	return hdr + 1;
+}
+
 /*
-** Same as malloc(3), except exits on failure.
+** Same as malloc(3), except exits on failure.  The memory must be freed
+** with xfree().
 */
 
 void *xmalloc(size_t size) {
-	void *ret = malloc(size);
+	void *ret = mem_alloc(mem_current(), size, false);
 
 	if (!ret) {
 		o_log(LOG_CRIT, "Fatal: malloc: %s", strerror(errno));
@@ -367,11 +801,17 @@ void *xmalloc(size_t size) {
 }
 
 /*
-** Same as calloc(3), except exits on failure.
+** Same as calloc(3), except exits on failure.  The memory must be freed
+** with xfree().
 */
 
 void *xcalloc(size_t nmemb, size_t size) {
-	void *ret = calloc(nmemb, size);
+	void *ret = NULL;
+
+	if (size == 0 || nmemb <= (size_t) -1 / size)
+		ret = mem_alloc(mem_current(), nmemb * size, true);
+	else
+		errno = ENOMEM;
 
 	if (!ret) {
 		o_log(LOG_CRIT, "Fatal: calloc: %s", strerror(errno));
@@ -382,18 +822,188 @@ void *xcalloc(size_t nmemb, size_t size) {
 }
 
 /*
-** Same as realloc(3), except exits on failure.
+** Same as realloc(3), except exits on failure.  The memory stays
+** accounted to the subsystem it was first allocated for.
 */
 
 void *xrealloc(void *ptr, size_t len) {
-	void *ret = realloc(ptr, len);
+	union mem_hdr *hdr;
+	size_t old_len;
 
-	if (!ret) {
+	if (!ptr)
+		return xmalloc(len);
+
+	hdr = (union mem_hdr *) ptr - 1;
+	old_len = hdr->h.size;
+
+	if (len > (size_t) -1 - sizeof(union mem_hdr)) {
+		errno = ENOMEM;
+		hdr = NULL;
+	} else
+		hdr = realloc(hdr, sizeof(union mem_hdr) + len);
+
+	if (!hdr) {
 		o_log(LOG_CRIT, "Fatal: realloc: %s", strerror(errno));
 		exit(EXIT_FAILURE);
 	}
 
-	return ret;
+	hdr->h.size = len;
+
+	if (len > old_len)
+		mem_count(hdr->h.tag, len - old_len);
+	else
+		mem_uncount(hdr->h.tag, old_len - len);
+
+	return hdr + 1;
+}
+
+/*
+** Free memory allocated by xmalloc() and friends.
+*/
+
+void xfree(void *ptr) {
+	union mem_hdr *hdr;
+
+	if (!ptr)
+		return;
+
+	hdr = (union mem_hdr *) ptr - 1;
+	mem_uncount(hdr->h.tag, sizeof(union mem_hdr) + hdr->h.size);
+	free(hdr);
+}
+
+/*
+** Returns the number of bytes currently allocated for "tag."
+*/
+
+size_t mem_live(enum mem_tag tag) {
+	return mem_read(tag);
+}
+
+/*
+** Returns the number of bytes currently allocated for all subsystems.
+*/
+
+static size_t mem_total(void) {
+	size_t total = 0;
+	size_t i;
+
+	for (i = 0; i < MEM_NUM_TAGS; ++i)
+		total += mem_read(i);
+
+	return total;
+}
+
+/*
+** Returns the resident size of the process in bytes, or 0 if it can't be
+** determined.
+*/
+
+static size_t mem_resident(void) {
+	unsigned long size, resident;
+	long page_size;
+	FILE *fp;
+
+	fp = fopen("/proc/self/statm", "r");
+	if (!fp)
+		return 0;
+
+	if (fscanf(fp, "%lu %lu", &size, &resident) != 2)
+		resident = 0;
+
+	fclose(fp);
+
+	page_size = sysconf(_SC_PAGESIZE);
+	if (page_size <= 0)
+		return 0;
+
+	return (size_t) resident * page_size;
+}
+
+/*
+** Keep the resident size below "limit" bytes.  Memory resident when this
+** is called is taken to stay resident; what is left of the limit is the
+** budget for allocations.  If the resident size can't be determined, the
+** whole limit is.
+*/
+
+void mem_set_limit(size_t limit) {
+	size_t resident = mem_resident();
+	size_t total = mem_total();
+	size_t base = resident > total ? resident - total : 0;
+
+	mem_limit = limit;
+	mem_budget = limit > base ? limit - base : 0;
+
+	if (limit > 0 && mem_budget <= total) {
+		o_log(LOG_INFO, "Memory limit of %lu KiB is exhausted at startup "
+			"(%lu KiB resident); user configuration files won't be cached",
+			(unsigned long) (limit / 1024), (unsigned long) (resident / 1024));
+	}
+}
+
+/*
+** Returns true if more memory is allocated than the budget allows.
+** Caches should evict entries and stop growing while this is the case.
+*/
+
+bool mem_over_budget(void) {
+	return mem_limit > 0 && mem_total() > mem_budget;
+}
+
+/*
+** Returns true if the resident size exceeds the limit, which it may do
+** despite the budget as freed memory isn't always returned to the system.
+*/
+
+bool mem_over_limit(void) {
+	size_t resident;
+
+	if (mem_limit == 0)
+		return false;
+
+	resident = mem_resident();
+	if (resident == 0)
+		return mem_over_budget();
+
+	return resident > mem_limit;
+}
+
+/*
+** Return memory that has been freed to the system, if possible.
+*/
+
+void mem_trim(void) {
+#ifdef HAVE_MALLOC_TRIM
+	malloc_trim(0);
+#endif
+}
+
+/*
+** Log the number of bytes allocated for each subsystem.
+*/
+
+void mem_log_stats(void) {
+	char line[512];
+	size_t off = 0;
+	size_t resident;
+	size_t i;
+
+	for (i = 0; i < MEM_NUM_TAGS && off < sizeof(line); ++i) {
+		off += snprintf(line + off, sizeof(line) - off, "%s%s %lu KiB",
+			i > 0 ? ", " : "", mem_names[i],
+			(unsigned long) (mem_read(i) / 1024));
+	}
+
+	resident = mem_resident();
+
+	if (mem_limit > 0) {
+		o_log(LOG_INFO, "Memory: %s; %lu KiB resident, limit %lu KiB",
+			line, (unsigned long) (resident / 1024),
+			(unsigned long) (mem_limit / 1024));
+	} else
+		o_log(LOG_INFO, "Memory: %s; %lu KiB resident",
+			line, (unsigned long) (resident / 1024));
 }
 
 /*
@@ -417,22 +1027,25 @@ char *xstrncpy(char *dest, const char *src, size_t n) {
 
 /*
 ** Same as strdup(3), except exits on failure, and returns NULL
-** if passed a NULL pointer.
+** if passed a NULL pointer.  The copy must be freed with xfree().
 */
 
 char *xstrdup(const char *string) {
+	size_t len;
 	char *ret;
 
 	if (!string)
 		return NULL;
 
-	ret = strdup(string);
+	len = strlen(string) + 1;
+	ret = mem_alloc(mem_current(), len, false);
 
 	if (!ret) {
 		o_log(LOG_CRIT, "Fatal: strdup: %s", strerror(errno));
 		exit(EXIT_FAILURE);
 	}
 
+	memcpy(ret, string, len);
 	return ret;
 }
 
@@ -464,7 +1077,7 @@ void list_destroy(list_t *list, void (*free_data)(void *)) {
 		if (free_data)
 			free_data(cur->data);
 
-		free(cur);
+		xfree(cur);
 		cur = next;
 	}
 }
@@ -485,7 +1098,19 @@ int o_log(int priority, const char *fmt, ...) {
 		return 0;
 
 	va_start(ap, fmt);
-	ret = vasprintf((char **) &buf, fmt, ap);
+	ret = vsnprintf(NULL, 0, fmt, ap);
+	va_end(ap);
+
+	if (ret < 0)
+		return ret;
+
+	/* failing to log must not end up here again through xmalloc() */
+	buf = mem_alloc(MEM_LOG, ret + 1, false);
+	if (!buf)
+		return -1;
+
+	va_start(ap, fmt);
+	vsnprintf(buf, ret + 1, fmt, ap);
 	va_end(ap);
 
 	if (opt_enabled(NOSYSLOG) || isatty(fileno(stderr)))
@@ -493,7 +1118,7 @@ int o_log(int priority, const char *fmt, ...) {
 	else
 		syslog(priority, "%s", buf);
 
-	free(buf);
+	xfree(buf);
 	return ret;
 }
 
@@ -543,16 +1168,21 @@ struct udb_lookup_res get_udb_user(	in_port_t lport,
 		return res;
 
 	/* If the user is local, return their UID */
+	nss_lock();
 	pw = getpwnam(buf.username);
 	if (pw) {
 		res.status = 1;
 		res.uid = pw->pw_uid;
-		return res;
 	}
+	nss_unlock();
+
+	if (res.status == 1)
+		return res;
 
 	/* User not local, reply with string from UDB table. */
 	sockprintf(sock, "%d,%d:USERID:%s:%s\r\n",
 		lport, fport, ret_os, buf.username);
+	audit_reply(AUDIT_UDB, AUDIT_USERID, MISSING_UID, buf.username);
 
 	o_log(LOG_INFO, "[%s] UDB lookup: %d , %d : (returned %s)",
 		faddr_buf, lport, fport, buf.username);
@@ -24,6 +24,42 @@
 #	define MIN(x,y) ((x) < (y) ? (x) : (y))
 #endif
 
+#ifndef MAX
+#	define MAX(x,y) ((x) > (y) ? (x) : (y))
+#endif
+
+/*
+** Mutexes protecting state shared between worker threads.  They compile
+** to nothing if thread support is not available.  Files using them must
+** include <pthread.h> if THREAD_SUPPORT is set.
+*/
+
+#if THREAD_SUPPORT
+#	define DEFINE_LOCK(x)	static pthread_mutex_t x = PTHREAD_MUTEX_INITIALIZER
+#	define o_lock(x)		pthread_mutex_lock(&(x))
+#	define o_unlock(x)		pthread_mutex_unlock(&(x))
+#else
+#	define DEFINE_LOCK(x)	static char x __notused
+#	define o_lock(x)		do { } while (0)
+#	define o_unlock(x)		do { } while (0)
+#endif
+
+/*
+** The subsystems memory allocated with xmalloc() and friends is accounted
+** to.  Allocations are accounted to the subsystem the calling thread has
+** entered with mem_enter().
+*/
+
+enum mem_tag {
+	MEM_OTHER,
+	MEM_CONFIG,
+	MEM_USERS,
+	MEM_MASQ,
+	MEM_CONN,
+	MEM_LOG,
+	MEM_NUM_TAGS
+};
+
 typedef struct list {
 	struct list *next;
 	void *data;
@@ -56,9 +92,27 @@ struct udb_lookup_res get_udb_user(	in_port_t lport,
 
 FILE *safe_open(const struct passwd *pw, const char *filename);
 
+void copy_pw(const struct passwd *pw, struct passwd *pwd);
+void free_pw(struct passwd *pwd);
+int get_pwuid(uid_t uid, struct passwd *pwd);
+int get_pwnam(const char *name, struct passwd *pwd);
+
+void nss_lock(void);
+void nss_unlock(void);
+
 void *xmalloc(size_t size);
 void *xcalloc(size_t nmemb, size_t size);
 void *xrealloc(void *ptr, size_t len);
+void xfree(void *ptr);
+
+enum mem_tag mem_enter(enum mem_tag tag);
+void mem_leave(enum mem_tag prev);
+size_t mem_live(enum mem_tag tag);
+void mem_set_limit(size_t limit);
+bool mem_over_budget(void);
+bool mem_over_limit(void);
+void mem_trim(void);
+void mem_log_stats(void);
 
 char *xstrncpy(char *dest, const char *src, size_t n);
 char *xstrdup(const char *string);
@@ -0,0 +1,705 @@
+/*
+** worker.c - oidentd worker threads.
+** Copyright (c) 2019      Janik Rabe  <oidentd@janikrabe.com>
+**
+** This program is free software; you can redistribute it and/or modify
+** it under the terms of the GNU General Public License, version 2,
+** as published by the Free Software Foundation.
+**
+** This program is distributed in the hope that it will be useful,
+** but WITHOUT ANY WARRANTY; without even the implied warranty of
+** MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+** GNU General Public License for more details.
+**
+** You should have received a copy of the GNU General Public License
+** along with this program; if not, write to the Free Software
+** Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA
+*/
+
+#define _GNU_SOURCE
+#include <config.h>
+
+#include <unistd.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <fcntl.h>
+#include <signal.h>
+#include <string.h>
+#include <errno.h>
+#include <sched.h>
+#include <syslog.h>
+#include <pwd.h>
+#include <sys/time.h>
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+
+#ifdef HAVE_STRUCT_TCP_INFO_TCPI_UNACKED
+#	include <netinet/tcp.h>
+#endif
+
+#include "oidentd.h"
+#include "util.h"
+#include "missing.h"
+#include "inet_util.h"
+#include "options.h"
+#include "worker.h"
+#include "shed.h"
+#include "trust.h"
+#include "acl.h"
+
+#if THREAD_SUPPORT
+#	include <pthread.h>
+
+extern u_int32_t timeout;
+extern u_int32_t connection_limit;
+extern u_int32_t close_wait;
+
+/*
+** The state of a worker thread.  "cpu" is the CPU the worker is pinned
+** to, or -1.  Connections are counted as local if the worker runs on the
+** CPU that received the connection's packets.  Workers added to the pool
+** while it is busy are "dynamic;" only they are removed again.
+*/
+
+struct worker {
+	u_int32_t id;
+	int *listen_fds;
+	int cpu;
+	bool dynamic;
+	bool in_use;
+	unsigned long conns;
+	unsigned long local;
+	unsigned long unknown;
+};
+
+DEFINE_LOCK(stats_mutex);
+static struct worker *workers;
+static u_int32_t num_workers;
+
+/*
+** The pool has "min_workers" workers, and room for up to "max_workers."
+** "num_active" is the number of workers that are meant to be running,
+** "busy" the number of them serving a connection, and "busy_usecs" the
+** sum of the time they have spent doing so since the pool was last
+** tuned.  Dynamic workers exit when they read a byte from "retire_pipe."
+*/
+
+static u_int32_t min_workers;
+static u_int32_t max_workers;
+static u_int32_t num_active;
+static u_int32_t busy;
+static unsigned long long busy_usecs;
+static struct timeval busy_changed;
+static struct timeval tuned;
+static time_t idle_since;
+static int retire_pipe[2] = { -1, -1 };
+
+/*
+** The number of connections from untrusted hosts being served.  At most
+** "connection_limit" of them are served at once, so that workers are left
+** for trusted hosts if the limit is below the number of workers.
+*/
+
+static u_int32_t untrusted_busy;
+
+/*
+** Workers wait on the read end of "stop_pipe" along with their listening
+** sockets.  worker_stop() writes to it to make them exit, and waits for
+** "running" to drop to zero.
+*/
+
+static int stop_pipe[2] = { -1, -1 };
+static volatile bool stopping;
+static u_int32_t running;
+static pthread_cond_t running_cond = PTHREAD_COND_INITIALIZER;
+
+static int set_nonblock(int fd, bool nonblock);
+static int worker_pin(struct worker *worker);
+static void worker_account(struct worker *worker, int sock);
+static bool worker_admit(void);
+static void worker_done(bool trusted);
+static void pool_advance(const struct timeval *now);
+static unsigned long pool_queue_depth(void);
+static int worker_spawn(struct worker *worker);
+static void *worker_main(void *data);
+
+/*
+** Set or clear the O_NONBLOCK flag of a file descriptor.
+** Returns 0 on success, -1 on failure.
+*/
+
+static int set_nonblock(int fd, bool nonblock) {
+	int flags = fcntl(fd, F_GETFL);
+
+	if (flags == -1)
+		return -1;
+
+	if (nonblock)
+		flags |= O_NONBLOCK;
+	else
+		flags &= ~O_NONBLOCK;
+
+	return fcntl(fd, F_SETFL, flags);
+}
+
+/*
+** Pin the calling worker thread to its CPU and ask the kernel to prefer
+** its listening sockets for connections arriving on that CPU.
+** Returns 0 on success, -1 on failure.
+*/
+
+static int worker_pin(struct worker *worker) {
+#ifdef HAVE_PTHREAD_SETAFFINITY_NP
+	cpu_set_t set;
+	int ret;
+	size_t i;
+
+	CPU_ZERO(&set);
+	CPU_SET(worker->cpu, &set);
+
+	ret = pthread_setaffinity_np(pthread_self(), sizeof(set), &set);
+	if (ret != 0) {
+		o_log(LOG_CRIT, "Failed to pin thread to CPU %d: %s",
+			worker->cpu, strerror(ret));
+		return -1;
+	}
+
+#	ifdef SO_INCOMING_CPU
+	for (i = 0; worker->listen_fds[i] != -1; ++i) {
+		if (setsockopt(worker->listen_fds[i], SOL_SOCKET, SO_INCOMING_CPU,
+				&worker->cpu, sizeof(worker->cpu)) != 0)
+		{
+			debug("setsockopt SO_INCOMING_CPU: %s", strerror(errno));
+		}
+	}
+#	else
+	(void) i;
+#	endif
+
+	return 0;
+#else
+	(void) worker;
+	return -1;
+#endif
+}
+
+/*
+** Count a connection accepted by "worker" for the locality statistics.
+*/
+
+static void worker_account(struct worker *worker, int sock) {
+	struct timeval now;
+	int rx_cpu = -1;
+	int cur_cpu = -1;
+
+#if defined SO_INCOMING_CPU && defined HAVE_SCHED_GETCPU
+	socklen_t len = sizeof(rx_cpu);
+
+	if (getsockopt(sock, SOL_SOCKET, SO_INCOMING_CPU, &rx_cpu, &len) != 0)
+		rx_cpu = -1;
+
+	cur_cpu = sched_getcpu();
+#else
+	(void) sock;
+#endif
+
+	gettimeofday(&now, NULL);
+
+	o_lock(stats_mutex);
+
+	pool_advance(&now);
+	++busy;
+	++worker->conns;
+
+	if (rx_cpu == -1 || cur_cpu == -1)
+		++worker->unknown;
+	else if (rx_cpu == cur_cpu)
+		++worker->local;
+
+	o_unlock(stats_mutex);
+}
+
+/*
+** Count a connection from an untrusted host as being served, unless the
+** connection limit has been reached.
+** Returns true if the connection may be served, false if it must be
+** closed.
+*/
+
+static bool worker_admit(void) {
+	bool ret = false;
+
+	o_lock(stats_mutex);
+
+	if (untrusted_busy < connection_limit) {
+		++untrusted_busy;
+		ret = true;
+	}
+
+	o_unlock(stats_mutex);
+	return ret;
+}
+
+/*
+** Stop counting a connection as being served, and as admitted by
+** worker_admit() if it isn't from a trusted host.
+*/
+
+static void worker_done(bool trusted) {
+	struct timeval now;
+
+	gettimeofday(&now, NULL);
+
+	o_lock(stats_mutex);
+
+	pool_advance(&now);
+	--busy;
+
+	if (!trusted)
+		--untrusted_busy;
+
+	o_unlock(stats_mutex);
+}
+
+/*
+** Add the time the busy workers have spent serving connections since the
+** number of busy workers last changed.  Must be called with stats_mutex
+** held.
+*/
+
+static void pool_advance(const struct timeval *now) {
+	long long usecs;
+
+	usecs = (now->tv_sec - busy_changed.tv_sec) * 1000000LL +
+		now->tv_usec - busy_changed.tv_usec;
+
+	if (usecs > 0)
+		busy_usecs += busy * usecs;
+
+	busy_changed = *now;
+}
+
+/*
+** Returns the number of connections waiting to be accepted on the
+** listening sockets, where the system reports it.
+*/
+
+static unsigned long pool_queue_depth(void) {
+	unsigned long depth = 0;
+#ifdef HAVE_STRUCT_TCP_INFO_TCPI_UNACKED
+	u_int32_t i;
+
+	for (i = 0; i < min_workers; ++i) {
+		size_t j;
+
+		/* shared sockets are only counted once */
+		if (i > 0 && workers[i].listen_fds == workers[0].listen_fds)
+			continue;
+
+		for (j = 0; workers[i].listen_fds[j] != -1; ++j) {
+			struct tcp_info info;
+			socklen_t len = sizeof(info);
+
+			/* for listening sockets, Linux reports the accept queue */
+			if (getsockopt(workers[i].listen_fds[j], IPPROTO_TCP, TCP_INFO,
+					&info, &len) == 0)
+			{
+				depth += info.tcpi_unacked;
+			}
+		}
+	}
+#endif
+
+	return depth;
+}
+
+/*
+** Log the number of connections served by each worker, and how many of
+** them were served on the CPU that received them.
+*/
+
+void worker_log_stats(void) {
+	u_int32_t i;
+
+	o_lock(stats_mutex);
+
+	if (max_workers > min_workers) {
+		o_log(LOG_INFO, "Thread pool: %u threads (%u to %u), %u busy",
+			num_active, min_workers, max_workers, busy);
+	}
+
+	for (i = 0; i < num_workers; ++i) {
+		struct worker *worker = &workers[i];
+		unsigned long known = worker->conns - worker->unknown;
+
+		if (!worker->in_use && worker->conns == 0)
+			continue;
+
+		o_log(LOG_INFO, "Worker %u (CPU %d): %lu connections, "
+			"%lu of %lu on the receiving CPU (%lu%%)",
+			worker->id, worker->cpu, worker->conns, worker->local, known,
+			known ? worker->local * 100 / known : 0);
+	}
+
+	o_unlock(stats_mutex);
+}
+
+/*
+** Wait for connections on the worker's listening sockets and serve them.
+** Workers that share sockets race to accept connections; those that lose
+** go back to waiting.
+*/
+
+static void *worker_main(void *data) {
+	struct worker *worker = data;
+	int *listen_fds = worker->listen_fds;
+
+	mem_enter(MEM_CONN);
+
+	if (worker->cpu != -1 && worker_pin(worker) != 0)
+		worker->cpu = -1;
+
+	while (!stopping) {
+		fd_set rfds;
+		size_t fdlen = 0;
+		int maxfd = stop_pipe[0];
+		size_t i;
+
+		FD_ZERO(&rfds);
+		FD_SET(stop_pipe[0], &rfds);
+
+		if (worker->dynamic) {
+			FD_SET(retire_pipe[0], &rfds);
+			maxfd = MAX(maxfd, retire_pipe[0]);
+		}
+
+		do {
+			int fd = listen_fds[fdlen++];
+			FD_SET(fd, &rfds);
+
+			if (fd > maxfd)
+				maxfd = fd;
+		} while (listen_fds[fdlen] != -1);
+
+		if (select(maxfd + 1, &rfds, NULL, NULL, NULL) <= 0)
+			continue;
+
+		/* only one of the dynamic workers gets each byte */
+		if (worker->dynamic && FD_ISSET(retire_pipe[0], &rfds)) {
+			char c;
+
+			if (read(retire_pipe[0], &c, 1) == 1)
+				break;
+		}
+
+		for (i = 0; i < fdlen && !stopping; ++i) {
+			struct sockaddr_storage peer;
+			socklen_t peerlen = sizeof(peer);
+			bool trusted;
+			int connectfd;
+
+			if (!FD_ISSET(listen_fds[i], &rfds))
+				continue;
+
+			connectfd = accept(listen_fds[i], (struct sockaddr *) &peer, &peerlen);
+			if (connectfd == -1) {
+				if (errno != EAGAIN && errno != EWOULDBLOCK)
+					debug("accept: %s", strerror(errno));
+				continue;
+			}
+
+			if (!acl_permit(&peer)) {
+				close(connectfd);
+				continue;
+			}
+
+			/* some systems let accepted sockets inherit O_NONBLOCK */
+			if (set_nonblock(connectfd, false) == -1 ||
+				sock_set_timeout(connectfd, timeout) == -1)
+			{
+				debug("Failed to set up connection: %s", strerror(errno));
+				close(connectfd);
+				continue;
+			}
+
+			trusted = trust_match(&peer);
+			if (!trusted && !worker_admit()) {
+				o_log(LOG_INFO, "Connection limit exceeded; "
+					"closing incoming connection");
+				close(connectfd);
+				continue;
+			}
+
+			worker_account(worker, connectfd);
+			shed_accepted(connectfd);
+			sock_set_nodelay(connectfd);
+			service_request(connectfd, connectfd);
+
+			if (close_wait > 0)
+				sock_close_wait(connectfd, close_wait, opt_enabled(CLOSE_RESET));
+			else
+				close(connectfd);
+
+			worker_done(trusted);
+		}
+	}
+
+	o_lock(stats_mutex);
+	worker->in_use = false;
+	if (--running == 0)
+		pthread_cond_broadcast(&running_cond);
+	o_unlock(stats_mutex);
+
+	return NULL;
+}
+
+/*
+** Make the workers stop accepting connections, and wait until they have
+** finished serving the connections they already accepted.
+*/
+
+void worker_stop(void) {
+	stopping = true;
+
+	if (write(stop_pipe[1], "", 1) == -1)
+		debug("write: %s", strerror(errno));
+
+	o_lock(stats_mutex);
+
+	while (running > 0)
+		pthread_cond_wait(&running_cond, &stats_mutex);
+
+	o_unlock(stats_mutex);
+}
+
+/*
+** Start a thread for "worker."  Signals are blocked in the workers so
+** they are handled by the calling thread.
+** Returns 0 on success, -1 on failure.
+*/
+
+static int worker_spawn(struct worker *worker) {
+	sigset_t set, oldset;
+	pthread_t thread;
+	int ret;
+
+	o_lock(stats_mutex);
+	++running;
+	worker->in_use = true;
+	o_unlock(stats_mutex);
+
+	sigfillset(&set);
+	sigdelset(&set, SIGSEGV);
+	pthread_sigmask(SIG_BLOCK, &set, &oldset);
+
+	ret = pthread_create(&thread, NULL, worker_main, worker);
+
+	pthread_sigmask(SIG_SETMASK, &oldset, NULL);
+
+	if (ret != 0) {
+		o_log(LOG_CRIT, "Failed to create thread: %s", strerror(ret));
+
+		o_lock(stats_mutex);
+		--running;
+		worker->in_use = false;
+		o_unlock(stats_mutex);
+		return -1;
+	}
+
+	pthread_detach(thread);
+	return 0;
+}
+
+/*
+** Start "num" worker threads, and make room for up to "max" of them.
+** Worker "i" serves connections on the sockets in "listen_fds[i]," which
+** may be shared with other workers; workers added by worker_tune() share
+** those of the first "num" workers.  With CPU_AFFINITY, the first "num"
+** workers are spread over the CPUs this process may run on, one CPU per
+** worker.
+** Returns 0 on success, -1 on failure.
+*/
+
+int worker_start(int **listen_fds, u_int32_t num, u_int32_t max) {
+	u_int32_t started;
+	int *cpus = NULL;
+	int ncpus = 0;
+	u_int32_t i;
+
+	for (i = 0; i < num; ++i) {
+		size_t j;
+
+		for (j = 0; listen_fds[i][j] != -1; ++j) {
+			if (set_nonblock(listen_fds[i][j], true) == -1) {
+				debug("fcntl: %s", strerror(errno));
+				return -1;
+			}
+		}
+	}
+
+#ifdef HAVE_PTHREAD_SETAFFINITY_NP
+	if (opt_enabled(CPU_AFFINITY)) {
+		cpu_set_t allowed;
+		int cpu;
+
+		if (sched_getaffinity(0, sizeof(allowed), &allowed) != 0) {
+			debug("sched_getaffinity: %s", strerror(errno));
+			return -1;
+		}
+
+		cpus = xmalloc(CPU_COUNT(&allowed) * sizeof(int));
+		for (cpu = 0; cpu < CPU_SETSIZE; ++cpu) {
+			if (CPU_ISSET(cpu, &allowed))
+				cpus[ncpus++] = cpu;
+		}
+	}
+#endif
+
+	if (pipe(stop_pipe) != 0) {
+		debug("pipe: %s", strerror(errno));
+		return -1;
+	}
+
+	fcntl(stop_pipe[0], F_SETFD, FD_CLOEXEC);
+	fcntl(stop_pipe[1], F_SETFD, FD_CLOEXEC);
+
+	if (max > num) {
+		if (pipe(retire_pipe) != 0) {
+			debug("pipe: %s", strerror(errno));
+			return -1;
+		}
+
+		fcntl(retire_pipe[0], F_SETFD, FD_CLOEXEC);
+		fcntl(retire_pipe[1], F_SETFD, FD_CLOEXEC);
+		set_nonblock(retire_pipe[0], true);
+	}
+
+	workers = xcalloc(max, sizeof(struct worker));
+
+	for (i = 0; i < max; ++i) {
+		workers[i].id = i;
+		workers[i].listen_fds = listen_fds[i % num];
+		workers[i].cpu = ncpus > 0 && i < num ? cpus[i % ncpus] : -1;
+		workers[i].dynamic = i >= num;
+	}
+
+	xfree(cpus);
+
+	gettimeofday(&tuned, NULL);
+	busy_changed = tuned;
+
+	min_workers = num;
+	max_workers = max;
+	num_workers = max;
+
+	for (started = 0; started < num; ++started) {
+		if (worker_spawn(&workers[started]) != 0)
+			break;
+	}
+
+	o_lock(stats_mutex);
+	num_active = started;
+	o_unlock(stats_mutex);
+
+	return started == num ? 0 : -1;
+}
+
+/*
+** Grow or shrink a pool of workers that may grow.  Workers are added
+** while connections wait to be accepted, while the workers are busy for
+** more than POOL_GROW_UTIL percent of the time, or while the latency
+** target is exceeded: one for each waiting connection, but at least a
+** quarter more at a time.  One dynamic worker is
+** removed per interval once they have been busy for less than
+** POOL_SHRINK_UTIL percent of the time for POOL_SHRINK_DELAY seconds.
+**
+** Workers beyond the connection limit would only close the connections
+** they accept, so the pool grows beyond the limit only as far as trusted
+** hosts keep workers busy.
+**
+** Returns the number of seconds until worker_tune() should be called
+** again, or -1 if the pool has a fixed size.
+*/
+
+long worker_tune(void) {
+	struct timeval now;
+	unsigned long queue;
+	unsigned long util = 0;
+	long long elapsed;
+	unsigned long long limit;
+	u_int32_t active;
+	u_int32_t cap;
+
+	if (max_workers <= min_workers)
+		return -1;
+
+	gettimeofday(&now, NULL);
+	elapsed = (now.tv_sec - tuned.tv_sec) * 1000000LL +
+		now.tv_usec - tuned.tv_usec;
+
+	if (elapsed < POOL_INTERVAL * 1000000LL)
+		return POOL_INTERVAL - elapsed / 1000000;
+
+	queue = pool_queue_depth();
+
+	o_lock(stats_mutex);
+
+	pool_advance(&now);
+	if (num_active > 0)
+		util = busy_usecs * 100 / (elapsed * num_active);
+
+	busy_usecs = 0;
+	tuned = now;
+
+	limit = (unsigned long long) connection_limit + busy - untrusted_busy + 1;
+	active = num_active;
+
+	o_unlock(stats_mutex);
+
+	cap = limit < max_workers ? MAX(limit, min_workers) : max_workers;
+
+	if ((queue > 0 || util >= POOL_GROW_UTIL || shed_active()) && active < cap) {
+		unsigned long add = MAX(MAX(1, active / 4), queue);
+		u_int32_t want = MIN(cap, active + add);
+		u_int32_t i;
+
+		idle_since = 0;
+
+		for (i = min_workers; i < max_workers && active < want; ++i) {
+			bool in_use;
+
+			o_lock(stats_mutex);
+			in_use = workers[i].in_use;
+			o_unlock(stats_mutex);
+
+			if (!in_use && worker_spawn(&workers[i]) == 0)
+				++active;
+		}
+
+		debug("Thread pool grown to %u threads (queue %lu, %lu%% busy)",
+			active, queue, util);
+	} else if (queue == 0 && util < POOL_SHRINK_UTIL && active > min_workers) {
+		if (idle_since == 0)
+			idle_since = now.tv_sec;
+
+		if (now.tv_sec - idle_since >= POOL_SHRINK_DELAY) {
+			if (write(retire_pipe[1], "", 1) == 1)
+				--active;
+			else
+				debug("write: %s", strerror(errno));
+
+			debug("Thread pool shrunk to %u threads (%lu%% busy)",
+				active, util);
+		}
+	} else
+		idle_since = 0;
+
+	o_lock(stats_mutex);
+	num_active = active;
+	o_unlock(stats_mutex);
+
+	return POOL_INTERVAL;
+}
+
+#endif
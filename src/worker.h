@@ -0,0 +1,27 @@
+/*
+** worker.h - oidentd worker threads.
+** Copyright (c) 2019      Janik Rabe  <oidentd@janikrabe.com>
+**
+** This program is free software; you can redistribute it and/or modify
+** it under the terms of the GNU General Public License, version 2,
+** as published by the Free Software Foundation.
+**
+** This program is distributed in the hope that it will be useful,
+** but WITHOUT ANY WARRANTY; without even the implied warranty of
+** MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+** GNU General Public License for more details.
+**
+** You should have received a copy of the GNU General Public License
+** along with this program; if not, write to the Free Software
+** Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA
+*/
+
+#ifndef __OIDENTD_WORKER_H
+#define __OIDENTD_WORKER_H
+
+int worker_start(int **listen_fds, u_int32_t num, u_int32_t max);
+long worker_tune(void);
+void worker_log_stats(void);
+void worker_stop(void);
+
+#endif